@@ -0,0 +1,332 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "telemetry_codec.h"
+#include "time_util.h"
+
+#define DEFAULT_SAMPLE_COUNT 100000
+#define RECORD_BUFFER_SIZE 256
+
+/*
+ * Sensor traces: an accelerometer (m/s^2, 2 decimals) and a thermometer (degree Celsius,
+ * 1 decimal), as in the sample payload
+ */
+static const TELEMETRY_SCHEMA schema
+    = { "IoT mbed", 4, { { "accelX", 2 }, { "accelY", 2 }, { "accelZ", 2 }, { "temp", 1 } } };
+
+typedef struct trace_tag
+{
+  const char* name;
+  int count;
+  TELEMETRY_SAMPLE* samples;
+} TRACE;
+
+static uint32_t random_state = 12345;
+
+// xorshift32, so that the traces are the same on every run and platform
+static int32_t random_between(int32_t low, int32_t high)
+{
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return low + (int32_t)(random_state % (uint32_t)(high - low + 1));
+}
+
+/*
+ * stationary: device at rest, gravity on Z with sensor noise and a slow temperature drift
+ * moving:     device in a vehicle, accelerations follow a bounded random walk
+ */
+static void generate_trace(TRACE* trace, const char* name, int count)
+{
+  int moving = strcmp(name, "moving") == 0;
+  int32_t accel[3] = { 0, 0, 981 };
+  int32_t temp = 185;
+
+  trace->name = name;
+  trace->count = count;
+  trace->samples = (TELEMETRY_SAMPLE*)calloc((size_t)count, sizeof(TELEMETRY_SAMPLE));
+
+  for (int i = 0; i < count; i++)
+  {
+    for (int axis = 0; axis < 3; axis++)
+    {
+      int32_t rest = axis == 2 ? 981 : 0;
+
+      if (moving)
+      {
+        accel[axis] += random_between(-40, 40) - (accel[axis] - rest) / 8;
+      }
+      else
+      {
+        accel[axis] = rest + random_between(-3, 3);
+      }
+
+      trace->samples[i].values[axis] = accel[axis];
+    }
+
+    if (random_between(0, 99) < 5)
+    {
+      temp += random_between(-1, 1);
+    }
+
+    trace->samples[i].values[3] = temp;
+  }
+}
+
+/*
+ * Load a CSV trace with accelX,accelY,accelZ,temp per line in the units of the schema. Lines that
+ * do not start with a number (e.g. a header) are skipped.
+ */
+static int load_trace(TRACE* trace, const char* path)
+{
+  FILE* file = fopen(path, "r");
+  char line[256];
+  int capacity = 1024;
+
+  trace->samples = NULL;
+  if (file == NULL)
+  {
+    printf("Failed to open %s\r\n", path);
+    return -1;
+  }
+
+  trace->name = path;
+  trace->count = 0;
+  trace->samples = (TELEMETRY_SAMPLE*)calloc((size_t)capacity, sizeof(TELEMETRY_SAMPLE));
+
+  while (trace->samples != NULL && fgets(line, sizeof(line), file) != NULL)
+  {
+    double values[4];
+
+    if (sscanf(line, "%lf,%lf,%lf,%lf", &values[0], &values[1], &values[2], &values[3]) != 4)
+    {
+      continue;
+    }
+
+    if (trace->count == capacity)
+    {
+      capacity *= 2;
+      trace->samples = (TELEMETRY_SAMPLE*)realloc(
+          trace->samples, (size_t)capacity * sizeof(TELEMETRY_SAMPLE));
+      if (trace->samples == NULL)
+      {
+        break;
+      }
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+      double scaled = values[i] * (schema.fields[i].decimals == 2 ? 100 : 10);
+      trace->samples[trace->count].values[i] = (int32_t)(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+    }
+
+    trace->count++;
+  }
+
+  fclose(file);
+  return trace->samples != NULL && trace->count > 0 ? 0 : -1;
+}
+
+/*
+ * Encode the whole trace, returning the total encoded bytes and the elapsed time
+ */
+static int encode_trace(
+    const TRACE* trace,
+    const char* encoder_name,
+    unsigned char* out,
+    int* out_lengths,
+    uint64_t* out_ns)
+{
+  TELEMETRY_ENCODER encoder;
+  int total = 0;
+  uint64_t start_ns;
+
+  telemetry_encoder_init(&encoder, encoder_name, &schema);
+
+  start_ns = time_util_now_ns();
+  for (int i = 0; i < trace->count; i++)
+  {
+    int len = telemetry_encoder_encode(
+        &encoder, &trace->samples[i], out + (size_t)i * RECORD_BUFFER_SIZE, RECORD_BUFFER_SIZE);
+
+    if (len < 0)
+    {
+      return -1;
+    }
+
+    out_lengths[i] = len;
+    total += len;
+  }
+  *out_ns = time_util_now_ns() - start_ns;
+
+  return total;
+}
+
+/*
+ * 1. Encode the trace as JSON and as delta records
+ * 2. Decode the delta records, and expand them to JSON as a Gateway would
+ * 3. Check that the round trip reproduces the JSON encoding and print the results
+ */
+static int run_benchmark(const TRACE* trace)
+{
+  int rc = 0;
+  int json_total;
+  int delta_total;
+  uint64_t json_ns;
+  uint64_t delta_ns;
+  uint64_t decode_ns;
+  uint64_t expand_ns;
+  size_t buffer_size = (size_t)trace->count * RECORD_BUFFER_SIZE;
+  unsigned char* json = (unsigned char*)malloc(buffer_size);
+  unsigned char* delta = (unsigned char*)malloc(buffer_size);
+  char* expanded = (char*)malloc(buffer_size);
+  int* json_lengths = (int*)malloc((size_t)trace->count * sizeof(int));
+  int* delta_lengths = (int*)malloc((size_t)trace->count * sizeof(int));
+  TELEMETRY_SAMPLE* decoded
+      = (TELEMETRY_SAMPLE*)malloc((size_t)trace->count * sizeof(TELEMETRY_SAMPLE));
+  TELEMETRY_DECODER decoder;
+  uint64_t start_ns;
+
+  if (json == NULL || delta == NULL || expanded == NULL || json_lengths == NULL
+      || delta_lengths == NULL || decoded == NULL)
+  {
+    printf("Failed to allocate buffers for %d samples\r\n", trace->count);
+    rc = -1;
+    goto exit;
+  }
+
+  // Fault the pages in up front so that the timings only measure the codecs
+  memset(json, 0, buffer_size);
+  memset(delta, 0, buffer_size);
+  memset(expanded, 0, buffer_size);
+  memset(decoded, 0, (size_t)trace->count * sizeof(TELEMETRY_SAMPLE));
+
+  // 1. Encode the trace as JSON and as delta records
+  json_total = encode_trace(trace, "json", json, json_lengths, &json_ns);
+  delta_total = encode_trace(trace, "delta", delta, delta_lengths, &delta_ns);
+  if (json_total < 0 || delta_total < 0)
+  {
+    printf("Failed to encode trace %s\r\n", trace->name);
+    rc = -1;
+    goto exit;
+  }
+
+  // 2. Decode the delta records, and expand them to JSON as a Gateway would
+  telemetry_decoder_init(&decoder, &schema);
+  start_ns = time_util_now_ns();
+  for (int i = 0; i < trace->count; i++)
+  {
+    int record_len;
+
+    if (telemetry_decoder_decode(
+            &decoder,
+            delta + (size_t)i * RECORD_BUFFER_SIZE,
+            delta_lengths[i],
+            &decoded[i],
+            &record_len)
+        != 0)
+    {
+      printf("Failed to decode record %d of trace %s\r\n", i, trace->name);
+      rc = -1;
+      goto exit;
+    }
+  }
+  decode_ns = time_util_now_ns() - start_ns;
+
+  start_ns = time_util_now_ns();
+  for (int i = 0; i < trace->count; i++)
+  {
+    telemetry_codec_to_json(
+        &schema, &decoded[i], expanded + (size_t)i * RECORD_BUFFER_SIZE, RECORD_BUFFER_SIZE);
+  }
+  expand_ns = time_util_now_ns() - start_ns;
+
+  // 3. Check that the round trip reproduces the JSON encoding and print the results
+  for (int i = 0; i < trace->count; i++)
+  {
+    size_t offset = (size_t)i * RECORD_BUFFER_SIZE;
+
+    if (memcmp(expanded + offset, json + offset, (size_t)json_lengths[i]) != 0)
+    {
+      printf("Round trip mismatch at record %d of trace %s\r\n", i, trace->name);
+      rc = -1;
+      goto exit;
+    }
+  }
+
+  printf(
+      "%-12s %8d %10.1f %10.1f %8.2f %10.1f %10.1f %10.1f %10.1f\r\n",
+      trace->name,
+      trace->count,
+      (double)json_total / trace->count,
+      (double)delta_total / trace->count,
+      (double)json_total / delta_total,
+      (double)json_ns / trace->count,
+      (double)delta_ns / trace->count,
+      (double)decode_ns / trace->count,
+      (double)expand_ns / trace->count);
+
+exit:
+  free(json);
+  free(delta);
+  free(expanded);
+  free(json_lengths);
+  free(delta_lengths);
+  free(decoded);
+  return rc;
+}
+
+/*
+ * Benchmark the JSON and delta payload encoders on generated sensor traces, or on the CSV traces
+ * given as arguments:
+ *   bench_codec [trace.csv ...]
+ */
+int main(int argc, char** argv)
+{
+  int rc = 0;
+
+  printf(
+      "%-12s %8s %10s %10s %8s %10s %10s %10s %10s\r\n",
+      "trace",
+      "samples",
+      "json B",
+      "delta B",
+      "ratio",
+      "json ns",
+      "delta ns",
+      "decode ns",
+      "expand ns");
+
+  if (argc > 1)
+  {
+    for (int i = 1; i < argc && rc == 0; i++)
+    {
+      TRACE trace;
+
+      if ((rc = load_trace(&trace, argv[i])) == 0)
+      {
+        rc = run_benchmark(&trace);
+      }
+      free(trace.samples);
+    }
+  }
+  else
+  {
+    const char* names[] = { "stationary", "moving" };
+
+    for (int i = 0; i < 2 && rc == 0; i++)
+    {
+      TRACE trace;
+
+      generate_trace(&trace, names[i], DEFAULT_SAMPLE_COUNT);
+      rc = trace.samples != NULL ? run_benchmark(&trace) : -1;
+      free(trace.samples);
+    }
+  }
+
+  return rc;
+}
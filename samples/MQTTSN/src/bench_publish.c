@@ -0,0 +1,230 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "event_log.h"
+#include "mqttsn_client.h"
+#include "time_util.h"
+#include "transport.h"
+
+#define DEFAULT_MESSAGE_COUNT 200000
+#define WARMUP_MESSAGE_COUNT 1000
+#define RUNS 3 // the fastest run of each path is reported
+#define SINK_PORT 10099
+#define BENCH_TOPIC_ID 1
+#define EVENT_LOG_PAYLOAD_SIZE 64
+
+static const int payload_sizes[] = { 16, 64, 128, 256, 512, 1024, 1400 };
+
+static const EVENT_LOG_MODE event_log_modes[]
+    = { EVENT_LOG_MODE_OFF, EVENT_LOG_MODE_RING, EVENT_LOG_MODE_PRINTF };
+static const char* event_log_mode_names[] = { "off", "ring", "printf" };
+
+static unsigned char payload[MQTTSN_CLIENT_BUFFER_SIZE];
+
+/*
+ * Drop whatever the sink socket received, so that every run starts with an empty receive queue
+ */
+static void drain_sink(int sink)
+{
+  unsigned char buffer[TRANSPORT_DATAGRAM_SIZE];
+
+  while (transport_socket_recv(sink, buffer, sizeof(buffer)) > 0)
+  {
+  }
+}
+
+/*
+ * Publish count messages of payload_len bytes with QoS -1, which needs no Gateway, flushing a full
+ * batch at a time as mqttsn_client_step() would, and the event log with it as the telemetry sample
+ * does. Return the elapsed nanoseconds, 0 on an error.
+ */
+static uint64_t publish_messages(int zero_copy, int payload_len, int count)
+{
+  MQTTSN_CLIENT client;
+  MQTTSN_CLIENT_OPTIONS options = mqttsn_client_options_default();
+  uint64_t start_ns = 0;
+  uint64_t elapsed_ns = 0;
+
+  options.client_id = "bench";
+  options.topic_name = "bench";
+  options.gateway_address = "127.0.0.1";
+  options.gateway_port = SINK_PORT;
+  options.predefined_topic_id = BENCH_TOPIC_ID;
+  options.qos = -1;
+  options.zero_copy = zero_copy;
+
+  if (mqttsn_client_init(&client, &options) != 0 || mqttsn_client_connect(&client) != 0)
+  {
+    printf("Failed to open the MQTTSN client\r\n");
+    return 0;
+  }
+
+  for (int i = 0; i < WARMUP_MESSAGE_COUNT + count; i++)
+  {
+    if (i == WARMUP_MESSAGE_COUNT)
+    {
+      mqttsn_client_flush(&client);
+      start_ns = time_util_now_ns();
+    }
+
+    if (mqttsn_client_publish(&client, payload, payload_len) != 0
+        || ((i + 1) % TRANSPORT_BATCH_SIZE == 0 && mqttsn_client_flush(&client) != 0))
+    {
+      printf("Failed to publish %d bytes\r\n", payload_len);
+      mqttsn_client_deinit(&client);
+      return 0;
+    }
+
+    if ((i + 1) % TRANSPORT_BATCH_SIZE == 0)
+    {
+      event_log_flush();
+    }
+  }
+
+  mqttsn_client_flush(&client);
+  elapsed_ns = time_util_now_ns() - start_ns;
+  mqttsn_client_deinit(&client);
+
+  return elapsed_ns;
+}
+
+/*
+ * Run the copy (zero_copy = 0) or zero-copy path RUNS times, keeping the fastest run.
+ * Return 0 on an error.
+ */
+static uint64_t run_path(int sink, int zero_copy, int payload_len, int count)
+{
+  uint64_t best_ns = UINT64_MAX;
+
+  for (int run = 0; run < RUNS; run++)
+  {
+    uint64_t elapsed_ns;
+
+    drain_sink(sink);
+    if ((elapsed_ns = publish_messages(zero_copy, payload_len, count)) == 0)
+    {
+      return 0;
+    }
+
+    best_ns = elapsed_ns < best_ns ? elapsed_ns : best_ns;
+  }
+
+  return best_ns;
+}
+
+/*
+ * Publish on the zero-copy path with the DEBUG event of every PUBLISH logged in each event log
+ * mode. Records and lines go to /dev/null: the ring is written out once per batch, the lines are
+ * line buffered as on a terminal. printf mode at INFO is restored afterwards.
+ * Return -1 on an error.
+ */
+static int compare_event_log_modes(int sink, int count)
+{
+  EVENT_LOG_CONFIG config
+      = { EVENT_LOG_MODE_OFF, EVENT_LOG_LEVEL_DEBUG, "/dev/null", EVENT_LOG_DEFAULT_RING_SIZE };
+  uint64_t off_ns = 0;
+
+  printf(
+      "\r\nEvent log, %d B payload, one DEBUG event per PUBLISH, compiled level %d:\r\n",
+      EVENT_LOG_PAYLOAD_SIZE,
+      EVENT_LOG_COMPILED_LEVEL);
+  printf("%10s %10s %12s %14s %12s\r\n", "mode", "messages", "ns/msg", "messages/s", "+ns/msg");
+
+  for (size_t i = 0; i < sizeof(event_log_modes) / sizeof(event_log_modes[0]); i++)
+  {
+    uint64_t elapsed_ns;
+
+    config.mode = event_log_modes[i];
+    if (event_log_open(&config) != 0)
+    {
+      return -1;
+    }
+
+    elapsed_ns = run_path(sink, 1, EVENT_LOG_PAYLOAD_SIZE, count);
+    event_log_close();
+    if (elapsed_ns == 0)
+    {
+      return -1;
+    }
+
+    off_ns = i == 0 ? elapsed_ns : off_ns;
+    printf(
+        "%10s %10d %12.1f %14.0f %12.1f\r\n",
+        event_log_mode_names[i],
+        count,
+        (double)elapsed_ns / count,
+        (double)count * 1e9 / (double)elapsed_ns,
+        ((double)elapsed_ns - (double)off_ns) / count);
+  }
+
+  config.mode = EVENT_LOG_MODE_PRINTF;
+  config.level = EVENT_LOG_LEVEL_INFO;
+  config.path = NULL;
+  return event_log_open(&config);
+}
+
+/*
+ * Compare the PUBLISH path that serializes the payload into the client buffer and copies the
+ * datagram into the send batch with the zero-copy path that serializes only the header and sends
+ * the payload of the caller with a second iovec. Datagrams go to a local sink socket. Then measure
+ * what logging every PUBLISH costs with the event log off, in ring mode and in printf mode.
+ *   bench_publish [message count]
+ */
+int main(int argc, char** argv)
+{
+  int count = argc > 1 ? atoi(argv[1]) : DEFAULT_MESSAGE_COUNT;
+  int sink = transport_socket_open(SINK_PORT, 1);
+
+  if (count <= 0 || sink < 0)
+  {
+    printf("Usage: bench_publish [message count], UDP port %d must be free\r\n", SINK_PORT);
+    return 1;
+  }
+
+  memset(payload, 'x', sizeof(payload));
+
+  printf(
+      "%10s %10s %12s %12s %8s %14s\r\n",
+      "payload B",
+      "messages",
+      "copy ns",
+      "zero-copy ns",
+      "speedup",
+      "copied B/msg");
+
+  for (size_t i = 0; i < sizeof(payload_sizes) / sizeof(payload_sizes[0]); i++)
+  {
+    uint64_t copy_ns = run_path(sink, 0, payload_sizes[i], count);
+    uint64_t zero_copy_ns = run_path(sink, 1, payload_sizes[i], count);
+
+    if (copy_ns == 0 || zero_copy_ns == 0)
+    {
+      transport_socket_close(sink);
+      return 1;
+    }
+
+    // The copy path copies the payload twice: into the client buffer and into the send batch
+    printf(
+        "%10d %10d %12.1f %12.1f %8.2f %7d -> %4d\r\n",
+        payload_sizes[i],
+        count,
+        (double)copy_ns / count,
+        (double)zero_copy_ns / count,
+        (double)copy_ns / (double)zero_copy_ns,
+        2 * payload_sizes[i],
+        0);
+  }
+
+  if (compare_event_log_modes(sink, count) != 0)
+  {
+    transport_socket_close(sink);
+    return 1;
+  }
+
+  transport_socket_close(sink);
+  return 0;
+}
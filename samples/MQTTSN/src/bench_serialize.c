@@ -0,0 +1,363 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MQTTSNPacket.h"
+#include "azure/iot/az_iot_hub_client.h"
+#include "time_util.h"
+
+#define DEFAULT_OPERATION_COUNT 1000000
+#define WARMUP_OPERATION_COUNT 10000
+#define RUNS 5 // the fastest run of each operation is reported
+#define PACKET_BUFFER_SIZE 256
+#define TOPIC_BUFFER_SIZE 128
+#define BENCH_TOPIC_ID 1
+#define BENCH_PAYLOAD_SIZE 64
+
+static const char* bench_hostname = "bench-hub.azure-devices.net";
+static const char* bench_device_id = "bench-device-0001";
+
+static az_iot_hub_client hub_client;
+static char topic_name[TOPIC_BUFFER_SIZE];
+static unsigned char payload[BENCH_PAYLOAD_SIZE];
+static unsigned char packet[PACKET_BUFFER_SIZE];
+
+// Serialized PUBACK and PUBLISH, read back by the deserialization benchmarks
+static unsigned char puback[PACKET_BUFFER_SIZE];
+static int puback_len;
+static unsigned char publish[PACKET_BUFFER_SIZE];
+static int publish_len;
+static int read_offset;
+
+// Keeps the results of every operation alive
+static volatile unsigned long checksum;
+
+/*
+ * Allocations are counted by replacing malloc and friends with wrappers around the glibc
+ * allocator, which the static and shared libraries resolve to as well. Allocations made inside
+ * glibc itself, e.g. by strdup(), are not counted. Elsewhere the count is not available.
+ */
+#if defined(__GLIBC__)
+#define ALLOCATIONS_COUNTED 1
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static unsigned long allocation_count;
+
+void* malloc(size_t size)
+{
+  allocation_count++;
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+  allocation_count++;
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+  allocation_count++;
+  return __libc_realloc(ptr, size);
+}
+#else
+#define ALLOCATIONS_COUNTED 0
+
+static unsigned long allocation_count;
+#endif
+
+typedef int (*BENCH_OPERATION)(int count);
+
+static int serialize_connect(int count)
+{
+  MQTTSNPacket_connectData options = MQTTSNPacket_connectData_initializer;
+
+  options.clientID.cstring = (char*)bench_device_id;
+  for (int i = 0; i < count; i++)
+  {
+    int len = MQTTSNSerialize_connect(packet, sizeof(packet), &options);
+
+    if (len <= 0)
+    {
+      return -1;
+    }
+
+    checksum += (unsigned long)len;
+  }
+
+  return 0;
+}
+
+static int serialize_register(int count)
+{
+  MQTTSNString topic_str = MQTTSNString_initializer;
+
+  topic_str.cstring = topic_name;
+  for (int i = 0; i < count; i++)
+  {
+    int len = MQTTSNSerialize_register(
+        packet, sizeof(packet), 0, (unsigned short)(i & 0xFFFF), &topic_str);
+
+    if (len <= 0)
+    {
+      return -1;
+    }
+
+    checksum += (unsigned long)len;
+  }
+
+  return 0;
+}
+
+static int serialize_publish(int count)
+{
+  MQTTSN_topicid topic;
+
+  memset(&topic, 0, sizeof(topic));
+  topic.type = MQTTSN_TOPIC_TYPE_PREDEFINED;
+  topic.data.id = BENCH_TOPIC_ID;
+  for (int i = 0; i < count; i++)
+  {
+    int len = MQTTSNSerialize_publish(
+        packet,
+        sizeof(packet),
+        0,
+        1,
+        0,
+        (unsigned short)(i & 0xFFFF),
+        topic,
+        payload,
+        sizeof(payload));
+
+    if (len <= 0)
+    {
+      return -1;
+    }
+
+    checksum += (unsigned long)len;
+  }
+
+  return 0;
+}
+
+static int deserialize_puback(int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    unsigned short topic_id;
+    unsigned short packet_id;
+    unsigned char return_code;
+
+    if (MQTTSNDeserialize_puback(&topic_id, &packet_id, &return_code, puback, puback_len) != 1)
+    {
+      return -1;
+    }
+
+    checksum += packet_id;
+  }
+
+  return 0;
+}
+
+// getfn of MQTTSNPacket_read(), reading the serialized PUBLISH from read_offset on
+static int read_publish(unsigned char* buf, int count)
+{
+  int len = publish_len - read_offset < count ? publish_len - read_offset : count;
+
+  memcpy(buf, publish + read_offset, (size_t)len);
+  read_offset += len;
+  return len;
+}
+
+static int packet_read(int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    read_offset = 0;
+    if (MQTTSNPacket_read(packet, sizeof(packet), read_publish) != MQTTSN_PUBLISH)
+    {
+      return -1;
+    }
+
+    checksum += (unsigned long)read_offset;
+  }
+
+  return 0;
+}
+
+static int get_publish_topic(int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    size_t len;
+
+    if (az_failed(az_iot_hub_client_telemetry_get_publish_topic(
+            &hub_client, NULL, topic_name, sizeof(topic_name), &len)))
+    {
+      return -1;
+    }
+
+    checksum += (unsigned long)len;
+  }
+
+  return 0;
+}
+
+static const struct
+{
+  const char* name;
+  BENCH_OPERATION run;
+} operations[] = {
+  { "MQTTSNSerialize_connect", serialize_connect },
+  { "MQTTSNSerialize_register", serialize_register },
+  { "MQTTSNSerialize_publish", serialize_publish },
+  { "MQTTSNDeserialize_puback", deserialize_puback },
+  { "MQTTSNPacket_read", packet_read },
+  { "telemetry_get_publish_topic", get_publish_topic },
+};
+
+/*
+ * Run the operation count times after a warmup, RUNS times, keeping the fastest run and the
+ * allocations it made. Return 0 on an error.
+ */
+static uint64_t run_operation(BENCH_OPERATION run, int count, unsigned long* out_allocations)
+{
+  uint64_t best_ns = UINT64_MAX;
+
+  if (run(WARMUP_OPERATION_COUNT) != 0)
+  {
+    return 0;
+  }
+
+  for (int i = 0; i < RUNS; i++)
+  {
+    unsigned long allocations = allocation_count;
+    uint64_t start_ns = time_util_now_ns();
+    uint64_t elapsed_ns;
+
+    if (run(count) != 0)
+    {
+      return 0;
+    }
+
+    elapsed_ns = time_util_now_ns() - start_ns;
+    if (elapsed_ns < best_ns)
+    {
+      best_ns = elapsed_ns;
+      *out_allocations = allocation_count - allocations;
+    }
+  }
+
+  return best_ns;
+}
+
+/*
+ * Build the inputs: the telemetry topic of a device, a payload, and a PUBACK and a PUBLISH to read
+ */
+static int prepare_inputs(void)
+{
+  MQTTSN_topicid topic;
+  size_t len;
+
+  if (az_failed(az_iot_hub_client_init(
+          &hub_client,
+          az_span_from_str((char*)bench_hostname),
+          az_span_from_str((char*)bench_device_id),
+          NULL))
+      || az_failed(az_iot_hub_client_telemetry_get_publish_topic(
+          &hub_client, NULL, topic_name, sizeof(topic_name), &len)))
+  {
+    printf("Failed to get the publish topic\r\n");
+    return -1;
+  }
+
+  memset(payload, 'x', sizeof(payload));
+  memset(&topic, 0, sizeof(topic));
+  topic.type = MQTTSN_TOPIC_TYPE_PREDEFINED;
+  topic.data.id = BENCH_TOPIC_ID;
+
+  puback_len
+      = MQTTSNSerialize_puback(puback, sizeof(puback), BENCH_TOPIC_ID, 1, MQTTSN_RC_ACCEPTED);
+  publish_len = MQTTSNSerialize_publish(
+      publish, sizeof(publish), 0, 1, 0, 1, topic, payload, sizeof(payload));
+  if (puback_len <= 0 || publish_len <= 0)
+  {
+    printf("Failed to serialize the PUBACK and PUBLISH inputs\r\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Time the MQTT-SN serialization and deserialization functions the client calls for every packet,
+ * and the topic generation of the Azure IoT Hub client, on fixed inputs. The fastest of RUNS runs
+ * is reported, so that results can be compared across versions of the libraries:
+ * 1. Build the inputs
+ * 2. Time each operation and print ns/op and allocations/op
+ *   bench_serialize [operation count]
+ */
+int main(int argc, char** argv)
+{
+  int count = argc > 1 ? atoi(argv[1]) : DEFAULT_OPERATION_COUNT;
+
+  if (count <= 0)
+  {
+    printf("Usage: bench_serialize [operation count]\r\n");
+    return 1;
+  }
+
+  // 1. Build the inputs
+  if (prepare_inputs() != 0)
+  {
+    return 1;
+  }
+
+  // 2. Time each operation and print ns/op and allocations/op
+  printf(
+      "%d operations, fastest of %d runs, topic \"%s\", %d B payload\r\n",
+      count,
+      RUNS,
+      topic_name,
+      BENCH_PAYLOAD_SIZE);
+  printf("%-28s %10s %14s %12s\r\n", "operation", "ns/op", "ops/s", "allocs/op");
+
+  for (size_t i = 0; i < sizeof(operations) / sizeof(operations[0]); i++)
+  {
+    unsigned long allocations = 0;
+    uint64_t elapsed_ns = run_operation(operations[i].run, count, &allocations);
+
+    if (elapsed_ns == 0)
+    {
+      printf("%s failed\r\n", operations[i].name);
+      return 1;
+    }
+
+    if (ALLOCATIONS_COUNTED)
+    {
+      printf(
+          "%-28s %10.1f %14.0f %12.2f\r\n",
+          operations[i].name,
+          (double)elapsed_ns / count,
+          (double)count * 1e9 / (double)elapsed_ns,
+          (double)allocations / count);
+    }
+    else
+    {
+      printf(
+          "%-28s %10.1f %14.0f %12s\r\n",
+          operations[i].name,
+          (double)elapsed_ns / count,
+          (double)count * 1e9 / (double)elapsed_ns,
+          "n/a");
+    }
+  }
+
+  return 0;
+}
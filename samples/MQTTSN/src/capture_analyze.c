@@ -0,0 +1,585 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "latency_histogram.h"
+#include "transport_capture.h"
+#include "wire_stats.h"
+
+#define MAX_INTERFACES 16
+#define PENDING_BUCKETS 65536
+
+// Link types of captures taken with tcpdump or Wireshark, besides TRANSPORT_CAPTURE_LINKTYPE_RAW
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+
+#define OPTION_END 0
+#define OPTION_TSRESOL 9
+
+#define IPPROTO_UDP_NUMBER 17
+#define UDP_HEADER_SIZE 8
+
+#define MQTTSN_PUBLISH 0x0C
+#define MQTTSN_PUBACK 0x0D
+#define MQTTSN_PUBREC 0x0F
+
+// The message type answering a request, 0 for none. PUBLISH is answered by PUBREC with QoS 2.
+static const int responses[WIRE_STATS_MESSAGE_TYPES] = {
+  [0x04] = 0x05, // CONNECT, CONNACK
+  [0x0A] = 0x0B, // REGISTER, REGACK
+  [0x0C] = MQTTSN_PUBACK, // PUBLISH
+  [0x12] = 0x13, // SUBSCRIBE, SUBACK
+  [0x14] = 0x15, // UNSUBSCRIBE, UNSUBACK
+  [0x16] = 0x17, // PINGREQ, PINGRESP
+  [0x18] = 0x18, // DISCONNECT, answered by a DISCONNECT
+};
+
+// Offset of the message ID from the message type, 0 for messages without one
+static const int message_id_offsets[WIRE_STATS_MESSAGE_TYPES] = {
+  [0x0A] = 3, [0x0B] = 3, [0x0C] = 4, [0x0D] = 3, [0x0F] = 1,
+  [0x12] = 2, [0x13] = 4, [0x14] = 2, [0x15] = 1,
+};
+
+// An address and port, IPv4 addresses mapped to IPv6
+typedef struct endpoint_tag
+{
+  unsigned char addr[16];
+  unsigned char port[2];
+} ENDPOINT;
+
+typedef struct pending_key_tag
+{
+  ENDPOINT requester;
+  ENDPOINT responder;
+  uint16_t response;
+  uint16_t message_id;
+} PENDING_KEY;
+
+// A request waiting for its response
+typedef struct pending_tag
+{
+  PENDING_KEY key;
+  int request;
+  uint64_t first_sent_us;
+  struct pending_tag* next;
+} PENDING;
+
+typedef struct request_stats_tag
+{
+  uint64_t requests;
+  uint64_t retransmissions;
+  uint64_t unanswered;
+  LATENCY_HISTOGRAM latency;
+} REQUEST_STATS;
+
+typedef struct interface_tag
+{
+  int linktype;
+  uint64_t units_per_second;
+} INTERFACE;
+
+typedef struct analysis_tag
+{
+  INTERFACE interfaces[MAX_INTERFACES];
+  int interface_count;
+  uint64_t datagrams;
+  uint64_t skipped; // not UDP over IP, or not an MQTT-SN packet
+  uint64_t first_us;
+  uint64_t last_us;
+  WIRE_STATS wire_stats;
+  REQUEST_STATS requests[WIRE_STATS_MESSAGE_TYPES];
+  PENDING* pending[PENDING_BUCKETS];
+} ANALYSIS;
+
+static uint32_t get_32(const unsigned char* buf)
+{
+  uint32_t value;
+
+  memcpy(&value, buf, sizeof(value));
+  return value;
+}
+
+static uint16_t get_16(const unsigned char* buf)
+{
+  uint16_t value;
+
+  memcpy(&value, buf, sizeof(value));
+  return value;
+}
+
+static void endpoint_from_ipv4(const unsigned char* addr, const unsigned char* port, ENDPOINT* out)
+{
+  memset(out->addr, 0, 10);
+  out->addr[10] = out->addr[11] = 0xFF;
+  memcpy(out->addr + 12, addr, 4);
+  memcpy(out->port, port, 2);
+}
+
+/*
+ * Find the UDP payload of an IPv4 or IPv6 packet, and the endpoints it was sent from and to.
+ * Return the payload length, -1 for anything else, e.g. fragments or IPv6 extension headers.
+ */
+static int get_udp_payload(
+    const unsigned char* packet,
+    int len,
+    ENDPOINT* source,
+    ENDPOINT* destination,
+    const unsigned char** payload)
+{
+  const unsigned char* udp;
+  int udp_len;
+
+  if (len >= 20 && packet[0] >> 4 == 4)
+  {
+    int header_len = (packet[0] & 0x0F) * 4;
+
+    if (packet[9] != IPPROTO_UDP_NUMBER || ((packet[6] & 0x3F) | packet[7]) != 0
+        || len < header_len + UDP_HEADER_SIZE)
+    {
+      return -1;
+    }
+
+    udp = packet + header_len;
+    endpoint_from_ipv4(packet + 12, udp, source);
+    endpoint_from_ipv4(packet + 16, udp + 2, destination);
+  }
+  else if (len >= 40 && packet[0] >> 4 == 6)
+  {
+    if (packet[6] != IPPROTO_UDP_NUMBER || len < 40 + UDP_HEADER_SIZE)
+    {
+      return -1;
+    }
+
+    udp = packet + 40;
+    memcpy(source->addr, packet + 8, 16);
+    memcpy(source->port, udp, 2);
+    memcpy(destination->addr, packet + 24, 16);
+    memcpy(destination->port, udp + 2, 2);
+  }
+  else
+  {
+    return -1;
+  }
+
+  // The captured bytes may stop short of the length in the UDP header
+  udp_len = (udp[4] << 8 | udp[5]) - UDP_HEADER_SIZE;
+  if (udp_len < 0 || udp_len > len - (int)(udp - packet) - UDP_HEADER_SIZE)
+  {
+    return -1;
+  }
+
+  *payload = udp + UDP_HEADER_SIZE;
+  return udp_len;
+}
+
+/*
+ * Strip the link layer header, return the IP packet length or -1
+ */
+static int get_ip_packet(int linktype, const unsigned char* data, int len, const unsigned char** ip)
+{
+  int offset;
+  int ethertype;
+
+  switch (linktype)
+  {
+    case TRANSPORT_CAPTURE_LINKTYPE_RAW:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+      *ip = data;
+      return len;
+
+    case LINKTYPE_ETHERNET:
+      offset = 14;
+      ethertype = len >= 14 ? data[12] << 8 | data[13] : 0;
+      if (ethertype == 0x8100 && len >= 18) // VLAN tag
+      {
+        offset = 18;
+        ethertype = data[16] << 8 | data[17];
+      }
+      break;
+
+    case LINKTYPE_LINUX_SLL:
+      offset = 16;
+      ethertype = len >= 16 ? data[14] << 8 | data[15] : 0;
+      break;
+
+    default:
+      return -1;
+  }
+
+  if (ethertype != 0x0800 && ethertype != 0x86DD)
+  {
+    return -1;
+  }
+
+  *ip = data + offset;
+  return len - offset;
+}
+
+static uint32_t hash_key(const PENDING_KEY* key)
+{
+  const unsigned char* bytes = (const unsigned char*)key;
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < sizeof(PENDING_KEY); i++)
+  {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+
+  return hash & (PENDING_BUCKETS - 1);
+}
+
+static PENDING** find_pending(ANALYSIS* analysis, const PENDING_KEY* key)
+{
+  PENDING** link = &analysis->pending[hash_key(key)];
+
+  while (*link != NULL && memcmp(&(*link)->key, key, sizeof(PENDING_KEY)) != 0)
+  {
+    link = &(*link)->next;
+  }
+
+  return link;
+}
+
+/*
+ * Count an MQTT-SN datagram, then either answer the request it responds to, or wait for the
+ * response to it. Retransmitted requests keep the time of their first transmission, so that
+ * latencies are those the client saw.
+ */
+static void analyze_datagram(
+    ANALYSIS* analysis,
+    const ENDPOINT* source,
+    const ENDPOINT* destination,
+    const unsigned char* buf,
+    int len,
+    int direction,
+    uint64_t time_us)
+{
+  int type = wire_stats_message_type(buf, len);
+  int type_offset = buf[0] == 0x01 ? 3 : 1;
+  int offset = message_id_offsets[type] > 0 ? type_offset + message_id_offsets[type] : 0;
+  int response = responses[type];
+  PENDING_KEY key;
+  PENDING** link;
+
+  if (type == WIRE_STATS_OTHER || offset + 2 > len)
+  {
+    analysis->skipped++;
+    return;
+  }
+
+  if (direction == TRANSPORT_CAPTURE_SENT)
+  {
+    wire_stats_record_sent(&analysis->wire_stats, buf, len);
+  }
+  else
+  {
+    wire_stats_record_received(&analysis->wire_stats, buf, len);
+  }
+
+  memset(&key, 0, sizeof(key));
+  key.message_id = (uint16_t)(offset > 0 ? buf[offset] << 8 | buf[offset + 1] : 0);
+
+  // A response goes back from the responder to the requester
+  key.requester = *destination;
+  key.responder = *source;
+  key.response = (uint16_t)type;
+  if (*(link = find_pending(analysis, &key)) != NULL)
+  {
+    PENDING* pending = *link;
+
+    latency_histogram_record(
+        &analysis->requests[pending->request].latency, time_us - pending->first_sent_us);
+    *link = pending->next;
+    free(pending);
+    return;
+  }
+
+  // QoS 0 and -1 PUBLISH packets are not answered, QoS 2 ones are answered by PUBREC
+  if (type == MQTTSN_PUBLISH)
+  {
+    int qos = (buf[type_offset + 1] >> 5) & 0x03;
+
+    response = qos == 1 ? MQTTSN_PUBACK : qos == 2 ? MQTTSN_PUBREC : 0;
+  }
+
+  if (response == 0)
+  {
+    return;
+  }
+
+  key.requester = *source;
+  key.responder = *destination;
+  key.response = (uint16_t)response;
+  if (*(link = find_pending(analysis, &key)) != NULL)
+  {
+    analysis->requests[type].retransmissions++;
+    if (direction == TRANSPORT_CAPTURE_SENT)
+    {
+      wire_stats_record_retransmitted(&analysis->wire_stats, buf, len);
+    }
+    return;
+  }
+
+  if ((*link = calloc(1, sizeof(PENDING))) != NULL)
+  {
+    (*link)->key = key;
+    (*link)->request = type;
+    (*link)->first_sent_us = time_us;
+    analysis->requests[type].requests++;
+  }
+}
+
+/*
+ * Take the link type and timestamp resolution of an interface description block
+ */
+static void read_interface(ANALYSIS* analysis, const unsigned char* body, uint32_t len)
+{
+  INTERFACE* interface;
+
+  if (analysis->interface_count == MAX_INTERFACES || len < 8)
+  {
+    return;
+  }
+
+  interface = &analysis->interfaces[analysis->interface_count++];
+  interface->linktype = get_16(body);
+  interface->units_per_second = 1000000;
+
+  for (uint32_t offset = 8; offset + 4 <= len;)
+  {
+    uint16_t code = get_16(body + offset);
+    uint16_t option_len = get_16(body + offset + 2);
+
+    if (code == OPTION_END || offset + 4 + option_len > len)
+    {
+      break;
+    }
+
+    // 10^-n seconds, or 2^-n with the top bit set
+    if (code == OPTION_TSRESOL && option_len >= 1)
+    {
+      unsigned char resolution = body[offset + 4];
+
+      interface->units_per_second = 1;
+      for (int i = 0; i < (resolution & 0x7F) && i < 63; i++)
+      {
+        interface->units_per_second *= resolution & 0x80 ? 2 : 10;
+      }
+    }
+
+    offset += 4 + (((uint32_t)option_len + 3) & ~3u);
+  }
+}
+
+/*
+ * Analyze the datagram of an enhanced packet block. Its direction comes from the flags option,
+ * captures without one, e.g. from tcpdump, count every datagram as received.
+ */
+static void read_packet(ANALYSIS* analysis, const unsigned char* body, uint32_t len)
+{
+  const INTERFACE* interface;
+  const unsigned char* ip;
+  const unsigned char* payload;
+  ENDPOINT source;
+  ENDPOINT destination;
+  uint64_t timestamp;
+  uint64_t time_us;
+  uint32_t captured_len;
+  uint32_t options;
+  int direction = TRANSPORT_CAPTURE_RECEIVED;
+  int ip_len;
+  int payload_len;
+
+  if (len < 20 || get_32(body) >= (uint32_t)analysis->interface_count
+      || (captured_len = get_32(body + 12)) > len - 20)
+  {
+    analysis->skipped++;
+    return;
+  }
+
+  interface = &analysis->interfaces[get_32(body)];
+  timestamp = (uint64_t)get_32(body + 4) << 32 | get_32(body + 8);
+  time_us = interface->units_per_second == 1000000
+      ? timestamp
+      : (uint64_t)((double)timestamp * 1e6 / (double)interface->units_per_second);
+
+  for (options = 20 + ((captured_len + 3) & ~3u); options + 4 <= len;)
+  {
+    uint16_t code = get_16(body + options);
+    uint16_t option_len = get_16(body + options + 2);
+
+    if (code == OPTION_END || options + 4 + option_len > len)
+    {
+      break;
+    }
+
+    if (code == TRANSPORT_CAPTURE_OPTION_FLAGS && option_len == 4)
+    {
+      direction = (get_32(body + options + 4) & 0x03) == 2 ? TRANSPORT_CAPTURE_SENT
+                                                            : TRANSPORT_CAPTURE_RECEIVED;
+    }
+
+    options += 4 + (((uint32_t)option_len + 3) & ~3u);
+  }
+
+  if ((ip_len = get_ip_packet(interface->linktype, body + 20, (int)captured_len, &ip)) < 0
+      || (payload_len = get_udp_payload(ip, ip_len, &source, &destination, &payload)) < 2)
+  {
+    analysis->skipped++;
+    return;
+  }
+
+  if (analysis->datagrams++ == 0)
+  {
+    analysis->first_us = time_us;
+  }
+  analysis->last_us = time_us;
+  analyze_datagram(analysis, &source, &destination, payload, payload_len, direction, time_us);
+}
+
+static void print_analysis(ANALYSIS* analysis, const char* path)
+{
+  // Requests still waiting were never answered
+  for (int i = 0; i < PENDING_BUCKETS; i++)
+  {
+    for (PENDING* pending = analysis->pending[i]; pending != NULL;)
+    {
+      PENDING* next = pending->next;
+
+      analysis->requests[pending->request].unanswered++;
+      free(pending);
+      pending = next;
+    }
+  }
+
+  printf(
+      "%s: %llu datagrams in %.3f s, %llu packets skipped\r\n",
+      path,
+      (unsigned long long)analysis->datagrams,
+      (double)(analysis->last_us - analysis->first_us) / 1e6,
+      (unsigned long long)analysis->skipped);
+  printf("Wire statistics:\r\n");
+  wire_stats_print_json(&analysis->wire_stats, stdout);
+
+  for (int type = 0; type < WIRE_STATS_MESSAGE_TYPES; type++)
+  {
+    REQUEST_STATS* stats = &analysis->requests[type];
+    char name[64];
+
+    if (stats->requests == 0)
+    {
+      continue;
+    }
+
+    snprintf(name, sizeof(name), "%s latency", wire_stats_message_type_name(type));
+    printf(
+        "%s: requests = %llu, retransmissions = %llu, unanswered = %llu\r\n",
+        wire_stats_message_type_name(type),
+        (unsigned long long)stats->requests,
+        (unsigned long long)stats->retransmissions,
+        (unsigned long long)stats->unanswered);
+    latency_histogram_print(&stats->latency, name);
+  }
+}
+
+/*
+ * 1. Check the section header of the pcapng capture
+ * 2. Read every block: interface descriptions for the link types, enhanced packet blocks for the
+ *    datagrams, which are counted per message type and paired with their requests
+ * 3. Print the bytes per message type as wire statistics JSON and the latency per request type
+ *   capture_analyze <capture file>
+ */
+int main(int argc, char** argv)
+{
+  static ANALYSIS analysis;
+  unsigned char* block = NULL;
+  size_t block_capacity = 0;
+  unsigned char header[12];
+  FILE* file;
+
+  if (argc != 2 || (file = fopen(argv[1], "rb")) == NULL)
+  {
+    printf("Usage: capture_analyze <capture file>\r\n");
+    return 1;
+  }
+
+  wire_stats_init(&analysis.wire_stats);
+  for (int i = 0; i < WIRE_STATS_MESSAGE_TYPES; i++)
+  {
+    latency_histogram_init(&analysis.requests[i].latency);
+  }
+
+  // 1. Check the section header of the pcapng capture
+  if (fread(header, 1, sizeof(header), file) != sizeof(header)
+      || get_32(header) != TRANSPORT_CAPTURE_SECTION_HEADER
+      || get_32(header + 8) != TRANSPORT_CAPTURE_BYTE_ORDER_MAGIC)
+  {
+    printf("%s is not a pcapng capture in the byte order of this host\r\n", argv[1]);
+    fclose(file);
+    return 1;
+  }
+
+  // 2. Read every block: interface descriptions for the link types, enhanced packet blocks for
+  //    the datagrams, which are counted per message type and paired with their requests
+  fseek(file, 0, SEEK_SET);
+  while (fread(header, 1, 8, file) == 8)
+  {
+    uint32_t type = get_32(header);
+    uint32_t len = get_32(header + 4);
+    uint32_t body_len = len - 12; // without the type and the length, at both ends
+
+    if (len < 12 || len % 4 != 0)
+    {
+      printf("Invalid block length %u\r\n", len);
+      break;
+    }
+
+    if (body_len + 4 > block_capacity)
+    {
+      unsigned char* grown = realloc(block, body_len + 4);
+
+      if (grown == NULL)
+      {
+        printf("Out of memory\r\n");
+        break;
+      }
+
+      block = grown;
+      block_capacity = body_len + 4;
+    }
+
+    if (fread(block, 1, body_len + 4, file) != body_len + 4)
+    {
+      printf("Truncated block at the end of the capture\r\n");
+      break;
+    }
+
+    if (type == TRANSPORT_CAPTURE_SECTION_HEADER)
+    {
+      // A new section describes its own interfaces
+      analysis.interface_count = 0;
+    }
+    else if (type == TRANSPORT_CAPTURE_INTERFACE_DESCRIPTION)
+    {
+      read_interface(&analysis, block, body_len);
+    }
+    else if (type == TRANSPORT_CAPTURE_ENHANCED_PACKET)
+    {
+      read_packet(&analysis, block, body_len);
+    }
+  }
+
+  fclose(file);
+  free(block);
+
+  // 3. Print the bytes per message type as wire statistics JSON and the latency per request type
+  print_analysis(&analysis, argv[1]);
+  return 0;
+}
@@ -0,0 +1,381 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "event_log.h"
+#include "time_util.h"
+
+// DO NOT MODIFY: Event Log Environment Variable Names
+#define ENV_MQTTSN_LOG_MODE "MQTTSN_LOG_MODE"
+#define ENV_MQTTSN_LOG_LEVEL "MQTTSN_LOG_LEVEL"
+#define ENV_MQTTSN_LOG_FILE "MQTTSN_LOG_FILE"
+#define ENV_MQTTSN_LOG_RING_SIZE "MQTTSN_LOG_RING_SIZE"
+
+#define DEFAULT_LOG_FILE "mqttsn_events.bin"
+
+/*
+ * Records of one thread. Only the owning thread moves head and only event_log_flush() moves tail,
+ * each on its own cache line.
+ */
+typedef struct event_log_ring_tag
+{
+  uint64_t head;
+  uint64_t dropped;
+  uint32_t thread;
+  uint32_t mask;
+  struct event_log_ring_tag* next;
+  _Alignas(64) uint64_t tail;
+  _Alignas(64) EVENT_LOG_RECORD records[];
+} EVENT_LOG_RING;
+
+typedef struct event_log_event_info_tag
+{
+  const char* name;
+  const char* format; // printf format of the message, the arguments are unsigned ints
+} EVENT_LOG_EVENT_INFO;
+
+static const EVENT_LOG_EVENT_INFO events[EVENT_LOG_EVENT_COUNT] = {
+  [EVENT_LOG_CONNACK] = { "CONNACK", "Successfully received CONNACK" },
+  [EVENT_LOG_REGACK] = { "REGACK", "Successfully received REGACK for topic id = %u" },
+  [EVENT_LOG_PUBLISH] = { "PUBLISH", "Sent PUBLISH packet ID = %u, %u bytes" },
+  [EVENT_LOG_PUBACK]
+  = { "PUBACK", "Received PUBACK for packet ID = %u, return code %u, latency = %u us" },
+  [EVENT_LOG_PUBLISH_REJECTED]
+  = { "PUBLISH_REJECTED", "Gateway rejected PUBLISH packet ID = %u, return code %u" },
+  [EVENT_LOG_PUBLISH_RETRANSMITTED]
+  = { "PUBLISH_RETRANSMITTED", "Retransmitted PUBLISH packet ID = %u" },
+  [EVENT_LOG_PUBLISH_DROPPED]
+  = { "PUBLISH_DROPPED", "Dropping PUBLISH packet ID = %u after %u retransmissions" },
+  [EVENT_LOG_REQUEST_RETRY] = { "REQUEST_RETRY", "Retry attempt number %u, RTO = %u ms" },
+  [EVENT_LOG_GATEWAY_DISCONNECT]
+  = { "GATEWAY_DISCONNECT", "Gateway disconnected the client, reconnecting" },
+  [EVENT_LOG_TOPIC_REJECTED]
+  = { "TOPIC_REJECTED", "Gateway rejected topic ID %u, falling back to REGISTER" },
+  [EVENT_LOG_MESSAGE_SENT] = { "MESSAGE_SENT", "Sending Message %u, queue depth = %u" },
+  [EVENT_LOG_TOPIC_REGISTERED]
+  = { "TOPIC_REGISTERED", "Registered topic %u as topic id = %u, %u registrations pending" },
+  // A return code of 0 means that no REGACK arrived
+  [EVENT_LOG_TOPIC_DROPPED]
+  = { "TOPIC_DROPPED", "Dropping topic %u and %u messages, %u retransmissions, return code %u" },
+};
+
+static const char* level_names[] = { "NONE", "ERROR", "WARN", "INFO", "DEBUG" };
+
+// printf mode at INFO until event_log_open(), as the printf calls the log replaced
+int event_log_level = EVENT_LOG_LEVEL_INFO;
+static EVENT_LOG_MODE mode = EVENT_LOG_MODE_PRINTF;
+static FILE* output;
+static uint32_t ring_size = EVENT_LOG_DEFAULT_RING_SIZE;
+static uint64_t start_ns;
+
+static EVENT_LOG_RING* rings; // every ring ever allocated, newest first
+static uint32_t ring_count;
+static char flush_lock;
+static uint64_t records_written;
+
+static _Thread_local EVENT_LOG_RING* thread_ring;
+
+/*
+ * Allocate the ring of the calling thread and push it on the list event_log_flush() walks
+ */
+static EVENT_LOG_RING* create_ring(void)
+{
+  EVENT_LOG_RING* ring;
+  size_t size = sizeof(EVENT_LOG_RING) + (size_t)ring_size * sizeof(EVENT_LOG_RECORD);
+
+  if ((ring = aligned_alloc(64, (size + 63) & ~(size_t)63)) == NULL)
+  {
+    return NULL;
+  }
+
+  memset((void*)ring, 0, sizeof(EVENT_LOG_RING));
+  ring->mask = ring_size - 1;
+  ring->thread = __atomic_add_fetch(&ring_count, 1, __ATOMIC_RELAXED);
+  ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(
+      &rings, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+  {
+  }
+
+  return thread_ring = ring;
+}
+
+static int parse_level(const char* value)
+{
+  for (int level = EVENT_LOG_LEVEL_NONE; level <= EVENT_LOG_LEVEL_DEBUG; level++)
+  {
+    if (strcasecmp(value, level_names[level]) == 0)
+    {
+      return level;
+    }
+  }
+
+  return -1;
+}
+
+/*
+ * Read the mode, level, file and ring size from the environment. Return -1 for an invalid value.
+ */
+int event_log_read_configuration(EVENT_LOG_CONFIG* config)
+{
+  const char* value;
+
+  memset(config, 0, sizeof(EVENT_LOG_CONFIG));
+  config->mode = EVENT_LOG_MODE_PRINTF;
+  config->level = EVENT_LOG_LEVEL_INFO;
+  config->ring_size = EVENT_LOG_DEFAULT_RING_SIZE;
+
+  if ((value = getenv(ENV_MQTTSN_LOG_MODE)) != NULL && strcmp(value, "printf") != 0)
+  {
+    if (strcmp(value, "off") == 0)
+    {
+      config->mode = EVENT_LOG_MODE_OFF;
+    }
+    else if (strcmp(value, "ring") == 0)
+    {
+      config->mode = EVENT_LOG_MODE_RING;
+    }
+    else
+    {
+      printf("Invalid value for %s, must be off, ring or printf\r\n", ENV_MQTTSN_LOG_MODE);
+      return -1;
+    }
+  }
+
+  if ((value = getenv(ENV_MQTTSN_LOG_LEVEL)) != NULL && (config->level = parse_level(value)) < 0)
+  {
+    printf(
+        "Invalid value for %s, must be none, error, warn, info or debug\r\n", ENV_MQTTSN_LOG_LEVEL);
+    return -1;
+  }
+
+  config->path = getenv(ENV_MQTTSN_LOG_FILE);
+  if (config->path == NULL && config->mode == EVENT_LOG_MODE_RING)
+  {
+    config->path = DEFAULT_LOG_FILE;
+  }
+
+  if ((value = getenv(ENV_MQTTSN_LOG_RING_SIZE)) != NULL)
+  {
+    config->ring_size = (uint32_t)strtoul(value, NULL, 10);
+    if (config->ring_size == 0 || (config->ring_size & (config->ring_size - 1)) != 0)
+    {
+      printf("Invalid value for %s, must be a power of two\r\n", ENV_MQTTSN_LOG_RING_SIZE);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Start logging. In ring mode the file starts with an EVENT_LOG_FILE_HEADER. A text log is line
+ * buffered, as a terminal is. Must not race with event_log_write().
+ */
+int event_log_open(const EVENT_LOG_CONFIG* config)
+{
+  EVENT_LOG_FILE_HEADER header;
+
+  if (config->mode == EVENT_LOG_MODE_RING && config->path == NULL)
+  {
+    printf("The event log needs a file in ring mode\r\n");
+    return -1;
+  }
+
+  event_log_close();
+  start_ns = time_util_now_ns();
+  ring_size = config->ring_size;
+
+  if (config->mode != EVENT_LOG_MODE_OFF && config->path != NULL)
+  {
+    if ((output = fopen(config->path, config->mode == EVENT_LOG_MODE_RING ? "wb" : "w")) == NULL)
+    {
+      printf("Failed to open the event log %s\r\n", config->path);
+      return -1;
+    }
+
+    setvbuf(output, NULL, config->mode == EVENT_LOG_MODE_RING ? _IOFBF : _IOLBF, BUFSIZ);
+  }
+
+  if (config->mode == EVENT_LOG_MODE_RING)
+  {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EVENT_LOG_FILE_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(EVENT_LOG_RECORD);
+    header.event_count = EVENT_LOG_EVENT_COUNT;
+    header.start_ns = start_ns;
+    fwrite(&header, sizeof(header), 1, output);
+  }
+
+  mode = config->mode;
+  event_log_level = config->mode == EVENT_LOG_MODE_OFF ? EVENT_LOG_LEVEL_NONE : config->level;
+  return 0;
+}
+
+/*
+ * Log an event, use EVENT_LOG() which checks the level first
+ */
+void event_log_write(int level, int event, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+  EVENT_LOG_RING* ring = thread_ring;
+  EVENT_LOG_RECORD* record;
+  EVENT_LOG_RECORD text;
+  uint64_t head = 0;
+
+  if (mode == EVENT_LOG_MODE_PRINTF)
+  {
+    ring = NULL;
+    record = &text;
+  }
+  else if (mode != EVENT_LOG_MODE_RING || (ring == NULL && (ring = create_ring()) == NULL))
+  {
+    return;
+  }
+  else
+  {
+    // A full ring keeps the records event_log_flush() has not written out yet
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask)
+    {
+      __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+      return;
+    }
+
+    record = &ring->records[head & ring->mask];
+  }
+
+  record->time_ns = time_util_now_ns();
+  record->thread = ring != NULL ? ring->thread : 0;
+  record->event = (uint16_t)event;
+  record->level = (uint8_t)level;
+  record->reserved = 0;
+  record->args[0] = a0;
+  record->args[1] = a1;
+  record->args[2] = a2;
+  record->args[3] = a3;
+
+  if (ring == NULL)
+  {
+    event_log_print_message(output != NULL ? output : stdout, record);
+    return;
+  }
+
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Append the records of every ring to the log file. Called from any thread, typically once per
+ * event loop iteration or by a reporting thread; it never waits on the threads that log.
+ */
+void event_log_flush(void)
+{
+  if (mode != EVENT_LOG_MODE_RING)
+  {
+    return;
+  }
+
+  while (__atomic_test_and_set(&flush_lock, __ATOMIC_ACQUIRE))
+  {
+  }
+
+  for (EVENT_LOG_RING* ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL;
+       ring = ring->next)
+  {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+
+    // The records up to head may wrap around the end of the ring
+    while (tail != head)
+    {
+      uint64_t index = tail & ring->mask;
+      uint64_t count = head - tail < ring->mask + 1 - index ? head - tail : ring->mask + 1 - index;
+
+      fwrite(&ring->records[index], sizeof(EVENT_LOG_RECORD), count, output);
+      tail += count;
+      records_written += count;
+    }
+
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  }
+
+  __atomic_clear(&flush_lock, __ATOMIC_RELEASE);
+}
+
+/*
+ * Flush and close the log, and free the rings. The other threads that logged must have stopped.
+ */
+void event_log_close(void)
+{
+  uint64_t dropped = 0;
+
+  event_log_flush();
+
+  for (EVENT_LOG_RING* ring = rings; ring != NULL;)
+  {
+    EVENT_LOG_RING* next = ring->next;
+
+    dropped += ring->dropped;
+    free(ring);
+    ring = next;
+  }
+
+  if (mode == EVENT_LOG_MODE_RING)
+  {
+    printf(
+        "Event log: %llu records written, %llu dropped\r\n",
+        (unsigned long long)records_written,
+        (unsigned long long)dropped);
+  }
+
+  if (output != NULL)
+  {
+    fclose(output);
+    output = NULL;
+  }
+
+  rings = NULL;
+  ring_count = 0;
+  records_written = 0;
+  thread_ring = NULL;
+  mode = EVENT_LOG_MODE_OFF;
+  event_log_level = EVENT_LOG_LEVEL_NONE;
+}
+
+const char* event_log_event_name(int event)
+{
+  return event >= 0 && event < EVENT_LOG_EVENT_COUNT ? events[event].name : "?";
+}
+
+const char* event_log_level_name(int level)
+{
+  return level >= EVENT_LOG_LEVEL_NONE && level <= EVENT_LOG_LEVEL_DEBUG ? level_names[level]
+                                                                         : "?";
+}
+
+/*
+ * Print the message of a record as the printf it replaced did, with a single call so that the
+ * lines of different threads do not mix
+ */
+void event_log_print_message(FILE* file, const EVENT_LOG_RECORD* record)
+{
+  char message[128];
+
+  if (record->event >= EVENT_LOG_EVENT_COUNT)
+  {
+    fprintf(file, "Unknown event %u\r\n", record->event);
+    return;
+  }
+
+  snprintf(
+      message,
+      sizeof(message),
+      events[record->event].format,
+      record->args[0],
+      record->args[1],
+      record->args[2],
+      record->args[3]);
+  fprintf(file, "%s\r\n", message);
+}
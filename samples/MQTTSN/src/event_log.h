@@ -0,0 +1,112 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// A record is kept when its level is at most the configured one
+#define EVENT_LOG_LEVEL_NONE 0
+#define EVENT_LOG_LEVEL_ERROR 1
+#define EVENT_LOG_LEVEL_WARN 2
+#define EVENT_LOG_LEVEL_INFO 3
+#define EVENT_LOG_LEVEL_DEBUG 4
+
+// Highest level compiled in: with -DEVENT_LOG_COMPILED_LEVEL=0 every EVENT_LOG() disappears
+#ifndef EVENT_LOG_COMPILED_LEVEL
+#define EVENT_LOG_COMPILED_LEVEL EVENT_LOG_LEVEL_DEBUG
+#endif
+
+#define EVENT_LOG_ARGS 4
+
+// Records per thread, a power of two: 2 MiB of 32 byte records
+#define EVENT_LOG_DEFAULT_RING_SIZE 65536
+
+#define EVENT_LOG_FILE_MAGIC "MQSNEVT1"
+
+typedef enum
+{
+  EVENT_LOG_MODE_OFF,
+  EVENT_LOG_MODE_RING, // binary records to a per-thread ring, written out by event_log_flush()
+  EVENT_LOG_MODE_PRINTF // text lines, as soon as they are logged
+} EVENT_LOG_MODE;
+
+// Every event has a fixed message with up to EVENT_LOG_ARGS integer arguments, see event_log.c
+typedef enum
+{
+  EVENT_LOG_CONNACK,
+  EVENT_LOG_REGACK,
+  EVENT_LOG_PUBLISH,
+  EVENT_LOG_PUBACK,
+  EVENT_LOG_PUBLISH_REJECTED,
+  EVENT_LOG_PUBLISH_RETRANSMITTED,
+  EVENT_LOG_PUBLISH_DROPPED,
+  EVENT_LOG_REQUEST_RETRY,
+  EVENT_LOG_GATEWAY_DISCONNECT,
+  EVENT_LOG_TOPIC_REJECTED,
+  EVENT_LOG_MESSAGE_SENT,
+  EVENT_LOG_TOPIC_REGISTERED,
+  EVENT_LOG_TOPIC_DROPPED,
+  EVENT_LOG_EVENT_COUNT
+} EVENT_LOG_EVENT;
+
+// Fixed-size binary record, also the record format of the log file
+typedef struct event_log_record_tag
+{
+  uint64_t time_ns; // monotonic clock
+  uint32_t thread; // 1 for the first thread that logged, 0 in printf mode
+  uint16_t event;
+  uint8_t level;
+  uint8_t reserved;
+  uint32_t args[EVENT_LOG_ARGS];
+} EVENT_LOG_RECORD;
+
+// Start of the log file, followed by the records of every thread
+typedef struct event_log_file_header_tag
+{
+  char magic[8]; // EVENT_LOG_FILE_MAGIC, not terminated
+  uint32_t record_size;
+  uint32_t event_count;
+  uint64_t start_ns; // monotonic time the log was opened
+} EVENT_LOG_FILE_HEADER;
+
+typedef struct event_log_config_tag
+{
+  EVENT_LOG_MODE mode;
+  int level;
+  const char* path; // binary log in ring mode, text log in printf mode (NULL = stdout)
+  uint32_t ring_size;
+} EVENT_LOG_CONFIG;
+
+/*
+ * Leveled event log for the hot path. In ring mode a record costs a clock read and a 32 byte
+ * store: every thread owns a single-producer ring, lock free, and event_log_flush() appends what
+ * the rings hold to the log file, from any thread. A full ring drops the newest records and counts
+ * them. event_log_decode prints the file. printf mode formats each record right away, like the
+ * printf calls it replaces, and is the mode until event_log_open() says otherwise.
+ * Levels above EVENT_LOG_COMPILED_LEVEL are compiled out, the configured level costs one compare.
+ */
+#define EVENT_LOG(level, event, a0, a1, a2, a3)                                             \
+  do                                                                                        \
+  {                                                                                         \
+    if ((level) <= EVENT_LOG_COMPILED_LEVEL && (level) <= event_log_level)                  \
+    {                                                                                       \
+      event_log_write(                                                                      \
+          (level), (event), (uint32_t)(a0), (uint32_t)(a1), (uint32_t)(a2), (uint32_t)(a3)); \
+    }                                                                                       \
+  } while (0)
+
+extern int event_log_level; // EVENT_LOG_LEVEL_NONE while the log is off
+
+int event_log_read_configuration(EVENT_LOG_CONFIG* config);
+int event_log_open(const EVENT_LOG_CONFIG* config);
+void event_log_write(int level, int event, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3);
+void event_log_flush(void);
+void event_log_close(void);
+const char* event_log_event_name(int event);
+const char* event_log_level_name(int level);
+void event_log_print_message(FILE* file, const EVENT_LOG_RECORD* record);
+
+#endif // EVENT_LOG_H
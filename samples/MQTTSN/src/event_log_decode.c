@@ -0,0 +1,109 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "event_log.h"
+
+/*
+ * Records of different threads reach the file in flush order: sort them by time, then thread
+ */
+static int compare_records(const void* a, const void* b)
+{
+  const EVENT_LOG_RECORD* left = (const EVENT_LOG_RECORD*)a;
+  const EVENT_LOG_RECORD* right = (const EVENT_LOG_RECORD*)b;
+
+  if (left->time_ns != right->time_ns)
+  {
+    return left->time_ns < right->time_ns ? -1 : 1;
+  }
+
+  return left->thread < right->thread ? -1 : left->thread > right->thread;
+}
+
+/*
+ * 1. Check the header of the binary event log
+ * 2. Read every record and sort them by time
+ * 3. Print one line per record, seconds since the log was opened first, then the count per event
+ *   event_log_decode <event log file>
+ */
+int main(int argc, char** argv)
+{
+  FILE* file;
+  EVENT_LOG_FILE_HEADER header;
+  EVENT_LOG_RECORD* records = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  uint64_t counts[EVENT_LOG_EVENT_COUNT + 1];
+
+  if (argc != 2 || (file = fopen(argv[1], "rb")) == NULL)
+  {
+    printf("Usage: event_log_decode <event log file>\r\n");
+    return 1;
+  }
+
+  // 1. Check the header of the binary event log
+  if (fread(&header, sizeof(header), 1, file) != 1
+      || memcmp(header.magic, EVENT_LOG_FILE_MAGIC, sizeof(header.magic)) != 0
+      || header.record_size != sizeof(EVENT_LOG_RECORD))
+  {
+    printf("%s is not an event log of this version\r\n", argv[1]);
+    fclose(file);
+    return 1;
+  }
+
+  // 2. Read every record and sort them by time
+  do
+  {
+    if (count == capacity)
+    {
+      EVENT_LOG_RECORD* grown;
+
+      capacity = capacity > 0 ? capacity * 2 : 4096;
+      if ((grown = realloc(records, capacity * sizeof(EVENT_LOG_RECORD))) == NULL)
+      {
+        printf("Out of memory after %zu records\r\n", count);
+        free(records);
+        fclose(file);
+        return 1;
+      }
+
+      records = grown;
+    }
+
+    count += fread(&records[count], sizeof(EVENT_LOG_RECORD), capacity - count, file);
+  } while (count == capacity);
+
+  fclose(file);
+  qsort(records, count, sizeof(EVENT_LOG_RECORD), compare_records);
+
+  // 3. Print one line per record, seconds since the log was opened first, then the count per
+  //    event. Events unknown to this build are counted together.
+  memset(counts, 0, sizeof(counts));
+  for (size_t i = 0; i < count; i++)
+  {
+    const EVENT_LOG_RECORD* record = &records[i];
+
+    printf(
+        "%12.6f T%-3u %-5s ",
+        (double)(int64_t)(record->time_ns - header.start_ns) / 1e9,
+        record->thread,
+        event_log_level_name(record->level));
+    event_log_print_message(stdout, record);
+    counts[record->event < EVENT_LOG_EVENT_COUNT ? record->event : EVENT_LOG_EVENT_COUNT]++;
+  }
+
+  printf("%zu records\r\n", count);
+  for (int event = 0; event <= EVENT_LOG_EVENT_COUNT; event++)
+  {
+    if (counts[event] > 0)
+    {
+      printf("%-22s %10llu\r\n", event_log_event_name(event), (unsigned long long)counts[event]);
+    }
+  }
+
+  free(records);
+  return 0;
+}
@@ -0,0 +1,302 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "MQTTSNPacket.h"
+#include "gateway_discovery.h"
+#include "transport_capture.h"
+
+/*
+ * Return the table entry of the gateway that sent a GWINFO or ADVERTISE from addr, NULL when the
+ * table is full
+ */
+static GATEWAY_TABLE_ENTRY* get_gateway(
+    GATEWAY_DISCOVERY* discovery,
+    const struct sockaddr_storage* addr,
+    unsigned char gateway_id)
+{
+  char address[INET6_ADDRSTRLEN];
+  const void* host;
+  in_port_t port;
+  GATEWAY_TABLE_ENTRY* entry;
+
+  if (addr->ss_family == AF_INET6)
+  {
+    host = &((const struct sockaddr_in6*)addr)->sin6_addr;
+    port = ((const struct sockaddr_in6*)addr)->sin6_port;
+  }
+  else
+  {
+    host = &((const struct sockaddr_in*)addr)->sin_addr;
+    port = ((const struct sockaddr_in*)addr)->sin_port;
+  }
+
+  if (inet_ntop(addr->ss_family, host, address, sizeof(address)) == NULL
+      || (entry = gateway_table_add(discovery->table, address, ntohs(port))) == NULL)
+  {
+    return NULL;
+  }
+
+  if (!entry->discovered || entry->gateway_id != gateway_id)
+  {
+    printf("Discovered gateway %u at %s:%d\r\n", gateway_id, entry->address, entry->port);
+  }
+
+  entry->gateway_id = gateway_id;
+  entry->discovered = 1;
+  return entry;
+}
+
+/*
+ * The gateway answered SEARCHGW: time the round trip of its first GWINFO in the open round, and
+ * give it another chance if the client had failed over from it
+ */
+static void handle_gwinfo(
+    GATEWAY_DISCOVERY* discovery,
+    unsigned char* buf,
+    int len,
+    const struct sockaddr_storage* from,
+    uint64_t now_us)
+{
+  unsigned char gateway_id;
+  unsigned short address_len;
+  unsigned char* address;
+  GATEWAY_TABLE_ENTRY* entry;
+  int index;
+
+  if (MQTTSNDeserialize_gwinfo(&gateway_id, &address_len, &address, buf, len) != 1
+      || address_len > 0 || (entry = get_gateway(discovery, from, gateway_id)) == NULL)
+  {
+    return;
+  }
+
+  discovery->gwinfos++;
+  entry->hold_down_until_us = 0;
+  if (entry->advertise_duration_s > 0)
+  {
+    entry->expires_us = now_us
+        + (uint64_t)entry->advertise_duration_s * 1000000 * GATEWAY_DISCOVERY_ADVERTISE_MISSES;
+  }
+
+  index = (int)(entry - discovery->table->entries);
+  if (discovery->search_sent_us != 0 && !discovery->answered[index])
+  {
+    discovery->answered[index] = 1;
+    gateway_table_record_rtt(entry, now_us - discovery->search_sent_us);
+    gateway_table_record_success(entry);
+  }
+}
+
+/*
+ * The gateway announced itself, and when to expect its next ADVERTISE
+ */
+static void handle_advertise(
+    GATEWAY_DISCOVERY* discovery,
+    unsigned char* buf,
+    int len,
+    const struct sockaddr_storage* from,
+    uint64_t now_us)
+{
+  unsigned char gateway_id;
+  unsigned short duration_s;
+  GATEWAY_TABLE_ENTRY* entry;
+
+  if (MQTTSNDeserialize_advertise(&gateway_id, &duration_s, buf, len) != 1
+      || (entry = get_gateway(discovery, from, gateway_id)) == NULL)
+  {
+    return;
+  }
+
+  discovery->advertises++;
+  entry->advertise_duration_s = duration_s;
+  entry->expires_us = duration_s > 0
+      ? now_us + (uint64_t)duration_s * 1000000 * GATEWAY_DISCOVERY_ADVERTISE_MISSES
+      : UINT64_MAX;
+}
+
+/*
+ * Every discovered gateway that did not answer the round counts a loss
+ */
+static void close_round(GATEWAY_DISCOVERY* discovery, uint64_t now_us)
+{
+  for (int i = 0; i < discovery->table->count; i++)
+  {
+    GATEWAY_TABLE_ENTRY* entry = &discovery->table->entries[i];
+
+    if (entry->discovered && !discovery->answered[i] && entry->expires_us > now_us)
+    {
+      gateway_table_record_loss(entry);
+    }
+  }
+
+  discovery->search_sent_us = 0;
+}
+
+/*
+ * Join the multicast group on port. With an interval, the first SEARCHGW is sent by the first
+ * gateway_discovery_step().
+ */
+int gateway_discovery_open(
+    GATEWAY_DISCOVERY* discovery,
+    const char* group,
+    int port,
+    uint64_t interval_us,
+    GATEWAY_TABLE* table)
+{
+  memset((void*)discovery, 0, sizeof(GATEWAY_DISCOVERY));
+  discovery->table = table;
+  discovery->interval_us = interval_us;
+  discovery->next_search_us = interval_us > 0 ? 0 : UINT64_MAX;
+
+  if ((discovery->sock = transport_multicast_open(group, port, &discovery->group)) < 0)
+  {
+    printf("Failed to join multicast group %s:%d\r\n", group, port);
+    return discovery->sock;
+  }
+
+  return 0;
+}
+
+void gateway_discovery_close(GATEWAY_DISCOVERY* discovery)
+{
+  if (discovery->sock >= 0)
+  {
+    transport_socket_close(discovery->sock);
+    discovery->sock = -1;
+  }
+}
+
+/*
+ * Multicast SEARCHGW and open a round of GATEWAY_DISCOVERY_WAIT_US, closing the open one first
+ */
+int gateway_discovery_search(GATEWAY_DISCOVERY* discovery, uint64_t now_us)
+{
+  unsigned char buf[8];
+  int len;
+
+  if (discovery->search_sent_us != 0)
+  {
+    close_round(discovery, now_us);
+  }
+
+  if ((len = MQTTSNSerialize_searchgw(buf, sizeof(buf), GATEWAY_DISCOVERY_RADIUS)) <= 0)
+  {
+    printf("Failed to serialize SEARCHGW packet, return code %d\r\n", len);
+    return -1;
+  }
+
+  if (sendto(
+          discovery->sock,
+          buf,
+          (size_t)len,
+          0,
+          (const struct sockaddr*)&discovery->group,
+          sizeof(discovery->group))
+      != len)
+  {
+    printf("Failed to send SEARCHGW packet\r\n");
+    return -1;
+  }
+
+  if (transport_capture_enabled)
+  {
+    transport_capture_record(
+        discovery->sock,
+        TRANSPORT_CAPTURE_SENT,
+        (const struct sockaddr*)&discovery->group,
+        buf,
+        len,
+        NULL,
+        0);
+  }
+
+  memset(discovery->answered, 0, sizeof(discovery->answered));
+  discovery->search_sent_us = now_us;
+  discovery->searches++;
+  if (discovery->interval_us > 0)
+  {
+    discovery->next_search_us = now_us + discovery->interval_us;
+  }
+
+  return 0;
+}
+
+/*
+ * 1. Process every GWINFO and ADVERTISE queued on the socket
+ * 2. Close the round once its replies were awaited long enough
+ * 3. Start the next round when the interval elapsed
+ * Never blocks. Return <0 on a socket error.
+ */
+int gateway_discovery_step(GATEWAY_DISCOVERY* discovery, uint64_t now_us)
+{
+  int count;
+
+  // 1. Process every GWINFO and ADVERTISE queued on the socket. SEARCHGW packets, including the
+  //    looped back ones of this client, are not answered by clients here.
+  do
+  {
+    unsigned char* buf;
+    int len;
+    struct sockaddr_storage from;
+    socklen_t from_len;
+
+    if ((count = transport_batch_receive(&discovery->receive_batch, discovery->sock, 0, NULL))
+        < 0)
+    {
+      return count;
+    }
+
+    while ((len = transport_batch_next_from(&discovery->receive_batch, &buf, &from, &from_len))
+           > 0)
+    {
+      int datalen;
+      int lenlen = MQTTSNPacket_decode(buf, len, &datalen);
+
+      if (lenlen <= 0 || datalen != len)
+      {
+        continue;
+      }
+
+      if (buf[lenlen] == MQTTSN_GWINFO)
+      {
+        handle_gwinfo(discovery, buf, len, &from, now_us);
+      }
+      else if (buf[lenlen] == MQTTSN_ADVERTISE)
+      {
+        handle_advertise(discovery, buf, len, &from, now_us);
+      }
+    }
+  } while (count == TRANSPORT_BATCH_SIZE);
+
+  // 2. Close the round once its replies were awaited long enough
+  if (discovery->search_sent_us != 0
+      && now_us >= discovery->search_sent_us + GATEWAY_DISCOVERY_WAIT_US)
+  {
+    close_round(discovery, now_us);
+  }
+
+  // 3. Start the next round when the interval elapsed
+  if (now_us >= discovery->next_search_us)
+  {
+    return gateway_discovery_search(discovery, now_us);
+  }
+
+  return 0;
+}
+
+/*
+ * Return the monotonic time at which gateway_discovery_step() must be called even if no datagram
+ * arrives, UINT64_MAX if there is no deadline
+ */
+uint64_t gateway_discovery_next_deadline_us(const GATEWAY_DISCOVERY* discovery)
+{
+  uint64_t round_end_us = discovery->search_sent_us != 0
+      ? discovery->search_sent_us + GATEWAY_DISCOVERY_WAIT_US
+      : UINT64_MAX;
+
+  return round_end_us < discovery->next_search_us ? round_end_us : discovery->next_search_us;
+}
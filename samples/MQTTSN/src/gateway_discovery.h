@@ -0,0 +1,54 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef GATEWAY_DISCOVERY_H
+#define GATEWAY_DISCOVERY_H
+
+#include <stdint.h>
+
+#include "gateway_table.h"
+#include "transport.h"
+
+// Time GWINFO replies to SEARCHGW are awaited; every gateway that did not answer counts a loss
+#define GATEWAY_DISCOVERY_WAIT_US 1000000
+
+// Hops a SEARCHGW may travel; 1 keeps it on the local network
+#define GATEWAY_DISCOVERY_RADIUS 1
+
+// A gateway is considered gone after missing this many ADVERTISE packets (N_ADV of MQTT-SN)
+#define GATEWAY_DISCOVERY_ADVERTISE_MISSES 3
+
+/*
+ * MQTT-SN gateway discovery on an IPv4 multicast group. SEARCHGW is multicast every interval and
+ * the GWINFO replies, which time the round trip to each gateway, and the ADVERTISE packets that
+ * gateways multicast on their own fill the gateway table. A gateway is addressed at the source
+ * address and port of its GWINFO or ADVERTISE, its unicast socket. GWINFO sent by a client on
+ * behalf of a gateway is ignored.
+ */
+typedef struct gateway_discovery_tag
+{
+  int sock;
+  struct sockaddr_in group;
+  GATEWAY_TABLE* table;
+  uint64_t interval_us; // between SEARCHGW rounds, 0 to search only on demand
+  uint64_t search_sent_us; // 0 when no round is open
+  uint64_t next_search_us;
+  unsigned char answered[GATEWAY_TABLE_MAX_SIZE]; // per table entry, in the open round
+  uint64_t searches;
+  uint64_t gwinfos;
+  uint64_t advertises;
+  TRANSPORT_RECEIVE_BATCH receive_batch;
+} GATEWAY_DISCOVERY;
+
+int gateway_discovery_open(
+    GATEWAY_DISCOVERY* discovery,
+    const char* group,
+    int port,
+    uint64_t interval_us,
+    GATEWAY_TABLE* table);
+void gateway_discovery_close(GATEWAY_DISCOVERY* discovery);
+int gateway_discovery_search(GATEWAY_DISCOVERY* discovery, uint64_t now_us);
+int gateway_discovery_step(GATEWAY_DISCOVERY* discovery, uint64_t now_us);
+uint64_t gateway_discovery_next_deadline_us(const GATEWAY_DISCOVERY* discovery);
+
+#endif // GATEWAY_DISCOVERY_H
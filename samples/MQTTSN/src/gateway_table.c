@@ -0,0 +1,148 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <string.h>
+
+#include "gateway_table.h"
+
+void gateway_table_init(GATEWAY_TABLE* table)
+{
+  memset((void*)table, 0, sizeof(GATEWAY_TABLE));
+}
+
+/*
+ * Return the entry of the gateway at address and port, adding it if it is new, NULL when the table
+ * is full
+ */
+GATEWAY_TABLE_ENTRY* gateway_table_add(GATEWAY_TABLE* table, const char* address, int port)
+{
+  GATEWAY_TABLE_ENTRY* entry;
+
+  for (int i = 0; i < table->count; i++)
+  {
+    entry = &table->entries[i];
+    if (entry->port == port && strcmp(entry->address, address) == 0)
+    {
+      return entry;
+    }
+  }
+
+  if (table->count == GATEWAY_TABLE_MAX_SIZE || strlen(address) >= GATEWAY_TABLE_ADDRESS_SIZE)
+  {
+    return NULL;
+  }
+
+  entry = &table->entries[table->count++];
+  memset((void*)entry, 0, sizeof(GATEWAY_TABLE_ENTRY));
+  snprintf(entry->address, sizeof(entry->address), "%s", address);
+  entry->port = port;
+  entry->gateway_id = -1;
+  entry->expires_us = UINT64_MAX;
+  return entry;
+}
+
+/*
+ * Smooth the round trip time with the gain of 1/8 used for SRTT by RFC 6298
+ */
+void gateway_table_record_rtt(GATEWAY_TABLE_ENTRY* entry, uint64_t rtt_us)
+{
+  entry->srtt_us = entry->rtt_samples++ == 0 ? rtt_us : (7 * entry->srtt_us + rtt_us) / 8;
+}
+
+void gateway_table_record_success(GATEWAY_TABLE_ENTRY* entry)
+{
+  entry->successes++;
+  entry->loss_ppm -= entry->loss_ppm / 8;
+}
+
+void gateway_table_record_loss(GATEWAY_TABLE_ENTRY* entry)
+{
+  entry->losses++;
+  entry->loss_ppm += (1000000 - entry->loss_ppm) / 8;
+}
+
+/*
+ * The client gave up on the gateway: skip it for a while, however good its record
+ */
+void gateway_table_hold_down(GATEWAY_TABLE_ENTRY* entry, uint64_t now_us)
+{
+  entry->hold_down_until_us = now_us + GATEWAY_TABLE_HOLD_DOWN_US;
+}
+
+/*
+ * Return the expected round trip to the gateway counting losses, lower is better
+ */
+uint64_t gateway_table_score_us(const GATEWAY_TABLE_ENTRY* entry)
+{
+  uint64_t srtt_us = entry->rtt_samples > 0 ? entry->srtt_us : GATEWAY_TABLE_UNKNOWN_RTT_US;
+  uint32_t loss_ppm
+      = entry->loss_ppm < GATEWAY_TABLE_MAX_LOSS_PPM ? entry->loss_ppm : GATEWAY_TABLE_MAX_LOSS_PPM;
+
+  return srtt_us * 1000000 / (1000000 - loss_ppm);
+}
+
+int gateway_table_is_usable(const GATEWAY_TABLE_ENTRY* entry, uint64_t now_us)
+{
+  return entry->expires_us > now_us && entry->hold_down_until_us <= now_us;
+}
+
+/*
+ * Return the usable gateway with the lowest score other than exclude, NULL if there is none
+ */
+GATEWAY_TABLE_ENTRY* gateway_table_best(
+    GATEWAY_TABLE* table,
+    const GATEWAY_TABLE_ENTRY* exclude,
+    uint64_t now_us)
+{
+  GATEWAY_TABLE_ENTRY* best = NULL;
+
+  for (int i = 0; i < table->count; i++)
+  {
+    GATEWAY_TABLE_ENTRY* entry = &table->entries[i];
+
+    if (entry != exclude && gateway_table_is_usable(entry, now_us)
+        && (best == NULL || gateway_table_score_us(entry) < gateway_table_score_us(best)))
+    {
+      best = entry;
+    }
+  }
+
+  return best;
+}
+
+void gateway_table_print(const GATEWAY_TABLE* table, uint64_t now_us)
+{
+  printf("Gateways, score = SRTT / (1 - loss rate):\r\n");
+  printf(
+      "%4s %-24s %6s %10s %8s %10s %10s %8s %s\r\n",
+      "id",
+      "address",
+      "port",
+      "SRTT ms",
+      "loss %",
+      "score ms",
+      "answered",
+      "lost",
+      "state");
+
+  for (int i = 0; i < table->count; i++)
+  {
+    const GATEWAY_TABLE_ENTRY* entry = &table->entries[i];
+
+    printf(
+        "%4d %-24s %6d %10.2f %8.1f %10.2f %10llu %8llu %s\r\n",
+        entry->gateway_id,
+        entry->address,
+        entry->port,
+        (double)entry->srtt_us / 1000.0,
+        (double)entry->loss_ppm / 10000.0,
+        (double)gateway_table_score_us(entry) / 1000.0,
+        (unsigned long long)entry->successes,
+        (unsigned long long)entry->losses,
+        entry->expires_us <= now_us             ? "expired"
+            : entry->hold_down_until_us > now_us ? "held down"
+            : entry->discovered                  ? "discovered"
+                                                 : "configured");
+  }
+}
@@ -0,0 +1,66 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef GATEWAY_TABLE_H
+#define GATEWAY_TABLE_H
+
+#include <stdint.h>
+
+#define GATEWAY_TABLE_MAX_SIZE 16
+#define GATEWAY_TABLE_ADDRESS_SIZE 64
+
+// Score of a gateway whose round trip time was never measured, the initial RTO of the client
+#define GATEWAY_TABLE_UNKNOWN_RTT_US 1000000
+
+// Loss rates are kept in parts per million and capped, so that the score of a gateway stays finite
+#define GATEWAY_TABLE_MAX_LOSS_PPM 900000
+
+// Time a gateway the client failed over from is not picked again, unless it answers SEARCHGW
+#define GATEWAY_TABLE_HOLD_DOWN_US 30000000ULL
+
+/*
+ * One known gateway. Round trip times come from SEARCHGW/GWINFO exchanges, which measure the path
+ * to the gateway rather than the broker behind it. Loss counts SEARCHGW rounds the gateway did not
+ * answer and requests or PUBLISH packets of the client that timed out.
+ */
+typedef struct gateway_table_entry_tag
+{
+  char address[GATEWAY_TABLE_ADDRESS_SIZE];
+  int port;
+  int gateway_id; // -1 until the gateway advertises itself or answers SEARCHGW
+  int discovered; // found by SEARCHGW or ADVERTISE, as opposed to configured
+  uint64_t srtt_us; // 0 until the first sample
+  uint64_t rtt_samples;
+  uint32_t loss_ppm; // smoothed with a gain of 1/8
+  uint64_t successes;
+  uint64_t losses;
+  int advertise_duration_s; // 0 until the gateway sends ADVERTISE
+  uint64_t expires_us; // UINT64_MAX unless the gateway advertises a duration
+  uint64_t hold_down_until_us;
+} GATEWAY_TABLE_ENTRY;
+
+/*
+ * Gateways ranked by their expected round trip: SRTT / (1 - loss rate). Entries are never removed,
+ * so pointers to them stay valid; an expired gateway is only skipped.
+ */
+typedef struct gateway_table_tag
+{
+  GATEWAY_TABLE_ENTRY entries[GATEWAY_TABLE_MAX_SIZE];
+  int count;
+} GATEWAY_TABLE;
+
+void gateway_table_init(GATEWAY_TABLE* table);
+GATEWAY_TABLE_ENTRY* gateway_table_add(GATEWAY_TABLE* table, const char* address, int port);
+void gateway_table_record_rtt(GATEWAY_TABLE_ENTRY* entry, uint64_t rtt_us);
+void gateway_table_record_success(GATEWAY_TABLE_ENTRY* entry);
+void gateway_table_record_loss(GATEWAY_TABLE_ENTRY* entry);
+void gateway_table_hold_down(GATEWAY_TABLE_ENTRY* entry, uint64_t now_us);
+uint64_t gateway_table_score_us(const GATEWAY_TABLE_ENTRY* entry);
+int gateway_table_is_usable(const GATEWAY_TABLE_ENTRY* entry, uint64_t now_us);
+GATEWAY_TABLE_ENTRY* gateway_table_best(
+    GATEWAY_TABLE* table,
+    const GATEWAY_TABLE_ENTRY* exclude,
+    uint64_t now_us);
+void gateway_table_print(const GATEWAY_TABLE* table, uint64_t now_us);
+
+#endif // GATEWAY_TABLE_H
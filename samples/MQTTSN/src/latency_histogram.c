@@ -0,0 +1,136 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <string.h>
+
+#include "latency_histogram.h"
+
+static int bucket_index(uint64_t value)
+{
+  int msb;
+
+  if (value < 8)
+  {
+    return (int)value;
+  }
+
+  msb = 63 - __builtin_clzll(value);
+  return 8 + (msb - 3) * 4 + (int)((value >> (msb - 2)) & 3);
+}
+
+/*
+ * Largest value that falls into the given bucket
+ */
+static uint64_t bucket_upper_bound(int index)
+{
+  int msb;
+  uint64_t sub;
+
+  if (index < 8)
+  {
+    return (uint64_t)index;
+  }
+
+  msb = (index - 8) / 4 + 3;
+  sub = (uint64_t)((index - 8) % 4);
+  return ((4 + sub + 1) << (msb - 2)) - 1;
+}
+
+void latency_histogram_init(LATENCY_HISTOGRAM* histogram)
+{
+  memset((void*)histogram, 0, sizeof(LATENCY_HISTOGRAM));
+  histogram->min = UINT64_MAX;
+}
+
+void latency_histogram_record(LATENCY_HISTOGRAM* histogram, uint64_t value)
+{
+  histogram->buckets[bucket_index(value)]++;
+  histogram->count++;
+  histogram->sum += value;
+
+  if (value < histogram->min)
+  {
+    histogram->min = value;
+  }
+
+  if (value > histogram->max)
+  {
+    histogram->max = value;
+  }
+}
+
+void latency_histogram_merge(LATENCY_HISTOGRAM* destination, const LATENCY_HISTOGRAM* source)
+{
+  for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+  {
+    destination->buckets[i] += source->buckets[i];
+  }
+
+  destination->count += source->count;
+  destination->sum += source->sum;
+
+  if (source->min < destination->min)
+  {
+    destination->min = source->min;
+  }
+
+  if (source->max > destination->max)
+  {
+    destination->max = source->max;
+  }
+}
+
+/*
+ * Return the upper bound of the bucket holding the requested percentile (0 - 100)
+ */
+uint64_t latency_histogram_percentile(const LATENCY_HISTOGRAM* histogram, double percentile)
+{
+  uint64_t rank;
+  uint64_t seen = 0;
+
+  if (histogram->count == 0)
+  {
+    return 0;
+  }
+
+  rank = (uint64_t)(percentile / 100.0 * (double)histogram->count + 0.5);
+  if (rank == 0)
+  {
+    rank = 1;
+  }
+
+  for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+  {
+    seen += histogram->buckets[i];
+
+    if (seen >= rank)
+    {
+      uint64_t bound = bucket_upper_bound(i);
+      return bound < histogram->max ? bound : histogram->max;
+    }
+  }
+
+  return histogram->max;
+}
+
+void latency_histogram_print(const LATENCY_HISTOGRAM* histogram, const char* name)
+{
+  if (histogram->count == 0)
+  {
+    printf("%s: no samples\r\n", name);
+    return;
+  }
+
+  printf(
+      "%s (us): count = %llu, min = %llu, avg = %llu, p50 = %llu, p90 = %llu, p99 = %llu, max = "
+      "%llu\r\n",
+      name,
+      (unsigned long long)histogram->count,
+      (unsigned long long)histogram->min,
+      (unsigned long long)(histogram->sum / histogram->count),
+      (unsigned long long)latency_histogram_percentile(histogram, 50),
+      (unsigned long long)latency_histogram_percentile(histogram, 90),
+      (unsigned long long)latency_histogram_percentile(histogram, 99),
+      (unsigned long long)histogram->max);
+}
@@ -0,0 +1,31 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+
+// Values below 8 get their own bucket, every power of two above is split in 4 sub-buckets
+#define LATENCY_HISTOGRAM_BUCKETS (8 + 61 * 4)
+
+/*
+ * Fixed-size log-linear histogram of microsecond samples. Recording is O(1) and never allocates,
+ * so it can be used on the publish hot path. Percentiles are accurate to within 25%.
+ */
+typedef struct latency_histogram_tag
+{
+  uint64_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+} LATENCY_HISTOGRAM;
+
+void latency_histogram_init(LATENCY_HISTOGRAM* histogram);
+void latency_histogram_record(LATENCY_HISTOGRAM* histogram, uint64_t value);
+void latency_histogram_merge(LATENCY_HISTOGRAM* destination, const LATENCY_HISTOGRAM* source);
+uint64_t latency_histogram_percentile(const LATENCY_HISTOGRAM* histogram, double percentile);
+void latency_histogram_print(const LATENCY_HISTOGRAM* histogram, const char* name);
+
+#endif // LATENCY_HISTOGRAM_H
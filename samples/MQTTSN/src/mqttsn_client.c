@@ -0,0 +1,1734 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "MQTTSNPacket.h"
+#include "event_log.h"
+#include "mqttsn_client.h"
+#include "time_util.h"
+#include "transport.h"
+
+// RTO before the first round trip is measured (RFC 6298), and its bounds. The upper bound keeps a
+// fleet retrying at least once a minute without hammering a Gateway that is down.
+#define INITIAL_RTO_MS 1000
+#define MIN_RTO_MS 200
+#define MAX_RTO_MS 60000
+#define PUBLISH_MAX_RETRANSMISSIONS 5
+
+// A faster gateway is looked for at most this often, and not right after a switch. It must score
+// less than the current one divided by the ratio.
+#define GATEWAY_CHECK_INTERVAL_US 10000000ULL
+#define GATEWAY_SWITCH_RATIO 2
+
+// A sleeping client pings the Gateway this much before its sleep duration expires, so that the
+// PINGREQ arrives while the Gateway still keeps the session
+#define WAKEUP_MARGIN_PERCENT 10
+
+/*
+ * Datagrams are batched per thread: sends are queued until mqttsn_client_flush() (called at the end
+ * of every step) and receives are drained with one recvmmsg call.
+ */
+static _Thread_local TRANSPORT_SEND_BATCH send_batch = { .sock = -1 };
+static _Thread_local TRANSPORT_RECEIVE_BATCH receive_batch;
+
+/*
+ * FNV-1a of the client ID, so that every client of a fleet jitters its timeouts differently but
+ * reproducibly
+ */
+static uint64_t get_jitter_seed(const char* client_id)
+{
+  uint64_t hash = 0xCBF29CE484222325ULL;
+
+  while (client_id != NULL && *client_id != '\0')
+  {
+    hash = (hash ^ (unsigned char)*client_id++) * 0x100000001B3ULL;
+  }
+
+  return hash;
+}
+
+static unsigned short next_packet_id(MQTTSN_CLIENT* client)
+{
+  // 0 is not a valid MQTT-SN message ID
+  if (++client->packet_id == 0)
+  {
+    client->packet_id = 1;
+  }
+
+  return client->packet_id;
+}
+
+/*
+ * Queue a datagram made of buf and, unless it is NULL, a payload that stays referenced until the
+ * next flush
+ */
+static int client_send_gather(
+    MQTTSN_CLIENT* client,
+    unsigned char* buf,
+    int len,
+    const unsigned char* payload,
+    int payload_len)
+{
+  int rc;
+
+  if (send_batch.sock != client->transport.sock)
+  {
+    if ((rc = transport_batch_flush(&send_batch)) < 0)
+    {
+      return rc;
+    }
+
+    transport_batch_init(&send_batch, client->transport.sock, client->options.wire_stats);
+  }
+
+  // The socket is connected to the Gateway, the datagram needs no address
+  return transport_batch_queue_gather_to(&send_batch, NULL, 0, buf, len, payload, payload_len);
+}
+
+static int client_send(MQTTSN_CLIENT* client, unsigned char* buf, int len)
+{
+  return client_send_gather(client, buf, len, NULL, 0);
+}
+
+/*
+ * Arm the timerfd for the earliest deadline so that the poll fd wakes the application
+ */
+static void update_timer(MQTTSN_CLIENT* client)
+{
+  struct itimerspec spec;
+  uint64_t deadline_us;
+
+  if (client->timer_fd < 0)
+  {
+    return;
+  }
+
+  deadline_us = mqttsn_client_next_deadline_us(client);
+  if (deadline_us == client->armed_deadline_us)
+  {
+    return;
+  }
+
+  memset(&spec, 0, sizeof(spec));
+  if (deadline_us != UINT64_MAX)
+  {
+    // A zero it_value disarms the timer, so an already expired deadline fires after 1 ns
+    spec.it_value.tv_sec = (time_t)(deadline_us / 1000000);
+    spec.it_value.tv_nsec = (long)(deadline_us % 1000000) * 1000 + 1;
+  }
+
+  timerfd_settime(client->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+  client->armed_deadline_us = deadline_us;
+}
+
+static int client_retransmit(
+    MQTTSN_CLIENT* client,
+    unsigned char* buf,
+    int len,
+    const unsigned char* payload,
+    int payload_len)
+{
+  if (client->options.wire_stats != NULL)
+  {
+    wire_stats_record_retransmitted(client->options.wire_stats, buf, len + payload_len);
+  }
+
+  return client_send_gather(client, buf, len, payload, payload_len);
+}
+
+/*
+ * Send the request serialized in the client buffer, every attempt after the first being a
+ * retransmission
+ */
+static int send_request_buffer(MQTTSN_CLIENT* client, int len)
+{
+  return client->retry_attempt > 0 ? client_retransmit(client, client->buffer, len, NULL, 0)
+                                   : client_send(client, client->buffer, len);
+}
+
+static int send_connect(MQTTSN_CLIENT* client)
+{
+  int len;
+  MQTTSNPacket_connectData options = MQTTSNPacket_connectData_initializer;
+  options.clientID.cstring = client->options.client_id;
+  options.cleansession = !client->resume_session;
+
+  if ((len = MQTTSNSerialize_connect(client->buffer, sizeof(client->buffer), &options)) <= 0)
+  {
+    printf("Failed to serialize CONNECT packet, return code %d\r\n", len);
+    return -1;
+  }
+
+  return send_request_buffer(client, len);
+}
+
+static int send_register(MQTTSN_CLIENT* client)
+{
+  int len;
+  MQTTSNString topic_str = MQTTSNString_initializer;
+  topic_str.cstring = client->options.topic_name;
+
+  if ((len = MQTTSNSerialize_register(
+           client->buffer, sizeof(client->buffer), 0, client->packet_id, &topic_str))
+      <= 0)
+  {
+    printf("Failed to serialize REGISTER packet, return code %d\r\n", len);
+    return -1;
+  }
+
+  return send_request_buffer(client, len);
+}
+
+static int send_sleep_disconnect(MQTTSN_CLIENT* client)
+{
+  int len;
+
+  if ((len = MQTTSNSerialize_disconnect(
+           client->buffer, sizeof(client->buffer), client->sleep_duration_s))
+      <= 0)
+  {
+    printf("Failed to serialize Disconnect packet, return code %d\r\n", len);
+    return -1;
+  }
+
+  return send_request_buffer(client, len);
+}
+
+static int send_wakeup_pingreq(MQTTSN_CLIENT* client)
+{
+  int len;
+  MQTTSNString client_id = MQTTSNString_initializer;
+  client_id.cstring = client->options.client_id;
+
+  if ((len = MQTTSNSerialize_pingreq(client->buffer, sizeof(client->buffer), client_id)) <= 0)
+  {
+    printf("Failed to serialize PINGREQ packet, return code %d\r\n", len);
+    return -1;
+  }
+
+  return send_request_buffer(client, len);
+}
+
+/*
+ * Send the request for the current state and start its response deadline
+ */
+static int send_request(MQTTSN_CLIENT* client, uint64_t now_us)
+{
+  if (client->retry_attempt == 0)
+  {
+    client->request_first_sent_us = now_us;
+  }
+  client->request_sent_us = now_us;
+  client->request_deadline_us = now_us + rtt_estimator_timeout_us(&client->rtt);
+
+  switch (client->state)
+  {
+    case MQTTSN_CLIENT_CONNECTING:
+      return send_connect(client);
+
+    case MQTTSN_CLIENT_REGISTERING:
+      return send_register(client);
+
+    case MQTTSN_CLIENT_FALLING_ASLEEP:
+      return send_sleep_disconnect(client);
+
+    default:
+      return send_wakeup_pingreq(client);
+  }
+}
+
+/*
+ * The radio is assumed on in every state but asleep and disconnected
+ */
+static void set_radio_on(MQTTSN_CLIENT* client, int on, uint64_t now_us)
+{
+  if (on && client->radio_on_since_us == 0)
+  {
+    client->radio_on_since_us = now_us;
+  }
+  else if (!on && client->radio_on_since_us != 0)
+  {
+    client->stats.radio_on_us += now_us - client->radio_on_since_us;
+    client->radio_on_since_us = 0;
+  }
+}
+
+/*
+ * The Gateway acknowledged the sleep DISCONNECT or answered the wake-up PINGREQ: sleep until
+ * shortly before the sleep duration expires
+ */
+static void fall_asleep(MQTTSN_CLIENT* client, uint64_t now_us)
+{
+  uint64_t duration_us = (uint64_t)client->sleep_duration_s * 1000000;
+
+  client->state = MQTTSN_CLIENT_ASLEEP;
+  client->retry_attempt = 0;
+  client->wakeup_deadline_us = now_us + duration_us - duration_us * WAKEUP_MARGIN_PERCENT / 100;
+  set_radio_on(client, 0, now_us);
+}
+
+/*
+ * Bytes of the REGISTER/REGACK exchange for the topic name
+ */
+static int get_register_exchange_len(MQTTSN_CLIENT* client)
+{
+  // REGISTER: length, MsgType, TopicId, MsgId, TopicName. REGACK: 7 bytes.
+  return MQTTSNPacket_len(5 + (int)strlen(client->options.topic_name)) + 7;
+}
+
+static void start_registration(MQTTSN_CLIENT* client, uint64_t now_us)
+{
+  client->retry_attempt = 0;
+
+  if (client->options.topic_name == NULL)
+  {
+    client->state = MQTTSN_CLIENT_CONNECTED;
+    return;
+  }
+
+  if (client->topic_type != MQTTSN_TOPIC_TYPE_NORMAL)
+  {
+    client->stats.register_round_trips_saved++;
+    client->stats.register_bytes_saved += (uint64_t)get_register_exchange_len(client);
+    client->state = MQTTSN_CLIENT_CONNECTED;
+    return;
+  }
+
+  client->state = MQTTSN_CLIENT_REGISTERING;
+  next_packet_id(client);
+  send_request(client, now_us);
+}
+
+/*
+ * The Gateway does not know the predefined, short or resumed topic ID: REGISTER the topic name
+ * instead. The messages in flight stay in the send window and are resent with the registered ID.
+ */
+static void fall_back_to_register(MQTTSN_CLIENT* client, uint64_t now_us)
+{
+  EVENT_LOG(EVENT_LOG_LEVEL_WARN, EVENT_LOG_TOPIC_REJECTED, client->preset_topic_id, 0, 0, 0);
+
+  // Only a predefined or short topic ID was counted as a saved REGISTER
+  if (client->topic_type != MQTTSN_TOPIC_TYPE_NORMAL)
+  {
+    client->topic_type = MQTTSN_TOPIC_TYPE_NORMAL;
+    client->stats.register_round_trips_saved--;
+    client->stats.register_bytes_saved -= (uint64_t)get_register_exchange_len(client);
+  }
+
+  start_registration(client, now_us);
+}
+
+/*
+ * An exchange was acknowledged: a round trip time sample if it was sent once (Karn's rule),
+ * otherwise a recovery from loss
+ */
+static void record_round_trip(
+    MQTTSN_CLIENT* client,
+    int retransmissions,
+    uint64_t round_trip_us,
+    uint64_t recovery_us)
+{
+  // The Gateway answers, whatever was lost before
+  client->gateway_timeouts = 0;
+  client->outage_since_us = 0;
+  if (client->gateway != NULL)
+  {
+    gateway_table_record_success(client->gateway);
+  }
+
+  if (retransmissions == 0)
+  {
+    rtt_estimator_sample(&client->rtt, round_trip_us);
+    return;
+  }
+
+  client->stats.recoveries++;
+  if (client->options.recovery_time != NULL)
+  {
+    latency_histogram_record(client->options.recovery_time, recovery_us);
+  }
+}
+
+static void record_puback(MQTTSN_CLIENT* client, uint64_t latency_us)
+{
+  MQTTSN_CLIENT_STATS* stats = &client->stats;
+
+  stats->pubacks++;
+  stats->latency_sum_us += latency_us;
+  if (latency_us < stats->latency_min_us)
+  {
+    stats->latency_min_us = latency_us;
+  }
+  if (latency_us > stats->latency_max_us)
+  {
+    stats->latency_max_us = latency_us;
+  }
+
+  if (client->options.puback_latency != NULL)
+  {
+    latency_histogram_record(client->options.puback_latency, latency_us);
+  }
+}
+
+/*
+ * Send the REGISTER of a topic registry entry, with a new packet ID unless it is a
+ * retransmission, and start its response deadline
+ */
+static int send_topic_register(MQTTSN_CLIENT* client, TOPIC_REGISTRY_ENTRY* topic, uint64_t now_us)
+{
+  int len;
+  MQTTSNString topic_str = MQTTSNString_initializer;
+  topic_str.cstring = topic->name;
+
+  if (topic->first_sent_us == 0)
+  {
+    topic->packet_id = next_packet_id(client);
+    topic->first_sent_us = now_us;
+  }
+  topic->sent_us = now_us;
+  topic->deadline_us = now_us + rtt_estimator_timeout_us(&client->rtt);
+
+  if ((len = MQTTSNSerialize_register(
+           client->buffer, sizeof(client->buffer), 0, topic->packet_id, &topic_str))
+      <= 0)
+  {
+    printf("Failed to serialize REGISTER packet, return code %d\r\n", len);
+    return -1;
+  }
+
+  return topic->retransmissions > 0 ? client_retransmit(client, client->buffer, len, NULL, 0)
+                                    : client_send(client, client->buffer, len);
+}
+
+/*
+ * A message of topic (a topic registry index or PUBLISH_WINDOW_DEFAULT_TOPIC) left the send
+ * window: it no longer pins its registry entry
+ */
+static void release_topic(MQTTSN_CLIENT* client, int topic)
+{
+  if (topic != PUBLISH_WINDOW_DEFAULT_TOPIC)
+  {
+    topic_registry_get(&client->registry, topic)->messages--;
+  }
+}
+
+/*
+ * Give up on a registry topic whose REGISTER timed out or was rejected, and on its messages
+ */
+static void drop_topic(MQTTSN_CLIENT* client, TOPIC_REGISTRY_ENTRY* topic, int return_code)
+{
+  int index = topic_registry_index(&client->registry, topic);
+  PUBLISH_WINDOW_ENTRY* entry;
+
+  EVENT_LOG(
+      EVENT_LOG_LEVEL_WARN,
+      EVENT_LOG_TOPIC_DROPPED,
+      index,
+      topic->messages,
+      topic->retransmissions,
+      return_code);
+  while ((entry = publish_window_find_topic(&client->window, index)) != NULL)
+  {
+    publish_window_remove(&client->window, entry);
+    client->stats.messages_lost++;
+  }
+
+  topic_registry_remove(&client->registry, topic);
+}
+
+/*
+ * A clean session forgot every registration: the registry topics of messages in the send window
+ * are registered again before these messages are resent
+ */
+static void reset_topics(MQTTSN_CLIENT* client)
+{
+  topic_registry_reset(&client->registry);
+  for (int i = client->registry.pending_list; i >= 0;
+       i = topic_registry_get(&client->registry, i)->next_pending)
+  {
+    publish_window_hold_topic(&client->window, i);
+  }
+}
+
+/*
+ * Advance the state machine with a datagram received from the Gateway
+ */
+static void handle_packet(MQTTSN_CLIENT* client, unsigned char* buf, int len, uint64_t now_us)
+{
+  int datalen;
+  int lenlen = MQTTSNPacket_decode(buf, len, &datalen);
+
+  if (lenlen <= 0 || datalen != len)
+  {
+    return;
+  }
+
+  switch (buf[lenlen])
+  {
+    case MQTTSN_CONNACK:
+    {
+      int connack_rc = -1; // left unset when the packet cannot be deserialized
+
+      if (client->state != MQTTSN_CLIENT_CONNECTING)
+      {
+        break;
+      }
+
+      if (MQTTSNDeserialize_connack(&connack_rc, buf, len) != 1 || connack_rc != 0)
+      {
+        printf("Failed to deserialize CONNACK packet, return code %d\r\n", connack_rc);
+        break;
+      }
+
+      if (client->options.verbose)
+      {
+        EVENT_LOG(EVENT_LOG_LEVEL_INFO, EVENT_LOG_CONNACK, 0, 0, 0, 0);
+      }
+      record_round_trip(
+          client,
+          client->retry_attempt,
+          now_us - client->request_sent_us,
+          now_us - client->request_first_sent_us);
+
+      // The Gateway kept the session and its topic ID while the client was asleep
+      if (client->resume_session)
+      {
+        client->resume_session = 0;
+        client->retry_attempt = 0;
+        client->state = MQTTSN_CLIENT_CONNECTED;
+        break;
+      }
+
+      reset_topics(client);
+      start_registration(client, now_us);
+      break;
+    }
+
+    case MQTTSN_REGACK:
+    {
+      unsigned short topic_id;
+      unsigned short packet_id;
+      unsigned char return_code;
+      TOPIC_REGISTRY_ENTRY* topic;
+
+      if (MQTTSNDeserialize_regack(&topic_id, &packet_id, &return_code, buf, len) != 1)
+      {
+        printf("Failed to deserialize REGACK packet\r\n");
+        break;
+      }
+
+      // A REGISTER of a registry topic, pipelined with the others and with PUBLISH packets
+      if ((topic = topic_registry_find_packet(&client->registry, packet_id)) != NULL)
+      {
+        int index = topic_registry_index(&client->registry, topic);
+
+        record_round_trip(
+            client,
+            topic->retransmissions,
+            now_us - topic->sent_us,
+            now_us - topic->first_sent_us);
+        if (return_code != MQTTSN_RC_ACCEPTED)
+        {
+          drop_topic(client, topic, return_code);
+          break;
+        }
+
+        topic_registry_set_registered(&client->registry, topic, topic_id);
+        EVENT_LOG(
+            EVENT_LOG_LEVEL_DEBUG,
+            EVENT_LOG_TOPIC_REGISTERED,
+            index,
+            topic_id,
+            client->registry.pending,
+            0);
+
+        // The messages waiting for the topic ID are sent with it
+        if (topic->messages > 0)
+        {
+          publish_window_set_topic(&client->window, index, MQTTSN_TOPIC_TYPE_NORMAL, topic_id);
+        }
+        break;
+      }
+
+      if (client->state != MQTTSN_CLIENT_REGISTERING)
+      {
+        break;
+      }
+
+      if (return_code != 0 || packet_id != client->packet_id)
+      {
+        printf("Failed to deserialize REGACK packet, return code %d\r\n", return_code);
+        break;
+      }
+
+      if (client->options.verbose)
+      {
+        EVENT_LOG(EVENT_LOG_LEVEL_INFO, EVENT_LOG_REGACK, topic_id, 0, 0, 0);
+      }
+      record_round_trip(
+          client,
+          client->retry_attempt,
+          now_us - client->request_sent_us,
+          now_us - client->request_first_sent_us);
+      client->topic_id = topic_id;
+      client->state = MQTTSN_CLIENT_CONNECTED;
+
+      // Messages sent with a previous topic ID are resent with the new one
+      if (client->window.in_flight > 0)
+      {
+        publish_window_set_topic(
+            &client->window, PUBLISH_WINDOW_DEFAULT_TOPIC, MQTTSN_TOPIC_TYPE_NORMAL, topic_id);
+      }
+      break;
+    }
+
+    case MQTTSN_PUBACK:
+    {
+      unsigned short topic_id;
+      unsigned short packet_id;
+      unsigned char return_code;
+      uint64_t latency_us;
+      int retransmissions;
+      int topic;
+      PUBLISH_WINDOW_ENTRY* entry;
+
+      if (MQTTSNDeserialize_puback(&topic_id, &packet_id, &return_code, buf, len) != 1)
+      {
+        printf("Failed to deserialize PUBACK packet\r\n");
+        break;
+      }
+
+      // Keep the message for a rejected preset or resumed topic ID, it is resent once registered
+      if (return_code == MQTTSN_RC_REJECTED_INVALID_TOPIC_ID && client->preset_topic_id != 0
+          && topic_id == client->preset_topic_id)
+      {
+        if (client->topic_id == client->preset_topic_id
+            && client->state == MQTTSN_CLIENT_CONNECTED && client->options.topic_name != NULL)
+        {
+          fall_back_to_register(client, now_us);
+        }
+        break;
+      }
+
+      // The Gateway no longer knows the topic ID of a registry topic: keep its messages until it
+      // is registered again
+      if (return_code == MQTTSN_RC_REJECTED_INVALID_TOPIC_ID
+          && (entry = publish_window_find(&client->window, packet_id)) != NULL
+          && entry->topic != PUBLISH_WINDOW_DEFAULT_TOPIC)
+      {
+        TOPIC_REGISTRY_ENTRY* registry_entry = topic_registry_get(&client->registry, entry->topic);
+
+        if (registry_entry->state == TOPIC_REGISTRY_REGISTERED)
+        {
+          EVENT_LOG(EVENT_LOG_LEVEL_WARN, EVENT_LOG_TOPIC_REJECTED, topic_id, 0, 0, 0);
+          topic_registry_reregister(&client->registry, registry_entry);
+          publish_window_hold_topic(&client->window, entry->topic);
+        }
+        break;
+      }
+
+      // A late PUBACK for an entry already released is ignored
+      if ((retransmissions
+           = publish_window_ack(&client->window, packet_id, now_us, &latency_us, &topic))
+          < 0)
+      {
+        break;
+      }
+
+      release_topic(client, topic);
+
+      record_round_trip(client, retransmissions, latency_us, latency_us);
+      EVENT_LOG(EVENT_LOG_LEVEL_DEBUG, EVENT_LOG_PUBACK, packet_id, return_code, latency_us, 0);
+
+      if (return_code != MQTTSN_RC_ACCEPTED)
+      {
+        EVENT_LOG(
+            EVENT_LOG_LEVEL_WARN, EVENT_LOG_PUBLISH_REJECTED, packet_id, return_code, 0, 0);
+        client->stats.messages_lost++;
+        break;
+      }
+
+      record_puback(client, latency_us);
+      break;
+    }
+
+    case MQTTSN_PINGRESP:
+      if (client->state == MQTTSN_CLIENT_AWAKE && MQTTSNDeserialize_pingresp(buf, len) == 1)
+      {
+        record_round_trip(
+            client,
+            client->retry_attempt,
+            now_us - client->request_sent_us,
+            now_us - client->request_first_sent_us);
+        fall_asleep(client, now_us);
+      }
+      break;
+
+    case MQTTSN_DISCONNECT:
+      // The Gateway acknowledged the sleep DISCONNECT
+      if (client->state == MQTTSN_CLIENT_FALLING_ASLEEP)
+      {
+        record_round_trip(
+            client,
+            client->retry_attempt,
+            now_us - client->request_sent_us,
+            now_us - client->request_first_sent_us);
+        client->stats.sleeps++;
+        fall_asleep(client, now_us);
+        break;
+      }
+
+      // The Gateway dropped the session: start over, messages in flight get retransmitted
+      if (client->state != MQTTSN_CLIENT_DISCONNECTED && client->state != MQTTSN_CLIENT_ASLEEP
+          && client->options.qos >= 0)
+      {
+        if (client->options.verbose)
+        {
+          EVENT_LOG(EVENT_LOG_LEVEL_INFO, EVENT_LOG_GATEWAY_DISCONNECT, 0, 0, 0, 0);
+        }
+        client->state = MQTTSN_CLIENT_CONNECTING;
+        client->resume_session = 0;
+        client->retry_attempt = 0;
+        send_request(client, now_us);
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+/*
+ * A request or PUBLISH sent at first_sent_us timed out: count it against the current gateway
+ */
+static void record_timeout(MQTTSN_CLIENT* client, uint64_t first_sent_us)
+{
+  if (client->gateway == NULL)
+  {
+    return;
+  }
+
+  client->gateway_timeouts++;
+  gateway_table_record_loss(client->gateway);
+  if (client->outage_since_us == 0)
+  {
+    client->outage_since_us = first_sent_us;
+  }
+}
+
+/*
+ * Retransmit the outstanding request or timed out PUBLISH packets, or wake a sleeping client up.
+ * Expired timers double the RTO once per call, however many PUBLISH packets timed out together.
+ */
+static void handle_timeouts(MQTTSN_CLIENT* client, uint64_t now_us)
+{
+  PUBLISH_WINDOW_ENTRY* entry;
+  TOPIC_REGISTRY_ENTRY* topic;
+  int backed_off = 0;
+
+  switch (client->state)
+  {
+    case MQTTSN_CLIENT_CONNECTING:
+    case MQTTSN_CLIENT_REGISTERING:
+    case MQTTSN_CLIENT_FALLING_ASLEEP:
+    case MQTTSN_CLIENT_AWAKE:
+      if (client->request_deadline_us <= now_us)
+      {
+        client->retry_attempt++;
+        client->stats.retransmissions++;
+        rtt_estimator_backoff(&client->rtt);
+        record_timeout(client, client->request_first_sent_us);
+        if (client->options.verbose)
+        {
+          EVENT_LOG(
+              EVENT_LOG_LEVEL_INFO,
+              EVENT_LOG_REQUEST_RETRY,
+              client->retry_attempt,
+              client->rtt.rto_us / 1000,
+              0,
+              0);
+        }
+        send_request(client, now_us);
+      }
+      break;
+
+    case MQTTSN_CLIENT_ASLEEP:
+      if (client->wakeup_deadline_us <= now_us)
+      {
+        client->state = MQTTSN_CLIENT_AWAKE;
+        client->stats.wakeups++;
+        set_radio_on(client, 1, now_us);
+        send_request(client, now_us);
+      }
+      break;
+
+    case MQTTSN_CLIENT_CONNECTED:
+      // REGISTER packets of registry topics, the new ones due right away
+      while ((topic = topic_registry_next_expired(&client->registry, now_us)) != NULL)
+      {
+        if (topic->first_sent_us != 0)
+        {
+          if (topic->retransmissions >= PUBLISH_MAX_RETRANSMISSIONS)
+          {
+            drop_topic(client, topic, 0);
+            continue;
+          }
+
+          if (!backed_off)
+          {
+            rtt_estimator_backoff(&client->rtt);
+            record_timeout(client, topic->first_sent_us);
+            backed_off = 1;
+          }
+
+          topic->retransmissions++;
+          client->stats.retransmissions++;
+        }
+
+        send_topic_register(client, topic, now_us);
+      }
+
+      while ((entry = publish_window_next_expired(&client->window, now_us)) != NULL)
+      {
+        // A message that waited for its topic to be registered is sent for the first time
+        if (entry->first_sent_us == 0)
+        {
+          publish_window_mark_sent(entry, now_us, now_us + rtt_estimator_timeout_us(&client->rtt));
+          client_send_gather(
+              client, entry->packet, entry->packet_len, entry->payload, entry->payload_len);
+          client->stats.publish_packets_sent++;
+          client->stats.publish_bytes_sent += (uint64_t)(entry->packet_len + entry->payload_len);
+          EVENT_LOG(
+              EVENT_LOG_LEVEL_DEBUG,
+              EVENT_LOG_PUBLISH,
+              entry->packet_id,
+              entry->packet_len + entry->payload_len,
+              0,
+              0);
+          continue;
+        }
+
+        if (entry->retransmissions >= PUBLISH_MAX_RETRANSMISSIONS)
+        {
+          EVENT_LOG(
+              EVENT_LOG_LEVEL_WARN,
+              EVENT_LOG_PUBLISH_DROPPED,
+              entry->packet_id,
+              entry->retransmissions,
+              0,
+              0);
+          release_topic(client, entry->topic);
+          publish_window_remove(&client->window, entry);
+          client->stats.messages_lost++;
+          continue;
+        }
+
+        // An entry due right away was not timed out but rewritten (publish_window_set_topic)
+        if (entry->deadline_us != 0 && !backed_off)
+        {
+          rtt_estimator_backoff(&client->rtt);
+          record_timeout(client, entry->first_sent_us);
+          backed_off = 1;
+        }
+
+        publish_window_mark_retransmitted(
+            entry, now_us, now_us + rtt_estimator_timeout_us(&client->rtt));
+        client->stats.retransmissions++;
+        client_retransmit(
+            client, entry->packet, entry->packet_len, entry->payload, entry->payload_len);
+        client->stats.publish_packets_sent++;
+        client->stats.publish_bytes_sent += (uint64_t)(entry->packet_len + entry->payload_len);
+
+        if (client->options.verbose)
+        {
+          EVENT_LOG(
+              EVENT_LOG_LEVEL_INFO, EVENT_LOG_PUBLISH_RETRANSMITTED, entry->packet_id, 0, 0, 0);
+        }
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+/*
+ * Replace the socket by one connected to the gateway, impaired like it and watched by the same
+ * epoll fd. The socket is closed first, as the new one may have to bind the same source port.
+ */
+static int reopen_transport(MQTTSN_CLIENT* client, const char* address, int port)
+{
+  struct epoll_event event;
+  int rc;
+
+  if (send_batch.sock == client->transport.sock)
+  {
+    transport_batch_flush(&send_batch);
+    send_batch.sock = -1;
+  }
+
+  transport_handle_close(&client->transport);
+
+  if ((rc = transport_handle_open(&client->transport, address, port, client->options.src_port, 1))
+      != 0)
+  {
+    printf("Failed to open transport to %s:%d, return code %d\r\n", address, port, rc);
+    return rc;
+  }
+
+  if (client->options.impairment != NULL
+      && transport_impairment_attach(client->transport.sock, client->options.impairment) != 0)
+  {
+    printf("Failed to impair socket %d\r\n", client->transport.sock);
+    return -1;
+  }
+
+  if (client->epoll_fd >= 0)
+  {
+    event.events = EPOLLIN;
+    event.data.fd = client->transport.sock;
+    if (epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, client->transport.sock, &event) != 0)
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * 1. Connect the socket to the new gateway
+ * 2. Start over with its round trip time unknown
+ * 3. CONNECT with a clean session: a registered topic is registered again, and the messages in
+ *    flight are resent once connected
+ */
+static int switch_gateway(MQTTSN_CLIENT* client, GATEWAY_TABLE_ENTRY* gateway, uint64_t now_us)
+{
+  int rc;
+
+  // 1. Connect the socket to the new gateway
+  client->gateway = gateway;
+  client->options.gateway_address = gateway->address;
+  client->options.gateway_port = gateway->port;
+  if ((rc = reopen_transport(client, gateway->address, gateway->port)) != 0)
+  {
+    return rc;
+  }
+
+  // 2. Start over with its round trip time unknown
+  rtt_estimator_init(
+      &client->rtt,
+      INITIAL_RTO_MS * 1000ULL,
+      MIN_RTO_MS * 1000ULL,
+      MAX_RTO_MS * 1000ULL,
+      get_jitter_seed(client->options.client_id));
+  client->gateway_timeouts = 0;
+  client->outage_since_us = 0;
+  client->next_gateway_check_us = now_us + GATEWAY_CHECK_INTERVAL_US;
+
+  // 3. CONNECT with a clean session: a registered topic is registered again, and the messages in
+  //    flight are resent once connected
+  if (client->topic_type != MQTTSN_TOPIC_TYPE_NORMAL && client->window.in_flight > 0)
+  {
+    publish_window_set_topic(
+        &client->window, PUBLISH_WINDOW_DEFAULT_TOPIC, client->topic_type, client->topic_id);
+  }
+
+  client->state = MQTTSN_CLIENT_CONNECTING;
+  client->resume_session = 0;
+  client->retry_attempt = 0;
+  return send_request(client, now_us);
+}
+
+/*
+ * 1. Record the time to recover once connected to the gateway failed over to
+ * 2. Fail over to the best other gateway after failover_timeouts consecutive timeouts
+ * 3. Switch to a gateway scoring less than the current one by GATEWAY_SWITCH_RATIO while nothing
+ *    is in flight, so that no message is sent to both
+ */
+static int check_gateway(MQTTSN_CLIENT* client, uint64_t now_us)
+{
+  GATEWAY_TABLE_ENTRY* best;
+
+  if (client->gateway == NULL
+      || (client->state != MQTTSN_CLIENT_CONNECTING && client->state != MQTTSN_CLIENT_REGISTERING
+          && client->state != MQTTSN_CLIENT_CONNECTED))
+  {
+    return 0;
+  }
+
+  // 1. Record the time to recover once connected to the gateway failed over to
+  if (client->failover_since_us != 0 && client->state == MQTTSN_CLIENT_CONNECTED)
+  {
+    printf(
+        "Recovered on gateway %s:%d after %.1f ms\r\n",
+        client->gateway->address,
+        client->gateway->port,
+        (double)(now_us - client->failover_since_us) / 1000.0);
+    if (client->options.failover_time != NULL)
+    {
+      latency_histogram_record(client->options.failover_time, now_us - client->failover_since_us);
+    }
+    client->failover_since_us = 0;
+  }
+
+  // 2. Fail over to the best other gateway after failover_timeouts consecutive timeouts. Without
+  //    an alternative the current gateway keeps being retried.
+  if (client->options.failover_timeouts > 0
+      && client->gateway_timeouts >= client->options.failover_timeouts)
+  {
+    if ((best = gateway_table_best(client->options.gateways, client->gateway, now_us)) == NULL)
+    {
+      return 0;
+    }
+
+    printf(
+        "Gateway %s:%d missed %d acknowledgements in a row, failing over to gateway %s:%d\r\n",
+        client->gateway->address,
+        client->gateway->port,
+        client->gateway_timeouts,
+        best->address,
+        best->port);
+    client->stats.failovers++;
+    if (client->failover_since_us == 0)
+    {
+      client->failover_since_us = client->outage_since_us;
+    }
+    gateway_table_hold_down(client->gateway, now_us);
+    return switch_gateway(client, best, now_us);
+  }
+
+  // 3. Switch to a gateway scoring less than the current one by GATEWAY_SWITCH_RATIO while nothing
+  //    is in flight, so that no message is sent to both
+  if (client->state != MQTTSN_CLIENT_CONNECTED || client->window.in_flight > 0
+      || client->registry.pending > 0 || now_us < client->next_gateway_check_us)
+  {
+    return 0;
+  }
+
+  client->next_gateway_check_us = now_us + GATEWAY_CHECK_INTERVAL_US;
+  best = gateway_table_best(client->options.gateways, client->gateway, now_us);
+  if (best == NULL || best->rtt_samples == 0 || client->gateway->rtt_samples == 0
+      || gateway_table_score_us(best) * GATEWAY_SWITCH_RATIO
+          >= gateway_table_score_us(client->gateway))
+  {
+    return 0;
+  }
+
+  printf(
+      "Gateway %s:%d scores %.2f ms, switching to gateway %s:%d scoring %.2f ms\r\n",
+      client->gateway->address,
+      client->gateway->port,
+      (double)gateway_table_score_us(client->gateway) / 1000.0,
+      best->address,
+      best->port,
+      (double)gateway_table_score_us(best) / 1000.0);
+  client->stats.gateway_switches++;
+  return switch_gateway(client, best, now_us);
+}
+
+MQTTSN_CLIENT_OPTIONS mqttsn_client_options_default(void)
+{
+  MQTTSN_CLIENT_OPTIONS options;
+
+  memset((void*)&options, 0, sizeof(options));
+  options.qos = 1;
+  options.send_window_size = 1;
+  return options;
+}
+
+/*
+ * 1. Allocate the send window and the topic registry
+ * 2. Open the non-blocking UDP socket connected to the Gateway, optionally impaired
+ * 3. Optionally combine the socket and a deadline timerfd behind one epoll fd
+ */
+int mqttsn_client_init(MQTTSN_CLIENT* client, const MQTTSN_CLIENT_OPTIONS* options)
+{
+  struct epoll_event event;
+  int rc;
+
+  memset((void*)client, 0, sizeof(MQTTSN_CLIENT));
+  client->options = *options;
+  client->transport.sock = -1;
+  client->timer_fd = -1;
+  client->epoll_fd = -1;
+  client->armed_deadline_us = UINT64_MAX;
+  client->stats.latency_min_us = UINT64_MAX;
+  client->topic_type = MQTTSN_TOPIC_TYPE_NORMAL;
+  rtt_estimator_init(
+      &client->rtt,
+      INITIAL_RTO_MS * 1000ULL,
+      MIN_RTO_MS * 1000ULL,
+      MAX_RTO_MS * 1000ULL,
+      get_jitter_seed(options->client_id));
+
+  if (options->predefined_topic_id != 0)
+  {
+    client->topic_type = MQTTSN_TOPIC_TYPE_PREDEFINED;
+    client->preset_topic_id = client->topic_id = options->predefined_topic_id;
+  }
+  else if (options->topic_name != NULL && strlen(options->topic_name) == 2)
+  {
+    client->topic_type = MQTTSN_TOPIC_TYPE_SHORT;
+    client->preset_topic_id = client->topic_id
+        = (unsigned short)((unsigned char)options->topic_name[0] << 8
+                           | (unsigned char)options->topic_name[1]);
+  }
+
+  // 1. Allocate the send window and the topic registry
+  if (publish_window_init(&client->window, options->send_window_size) != 0)
+  {
+    printf(
+        "Invalid send window size %d, must be between 1 and %d\r\n",
+        options->send_window_size,
+        PUBLISH_WINDOW_MAX_SIZE);
+    return -1;
+  }
+
+  if (topic_registry_init(&client->registry, options->topic_registry_size) != 0)
+  {
+    printf(
+        "Invalid topic registry size %d, must be between 0 and %d\r\n",
+        options->topic_registry_size,
+        TOPIC_REGISTRY_MAX_SIZE);
+    return -1;
+  }
+
+  // 2. Open the non-blocking UDP socket connected to the Gateway, optionally impaired
+  if ((rc = transport_handle_open(
+           &client->transport,
+           options->gateway_address,
+           options->gateway_port,
+           options->src_port,
+           1))
+      != 0)
+  {
+    printf("Failed to open transport, return code %d\r\n", rc);
+    return rc;
+  }
+
+  if (options->impairment != NULL
+      && transport_impairment_attach(client->transport.sock, options->impairment) != 0)
+  {
+    printf("Failed to impair socket %d\r\n", client->transport.sock);
+    return -1;
+  }
+
+  if (options->gateways != NULL)
+  {
+    client->gateway
+        = gateway_table_add(options->gateways, options->gateway_address, options->gateway_port);
+  }
+
+  // 3. Optionally combine the socket and a deadline timerfd behind one epoll fd
+  if (options->use_timerfd)
+  {
+    if ((client->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0
+        || (client->epoll_fd = epoll_create1(0)) < 0)
+    {
+      printf("Failed to create timer, errno %d\r\n", errno);
+      return -1;
+    }
+
+    event.events = EPOLLIN;
+    event.data.fd = client->transport.sock;
+    if (epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, client->transport.sock, &event) != 0)
+    {
+      return -1;
+    }
+
+    event.data.fd = client->timer_fd;
+    if (epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, client->timer_fd, &event) != 0)
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void mqttsn_client_deinit(MQTTSN_CLIENT* client)
+{
+  if (send_batch.sock == client->transport.sock)
+  {
+    transport_batch_flush(&send_batch);
+    send_batch.sock = -1;
+  }
+
+  transport_handle_close(&client->transport);
+  if (client->timer_fd >= 0)
+  {
+    close(client->timer_fd);
+  }
+  if (client->epoll_fd >= 0)
+  {
+    close(client->epoll_fd);
+  }
+
+  publish_window_deinit(&client->window);
+  topic_registry_deinit(&client->registry);
+  client->timer_fd = client->epoll_fd = -1;
+}
+
+/*
+ * Start the CONNECT/REGISTER handshake, or resume the session of a sleeping client. Progress is
+ * made by mqttsn_client_step(). With QoS -1 the client can publish right away.
+ */
+int mqttsn_client_connect(MQTTSN_CLIENT* client)
+{
+  int rc;
+  uint64_t now_us = time_util_now_us();
+
+  client->resume_session = client->resume_session || client->state == MQTTSN_CLIENT_ASLEEP
+      || client->state == MQTTSN_CLIENT_AWAKE;
+  client->state = MQTTSN_CLIENT_CONNECTING;
+  client->retry_attempt = 0;
+  set_radio_on(client, 1, now_us);
+
+  // QoS -1 has no session to set up, the Gateway must already know the topic ID
+  if (client->options.qos < 0)
+  {
+    if (client->preset_topic_id == 0)
+    {
+      printf("QoS -1 needs a predefined or short topic ID\r\n");
+      return -1;
+    }
+
+    client->state = MQTTSN_CLIENT_CONNECTED;
+    return 0;
+  }
+
+  if ((rc = send_request(client, now_us)) == 0)
+  {
+    rc = mqttsn_client_flush(client);
+  }
+
+  update_timer(client);
+  return rc;
+}
+
+/*
+ * Resume a session saved by an earlier process: the next mqttsn_client_connect() sends CONNECT
+ * without clean session and publishes with the saved topic ID right after CONNACK. If the Gateway
+ * no longer knows the ID, the topic is registered again.
+ */
+void mqttsn_client_resume(
+    MQTTSN_CLIENT* client,
+    int topic_type,
+    unsigned short topic_id,
+    unsigned short packet_id)
+{
+  client->topic_type = topic_type;
+  client->preset_topic_id = client->topic_id = topic_id;
+  client->packet_id = packet_id;
+  client->resume_session = 1;
+}
+
+/*
+ * Queue a PUBLISH of the payload on the registered topic. It is sent by the next
+ * mqttsn_client_step() or mqttsn_client_flush().
+ * Return 0 on success, MQTTSN_CLIENT_BUSY when not connected or the send window is full, <0 for an
+ * error
+ */
+int mqttsn_client_publish(MQTTSN_CLIENT* client, const unsigned char* payload, int payload_len)
+{
+  return mqttsn_client_publish_tagged(client, payload, payload_len, 0);
+}
+
+/*
+ * Serialize the header of a PUBLISH whose payload is sent separately into the client buffer,
+ * exactly as MQTTSNSerialize_publish() lays it out: length, MsgType, Flags, TopicId, MsgId
+ * Return the header length
+ */
+static int serialize_publish_header(
+    MQTTSN_CLIENT* client,
+    MQTTSN_topicid topic,
+    unsigned short packet_id,
+    int payload_len)
+{
+  unsigned char* ptr = client->buffer;
+  MQTTSNFlags flags;
+
+  flags.all = 0;
+  flags.bits.QoS = client->options.qos;
+  flags.bits.topicIdType = topic.type;
+
+  ptr += MQTTSNPacket_encode(ptr, MQTTSNPacket_len(payload_len + 6));
+  *ptr++ = MQTTSN_PUBLISH;
+  *ptr++ = flags.all;
+  if (topic.type == MQTTSN_TOPIC_TYPE_SHORT)
+  {
+    *ptr++ = (unsigned char)topic.data.short_name[0];
+    *ptr++ = (unsigned char)topic.data.short_name[1];
+  }
+  else
+  {
+    *ptr++ = (unsigned char)(topic.data.id >> 8);
+    *ptr++ = (unsigned char)(topic.data.id & 0xFF);
+  }
+  *ptr++ = (unsigned char)(packet_id >> 8);
+  *ptr++ = (unsigned char)(packet_id & 0xFF);
+
+  return (int)(ptr - client->buffer);
+}
+
+/*
+ * Queue a PUBLISH of the payload to topic_id, whose send window entry refers to window_topic (a
+ * topic registry index or PUBLISH_WINDOW_DEFAULT_TOPIC). A held QoS 1 message is only added to the
+ * send window, where it waits for its topic to be registered.
+ */
+static int publish_message(
+    MQTTSN_CLIENT* client,
+    MQTTSN_topicid topic_id,
+    int window_topic,
+    int held,
+    const unsigned char* payload,
+    int payload_len,
+    uint64_t tag)
+{
+  int len;
+  int rc;
+  const unsigned char* referenced = NULL;
+  int referenced_len = 0;
+  uint64_t now_us = time_util_now_us();
+
+  if (client->options.zero_copy)
+  {
+    // Same limit as for a packet serialized whole into the client buffer
+    len = serialize_publish_header(client, topic_id, next_packet_id(client), payload_len);
+    if (payload_len < 0 || len + payload_len > MQTTSN_CLIENT_BUFFER_SIZE)
+    {
+      printf("PUBLISH payload of %d bytes does not fit in a datagram\r\n", payload_len);
+      return -1;
+    }
+
+    referenced = payload;
+    referenced_len = payload_len;
+  }
+  else if (
+      (len = MQTTSNSerialize_publish(
+           client->buffer,
+           sizeof(client->buffer),
+           0,
+           client->options.qos,
+           0,
+           next_packet_id(client),
+           topic_id,
+           (unsigned char*)payload,
+           payload_len))
+      <= 0)
+  {
+    printf("Failed to serialize PUBLISH packet, return code %d\r\n", len);
+    return -1;
+  }
+
+  if (held)
+  {
+    if (publish_window_add(
+            &client->window,
+            client->packet_id,
+            client->buffer,
+            len,
+            referenced,
+            referenced_len,
+            window_topic,
+            0,
+            UINT64_MAX,
+            tag)
+        != 0)
+    {
+      return -1;
+    }
+
+    client->stats.publishes++;
+    update_timer(client);
+    return 0;
+  }
+
+  if ((rc = client_send_gather(client, client->buffer, len, referenced, referenced_len)) != 0)
+  {
+    printf(
+        "Failed to send PUBLISH packet with packet id = %d, return code %d\r\n",
+        client->packet_id,
+        rc);
+    return rc;
+  }
+
+  if (client->options.qos > 0
+      && publish_window_add(
+             &client->window,
+             client->packet_id,
+             client->buffer,
+             len,
+             referenced,
+             referenced_len,
+             window_topic,
+             now_us,
+             now_us + rtt_estimator_timeout_us(&client->rtt),
+             tag)
+          != 0)
+  {
+    return -1;
+  }
+
+  client->stats.publishes++;
+  client->stats.publish_packets_sent++;
+  client->stats.publish_bytes_sent += (uint64_t)(len + referenced_len);
+  EVENT_LOG(
+      EVENT_LOG_LEVEL_DEBUG, EVENT_LOG_PUBLISH, client->packet_id, len + referenced_len, 0, 0);
+  update_timer(client);
+  return 0;
+}
+
+/*
+ * mqttsn_client_publish() with a tag that stays with the message until it leaves the send window,
+ * see mqttsn_client_lowest_tag_in_flight().
+ * With the zero_copy option only the header is serialized; it is sent together with the payload
+ * of the caller, which must stay unchanged until the message leaves the send window (QoS 1) or
+ * until the next flush.
+ */
+int mqttsn_client_publish_tagged(
+    MQTTSN_CLIENT* client,
+    const unsigned char* payload,
+    int payload_len,
+    uint64_t tag)
+{
+  MQTTSN_topicid topic;
+
+  if (!mqttsn_client_can_publish(client))
+  {
+    return MQTTSN_CLIENT_BUSY;
+  }
+
+  topic.type = (enum MQTTSN_topicTypes)client->topic_type;
+  if (client->topic_type == MQTTSN_TOPIC_TYPE_SHORT)
+  {
+    memcpy(topic.data.short_name, client->options.topic_name, 2);
+  }
+  else
+  {
+    topic.data.id = client->topic_id;
+  }
+
+  return publish_message(
+      client, topic, PUBLISH_WINDOW_DEFAULT_TOPIC, 0, payload, payload_len, tag);
+}
+
+/*
+ * mqttsn_client_publish_tagged() to any topic name, through the topic registry:
+ * 1. Look the topic up, or add it and queue its REGISTER right away, evicting the least recently
+ *    used topic that no message in flight refers to
+ * 2. Publish to a registered topic right away
+ * 3. With QoS 1, hold the message in the send window until the REGACK gives its topic ID, so that
+ *    the REGISTER packets of several new topics and the PUBLISH packets of the registered ones are
+ *    in flight together. With QoS 0 there is nothing to hold the message in: come back once the
+ *    topic is registered.
+ * Return 0 on success, MQTTSN_CLIENT_BUSY when not connected, the send window is full, the QoS 0
+ * topic is not registered yet or every registry topic is in use, <0 for an error
+ */
+int mqttsn_client_publish_topic(
+    MQTTSN_CLIENT* client,
+    const char* topic_name,
+    const unsigned char* payload,
+    int payload_len,
+    uint64_t tag)
+{
+  TOPIC_REGISTRY_ENTRY* topic;
+  MQTTSN_topicid topic_id;
+  int index;
+  int rc;
+
+  if (client->registry.size == 0 || client->options.qos < 0)
+  {
+    printf("Publishing to a topic name needs a topic registry and a connection\r\n");
+    return -1;
+  }
+
+  if (!mqttsn_client_can_publish(client))
+  {
+    return MQTTSN_CLIENT_BUSY;
+  }
+
+  // 1. Look the topic up, or add it and queue its REGISTER right away
+  if ((topic = topic_registry_lookup(&client->registry, topic_name)) == NULL)
+  {
+    if (strlen(topic_name) >= TOPIC_REGISTRY_NAME_SIZE)
+    {
+      printf("Topic name of %zu bytes is too long to register\r\n", strlen(topic_name));
+      return -1;
+    }
+
+    if ((topic = topic_registry_add(&client->registry, topic_name)) == NULL)
+    {
+      return MQTTSN_CLIENT_BUSY;
+    }
+
+    if ((rc = send_topic_register(client, topic, time_util_now_us())) != 0)
+    {
+      return rc;
+    }
+  }
+
+  index = topic_registry_index(&client->registry, topic);
+  topic_id.type = MQTTSN_TOPIC_TYPE_NORMAL;
+  topic_id.data.id = topic->topic_id;
+
+  // 2. Publish to a registered topic right away
+  // 3. With QoS 1, hold the message in the send window until the REGACK gives its topic ID
+  if (topic->state != TOPIC_REGISTRY_REGISTERED && client->options.qos == 0)
+  {
+    update_timer(client);
+    return MQTTSN_CLIENT_BUSY;
+  }
+
+  if ((rc = publish_message(
+           client,
+           topic_id,
+           index,
+           topic->state != TOPIC_REGISTRY_REGISTERED,
+           payload,
+           payload_len,
+           tag))
+          == 0
+      && client->options.qos > 0)
+  {
+    topic->messages++;
+  }
+
+  return rc;
+}
+
+/*
+ * 1. Process every datagram queued on the socket
+ * 2. Handle expired deadlines, and switch gateway if the current one degraded
+ * 3. Send everything queued and re-arm the deadline timer
+ * Never blocks. Return <0 on a socket error.
+ */
+int mqttsn_client_step(MQTTSN_CLIENT* client)
+{
+  int count;
+  uint64_t expirations;
+
+  if (client->timer_fd >= 0)
+  {
+    // Clear the timer readiness, deadlines are checked against the clock below
+    if (read(client->timer_fd, &expirations, sizeof(expirations)) > 0)
+    {
+      client->armed_deadline_us = UINT64_MAX;
+    }
+  }
+
+  // 1. Process every datagram queued on the socket
+  do
+  {
+    unsigned char* datagram;
+    int len;
+    uint64_t now_us;
+
+    if ((count = transport_batch_receive(
+             &receive_batch, client->transport.sock, 0, client->options.wire_stats))
+        < 0)
+    {
+      return count;
+    }
+
+    now_us = time_util_now_us();
+    while ((len = transport_batch_next(&receive_batch, &datagram)) > 0)
+    {
+      handle_packet(client, datagram, len, now_us);
+    }
+  } while (count == TRANSPORT_BATCH_SIZE);
+
+  // 2. Handle expired deadlines, and switch gateway if the current one degraded
+  handle_timeouts(client, time_util_now_us());
+  if ((count = check_gateway(client, time_util_now_us())) < 0)
+  {
+    return count;
+  }
+
+  // 3. Send everything queued and re-arm the deadline timer
+  return mqttsn_client_flush(client);
+}
+
+int mqttsn_client_flush(MQTTSN_CLIENT* client)
+{
+  int rc = 0;
+
+  if (send_batch.sock == client->transport.sock)
+  {
+    rc = transport_batch_flush(&send_batch);
+  }
+
+  // Datagrams held back by an impairment whose delay has passed
+  if (rc >= 0)
+  {
+    rc = transport_socket_service(client->transport.sock);
+  }
+
+  update_timer(client);
+  return rc < 0 ? rc : 0;
+}
+
+/*
+ * Send DISCONNECT, unless publishing with QoS -1. Messages still in the send window are abandoned.
+ */
+int mqttsn_client_disconnect(MQTTSN_CLIENT* client)
+{
+  int len;
+  int rc;
+
+  if (client->options.qos < 0)
+  {
+    client->state = MQTTSN_CLIENT_DISCONNECTED;
+    rc = mqttsn_client_flush(client);
+    set_radio_on(client, 0, time_util_now_us());
+    return rc;
+  }
+
+  if ((len = MQTTSNSerialize_disconnect(client->buffer, sizeof(client->buffer), 0)) <= 0)
+  {
+    printf("Failed to serialize Disconnect packet, return code %d\r\n", len);
+    return -1;
+  }
+
+  client->state = MQTTSN_CLIENT_DISCONNECTED;
+  client->resume_session = 0;
+
+  if ((rc = client_send(client, client->buffer, len)) != 0)
+  {
+    return rc;
+  }
+
+  rc = mqttsn_client_flush(client);
+  set_radio_on(client, 0, time_util_now_us());
+  return rc;
+}
+
+/*
+ * Send DISCONNECT with a sleep duration once every message is acknowledged. The Gateway keeps the
+ * session and the client keeps its radio off, except to ping the Gateway with its client ID
+ * shortly before every sleep duration expires; it falls asleep again on PINGRESP. Call
+ * mqttsn_client_connect() to publish again. With QoS -1 there is no session to keep and the radio
+ * is simply turned off.
+ * Return 0 on success, MQTTSN_CLIENT_BUSY when not connected or messages are in flight, <0 for an
+ * error
+ */
+int mqttsn_client_sleep(MQTTSN_CLIENT* client, int duration_s)
+{
+  int rc;
+
+  if (client->state != MQTTSN_CLIENT_CONNECTED || client->window.in_flight > 0
+      || client->registry.pending > 0)
+  {
+    return MQTTSN_CLIENT_BUSY;
+  }
+
+  // The duration is a 16 bit field of DISCONNECT
+  if (duration_s <= 0 || duration_s > 0xFFFF)
+  {
+    printf("Invalid sleep duration %d s\r\n", duration_s);
+    return -1;
+  }
+
+  if (client->options.qos < 0)
+  {
+    client->state = MQTTSN_CLIENT_ASLEEP;
+    client->wakeup_deadline_us = UINT64_MAX;
+    client->stats.sleeps++;
+    set_radio_on(client, 0, time_util_now_us());
+    return mqttsn_client_flush(client);
+  }
+
+  client->sleep_duration_s = duration_s;
+  client->state = MQTTSN_CLIENT_FALLING_ASLEEP;
+  client->retry_attempt = 0;
+
+  if ((rc = send_request(client, time_util_now_us())) == 0)
+  {
+    rc = mqttsn_client_flush(client);
+  }
+
+  return rc;
+}
+
+/*
+ * Return the estimated time the radio was on: from mqttsn_client_connect() on, except while asleep
+ */
+uint64_t mqttsn_client_radio_on_us(const MQTTSN_CLIENT* client, uint64_t now_us)
+{
+  return client->stats.radio_on_us
+      + (client->radio_on_since_us != 0 ? now_us - client->radio_on_since_us : 0);
+}
+
+/*
+ * Return the fd to wait on for readability: the epoll fd combining the socket and the deadline
+ * timer when use_timerfd is set, otherwise the socket (then also honour
+ * mqttsn_client_next_deadline_us())
+ */
+int mqttsn_client_poll_fd(const MQTTSN_CLIENT* client)
+{
+  return client->epoll_fd >= 0 ? client->epoll_fd : client->transport.sock;
+}
+
+/*
+ * Return the monotonic time (time_util_now_us) at which mqttsn_client_step() must be called even if
+ * no datagram arrives, UINT64_MAX if there is no deadline
+ */
+uint64_t mqttsn_client_next_deadline_us(const MQTTSN_CLIENT* client)
+{
+  uint64_t deadline_us;
+  uint64_t transport_deadline_us = transport_socket_next_deadline_us(client->transport.sock);
+
+  switch (client->state)
+  {
+    case MQTTSN_CLIENT_CONNECTING:
+    case MQTTSN_CLIENT_REGISTERING:
+    case MQTTSN_CLIENT_FALLING_ASLEEP:
+    case MQTTSN_CLIENT_AWAKE:
+      deadline_us = client->request_deadline_us;
+      break;
+
+    case MQTTSN_CLIENT_ASLEEP:
+      deadline_us = client->wakeup_deadline_us;
+      break;
+
+    case MQTTSN_CLIENT_CONNECTED:
+      deadline_us = publish_window_next_deadline(&client->window);
+      if (topic_registry_next_deadline(&client->registry) < deadline_us)
+      {
+        deadline_us = topic_registry_next_deadline(&client->registry);
+      }
+      break;
+
+    default:
+      deadline_us = UINT64_MAX;
+      break;
+  }
+
+  return transport_deadline_us < deadline_us ? transport_deadline_us : deadline_us;
+}
+
+int mqttsn_client_can_publish(const MQTTSN_CLIENT* client)
+{
+  return client->state == MQTTSN_CLIENT_CONNECTED && !publish_window_is_full(&client->window);
+}
+
+int mqttsn_client_in_flight(const MQTTSN_CLIENT* client)
+{
+  return client->window.in_flight;
+}
+
+/*
+ * Return the lowest tag of the messages still waiting for their PUBACK, UINT64_MAX if none. With
+ * increasing tags, every message tagged below it was acknowledged or given up on.
+ */
+uint64_t mqttsn_client_lowest_tag_in_flight(const MQTTSN_CLIENT* client)
+{
+  return publish_window_lowest_tag(&client->window);
+}
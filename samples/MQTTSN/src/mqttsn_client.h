@@ -0,0 +1,169 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef MQTTSN_CLIENT_H
+#define MQTTSN_CLIENT_H
+
+#include <stdint.h>
+
+#include "gateway_table.h"
+#include "latency_histogram.h"
+#include "publish_window.h"
+#include "rtt_estimator.h"
+#include "topic_registry.h"
+#include "transport.h"
+#include "transport_impairment.h"
+#include "wire_stats.h"
+
+// mqttsn_client_publish could not accept the message yet (not connected or send window full)
+#define MQTTSN_CLIENT_BUSY 1
+
+#define MQTTSN_CLIENT_BUFFER_SIZE PUBLISH_WINDOW_PACKET_SIZE
+
+typedef enum
+{
+  MQTTSN_CLIENT_DISCONNECTED,
+  MQTTSN_CLIENT_CONNECTING,
+  MQTTSN_CLIENT_REGISTERING,
+  MQTTSN_CLIENT_CONNECTED,
+  MQTTSN_CLIENT_FALLING_ASLEEP, // DISCONNECT with a sleep duration sent
+  MQTTSN_CLIENT_ASLEEP, // radio off, the Gateway keeps the session
+  MQTTSN_CLIENT_AWAKE // PINGREQ with the client ID sent, back to sleep on PINGRESP
+} MQTTSN_CLIENT_STATE;
+
+typedef struct mqttsn_client_options_tag
+{
+  // Strings are not copied and must outlive the client
+  char* client_id;
+  char* topic_name;
+  char* gateway_address;
+  int gateway_port;
+  int src_port; // 0 = ephemeral source port
+  unsigned short predefined_topic_id; // 0 = use a short topic name or REGISTER the topic name
+  int qos; // -1 (no connection, predefined or short topic ID only), 0 or 1
+  int send_window_size; // QoS 1 PUBLISH packets allowed in flight
+  int use_timerfd; // make mqttsn_client_poll_fd() also readable when a deadline expires
+  // reference PUBLISH payloads instead of copying them, see mqttsn_client_publish_tagged()
+  int zero_copy;
+  int verbose; // log handshake progress and retransmissions, see event_log.h
+  LATENCY_HISTOGRAM* puback_latency; // optional, may be shared between clients
+  // optional, may be shared: first transmission to acknowledgement of retransmitted exchanges
+  LATENCY_HISTOGRAM* recovery_time;
+  WIRE_STATS* wire_stats; // optional, may be shared between clients
+  const TRANSPORT_IMPAIRMENT_CONFIG* impairment; // optional, simulated loss and delay on the socket
+  // optional: gateways to switch to, see mqttsn_client_step(). The configured one is added to it.
+  GATEWAY_TABLE* gateways;
+  int failover_timeouts; // consecutive timeouts after which the client fails over, 0 = never
+  // topics registered on demand by mqttsn_client_publish_topic(), 0 = publish to topic_name only
+  int topic_registry_size;
+  // optional: first unacknowledged transmission to the failed gateway to reconnection to another
+  LATENCY_HISTOGRAM* failover_time;
+} MQTTSN_CLIENT_OPTIONS;
+
+typedef struct mqttsn_client_stats_tag
+{
+  uint64_t publishes;
+  uint64_t publish_packets_sent; // including retransmissions
+  uint64_t publish_bytes_sent; // MQTT-SN bytes, including retransmissions
+  uint64_t pubacks;
+  uint64_t retransmissions;
+  uint64_t messages_lost;
+  uint64_t recoveries; // CONNECT, REGISTER or PUBLISH acknowledged after a retransmission
+  uint64_t register_round_trips_saved;
+  uint64_t register_bytes_saved;
+  uint64_t sleeps;
+  uint64_t wakeups; // PINGREQ sent while asleep
+  uint64_t failovers; // switches to another gateway after timeouts
+  uint64_t gateway_switches; // switches to a faster gateway
+  uint64_t radio_on_us; // time spent in any state but asleep, up to the last state change
+  uint64_t latency_sum_us;
+  uint64_t latency_min_us;
+  uint64_t latency_max_us;
+} MQTTSN_CLIENT_STATS;
+
+/*
+ * Non-blocking MQTT-SN client for one connection. The CONNECT -> REGISTER -> PUBLISH/PUBACK flow
+ * is driven by mqttsn_client_step(), which never blocks: the application waits for
+ * mqttsn_client_poll_fd() to become readable, or for mqttsn_client_next_deadline_us(), in its own
+ * poll/epoll loop and keeps doing other work in between.
+ * REGISTER is skipped for a predefined topic ID or a two character (short) topic name. If the
+ * Gateway rejects that ID, the client falls back to REGISTER and resends the rejected messages.
+ * Retransmission timeouts follow the round trip time measured on the connection.
+ * Between messages a battery powered client can sleep (mqttsn_client_sleep()): the radio is
+ * assumed off except for the PINGREQ that keeps the session alive, and mqttsn_client_connect()
+ * resumes the session without registering the topic again.
+ * With QoS -1 there is no connection at all: PUBLISH packets go straight to the predefined or short
+ * topic ID and are never acknowledged.
+ * With a gateway table, the client fails over to the best other gateway once the current one
+ * misses failover_timeouts acknowledgements in a row, and switches to a gateway whose score is
+ * less than half that of the current one while nothing is in flight. Either way it connects with a
+ * clean session and registers the topic again; messages in flight are resent to the new gateway.
+ * With a topic registry, mqttsn_client_publish_topic() publishes to any topic name: the first
+ * message to a topic waits in the send window while its REGISTER is in flight, alongside the
+ * REGISTER packets of other new topics and the PUBLISH packets of registered ones.
+ */
+typedef struct mqttsn_client_tag
+{
+  MQTTSN_CLIENT_OPTIONS options;
+  MQTTSN_CLIENT_STATE state;
+  TRANSPORT_HANDLE transport;
+  int timer_fd;
+  int epoll_fd;
+  int topic_type;
+  unsigned short topic_id;
+  unsigned short preset_topic_id; // predefined, short or resumed topic ID used instead of REGISTER
+  unsigned short packet_id;
+  int retry_attempt;
+  uint64_t request_first_sent_us;
+  uint64_t request_sent_us;
+  uint64_t request_deadline_us;
+  uint64_t armed_deadline_us;
+  int sleep_duration_s;
+  int resume_session; // CONNECT without clean session after sleeping or mqttsn_client_resume()
+  uint64_t wakeup_deadline_us;
+  uint64_t radio_on_since_us; // 0 while asleep or disconnected
+  GATEWAY_TABLE_ENTRY* gateway; // current gateway in options.gateways, NULL without a table
+  int gateway_timeouts; // consecutive timeouts on the current gateway
+  uint64_t outage_since_us; // first unacknowledged transmission of the current outage, 0 if none
+  uint64_t failover_since_us; // start of the outage that caused a failover, 0 once reconnected
+  uint64_t next_gateway_check_us;
+  PUBLISH_WINDOW window;
+  TOPIC_REGISTRY registry; // empty without topic_registry_size
+  RTT_ESTIMATOR rtt; // shared by CONNECT, REGISTER and PUBLISH
+  MQTTSN_CLIENT_STATS stats;
+  unsigned char buffer[MQTTSN_CLIENT_BUFFER_SIZE];
+} MQTTSN_CLIENT;
+
+MQTTSN_CLIENT_OPTIONS mqttsn_client_options_default(void);
+int mqttsn_client_init(MQTTSN_CLIENT* client, const MQTTSN_CLIENT_OPTIONS* options);
+void mqttsn_client_deinit(MQTTSN_CLIENT* client);
+int mqttsn_client_connect(MQTTSN_CLIENT* client);
+void mqttsn_client_resume(
+    MQTTSN_CLIENT* client,
+    int topic_type,
+    unsigned short topic_id,
+    unsigned short packet_id);
+int mqttsn_client_publish(MQTTSN_CLIENT* client, const unsigned char* payload, int payload_len);
+int mqttsn_client_publish_tagged(
+    MQTTSN_CLIENT* client,
+    const unsigned char* payload,
+    int payload_len,
+    uint64_t tag);
+int mqttsn_client_publish_topic(
+    MQTTSN_CLIENT* client,
+    const char* topic_name,
+    const unsigned char* payload,
+    int payload_len,
+    uint64_t tag);
+int mqttsn_client_step(MQTTSN_CLIENT* client);
+int mqttsn_client_flush(MQTTSN_CLIENT* client);
+int mqttsn_client_disconnect(MQTTSN_CLIENT* client);
+int mqttsn_client_sleep(MQTTSN_CLIENT* client, int duration_s);
+uint64_t mqttsn_client_radio_on_us(const MQTTSN_CLIENT* client, uint64_t now_us);
+int mqttsn_client_poll_fd(const MQTTSN_CLIENT* client);
+uint64_t mqttsn_client_next_deadline_us(const MQTTSN_CLIENT* client);
+int mqttsn_client_can_publish(const MQTTSN_CLIENT* client);
+int mqttsn_client_in_flight(const MQTTSN_CLIENT* client);
+uint64_t mqttsn_client_lowest_tag_in_flight(const MQTTSN_CLIENT* client);
+
+#endif // MQTTSN_CLIENT_H
@@ -0,0 +1,1097 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+/*
+ * Minimal MQTT-SN Gateway for offline benchmarking of the samples. It answers CONNECT, REGISTER,
+ * PUBLISH (QoS -1, 0 and 1), PINGREQ and DISCONNECT, including the sleep of a client that
+ * disconnects with a duration, for any number of clients on one UDP socket, driven by a single
+ * epoll loop, and reports the rates at which it receives traffic. On a multicast group it answers
+ * SEARCHGW with GWINFO and can ADVERTISE itself, both sent from the Gateway socket. Nothing is
+ * forwarded to a broker: PUBLISH payloads are counted and dropped, so there are never messages to
+ * buffer for a sleeping client.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "MQTTSNPacket.h"
+#include "predefined_topics.h"
+#include "time_util.h"
+#include "transport.h"
+#include "wire_stats.h"
+
+// DO NOT MODIFY: UDP port the emulator listens on, the Gateway port of the samples
+#define ENV_MQTTSN_GATEWAY_PORT "MQTTSN_GATEWAY_PORT"
+
+// DO NOT MODIFY: Topic ID mapping file shared with the clients, empty to reject predefined IDs
+#define ENV_MQTTSN_PREDEFINED_TOPIC_FILE "MQTTSN_PREDEFINED_TOPIC_FILE"
+
+// DO NOT MODIFY: Seconds to run before printing the summary, 0 = until SIGINT or SIGTERM
+#define ENV_GATEWAY_EMULATOR_DURATION "GATEWAY_EMULATOR_DURATION"
+
+// DO NOT MODIFY: 1 to share the port with other emulator processes through SO_REUSEPORT
+#define ENV_GATEWAY_EMULATOR_REUSEPORT "GATEWAY_EMULATOR_REUSEPORT"
+
+// DO NOT MODIFY: Multicast group of SEARCHGW, GWINFO and ADVERTISE, empty to not be discovered
+#define ENV_MQTTSN_DISCOVERY_GROUP "MQTTSN_DISCOVERY_GROUP"
+
+// DO NOT MODIFY: UDP port of the multicast group
+#define ENV_MQTTSN_DISCOVERY_PORT "MQTTSN_DISCOVERY_PORT"
+
+// DO NOT MODIFY: Gateway ID sent in GWINFO and ADVERTISE
+#define ENV_GATEWAY_EMULATOR_ID "GATEWAY_EMULATOR_ID"
+
+// DO NOT MODIFY: Seconds between ADVERTISE packets, 0 to only answer SEARCHGW
+#define ENV_GATEWAY_EMULATOR_ADVERTISE_INTERVAL "GATEWAY_EMULATOR_ADVERTISE_INTERVAL"
+
+#define DEFAULT_GATEWAY_PORT "10000"
+#define DEFAULT_GATEWAY_EMULATOR_DURATION "0"
+#define DEFAULT_GATEWAY_EMULATOR_REUSEPORT "0"
+#define DEFAULT_DISCOVERY_GROUP ""
+#define DEFAULT_DISCOVERY_PORT "1883"
+#define DEFAULT_GATEWAY_EMULATOR_ID "1"
+#define DEFAULT_GATEWAY_EMULATOR_ADVERTISE_INTERVAL "0"
+#define INITIAL_CLIENT_TABLE_SIZE 1024
+#define INITIAL_TOPIC_TABLE_SIZE 1024
+#define MAX_TOPIC_ID 0xFFFF
+#define MAX_CLIENT_ID_LENGTH 64
+#define SOCKET_RECEIVE_BUFFER_SIZE (8 * 1024 * 1024)
+#define MAX_BATCHES_PER_WAKEUP 64 // bound the time spent draining the socket between reports
+#define EPOLL_MAX_EVENTS 4
+#define REPORT_INTERVAL_US 1000000
+#define MQTTSN_FLAG_QOS_MASK 0x60 // both QoS bits set: QoS -1
+
+/*
+ * Session state of one client, keyed by its source address
+ */
+typedef struct emulator_client_tag
+{
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  int in_use;
+  int connected;
+  int asleep; // disconnected with a sleep duration, the session is kept
+  char client_id[MAX_CLIENT_ID_LENGTH];
+  uint64_t publishes;
+} EMULATOR_CLIENT;
+
+typedef struct emulator_counters_tag
+{
+  uint64_t datagrams;
+  uint64_t bytes; // UDP payload bytes
+  uint64_t publishes;
+  uint64_t payload_bytes;
+} EMULATOR_COUNTERS;
+
+typedef struct gateway_emulator_tag
+{
+  int gateway_port;
+  int duration_s;
+  int reuse_port;
+  int gateway_id;
+  int advertise_interval_s;
+  int sock;
+  int multicast_sock; // -1 without discovery
+  struct sockaddr_in group;
+  uint64_t next_advertise_us;
+  int epoll_fd;
+  int timer_fd;
+  int signal_fd;
+  // Open addressing hash table of clients, at most half full
+  EMULATOR_CLIENT* clients;
+  int client_capacity;
+  int client_count;
+  // Registered topic names indexed by topic ID - 1, plus an open addressing name -> ID index.
+  // Topic IDs are shared by all clients, so a topic keeps its ID across reconnects.
+  char** topic_names;
+  int topic_count;
+  unsigned short* topic_index;
+  int topic_index_capacity;
+  PREDEFINED_TOPICS predefined_topics;
+  EMULATOR_COUNTERS total;
+  EMULATOR_COUNTERS interval;
+  uint64_t peak_publishes_per_s;
+  uint64_t duplicates;
+  uint64_t rejected_publishes;
+  uint64_t connectionless_publishes; // QoS -1
+  uint64_t sleeps;
+  uint64_t wakeups;
+  uint64_t searches;
+  uint64_t advertises;
+  uint64_t malformed;
+  uint64_t receive_calls;
+  uint64_t start_us;
+  uint64_t first_publish_us;
+  uint64_t last_publish_us;
+  WIRE_STATS wire_stats;
+  TRANSPORT_RECEIVE_BATCH receive_batch;
+  TRANSPORT_SEND_BATCH send_batch;
+  unsigned char reply[TRANSPORT_DATAGRAM_SIZE];
+} GATEWAY_EMULATOR;
+
+/*
+ * Read an OS environment variable, falling back to the default value
+ */
+static const char* read_configuration_entry(const char* env_name, const char* default_value)
+{
+  char* env = getenv(env_name);
+  const char* value = env != NULL ? env : default_value;
+
+  printf("%s = %s\r\n", env_name, value);
+  return value;
+}
+
+/*
+ * FNV-1a, good enough to spread source addresses and topic names over the tables
+ */
+static uint32_t hash_bytes(const void* data, size_t len, uint32_t hash)
+{
+  const unsigned char* bytes = (const unsigned char*)data;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+
+  return hash;
+}
+
+/*
+ * The kernel zeroes the fields of a source address that it does not fill, so that addresses of
+ * either family hash and compare whole
+ */
+static EMULATOR_CLIENT* find_client_slot(
+    EMULATOR_CLIENT* clients,
+    int capacity,
+    const struct sockaddr_storage* addr,
+    socklen_t addr_len)
+{
+  uint32_t slot = hash_bytes(addr, addr_len, 2166136261u) & (uint32_t)(capacity - 1);
+
+  while (clients[slot].in_use
+         && (clients[slot].addr_len != addr_len
+             || memcmp(&clients[slot].addr, addr, addr_len) != 0))
+  {
+    slot = (slot + 1) & (uint32_t)(capacity - 1);
+  }
+
+  return &clients[slot];
+}
+
+/*
+ * Return the client for the source address, adding it when create is set, or NULL
+ */
+static EMULATOR_CLIENT* get_client(
+    GATEWAY_EMULATOR* emulator,
+    const struct sockaddr_storage* addr,
+    socklen_t addr_len,
+    int create)
+{
+  EMULATOR_CLIENT* client
+      = find_client_slot(emulator->clients, emulator->client_capacity, addr, addr_len);
+
+  if (client->in_use || !create)
+  {
+    return client->in_use ? client : NULL;
+  }
+
+  if ((emulator->client_count + 1) * 2 > emulator->client_capacity)
+  {
+    int capacity = emulator->client_capacity * 2;
+    EMULATOR_CLIENT* clients = calloc((size_t)capacity, sizeof(EMULATOR_CLIENT));
+
+    if (clients == NULL)
+    {
+      return NULL;
+    }
+
+    for (int i = 0; i < emulator->client_capacity; i++)
+    {
+      if (emulator->clients[i].in_use)
+      {
+        *find_client_slot(
+            clients, capacity, &emulator->clients[i].addr, emulator->clients[i].addr_len)
+            = emulator->clients[i];
+      }
+    }
+
+    free(emulator->clients);
+    emulator->clients = clients;
+    emulator->client_capacity = capacity;
+    client = find_client_slot(clients, capacity, addr, addr_len);
+  }
+
+  client->in_use = 1;
+  client->addr = *addr;
+  client->addr_len = addr_len;
+  emulator->client_count++;
+  return client;
+}
+
+static unsigned short* find_topic_slot(
+    GATEWAY_EMULATOR* emulator,
+    unsigned short* index,
+    int capacity,
+    const char* name,
+    int len)
+{
+  uint32_t slot = hash_bytes(name, (size_t)len, 2166136261u) & (uint32_t)(capacity - 1);
+
+  while (index[slot] != 0)
+  {
+    const char* existing = emulator->topic_names[index[slot] - 1];
+
+    if (strncmp(existing, name, (size_t)len) == 0 && existing[len] == '\0')
+    {
+      break;
+    }
+
+    slot = (slot + 1) & (uint32_t)(capacity - 1);
+  }
+
+  return &index[slot];
+}
+
+/*
+ * Return the topic ID of the topic name, assigning the next free ID to a new name, or 0 when the
+ * topic IDs are exhausted
+ */
+static unsigned short register_topic(GATEWAY_EMULATOR* emulator, const char* name, int len)
+{
+  unsigned short* slot = find_topic_slot(
+      emulator, emulator->topic_index, emulator->topic_index_capacity, name, len);
+  char* copy;
+
+  if (*slot != 0)
+  {
+    return *slot;
+  }
+
+  if (emulator->topic_count == MAX_TOPIC_ID)
+  {
+    return 0;
+  }
+
+  if ((emulator->topic_count + 1) * 2 > emulator->topic_index_capacity)
+  {
+    int capacity = emulator->topic_index_capacity * 2;
+    unsigned short* index = calloc((size_t)capacity, sizeof(unsigned short));
+    char** names = realloc(emulator->topic_names, (size_t)capacity / 2 * sizeof(char*));
+
+    if (index == NULL || names == NULL)
+    {
+      free(index);
+      if (names != NULL)
+      {
+        emulator->topic_names = names;
+      }
+      return 0;
+    }
+
+    emulator->topic_names = names;
+    for (int id = 1; id <= emulator->topic_count; id++)
+    {
+      const char* existing = emulator->topic_names[id - 1];
+      *find_topic_slot(emulator, index, capacity, existing, (int)strlen(existing))
+          = (unsigned short)id;
+    }
+
+    free(emulator->topic_index);
+    emulator->topic_index = index;
+    emulator->topic_index_capacity = capacity;
+    slot = find_topic_slot(emulator, index, capacity, name, len);
+  }
+
+  if ((copy = malloc((size_t)len + 1)) == NULL)
+  {
+    return 0;
+  }
+
+  memcpy(copy, name, (size_t)len);
+  copy[len] = '\0';
+  emulator->topic_names[emulator->topic_count++] = copy;
+  *slot = (unsigned short)emulator->topic_count;
+  return *slot;
+}
+
+/*
+ * Check that the client may publish to the topic of a PUBLISH packet. Without a client, for QoS -1,
+ * only topic IDs predefined for every client are valid.
+ */
+static int is_valid_topic(
+    GATEWAY_EMULATOR* emulator,
+    const EMULATOR_CLIENT* client,
+    const MQTTSN_topicid* topic)
+{
+  switch (topic->type)
+  {
+    case MQTTSN_TOPIC_TYPE_NORMAL:
+      return client != NULL && topic->data.id > 0 && topic->data.id <= emulator->topic_count;
+
+    case MQTTSN_TOPIC_TYPE_PREDEFINED:
+      return predefined_topics_find_name(
+                 &emulator->predefined_topics,
+                 client != NULL ? client->client_id : "",
+                 topic->data.id)
+          != NULL;
+
+    case MQTTSN_TOPIC_TYPE_SHORT:
+      return 1;
+
+    default:
+      return 0;
+  }
+}
+
+static void queue_reply(GATEWAY_EMULATOR* emulator, const EMULATOR_CLIENT* client, int len)
+{
+  if (len > 0)
+  {
+    transport_batch_queue_to(
+        &emulator->send_batch,
+        (const struct sockaddr*)&client->addr,
+        client->addr_len,
+        emulator->reply,
+        len);
+  }
+}
+
+/*
+ * Tell a client that has no session, e.g. after the emulator was restarted, to connect again
+ */
+static void reject_client(
+    GATEWAY_EMULATOR* emulator,
+    const struct sockaddr_storage* addr,
+    socklen_t addr_len)
+{
+  int len = MQTTSNSerialize_disconnect(emulator->reply, sizeof(emulator->reply), -1);
+
+  if (len > 0)
+  {
+    transport_batch_queue_to(
+        &emulator->send_batch, (const struct sockaddr*)addr, addr_len, emulator->reply, len);
+  }
+}
+
+static void handle_publish(
+    GATEWAY_EMULATOR* emulator,
+    EMULATOR_CLIENT* client,
+    unsigned char* buf,
+    int len,
+    uint64_t now_us)
+{
+  unsigned char dup;
+  unsigned char retained;
+  unsigned short packet_id;
+  int qos;
+  int payload_len;
+  unsigned char* payload;
+  MQTTSN_topicid topic;
+  unsigned char return_code = MQTTSN_RC_ACCEPTED;
+
+  if (MQTTSNDeserialize_publish(
+          &dup, &qos, &retained, &packet_id, &topic, &payload, &payload_len, buf, len)
+      != 1)
+  {
+    emulator->malformed++;
+    return;
+  }
+
+  // QoS -1 has both QoS bits set, read back as -1 or 3 depending on the flags bit-field; nothing
+  // is sent back
+  if (qos < 0 || qos == 3)
+  {
+    qos = -1;
+    emulator->connectionless_publishes++;
+    client = NULL;
+  }
+
+  if (!is_valid_topic(emulator, client, &topic))
+  {
+    emulator->rejected_publishes++;
+    return_code = MQTTSN_RC_REJECTED_INVALID_TOPIC_ID;
+  }
+  else
+  {
+    if (emulator->total.publishes == 0)
+    {
+      emulator->first_publish_us = now_us;
+    }
+    emulator->last_publish_us = now_us;
+    emulator->total.publishes++;
+    emulator->total.payload_bytes += (uint64_t)payload_len;
+    emulator->interval.publishes++;
+    emulator->interval.payload_bytes += (uint64_t)payload_len;
+    emulator->duplicates += dup;
+    if (client != NULL)
+    {
+      client->publishes++;
+    }
+  }
+
+  if (qos == 1)
+  {
+    queue_reply(
+        emulator,
+        client,
+        MQTTSNSerialize_puback(
+            emulator->reply, sizeof(emulator->reply), topic.data.id, packet_id, return_code));
+  }
+}
+
+/*
+ * Answer one datagram. Replies are queued on the send batch, which is flushed once per received
+ * batch.
+ */
+static void handle_datagram(
+    GATEWAY_EMULATOR* emulator,
+    unsigned char* buf,
+    int len,
+    const struct sockaddr_storage* from,
+    socklen_t from_len,
+    uint64_t now_us)
+{
+  EMULATOR_CLIENT* client;
+  int datalen;
+  int lenlen = MQTTSNPacket_decode(buf, len, &datalen);
+
+  emulator->total.datagrams++;
+  emulator->total.bytes += (uint64_t)len;
+  emulator->interval.datagrams++;
+  emulator->interval.bytes += (uint64_t)len;
+
+  if (lenlen <= 0 || datalen != len)
+  {
+    emulator->malformed++;
+    return;
+  }
+
+  if (buf[lenlen] == MQTTSN_CONNECT)
+  {
+    MQTTSNPacket_connectData data = MQTTSNPacket_connectData_initializer;
+    int id_len;
+
+    if (MQTTSNDeserialize_connect(&data, buf, len) != 1
+        || (client = get_client(emulator, from, from_len, 1)) == NULL)
+    {
+      emulator->malformed++;
+      return;
+    }
+
+    id_len = data.clientID.lenstring.len < MAX_CLIENT_ID_LENGTH ? data.clientID.lenstring.len
+                                                                : MAX_CLIENT_ID_LENGTH - 1;
+    memcpy(client->client_id, data.clientID.lenstring.data, (size_t)id_len);
+    client->client_id[id_len] = '\0';
+    client->connected = 1;
+    client->asleep = 0;
+    queue_reply(
+        emulator,
+        client,
+        MQTTSNSerialize_connack(emulator->reply, sizeof(emulator->reply), MQTTSN_RC_ACCEPTED));
+    return;
+  }
+
+  if ((client = get_client(emulator, from, from_len, 0)) == NULL || !client->connected
+      || client->asleep)
+  {
+    // QoS -1 PUBLISH needs no session at all
+    if (buf[lenlen] == MQTTSN_PUBLISH && len > lenlen + 1
+        && (buf[lenlen + 1] & MQTTSN_FLAG_QOS_MASK) == MQTTSN_FLAG_QOS_MASK)
+    {
+      handle_publish(emulator, NULL, buf, len, now_us);
+      return;
+    }
+
+    // PINGREQ and DISCONNECT are harmless without an active session, anything else needs one
+    if (buf[lenlen] != MQTTSN_PINGREQ && buf[lenlen] != MQTTSN_DISCONNECT)
+    {
+      reject_client(emulator, from, from_len);
+      return;
+    }
+  }
+
+  switch (buf[lenlen])
+  {
+    case MQTTSN_REGISTER:
+    {
+      unsigned short topic_id;
+      unsigned short packet_id;
+      MQTTSNString topic_name = MQTTSNString_initializer;
+
+      if (MQTTSNDeserialize_register(&topic_id, &packet_id, &topic_name, buf, len) != 1)
+      {
+        emulator->malformed++;
+        break;
+      }
+
+      topic_id = register_topic(emulator, topic_name.lenstring.data, topic_name.lenstring.len);
+      queue_reply(
+          emulator,
+          client,
+          MQTTSNSerialize_regack(
+              emulator->reply,
+              sizeof(emulator->reply),
+              topic_id,
+              packet_id,
+              topic_id != 0 ? MQTTSN_RC_ACCEPTED : MQTTSN_RC_REJECTED_CONGESTED));
+      break;
+    }
+
+    case MQTTSN_PUBLISH:
+      handle_publish(emulator, client, buf, len, now_us);
+      break;
+
+    case MQTTSN_PINGREQ:
+    {
+      int reply_len = MQTTSNSerialize_pingresp(emulator->reply, sizeof(emulator->reply));
+
+      // A sleeping client wakes up with its client ID: nothing is buffered, it can sleep on
+      if (client != NULL && client->asleep && len > lenlen + 1)
+      {
+        emulator->wakeups++;
+      }
+
+      if (reply_len > 0)
+      {
+        transport_batch_queue_to(
+            &emulator->send_batch,
+            (const struct sockaddr*)from,
+            from_len,
+            emulator->reply,
+            reply_len);
+      }
+      break;
+    }
+
+    case MQTTSN_DISCONNECT:
+    {
+      int duration = -1;
+
+      // A sleep duration keeps the session, the DISCONNECT reply acknowledges both
+      if (client != NULL)
+      {
+        int was_asleep = client->asleep;
+
+        MQTTSNDeserialize_disconnect(&duration, buf, len);
+        client->asleep = client->connected && duration > 0;
+        client->connected = client->asleep;
+        emulator->sleeps += (uint64_t)(client->asleep && !was_asleep);
+      }
+      reject_client(emulator, from, from_len);
+      break;
+    }
+
+    default:
+      // Not emulated: SUBSCRIBE, QoS 2 flows, will topics, ... SEARCHGW is answered on the
+      // discovery group only.
+      emulator->malformed++;
+      break;
+  }
+}
+
+/*
+ * Multicast GWINFO in reply to SEARCHGW; other discovery packets come from clients or other
+ * Gateways and are ignored
+ */
+static int receive_discovery(GATEWAY_EMULATOR* emulator)
+{
+  int rc;
+  unsigned char* buf;
+  int len;
+
+  if ((rc = transport_batch_receive(
+           &emulator->receive_batch, emulator->multicast_sock, 0, &emulator->wire_stats))
+      <= 0)
+  {
+    return rc;
+  }
+
+  while ((len = transport_batch_next(&emulator->receive_batch, &buf)) > 0)
+  {
+    unsigned char radius;
+    int reply_len;
+
+    if (MQTTSNDeserialize_searchgw(&radius, buf, len) != 1)
+    {
+      continue;
+    }
+
+    emulator->searches++;
+    if ((reply_len = MQTTSNSerialize_gwinfo(
+             emulator->reply,
+             sizeof(emulator->reply),
+             (unsigned char)emulator->gateway_id,
+             0,
+             NULL))
+        > 0)
+    {
+      transport_batch_queue_to(
+          &emulator->send_batch,
+          (const struct sockaddr*)&emulator->group,
+          sizeof(emulator->group),
+          emulator->reply,
+          reply_len);
+    }
+  }
+
+  return transport_batch_flush(&emulator->send_batch);
+}
+
+/*
+ * Multicast ADVERTISE with the interval until the next one, when it is due
+ */
+static void advertise(GATEWAY_EMULATOR* emulator, uint64_t now_us)
+{
+  int len;
+
+  if (emulator->multicast_sock < 0 || emulator->advertise_interval_s <= 0
+      || now_us < emulator->next_advertise_us)
+  {
+    return;
+  }
+
+  emulator->next_advertise_us = now_us + (uint64_t)emulator->advertise_interval_s * 1000000;
+  if ((len = MQTTSNSerialize_advertise(
+           emulator->reply,
+           sizeof(emulator->reply),
+           (unsigned char)emulator->gateway_id,
+           (unsigned short)emulator->advertise_interval_s))
+      > 0)
+  {
+    transport_batch_queue_to(
+        &emulator->send_batch,
+        (const struct sockaddr*)&emulator->group,
+        sizeof(emulator->group),
+        emulator->reply,
+        len);
+    transport_batch_flush(&emulator->send_batch);
+    emulator->advertises++;
+  }
+}
+
+/*
+ * 1. Read the configuration and the predefined topic ID mapping file
+ * 2. Open the UDP socket with a large receive buffer, and join the discovery group
+ * 3. Add the sockets, a report timer and SIGINT/SIGTERM to an epoll set
+ */
+static int init_gateway_emulator(GATEWAY_EMULATOR* emulator)
+{
+  int rc;
+  const char* topic_file;
+  const char* discovery_group;
+  int discovery_port;
+  int receive_buffer_size = SOCKET_RECEIVE_BUFFER_SIZE;
+  struct itimerspec interval;
+  struct epoll_event event;
+  sigset_t signals;
+
+  memset((void*)emulator, 0, sizeof(GATEWAY_EMULATOR));
+  emulator->sock = -1;
+  emulator->multicast_sock = -1;
+  emulator->epoll_fd = -1;
+  emulator->timer_fd = -1;
+  emulator->signal_fd = -1;
+  wire_stats_init(&emulator->wire_stats);
+
+  // 1. Read the configuration and the predefined topic ID mapping file
+  emulator->gateway_port
+      = atoi(read_configuration_entry(ENV_MQTTSN_GATEWAY_PORT, DEFAULT_GATEWAY_PORT));
+  emulator->duration_s = atoi(read_configuration_entry(
+      ENV_GATEWAY_EMULATOR_DURATION, DEFAULT_GATEWAY_EMULATOR_DURATION));
+  emulator->reuse_port = atoi(read_configuration_entry(
+      ENV_GATEWAY_EMULATOR_REUSEPORT, DEFAULT_GATEWAY_EMULATOR_REUSEPORT));
+  topic_file = read_configuration_entry(ENV_MQTTSN_PREDEFINED_TOPIC_FILE, "");
+  discovery_group = read_configuration_entry(ENV_MQTTSN_DISCOVERY_GROUP, DEFAULT_DISCOVERY_GROUP);
+  discovery_port
+      = atoi(read_configuration_entry(ENV_MQTTSN_DISCOVERY_PORT, DEFAULT_DISCOVERY_PORT));
+  emulator->gateway_id
+      = atoi(read_configuration_entry(ENV_GATEWAY_EMULATOR_ID, DEFAULT_GATEWAY_EMULATOR_ID));
+  emulator->advertise_interval_s = atoi(read_configuration_entry(
+      ENV_GATEWAY_EMULATOR_ADVERTISE_INTERVAL, DEFAULT_GATEWAY_EMULATOR_ADVERTISE_INTERVAL));
+
+  if (emulator->gateway_port <= 0)
+  {
+    printf("Invalid value for %s\r\n", ENV_MQTTSN_GATEWAY_PORT);
+    return -1;
+  }
+
+  if (emulator->gateway_id < 0 || emulator->gateway_id > 0xFF
+      || emulator->advertise_interval_s < 0 || emulator->advertise_interval_s > 0xFFFF)
+  {
+    printf(
+        "Invalid value for %s or %s\r\n",
+        ENV_GATEWAY_EMULATOR_ID,
+        ENV_GATEWAY_EMULATOR_ADVERTISE_INTERVAL);
+    return -1;
+  }
+
+  if (topic_file[0] != '\0'
+      && predefined_topics_load(&emulator->predefined_topics, topic_file) != 0)
+  {
+    return -1;
+  }
+
+  emulator->client_capacity = INITIAL_CLIENT_TABLE_SIZE;
+  emulator->topic_index_capacity = INITIAL_TOPIC_TABLE_SIZE;
+  emulator->clients = calloc((size_t)emulator->client_capacity, sizeof(EMULATOR_CLIENT));
+  emulator->topic_index = calloc((size_t)emulator->topic_index_capacity, sizeof(unsigned short));
+  emulator->topic_names = calloc((size_t)emulator->topic_index_capacity / 2, sizeof(char*));
+  if (emulator->clients == NULL || emulator->topic_index == NULL || emulator->topic_names == NULL)
+  {
+    printf("Failed to allocate the client and topic tables\r\n");
+    return -1;
+  }
+
+  // 2. Open the UDP socket with a large receive buffer, and join the discovery group
+  if ((rc = emulator->sock = emulator->reuse_port
+               ? transport_socket_open_shared(emulator->gateway_port, 1)
+               : transport_socket_open(emulator->gateway_port, 1))
+      < 0)
+  {
+    printf("Failed to listen on port %d, return code %d\r\n", emulator->gateway_port, rc);
+    return rc;
+  }
+
+  // The kernel may cap this at net.core.rmem_max; a bigger buffer only absorbs longer bursts
+  (void)setsockopt(
+      emulator->sock, SOL_SOCKET, SO_RCVBUF, &receive_buffer_size, sizeof(receive_buffer_size));
+  transport_batch_init(&emulator->send_batch, emulator->sock, &emulator->wire_stats);
+
+  if (discovery_group[0] != '\0'
+      && (rc = emulator->multicast_sock
+          = transport_multicast_open(discovery_group, discovery_port, &emulator->group))
+          < 0)
+  {
+    printf("Failed to join %s:%d, return code %d\r\n", discovery_group, discovery_port, rc);
+    return rc;
+  }
+
+  // 3. Add the sockets, a report timer and SIGINT/SIGTERM to an epoll set
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+
+  memset(&interval, 0, sizeof(interval));
+  interval.it_value.tv_sec = REPORT_INTERVAL_US / 1000000;
+  interval.it_interval.tv_sec = REPORT_INTERVAL_US / 1000000;
+
+  if (sigprocmask(SIG_BLOCK, &signals, NULL) != 0
+      || (emulator->signal_fd = signalfd(-1, &signals, SFD_CLOEXEC)) < 0
+      || (emulator->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0
+      || timerfd_settime(emulator->timer_fd, 0, &interval, NULL) != 0
+      || (emulator->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+  {
+    printf("Failed to create the event loop, errno %d\r\n", errno);
+    return -1;
+  }
+
+  event.events = EPOLLIN;
+  event.data.fd = emulator->sock;
+  rc = epoll_ctl(emulator->epoll_fd, EPOLL_CTL_ADD, emulator->sock, &event);
+  event.data.fd = emulator->timer_fd;
+  rc = rc != 0 ? rc : epoll_ctl(emulator->epoll_fd, EPOLL_CTL_ADD, emulator->timer_fd, &event);
+  event.data.fd = emulator->signal_fd;
+  rc = rc != 0 ? rc : epoll_ctl(emulator->epoll_fd, EPOLL_CTL_ADD, emulator->signal_fd, &event);
+  if (emulator->multicast_sock >= 0)
+  {
+    event.data.fd = emulator->multicast_sock;
+    rc = rc != 0 ? rc
+                 : epoll_ctl(emulator->epoll_fd, EPOLL_CTL_ADD, emulator->multicast_sock, &event);
+  }
+  if (rc != 0)
+  {
+    printf("epoll_ctl failed, errno %d\r\n", errno);
+    return -1;
+  }
+
+  printf(
+      "MQTT-SN Gateway emulator listening on UDP port %d%s\r\n",
+      emulator->gateway_port,
+      emulator->reuse_port ? ", shared with SO_REUSEPORT" : "");
+  if (emulator->multicast_sock >= 0)
+  {
+    printf(
+        "Gateway ID %d answering SEARCHGW on %s:%d\r\n",
+        emulator->gateway_id,
+        discovery_group,
+        discovery_port);
+  }
+  return 0;
+}
+
+/*
+ * Drain the socket with recvmmsg batches, answering each batch with one sendmmsg call
+ */
+static int receive_datagrams(GATEWAY_EMULATOR* emulator)
+{
+  int rc = 0;
+
+  for (int i = 0; i < MAX_BATCHES_PER_WAKEUP; i++)
+  {
+    uint64_t now_us;
+    unsigned char* buf;
+    int len;
+    struct sockaddr_storage from;
+    socklen_t from_len;
+
+    if ((rc = transport_batch_receive(
+             &emulator->receive_batch, emulator->sock, 0, &emulator->wire_stats))
+        <= 0)
+    {
+      break;
+    }
+
+    emulator->receive_calls++;
+    now_us = time_util_now_us();
+    while ((len = transport_batch_next_from(&emulator->receive_batch, &buf, &from, &from_len))
+           > 0)
+    {
+      handle_datagram(emulator, buf, len, &from, from_len, now_us);
+    }
+
+    if ((rc = transport_batch_flush(&emulator->send_batch)) < 0)
+    {
+      break;
+    }
+  }
+
+  return rc < 0 ? rc : 0;
+}
+
+static void report_interval(GATEWAY_EMULATOR* emulator, uint64_t now_us)
+{
+  if (emulator->interval.datagrams > 0)
+  {
+    printf(
+        "[%5.1fs] clients = %d, datagrams/s = %llu, PUBLISH/s = %llu, bytes/s = %llu, payload "
+        "bytes/s = %llu\r\n",
+        (double)(now_us - emulator->start_us) / 1e6,
+        emulator->client_count,
+        (unsigned long long)emulator->interval.datagrams,
+        (unsigned long long)emulator->interval.publishes,
+        (unsigned long long)emulator->interval.bytes,
+        (unsigned long long)emulator->interval.payload_bytes);
+  }
+
+  if (emulator->interval.publishes > emulator->peak_publishes_per_s)
+  {
+    emulator->peak_publishes_per_s = emulator->interval.publishes;
+  }
+
+  memset(&emulator->interval, 0, sizeof(emulator->interval));
+}
+
+/*
+ * 1. Wait on epoll for datagrams, the report timer or a termination signal
+ * 2. Answer received datagrams and SEARCHGW
+ * 3. Print the receive rates once per second, ADVERTISE when due and stop after the configured
+ *    duration
+ */
+static int run_gateway_emulator(GATEWAY_EMULATOR* emulator)
+{
+  struct epoll_event events[EPOLL_MAX_EVENTS];
+  int running = 1;
+
+  emulator->start_us = time_util_now_us();
+  advertise(emulator, emulator->start_us);
+
+  while (running)
+  {
+    int count;
+
+    // 1. Wait on epoll for datagrams, the report timer or a termination signal
+    if ((count = epoll_wait(emulator->epoll_fd, events, EPOLL_MAX_EVENTS, -1)) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      printf("epoll_wait failed, errno %d\r\n", errno);
+      return -1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+      int fd = events[i].data.fd;
+
+      // 2. Answer received datagrams and SEARCHGW
+      if (fd == emulator->sock)
+      {
+        if (receive_datagrams(emulator) != 0)
+        {
+          return -1;
+        }
+      }
+      else if (fd == emulator->multicast_sock)
+      {
+        if (receive_discovery(emulator) < 0)
+        {
+          return -1;
+        }
+      }
+      // 3. Print the receive rates once per second, ADVERTISE when due and stop after the
+      //    configured duration
+      else if (fd == emulator->timer_fd)
+      {
+        uint64_t expirations;
+        uint64_t now_us = time_util_now_us();
+
+        if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        {
+          report_interval(emulator, now_us);
+        }
+
+        advertise(emulator, now_us);
+
+        if (emulator->duration_s > 0
+            && now_us - emulator->start_us >= (uint64_t)emulator->duration_s * 1000000)
+        {
+          running = 0;
+        }
+      }
+      else if (fd == emulator->signal_fd)
+      {
+        struct signalfd_siginfo info;
+
+        if (read(fd, &info, sizeof(info)) == sizeof(info))
+        {
+          printf("Received signal %u, stopping\r\n", info.ssi_signo);
+        }
+        running = 0;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Print totals, receive rates and wire statistics
+ */
+static void report_gateway_emulator(GATEWAY_EMULATOR* emulator)
+{
+  int connected = 0;
+  int asleep = 0;
+  double publish_seconds
+      = (double)(emulator->last_publish_us - emulator->first_publish_us) / 1e6;
+
+  for (int i = 0; i < emulator->client_capacity; i++)
+  {
+    connected += emulator->clients[i].in_use && emulator->clients[i].connected;
+    asleep += emulator->clients[i].in_use && emulator->clients[i].asleep;
+  }
+
+  printf(
+      "Clients: %d, still connected: %d (asleep: %d), registered topics: %d\r\n",
+      emulator->client_count,
+      connected,
+      asleep,
+      emulator->topic_count);
+  printf(
+      "QoS -1 PUBLISH = %llu, sleeps = %llu, wake-ups = %llu\r\n",
+      (unsigned long long)emulator->connectionless_publishes,
+      (unsigned long long)emulator->sleeps,
+      (unsigned long long)emulator->wakeups);
+  printf(
+      "SEARCHGW answered = %llu, ADVERTISE sent = %llu\r\n",
+      (unsigned long long)emulator->searches,
+      (unsigned long long)emulator->advertises);
+  printf(
+      "Total datagrams = %llu, bytes = %llu, datagrams per receive call = %.2f\r\n",
+      (unsigned long long)emulator->total.datagrams,
+      (unsigned long long)emulator->total.bytes,
+      emulator->receive_calls > 0
+          ? (double)emulator->total.datagrams / (double)emulator->receive_calls
+          : 0.0);
+  printf(
+      "Total PUBLISH = %llu, payload bytes = %llu, duplicates = %llu, rejected = %llu, malformed "
+      "= %llu\r\n",
+      (unsigned long long)emulator->total.publishes,
+      (unsigned long long)emulator->total.payload_bytes,
+      (unsigned long long)emulator->duplicates,
+      (unsigned long long)emulator->rejected_publishes,
+      (unsigned long long)emulator->malformed);
+  printf(
+      "Receive rate = %.1f PUBLISH/s over %.2f s, peak = %llu PUBLISH/s\r\n",
+      publish_seconds > 0 ? (double)emulator->total.publishes / publish_seconds : 0.0,
+      publish_seconds,
+      (unsigned long long)emulator->peak_publishes_per_s);
+  printf("Wire statistics:\r\n");
+  wire_stats_print_json(&emulator->wire_stats, stdout);
+}
+
+static void close_gateway_emulator(GATEWAY_EMULATOR* emulator)
+{
+  if (emulator->sock >= 0)
+  {
+    transport_socket_close(emulator->sock);
+  }
+
+  if (emulator->multicast_sock >= 0)
+  {
+    transport_socket_close(emulator->multicast_sock);
+  }
+
+  if (emulator->epoll_fd >= 0)
+  {
+    close(emulator->epoll_fd);
+  }
+
+  if (emulator->timer_fd >= 0)
+  {
+    close(emulator->timer_fd);
+  }
+
+  if (emulator->signal_fd >= 0)
+  {
+    close(emulator->signal_fd);
+  }
+
+  for (int i = 0; i < emulator->topic_count; i++)
+  {
+    free(emulator->topic_names[i]);
+  }
+
+  free(emulator->topic_names);
+  free(emulator->topic_index);
+  free(emulator->clients);
+  predefined_topics_deinit(&emulator->predefined_topics);
+}
+
+/*
+ * 1. Open the Gateway socket and event loop
+ * 2. Serve clients until the duration elapses or the process is interrupted
+ * 3. Report receive rates
+ */
+int main(int argc, char** argv)
+{
+  int rc;
+  static GATEWAY_EMULATOR emulator;
+
+  if ((rc = init_gateway_emulator(&emulator)) != 0)
+  {
+    printf("init_gateway_emulator failed, return code %d\r\n", rc);
+  }
+  else if ((rc = run_gateway_emulator(&emulator)) != 0)
+  {
+    printf("run_gateway_emulator failed, return code %d\r\n", rc);
+  }
+  else
+  {
+    report_gateway_emulator(&emulator);
+  }
+
+  close_gateway_emulator(&emulator);
+
+  return rc;
+}
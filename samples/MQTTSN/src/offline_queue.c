@@ -0,0 +1,318 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "offline_queue.h"
+
+#define RECORD_ALIGNMENT 8
+#define WRAP_MARKER 0xFFFFFFFFu // the rest of the record space is unused, continue at offset 0
+#define MIN_CAPACITY 1024
+
+/*
+ * Every record starts aligned, with its length and a checksum that exposes a record the kernel
+ * did not finish writing back before a power loss
+ */
+typedef struct offline_queue_record_tag
+{
+  uint32_t length;
+  uint32_t checksum;
+} OFFLINE_QUEUE_RECORD;
+
+static uint32_t get_checksum(const unsigned char* data, uint32_t len)
+{
+  uint32_t hash = (2166136261u ^ len) * 16777619u;
+
+  for (uint32_t i = 0; i < len; i++)
+  {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+
+  return hash;
+}
+
+static uint64_t get_record_size(uint32_t len)
+{
+  uint64_t size = sizeof(OFFLINE_QUEUE_RECORD) + (uint64_t)len;
+
+  return (size + RECORD_ALIGNMENT - 1) & ~(uint64_t)(RECORD_ALIGNMENT - 1);
+}
+
+static OFFLINE_QUEUE_RECORD* get_record(const OFFLINE_QUEUE* queue, uint64_t position)
+{
+  return (OFFLINE_QUEUE_RECORD*)(queue->records + position % queue->header->capacity);
+}
+
+/*
+ * Return the position after the record at position, or the start of the next lap after a wrap
+ * marker. Set *is_record for a record.
+ */
+static uint64_t get_next_position(const OFFLINE_QUEUE* queue, uint64_t position, int* is_record)
+{
+  OFFLINE_QUEUE_RECORD* record = get_record(queue, position);
+  uint64_t capacity = queue->header->capacity;
+
+  *is_record = record->length != WRAP_MARKER;
+  return *is_record ? position + get_record_size(record->length)
+                    : position + capacity - position % capacity;
+}
+
+/*
+ * Check every record between head and tail and cut the queue at the first corrupt one
+ */
+static void recover(OFFLINE_QUEUE* queue)
+{
+  OFFLINE_QUEUE_HEADER* header = queue->header;
+  uint64_t position = header->head;
+  uint64_t count = 0;
+
+  while (position < header->tail)
+  {
+    OFFLINE_QUEUE_RECORD* record = get_record(queue, position);
+    int is_record;
+
+    if (record->length != WRAP_MARKER
+        && (position % header->capacity + get_record_size(record->length) > header->capacity
+            || record->checksum
+                != get_checksum((unsigned char*)(record + 1), record->length)))
+    {
+      break;
+    }
+
+    position = get_next_position(queue, position, &is_record);
+    count += (uint64_t)is_record;
+  }
+
+  header->tail = position < header->tail ? position : header->tail;
+  header->appended = header->committed + count;
+  queue->recovered = count;
+}
+
+/*
+ * 1. Size the mapping: the header and the record space, a multiple of the record alignment
+ * 2. Map the file shared, or anonymous memory without a path
+ * 3. Start a new queue unless the file holds one of this version and capacity
+ * 4. Recover the records that were not acknowledged before the previous run ended
+ */
+int offline_queue_open(OFFLINE_QUEUE* queue, const char* path, size_t size, int max_depth)
+{
+  struct stat st;
+  void* map;
+  uint64_t capacity;
+
+  memset((void*)queue, 0, sizeof(OFFLINE_QUEUE));
+  queue->fd = -1;
+  queue->max_depth = max_depth;
+
+  // 1. Size the mapping: the header and the record space, a multiple of the record alignment
+  if (size < sizeof(OFFLINE_QUEUE_HEADER) + MIN_CAPACITY || max_depth <= 0)
+  {
+    printf(
+        "Invalid offline queue size %zu bytes or depth %d, the minimum size is %zu bytes\r\n",
+        size,
+        max_depth,
+        sizeof(OFFLINE_QUEUE_HEADER) + MIN_CAPACITY);
+    return -1;
+  }
+
+  capacity = (size - sizeof(OFFLINE_QUEUE_HEADER)) & ~(uint64_t)(RECORD_ALIGNMENT - 1);
+  queue->map_size = sizeof(OFFLINE_QUEUE_HEADER) + capacity;
+
+  // 2. Map the file shared, or anonymous memory without a path
+  if (path != NULL && path[0] != '\0')
+  {
+    if ((queue->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0
+        || fstat(queue->fd, &st) != 0
+        || (st.st_size != (off_t)queue->map_size
+            && ftruncate(queue->fd, (off_t)queue->map_size) != 0))
+    {
+      printf("Failed to open offline queue %s, errno %d\r\n", path, errno);
+      offline_queue_close(queue);
+      return -1;
+    }
+
+    map = mmap(NULL, queue->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, queue->fd, 0);
+  }
+  else
+  {
+    map = mmap(
+        NULL, queue->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+
+  if (map == MAP_FAILED)
+  {
+    printf("Failed to map offline queue, errno %d\r\n", errno);
+    offline_queue_close(queue);
+    return -1;
+  }
+
+  queue->header = (OFFLINE_QUEUE_HEADER*)map;
+  queue->records = (unsigned char*)map + sizeof(OFFLINE_QUEUE_HEADER);
+
+  // 3. Start a new queue unless the file holds one of this version and capacity
+  if (queue->header->magic != OFFLINE_QUEUE_MAGIC
+      || queue->header->version != OFFLINE_QUEUE_VERSION
+      || queue->header->capacity != capacity || queue->header->head > queue->header->tail)
+  {
+    memset((void*)queue->header, 0, sizeof(OFFLINE_QUEUE_HEADER));
+    queue->header->magic = OFFLINE_QUEUE_MAGIC;
+    queue->header->version = OFFLINE_QUEUE_VERSION;
+    queue->header->capacity = capacity;
+  }
+
+  // 4. Recover the records that were not acknowledged before the previous run ended
+  recover(queue);
+  queue->send_position = queue->header->head;
+  queue->peak_depth = offline_queue_depth(queue);
+
+  return 0;
+}
+
+void offline_queue_close(OFFLINE_QUEUE* queue)
+{
+  if (queue->header != NULL)
+  {
+    munmap((void*)queue->header, queue->map_size);
+    queue->header = NULL;
+  }
+
+  if (queue->fd >= 0)
+  {
+    close(queue->fd);
+    queue->fd = -1;
+  }
+}
+
+/*
+ * Producer: copy the message to the tail and publish it with a release store, so the consumer
+ * never sees a partial record. Never blocks.
+ * Return 0 on success, OFFLINE_QUEUE_FULL when the message was dropped, <0 when it can never fit
+ */
+int offline_queue_append(OFFLINE_QUEUE* queue, const unsigned char* data, int len)
+{
+  OFFLINE_QUEUE_HEADER* header = queue->header;
+  uint64_t capacity = header->capacity;
+  uint64_t tail = header->tail;
+  uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+  uint64_t record_size = get_record_size((uint32_t)len);
+  uint64_t offset = tail % capacity;
+  uint64_t wrap = offset + record_size > capacity ? capacity - offset : 0;
+  OFFLINE_QUEUE_RECORD* record;
+  int depth;
+
+  if (len < 0 || record_size > capacity / 2)
+  {
+    return -1;
+  }
+
+  if (offline_queue_depth(queue) >= queue->max_depth || tail + wrap + record_size - head > capacity)
+  {
+    queue->dropped++;
+    return OFFLINE_QUEUE_FULL;
+  }
+
+  // A record never straddles the end of the record space
+  if (wrap > 0)
+  {
+    get_record(queue, tail)->length = WRAP_MARKER;
+    tail += wrap;
+  }
+
+  record = get_record(queue, tail);
+  memcpy((void*)(record + 1), data, (size_t)len);
+  record->length = (uint32_t)len;
+  record->checksum = get_checksum(data, (uint32_t)len);
+
+  __atomic_store_n(&header->tail, tail + record_size, __ATOMIC_RELEASE);
+  __atomic_store_n(&header->appended, header->appended + 1, __ATOMIC_RELEASE);
+
+  if ((depth = offline_queue_depth(queue)) > queue->peak_depth)
+  {
+    queue->peak_depth = depth;
+  }
+
+  return 0;
+}
+
+/*
+ * Consumer: return the length of the next record to send and its position, 0 if every record was
+ * sent. The record stays in the queue until it is committed.
+ */
+int offline_queue_peek(OFFLINE_QUEUE* queue, unsigned char** data, uint64_t* position)
+{
+  uint64_t tail = __atomic_load_n(&queue->header->tail, __ATOMIC_ACQUIRE);
+
+  while (queue->send_position < tail)
+  {
+    OFFLINE_QUEUE_RECORD* record = get_record(queue, queue->send_position);
+    int is_record;
+    uint64_t next = get_next_position(queue, queue->send_position, &is_record);
+
+    if (is_record)
+    {
+      *data = (unsigned char*)(record + 1);
+      *position = queue->send_position;
+      return (int)record->length;
+    }
+
+    queue->send_position = next;
+  }
+
+  return 0;
+}
+
+/*
+ * Consumer: the record returned by offline_queue_peek() was handed to the client
+ */
+void offline_queue_advance(OFFLINE_QUEUE* queue)
+{
+  int is_record;
+
+  queue->send_position = get_next_position(queue, queue->send_position, &is_record);
+}
+
+/*
+ * Consumer: every record before position was acknowledged (or given up on), release its space
+ */
+void offline_queue_commit(OFFLINE_QUEUE* queue, uint64_t position)
+{
+  OFFLINE_QUEUE_HEADER* header = queue->header;
+  uint64_t head = header->head;
+  uint64_t committed = header->committed;
+
+  if (position > queue->send_position)
+  {
+    position = queue->send_position;
+  }
+
+  while (head < position)
+  {
+    int is_record;
+
+    head = get_next_position(queue, head, &is_record);
+    committed += (uint64_t)is_record;
+  }
+
+  __atomic_store_n(&header->committed, committed, __ATOMIC_RELEASE);
+  __atomic_store_n(&header->head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Return the number of records not acknowledged yet, sent or not
+ */
+int offline_queue_depth(const OFFLINE_QUEUE* queue)
+{
+  return (int)(__atomic_load_n(&queue->header->appended, __ATOMIC_ACQUIRE)
+               - __atomic_load_n(&queue->header->committed, __ATOMIC_ACQUIRE));
+}
+
+int offline_queue_has_unsent(const OFFLINE_QUEUE* queue)
+{
+  return queue->send_position < __atomic_load_n(&queue->header->tail, __ATOMIC_ACQUIRE);
+}
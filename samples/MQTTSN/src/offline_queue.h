@@ -0,0 +1,67 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef OFFLINE_QUEUE_H
+#define OFFLINE_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OFFLINE_QUEUE_MAGIC 0x4D534E51 // "MSNQ"
+#define OFFLINE_QUEUE_VERSION 1
+
+// offline_queue_append dropped the record: the queue is at its depth or byte limit
+#define OFFLINE_QUEUE_FULL 1
+
+#define OFFLINE_QUEUE_CACHE_LINE 64
+
+/*
+ * Header at the start of the queue file. Positions are byte offsets that only grow, the record
+ * space wraps at position % capacity. The producer and consumer fields sit on separate cache
+ * lines because each side only writes its own.
+ */
+typedef struct offline_queue_header_tag
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity; // bytes of record space after the header
+  unsigned char pad0[OFFLINE_QUEUE_CACHE_LINE - 16];
+  // Written by the producer
+  uint64_t tail; // end of the last complete record
+  uint64_t appended; // records
+  unsigned char pad1[OFFLINE_QUEUE_CACHE_LINE - 16];
+  // Written by the consumer
+  uint64_t head; // start of the oldest record not yet acknowledged
+  uint64_t committed; // records
+  unsigned char pad2[OFFLINE_QUEUE_CACHE_LINE - 16];
+} OFFLINE_QUEUE_HEADER;
+
+/*
+ * Store-and-forward queue of telemetry messages in a memory-mapped ring, for one producer and one
+ * consumer. Appending never blocks: when the queue is full the new message is dropped and counted.
+ * The consumer sends records from a cursor and commits them only once they were acknowledged, so
+ * after a crash or a restart every record that was not acknowledged is sent again.
+ */
+typedef struct offline_queue_tag
+{
+  int fd; // -1 for a queue in anonymous memory
+  OFFLINE_QUEUE_HEADER* header;
+  unsigned char* records;
+  size_t map_size;
+  int max_depth;
+  uint64_t send_position; // next record to send, between head and tail
+  uint64_t recovered; // records found in the file when it was opened
+  uint64_t dropped;
+  int peak_depth;
+} OFFLINE_QUEUE;
+
+int offline_queue_open(OFFLINE_QUEUE* queue, const char* path, size_t size, int max_depth);
+void offline_queue_close(OFFLINE_QUEUE* queue);
+int offline_queue_append(OFFLINE_QUEUE* queue, const unsigned char* data, int len);
+int offline_queue_peek(OFFLINE_QUEUE* queue, unsigned char** data, uint64_t* position);
+void offline_queue_advance(OFFLINE_QUEUE* queue);
+void offline_queue_commit(OFFLINE_QUEUE* queue, uint64_t position);
+int offline_queue_depth(const OFFLINE_QUEUE* queue);
+int offline_queue_has_unsent(const OFFLINE_QUEUE* queue);
+
+#endif // OFFLINE_QUEUE_H
@@ -0,0 +1,988 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE // pthread_setaffinity_np
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "azure/iot/az_iot_hub_client.h"
+#include "event_log.h"
+#include "latency_histogram.h"
+#include "mqttsn_client.h"
+#include "predefined_topics.h"
+#include "time_util.h"
+#include "transport_capture.h"
+
+// DO NOT MODIFY: IoT Hub Hostname Environment Variable Name
+#define ENV_IOT_HUB_HOSTNAME "AZ_IOT_HUB_HOSTNAME"
+
+// DO NOT MODIFY: MQTTSN Gateway IP Address Environment Variable Name
+#define ENV_MQTTSN_GATEWAY_ADDRESS "MQTTSN_GATEWAY_ADDRESS"
+
+// DO NOT MODIFY: MQTTSN Gateway gateway_port Environment Variable Name
+#define ENV_MQTTSN_GATEWAY_PORT "MQTTSN_GATEWAY_PORT"
+
+// DO NOT MODIFY: Fleet configuration Environment Variable Names
+#define ENV_FLEET_DEVICE_COUNT "FLEET_DEVICE_COUNT"
+#define ENV_FLEET_DEVICE_ID_PREFIX "FLEET_DEVICE_ID_PREFIX"
+#define ENV_FLEET_SRC_PORT_BASE "FLEET_SRC_PORT_BASE"
+#define ENV_FLEET_CONNECT_RATE "FLEET_CONNECT_RATE"
+#define ENV_FLEET_REPORT_FILE "FLEET_REPORT_FILE"
+#define ENV_FLEET_THREADS "FLEET_THREADS"
+#define ENV_FLEET_PIN_THREADS "FLEET_PIN_THREADS"
+
+// DO NOT MODIFY: Number of unacknowledged QoS 1 PUBLISH packets allowed in flight per device
+#define ENV_MQTTSN_SEND_WINDOW "MQTTSN_SEND_WINDOW"
+
+// DO NOT MODIFY: Topic ID mapping file shared with the Gateway, empty to REGISTER the topics
+#define ENV_MQTTSN_PREDEFINED_TOPIC_FILE "MQTTSN_PREDEFINED_TOPIC_FILE"
+
+#define DEFAULT_GATEWAY_ADDRESS "127.0.0.1"
+#define DEFAULT_GATEWAY_PORT "10000"
+#define DEFAULT_FLEET_DEVICE_COUNT "1000"
+#define DEFAULT_FLEET_DEVICE_ID_PREFIX "fleet-device-"
+#define DEFAULT_FLEET_SRC_PORT_BASE "0" // 0 = one ephemeral source port per device
+#define DEFAULT_FLEET_CONNECT_RATE "1000" // CONNECTs started per second across the fleet
+#define DEFAULT_FLEET_THREADS "1" // 0 = one worker thread per CPU the process may run on
+#define DEFAULT_FLEET_PIN_THREADS "1"
+#define DEFAULT_SEND_WINDOW "1"
+#define TELEMETRY_SEND_INTERVAL_MS 1000
+#define NUMBER_OF_MESSAGES 100
+#define TELEMETRY_PAYLOAD \
+  "{\"d\":{\"myName\":\"IoT mbed\",\"accelX\":12,\"accelY\":4,\"accelZ\":12,\"temp\":18}}"
+#define MAX_RETRY_ATTEMPTS 5
+#define EPOLL_MAX_EVENTS 256
+#define REPORT_INTERVAL_US 1000000
+#define REPORT_POLL_US 10000 // how often the reporting thread checks whether the workers are done
+#define CACHE_LINE_SIZE 64
+
+#if defined(AZ_TELEMETRY_QOS_0) || defined(AZ_TELEMETRY_QOS_MINUS_1)
+#undef ENABLE_PUBACK // default to qos 1 and enable puback if QoS 1
+#else
+#define ENABLE_PUBACK
+#endif
+
+typedef enum
+{
+  FLEET_DEVICE_IDLE,
+  FLEET_DEVICE_RUNNING,
+  FLEET_DEVICE_DONE,
+  FLEET_DEVICE_FAILED
+} FLEET_DEVICE_STATE;
+
+struct fleet_context_tag;
+
+/*
+ * Everything a simulated device needs: its own hub client, MQTTSN client (socket, buffer, send
+ * window and timers) and publish schedule. worker is the index of the worker that owns it, and
+ * heap_index its position in the timer heap of that worker.
+ */
+typedef struct fleet_device_tag
+{
+  char device_id[64];
+  char topic_name[128];
+  unsigned short predefined_topic_id;
+  az_iot_hub_client client;
+  MQTTSN_CLIENT mqttsn_client;
+  FLEET_DEVICE_STATE state;
+  int messages_sent;
+  int worker;
+  int heap_index;
+  uint64_t deadline_us;
+  uint64_t next_publish_us;
+} FLEET_DEVICE;
+
+/*
+ * One worker thread and the contiguous shard of devices it owns, with its own epoll set, timer
+ * heap and statistics. Only the worker writes them, so devices are driven without locks; the
+ * counters the reporting thread reads while the worker runs are relaxed atomics. Workers are cache
+ * line aligned so that their counters never share a line.
+ */
+typedef struct fleet_worker_tag
+{
+  _Alignas(CACHE_LINE_SIZE) struct fleet_context_tag* fleet;
+  int index;
+  int cpu; // -1 when not pinned
+  int first_device;
+  int device_count;
+  int active_devices; // atomic
+  int epoll_fd;
+  int* timer_heap; // device indices
+  pthread_t thread;
+  int started;
+  int rc;
+  uint64_t publish_count; // atomic
+  uint64_t pubacks; // atomic copy of puback_latency.count
+  uint64_t first_publish_us;
+  uint64_t last_publish_us;
+  LATENCY_HISTOGRAM puback_latency;
+  LATENCY_HISTOGRAM recovery_time;
+  WIRE_STATS wire_stats;
+} FLEET_WORKER;
+
+typedef struct fleet_context_tag
+{
+  char iot_hub_hostname[128];
+  char gateway_address[64];
+  char device_id_prefix[32];
+  int gateway_port;
+  int src_port_base;
+  int connect_rate;
+  int send_window_size;
+  int device_count;
+  int thread_count;
+  int pin_threads;
+  FLEET_DEVICE* devices;
+  FLEET_WORKER* workers;
+  // Merged from the workers once they are done
+  uint64_t publish_count;
+  uint64_t first_publish_us;
+  uint64_t last_publish_us;
+  PREDEFINED_TOPICS predefined_topics;
+  LATENCY_HISTOGRAM puback_latency;
+  LATENCY_HISTOGRAM recovery_time;
+  WIRE_STATS wire_stats;
+  TRANSPORT_IMPAIRMENT_CONFIG impairment;
+  int impaired;
+} FLEET_CONTEXT;
+
+/*
+ * Read an OS environment variable, falling back to the default value
+ */
+static const char* read_configuration_entry(const char* env_name, const char* default_value)
+{
+  char* env = getenv(env_name);
+  const char* value = env != NULL ? env : default_value;
+
+  printf("%s = %s\r\n", env_name, value != NULL ? value : "(missing)");
+  return value;
+}
+
+static int copy_configuration_entry(
+    const char* env_name,
+    const char* default_value,
+    char* out,
+    size_t size)
+{
+  const char* value = read_configuration_entry(env_name, default_value);
+
+  if (value == NULL || strlen(value) >= size)
+  {
+    printf("Invalid value for %s, please set the environment variable.\r\n", env_name);
+    return -1;
+  }
+
+  strcpy(out, value);
+  return 0;
+}
+
+/*
+ * Timer heap: a binary min-heap per worker of device indices ordered by deadline, so the event loop
+ * finds the next expiring device in O(1) and reschedules in O(log n) regardless of the fleet size.
+ */
+static void timer_heap_swap(FLEET_WORKER* worker, int a, int b)
+{
+  FLEET_DEVICE* devices = worker->fleet->devices;
+  int tmp = worker->timer_heap[a];
+
+  worker->timer_heap[a] = worker->timer_heap[b];
+  worker->timer_heap[b] = tmp;
+  devices[worker->timer_heap[a]].heap_index = a;
+  devices[worker->timer_heap[b]].heap_index = b;
+}
+
+static uint64_t timer_heap_key(FLEET_WORKER* worker, int position)
+{
+  return worker->fleet->devices[worker->timer_heap[position]].deadline_us;
+}
+
+static void timer_heap_fix(FLEET_WORKER* worker, int position)
+{
+  while (position > 0)
+  {
+    int parent = (position - 1) / 2;
+
+    if (timer_heap_key(worker, parent) <= timer_heap_key(worker, position))
+    {
+      break;
+    }
+
+    timer_heap_swap(worker, position, parent);
+    position = parent;
+  }
+
+  for (;;)
+  {
+    int smallest = position;
+    int left = 2 * position + 1;
+    int right = left + 1;
+
+    if (left < worker->device_count
+        && timer_heap_key(worker, left) < timer_heap_key(worker, smallest))
+    {
+      smallest = left;
+    }
+    if (right < worker->device_count
+        && timer_heap_key(worker, right) < timer_heap_key(worker, smallest))
+    {
+      smallest = right;
+    }
+    if (smallest == position)
+    {
+      break;
+    }
+
+    timer_heap_swap(worker, position, smallest);
+    position = smallest;
+  }
+}
+
+static void schedule_device(FLEET_WORKER* worker, FLEET_DEVICE* device, uint64_t deadline_us)
+{
+  device->deadline_us = deadline_us;
+  timer_heap_fix(worker, device->heap_index);
+}
+
+/*
+ * 1. Read the fleet configuration, the predefined topic ID mapping file, the optional
+ *    simulated network impairment, the event log and the capture configuration
+ * 2. Initialize one az_iot_hub_client, telemetry topic and predefined topic ID per device
+ */
+static int init_fleet_context(FLEET_CONTEXT* fleet)
+{
+  int rc;
+  const char* topic_file;
+  EVENT_LOG_CONFIG event_log;
+  TRANSPORT_CAPTURE_CONFIG capture;
+
+  memset((void*)fleet, 0, sizeof(FLEET_CONTEXT));
+  latency_histogram_init(&fleet->puback_latency);
+  latency_histogram_init(&fleet->recovery_time);
+  wire_stats_init(&fleet->wire_stats);
+
+  // 1. Read the fleet configuration, the predefined topic ID mapping file, the optional
+  //    simulated network impairment, the event log and the capture configuration
+  if (copy_configuration_entry(
+          ENV_MQTTSN_GATEWAY_ADDRESS,
+          DEFAULT_GATEWAY_ADDRESS,
+          fleet->gateway_address,
+          sizeof(fleet->gateway_address))
+          != 0
+      || copy_configuration_entry(
+             ENV_IOT_HUB_HOSTNAME, "", fleet->iot_hub_hostname, sizeof(fleet->iot_hub_hostname))
+          != 0
+      || copy_configuration_entry(
+             ENV_FLEET_DEVICE_ID_PREFIX,
+             DEFAULT_FLEET_DEVICE_ID_PREFIX,
+             fleet->device_id_prefix,
+             sizeof(fleet->device_id_prefix))
+          != 0)
+  {
+    return -1;
+  }
+
+  fleet->gateway_port
+      = atoi(read_configuration_entry(ENV_MQTTSN_GATEWAY_PORT, DEFAULT_GATEWAY_PORT));
+  fleet->device_count
+      = atoi(read_configuration_entry(ENV_FLEET_DEVICE_COUNT, DEFAULT_FLEET_DEVICE_COUNT));
+  fleet->src_port_base
+      = atoi(read_configuration_entry(ENV_FLEET_SRC_PORT_BASE, DEFAULT_FLEET_SRC_PORT_BASE));
+  fleet->connect_rate
+      = atoi(read_configuration_entry(ENV_FLEET_CONNECT_RATE, DEFAULT_FLEET_CONNECT_RATE));
+  fleet->send_window_size
+      = atoi(read_configuration_entry(ENV_MQTTSN_SEND_WINDOW, DEFAULT_SEND_WINDOW));
+  fleet->thread_count = atoi(read_configuration_entry(ENV_FLEET_THREADS, DEFAULT_FLEET_THREADS));
+  fleet->pin_threads
+      = atoi(read_configuration_entry(ENV_FLEET_PIN_THREADS, DEFAULT_FLEET_PIN_THREADS));
+
+  topic_file = read_configuration_entry(ENV_MQTTSN_PREDEFINED_TOPIC_FILE, "");
+
+  if (fleet->device_count <= 0 || fleet->connect_rate <= 0 || fleet->thread_count < 0)
+  {
+    printf("Device count and connect rate must be positive, thread count must not be negative\r\n");
+    return -1;
+  }
+
+  if (topic_file[0] != '\0' && predefined_topics_load(&fleet->predefined_topics, topic_file) != 0)
+  {
+    return -1;
+  }
+
+  if ((fleet->impaired = transport_impairment_read_configuration(&fleet->impairment)) < 0
+      || event_log_read_configuration(&event_log) != 0 || event_log_open(&event_log) != 0
+      || transport_capture_read_configuration(&capture) != 0
+      || transport_capture_open(&capture) != 0)
+  {
+    return -1;
+  }
+
+  fleet->devices = calloc((size_t)fleet->device_count, sizeof(FLEET_DEVICE));
+  if (fleet->devices == NULL)
+  {
+    printf("Failed to allocate %d devices\r\n", fleet->device_count);
+    return -1;
+  }
+
+  // 2. Initialize one az_iot_hub_client, telemetry topic and predefined topic ID per device
+  for (int i = 0; i < fleet->device_count; i++)
+  {
+    FLEET_DEVICE* device = &fleet->devices[i];
+    size_t topic_len;
+
+    snprintf(device->device_id, sizeof(device->device_id), "%s%d", fleet->device_id_prefix, i);
+    device->mqttsn_client.transport.sock = -1;
+
+    if (az_failed(
+            rc = az_iot_hub_client_init(
+                &device->client,
+                az_span_from_str(fleet->iot_hub_hostname),
+                az_span_from_str(device->device_id),
+                NULL)))
+    {
+      printf("Failed to initialize client for %s, return code %d\r\n", device->device_id, rc);
+      return rc;
+    }
+
+    if (az_failed(
+            rc = az_iot_hub_client_telemetry_get_publish_topic(
+                &device->client,
+                NULL,
+                device->topic_name,
+                sizeof(device->topic_name),
+                &topic_len)))
+    {
+      printf("Failed to get publish topic for %s, return code %d\r\n", device->device_id, rc);
+      return rc;
+    }
+
+    device->predefined_topic_id = predefined_topics_lookup(
+        &fleet->predefined_topics, device->device_id, device->topic_name);
+  }
+
+  return 0;
+}
+
+/*
+ * Split the devices into one contiguous shard per worker, and pick the CPU each worker is pinned
+ * to among the CPUs the process may run on
+ */
+static int create_fleet_workers(FLEET_CONTEXT* fleet)
+{
+  cpu_set_t allowed;
+  int cpus[CPU_SETSIZE];
+  int cpu_count = 0;
+
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+  {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+      if (CPU_ISSET(cpu, &allowed))
+      {
+        cpus[cpu_count++] = cpu;
+      }
+    }
+  }
+
+  if (fleet->thread_count == 0)
+  {
+    fleet->thread_count = cpu_count > 0 ? cpu_count : 1;
+  }
+
+  if (fleet->thread_count > fleet->device_count)
+  {
+    fleet->thread_count = fleet->device_count;
+  }
+
+  if ((fleet->workers = aligned_alloc(
+           CACHE_LINE_SIZE, (size_t)fleet->thread_count * sizeof(FLEET_WORKER)))
+      == NULL)
+  {
+    printf("Failed to allocate %d workers\r\n", fleet->thread_count);
+    return -1;
+  }
+
+  memset((void*)fleet->workers, 0, (size_t)fleet->thread_count * sizeof(FLEET_WORKER));
+  for (int w = 0; w < fleet->thread_count; w++)
+  {
+    FLEET_WORKER* worker = &fleet->workers[w];
+
+    worker->fleet = fleet;
+    worker->index = w;
+    worker->cpu = fleet->pin_threads && cpu_count > 0 ? cpus[w % cpu_count] : -1;
+    worker->first_device = (int)((int64_t)fleet->device_count * w / fleet->thread_count);
+    worker->device_count
+        = (int)((int64_t)fleet->device_count * (w + 1) / fleet->thread_count)
+        - worker->first_device;
+    worker->epoll_fd = -1;
+    latency_histogram_init(&worker->puback_latency);
+    latency_histogram_init(&worker->recovery_time);
+    wire_stats_init(&worker->wire_stats);
+
+    if ((worker->timer_heap = calloc((size_t)worker->device_count, sizeof(int))) == NULL)
+    {
+      printf("Failed to allocate the timer heap of worker %d\r\n", w);
+      return -1;
+    }
+
+    for (int i = 0; i < worker->device_count; i++)
+    {
+      worker->timer_heap[i] = worker->first_device + i;
+      fleet->devices[worker->first_device + i].worker = w;
+      fleet->devices[worker->first_device + i].heap_index = i;
+    }
+  }
+
+  printf(
+      "%d worker threads, %s\r\n",
+      fleet->thread_count,
+      fleet->workers[0].cpu >= 0 ? "pinned to CPUs" : "not pinned");
+  return 0;
+}
+
+/*
+ * 1. Raise the file descriptor limit to fit one socket per device
+ * 2. Shard the devices across the worker threads, each with its own epoll set
+ * 3. Open a non-blocking MQTTSN client per device, reporting to its worker's statistics, and add
+ *    its socket to the worker's epoll set
+ */
+static int open_fleet_clients(FLEET_CONTEXT* fleet)
+{
+  int rc;
+  struct rlimit limit;
+
+  // 1. Raise the file descriptor limit to fit one socket per device
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)fleet->device_count + 64)
+  {
+    limit.rlim_cur = (rlim_t)fleet->device_count + 64;
+    if (limit.rlim_cur > limit.rlim_max)
+    {
+      limit.rlim_cur = limit.rlim_max;
+    }
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  // 2. Shard the devices across the worker threads, each with its own epoll set
+  if ((rc = create_fleet_workers(fleet)) != 0)
+  {
+    return rc;
+  }
+
+  for (int w = 0; w < fleet->thread_count; w++)
+  {
+    if ((fleet->workers[w].epoll_fd = epoll_create1(0)) < 0)
+    {
+      printf("Failed to create epoll instance, errno %d\r\n", errno);
+      return -1;
+    }
+  }
+
+  // 3. Open a non-blocking MQTTSN client per device, reporting to its worker's statistics, and add
+  //    its socket to the worker's epoll set. Every device has its own source port.
+  for (int i = 0; i < fleet->device_count; i++)
+  {
+    FLEET_DEVICE* device = &fleet->devices[i];
+    FLEET_WORKER* worker = &fleet->workers[device->worker];
+    MQTTSN_CLIENT_OPTIONS options = mqttsn_client_options_default();
+    TRANSPORT_IMPAIRMENT_CONFIG impairment = fleet->impairment;
+    struct epoll_event event;
+
+    options.client_id = device->device_id;
+    options.topic_name = device->topic_name;
+    options.gateway_address = fleet->gateway_address;
+    options.gateway_port = fleet->gateway_port;
+    options.src_port = fleet->src_port_base > 0 ? fleet->src_port_base + i : 0;
+    options.predefined_topic_id = device->predefined_topic_id;
+#if defined(AZ_TELEMETRY_QOS_MINUS_1)
+    options.qos = -1; // no connection, needs a predefined topic ID
+#elif defined(ENABLE_PUBACK)
+    options.qos = 1;
+#else
+    options.qos = 0;
+#endif
+    options.send_window_size = fleet->send_window_size;
+    options.zero_copy = 1; // the payload is a constant, it never needs to be copied
+    options.puback_latency = &worker->puback_latency;
+    options.recovery_time = &worker->recovery_time;
+    options.wire_stats = &worker->wire_stats;
+
+    // Every device draws its own, reproducible, impairments
+    impairment.seed += (uint32_t)i;
+    options.impairment = fleet->impaired ? &impairment : NULL;
+
+    if ((rc = mqttsn_client_init(&device->mqttsn_client, &options)) != 0)
+    {
+      printf("Failed to open client for %s, return code %d\r\n", device->device_id, rc);
+      return rc;
+    }
+
+    event.events = EPOLLIN;
+    event.data.u32 = (uint32_t)i;
+    if (epoll_ctl(
+            worker->epoll_fd,
+            EPOLL_CTL_ADD,
+            mqttsn_client_poll_fd(&device->mqttsn_client),
+            &event)
+        != 0)
+    {
+      printf("Failed to add %s to epoll, errno %d\r\n", device->device_id, errno);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void finish_device(FLEET_WORKER* worker, FLEET_DEVICE* device, FLEET_DEVICE_STATE state)
+{
+  device->state = state;
+  __atomic_store_n(&worker->active_devices, worker->active_devices - 1, __ATOMIC_RELAXED);
+  schedule_device(worker, device, UINT64_MAX);
+}
+
+/*
+ * 1. Start the connection when the device's turn in the connect ramp comes
+ * 2. Let the MQTTSN client process datagrams, timeouts and retransmissions
+ * 3. Publish the next message when it is due and the send window has room
+ * 4. Disconnect once every message has been acknowledged
+ * 5. Wake up again at the earliest of the client deadline and the next publish time
+ */
+static void service_device(FLEET_WORKER* worker, FLEET_DEVICE* device, uint64_t now_us)
+{
+  MQTTSN_CLIENT* client = &device->mqttsn_client;
+  uint64_t deadline_us;
+
+  // 1. Start the connection when the device's turn in the connect ramp comes
+  if (device->state == FLEET_DEVICE_IDLE)
+  {
+    if (now_us < device->deadline_us)
+    {
+      return;
+    }
+
+    device->state = FLEET_DEVICE_RUNNING;
+    mqttsn_client_connect(client);
+  }
+  else if (device->state != FLEET_DEVICE_RUNNING)
+  {
+    return;
+  }
+
+  // 2. Let the MQTTSN client process datagrams, timeouts and retransmissions
+  mqttsn_client_step(client);
+
+  if (client->retry_attempt > MAX_RETRY_ATTEMPTS)
+  {
+    printf("Device %s gave up after %d retries\r\n", device->device_id, MAX_RETRY_ATTEMPTS);
+    finish_device(worker, device, FLEET_DEVICE_FAILED);
+    return;
+  }
+
+  // 3. Publish the next message when it is due and the send window has room
+  if (device->next_publish_us == 0 && client->state == MQTTSN_CLIENT_CONNECTED)
+  {
+    device->next_publish_us = now_us;
+  }
+
+  while (device->messages_sent < NUMBER_OF_MESSAGES && device->next_publish_us != 0
+         && device->next_publish_us <= now_us && mqttsn_client_can_publish(client))
+  {
+    if (mqttsn_client_publish(
+            client, (unsigned char*)TELEMETRY_PAYLOAD, sizeof(TELEMETRY_PAYLOAD) - 1)
+        != 0)
+    {
+      break;
+    }
+
+    if (worker->first_publish_us == 0)
+    {
+      worker->first_publish_us = now_us;
+    }
+
+    __atomic_store_n(&worker->publish_count, worker->publish_count + 1, __ATOMIC_RELAXED);
+    worker->last_publish_us = now_us;
+    device->messages_sent++;
+    device->next_publish_us += TELEMETRY_SEND_INTERVAL_MS * 1000ULL;
+  }
+
+  mqttsn_client_flush(client);
+
+  // 4. Disconnect once every message has been acknowledged
+  if (device->messages_sent >= NUMBER_OF_MESSAGES && mqttsn_client_in_flight(client) == 0)
+  {
+    mqttsn_client_disconnect(client);
+    finish_device(worker, device, FLEET_DEVICE_DONE);
+    return;
+  }
+
+  // 5. Wake up again at the earliest of the client deadline and the next publish time
+  deadline_us = mqttsn_client_next_deadline_us(client);
+  if (device->messages_sent < NUMBER_OF_MESSAGES && device->next_publish_us != 0
+      && mqttsn_client_can_publish(client) && device->next_publish_us < deadline_us)
+  {
+    deadline_us = device->next_publish_us;
+  }
+
+  schedule_device(worker, device, deadline_us);
+}
+
+/*
+ * Worker thread: pin itself to its CPU, then wait on its epoll set until the earliest deadline of
+ * its devices, dispatching datagrams and expired timers, until all of its devices are done
+ */
+static void* run_fleet_worker(void* context)
+{
+  FLEET_WORKER* worker = (FLEET_WORKER*)context;
+  FLEET_DEVICE* devices = worker->fleet->devices;
+  struct epoll_event events[EPOLL_MAX_EVENTS];
+
+  if (worker->cpu >= 0)
+  {
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+    {
+      printf("Failed to pin worker %d to CPU %d\r\n", worker->index, worker->cpu);
+    }
+  }
+
+  while (worker->active_devices > 0)
+  {
+    uint64_t now_us = time_util_now_us();
+    uint64_t next_deadline_us = devices[worker->timer_heap[0]].deadline_us;
+    int timeout_ms = 0;
+    int count;
+
+    if (next_deadline_us > now_us)
+    {
+      uint64_t wait_us = next_deadline_us - now_us;
+      if (wait_us > REPORT_INTERVAL_US)
+      {
+        wait_us = REPORT_INTERVAL_US;
+      }
+      timeout_ms = (int)((wait_us + 999) / 1000);
+    }
+
+    if ((count = epoll_wait(worker->epoll_fd, events, EPOLL_MAX_EVENTS, timeout_ms)) < 0
+        && errno != EINTR)
+    {
+      printf("epoll_wait failed in worker %d, errno %d\r\n", worker->index, errno);
+      worker->rc = -1;
+      break;
+    }
+
+    now_us = time_util_now_us();
+    for (int i = 0; i < count; i++)
+    {
+      service_device(worker, &devices[events[i].data.u32], now_us);
+    }
+
+    while (devices[worker->timer_heap[0]].deadline_us <= now_us)
+    {
+      service_device(worker, &devices[worker->timer_heap[0]], now_us);
+    }
+
+    __atomic_store_n(&worker->pubacks, worker->puback_latency.count, __ATOMIC_RELAXED);
+  }
+
+  __atomic_store_n(&worker->active_devices, 0, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+/*
+ * Add the statistics of every worker to the fleet totals
+ */
+static void merge_fleet_workers(FLEET_CONTEXT* fleet)
+{
+  for (int w = 0; w < fleet->thread_count; w++)
+  {
+    FLEET_WORKER* worker = &fleet->workers[w];
+
+    fleet->publish_count += worker->publish_count;
+    if (worker->first_publish_us != 0
+        && (fleet->first_publish_us == 0 || worker->first_publish_us < fleet->first_publish_us))
+    {
+      fleet->first_publish_us = worker->first_publish_us;
+    }
+    if (worker->last_publish_us > fleet->last_publish_us)
+    {
+      fleet->last_publish_us = worker->last_publish_us;
+    }
+    latency_histogram_merge(&fleet->puback_latency, &worker->puback_latency);
+    latency_histogram_merge(&fleet->recovery_time, &worker->recovery_time);
+    wire_stats_merge(&fleet->wire_stats, &worker->wire_stats);
+  }
+}
+
+/*
+ * 1. Stagger the CONNECT of every device according to the connect rate
+ * 2. Start one thread per worker, each driving its shard of devices from its own epoll loop
+ * 3. Print the publish rate once per second, summed over the workers, and write out their event
+ *    log rings until they are all done
+ * 4. Join the workers and merge their statistics
+ */
+static int run_fleet(FLEET_CONTEXT* fleet)
+{
+  int rc = 0;
+  int active_devices;
+  uint64_t start_us = time_util_now_us();
+  uint64_t next_report_us = start_us + REPORT_INTERVAL_US;
+  uint64_t last_report_publishes = 0;
+
+  // 1. Stagger the CONNECT of every device according to the connect rate
+  for (int i = 0; i < fleet->device_count; i++)
+  {
+    fleet->devices[i].deadline_us
+        = start_us + (uint64_t)i * 1000000 / (uint64_t)fleet->connect_rate;
+  }
+
+  // 2. Start one thread per worker, each driving its shard of devices from its own epoll loop
+  for (int w = 0; w < fleet->thread_count; w++)
+  {
+    FLEET_WORKER* worker = &fleet->workers[w];
+
+    worker->active_devices = worker->device_count;
+    if (pthread_create(&worker->thread, NULL, run_fleet_worker, worker) != 0)
+    {
+      printf("Failed to start worker %d\r\n", w);
+      worker->active_devices = 0;
+      rc = -1;
+      break;
+    }
+
+    worker->started = 1;
+  }
+
+  // 3. Print the publish rate once per second, summed over the workers, and write out their event
+  //    log rings until they are all done
+  do
+  {
+    uint64_t now_us = time_util_now_us();
+    uint64_t publishes = 0;
+    uint64_t pubacks = 0;
+    struct timespec pause = { 0, REPORT_POLL_US * 1000 };
+
+    active_devices = 0;
+    for (int w = 0; w < fleet->thread_count; w++)
+    {
+      active_devices += __atomic_load_n(&fleet->workers[w].active_devices, __ATOMIC_RELAXED);
+      publishes += __atomic_load_n(&fleet->workers[w].publish_count, __ATOMIC_RELAXED);
+      pubacks += __atomic_load_n(&fleet->workers[w].pubacks, __ATOMIC_RELAXED);
+    }
+
+    if (now_us >= next_report_us)
+    {
+      printf(
+          "[%5.1fs] active devices = %d, publishes/s = %llu, total publishes = %llu, pubacks = "
+          "%llu\r\n",
+          (double)(now_us - start_us) / 1e6,
+          active_devices,
+          (unsigned long long)(publishes - last_report_publishes),
+          (unsigned long long)publishes,
+          (unsigned long long)pubacks);
+      last_report_publishes = publishes;
+      next_report_us += REPORT_INTERVAL_US;
+    }
+
+    event_log_flush();
+    if (active_devices > 0)
+    {
+      nanosleep(&pause, NULL);
+    }
+  } while (active_devices > 0);
+
+  // 4. Join the workers and merge their statistics
+  for (int w = 0; w < fleet->thread_count; w++)
+  {
+    if (fleet->workers[w].started)
+    {
+      pthread_join(fleet->workers[w].thread, NULL);
+      rc = rc != 0 ? rc : fleet->workers[w].rc;
+    }
+  }
+
+  merge_fleet_workers(fleet);
+  return rc;
+}
+
+/*
+ * 1. Print fleet wide throughput, PUBACK latency and loss recovery time distributions and wire
+ *    statistics
+ * 2. Optionally write per-device statistics to a CSV file
+ */
+static void report_fleet(FLEET_CONTEXT* fleet)
+{
+  int failed = 0;
+  int measured = 0;
+  uint64_t retransmissions = 0;
+  uint64_t recoveries = 0;
+  uint64_t srtt_sum_us = 0;
+  uint64_t rto_sum_us = 0;
+  uint64_t register_round_trips_saved = 0;
+  uint64_t register_bytes_saved = 0;
+  const char* report_file = getenv(ENV_FLEET_REPORT_FILE);
+  double publish_seconds = (double)(fleet->last_publish_us - fleet->first_publish_us) / 1e6;
+
+  for (int i = 0; i < fleet->device_count; i++)
+  {
+    MQTTSN_CLIENT_STATS* stats = &fleet->devices[i].mqttsn_client.stats;
+
+    RTT_ESTIMATOR* rtt = &fleet->devices[i].mqttsn_client.rtt;
+
+    failed += fleet->devices[i].state == FLEET_DEVICE_FAILED;
+    retransmissions += stats->retransmissions;
+    recoveries += stats->recoveries;
+    if (rtt->samples > 0)
+    {
+      measured++;
+      srtt_sum_us += rtt->srtt_us;
+      rto_sum_us += rtt->rto_us;
+    }
+    register_round_trips_saved += stats->register_round_trips_saved;
+    register_bytes_saved += stats->register_bytes_saved;
+  }
+
+  // 1. Print fleet wide throughput, PUBACK latency and loss recovery time distributions and wire
+  //    statistics
+  printf(
+      "Devices: %d, failed: %d, worker threads: %d\r\n",
+      fleet->device_count,
+      failed,
+      fleet->thread_count);
+  printf(
+      "Total publishes = %llu, pubacks = %llu, retransmissions = %llu, recoveries = %llu\r\n",
+      (unsigned long long)fleet->publish_count,
+      (unsigned long long)fleet->puback_latency.count,
+      (unsigned long long)retransmissions,
+      (unsigned long long)recoveries);
+  printf(
+      "Mean SRTT = %.1f ms, mean RTO = %.1f ms over %d devices with RTT samples\r\n",
+      measured > 0 ? (double)srtt_sum_us / measured / 1000.0 : 0.0,
+      measured > 0 ? (double)rto_sum_us / measured / 1000.0 : 0.0,
+      measured);
+  printf(
+      "Publish rate = %.1f publishes/s over %.2f s\r\n",
+      publish_seconds > 0 ? (double)fleet->publish_count / publish_seconds : 0.0,
+      publish_seconds);
+  printf(
+      "REGISTER round trips saved = %llu, bytes saved = %llu\r\n",
+      (unsigned long long)register_round_trips_saved,
+      (unsigned long long)register_bytes_saved);
+  latency_histogram_print(&fleet->puback_latency, "PUBACK latency");
+  latency_histogram_print(&fleet->recovery_time, "Recovery time");
+  if (fleet->impaired)
+  {
+    transport_impairment_print_totals();
+  }
+  printf("Wire statistics:\r\n");
+  wire_stats_print_json(&fleet->wire_stats, stdout);
+
+  // 2. Optionally write per-device statistics to a CSV file
+  if (report_file != NULL)
+  {
+    FILE* file = fopen(report_file, "w");
+
+    if (file == NULL)
+    {
+      printf("Failed to open report file %s\r\n", report_file);
+      return;
+    }
+
+    fprintf(
+        file,
+        "device_id,state,pubacks,retransmissions,latency_min_us,latency_avg_us,latency_max_us,"
+        "srtt_us,rto_us\n");
+    for (int i = 0; i < fleet->device_count; i++)
+    {
+      FLEET_DEVICE* device = &fleet->devices[i];
+      MQTTSN_CLIENT_STATS* stats = &device->mqttsn_client.stats;
+      uint64_t latency_avg_us = stats->pubacks ? stats->latency_sum_us / stats->pubacks : 0;
+
+      fprintf(
+          file,
+          "%s,%s,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+          device->device_id,
+          device->state == FLEET_DEVICE_DONE ? "done" : "failed",
+          (unsigned long long)stats->pubacks,
+          (unsigned long long)stats->retransmissions,
+          (unsigned long long)(stats->pubacks ? stats->latency_min_us : 0),
+          (unsigned long long)latency_avg_us,
+          (unsigned long long)stats->latency_max_us,
+          (unsigned long long)device->mqttsn_client.rtt.srtt_us,
+          (unsigned long long)device->mqttsn_client.rtt.rto_us);
+    }
+
+    fclose(file);
+    printf("Per-device statistics written to %s\r\n", report_file);
+  }
+}
+
+static void close_fleet(FLEET_CONTEXT* fleet)
+{
+  for (int i = 0; fleet->devices != NULL && i < fleet->device_count; i++)
+  {
+    if (fleet->devices[i].mqttsn_client.transport.sock >= 0)
+    {
+      mqttsn_client_deinit(&fleet->devices[i].mqttsn_client);
+    }
+  }
+
+  for (int w = 0; fleet->workers != NULL && w < fleet->thread_count; w++)
+  {
+    if (fleet->workers[w].epoll_fd >= 0)
+    {
+      close(fleet->workers[w].epoll_fd);
+    }
+    free(fleet->workers[w].timer_heap);
+  }
+
+  free(fleet->devices);
+  free(fleet->workers);
+  predefined_topics_deinit(&fleet->predefined_topics);
+  event_log_close();
+  transport_capture_close();
+}
+
+/*
+ * 1. Initialize the fleet of device contexts
+ * 2. Open one MQTTSN client per device
+ * 3. Drive the devices from one epoll event loop per worker thread
+ * 4. Report throughput and latency
+ */
+int main(int argc, char** argv)
+{
+  int rc;
+  FLEET_CONTEXT fleet;
+
+  if ((rc = init_fleet_context(&fleet)) != 0)
+  {
+    printf("init_fleet_context failed, return code %d\r\n", rc);
+  }
+  else if ((rc = open_fleet_clients(&fleet)) != 0)
+  {
+    printf("open_fleet_clients failed, return code %d\r\n", rc);
+  }
+  else if ((rc = run_fleet(&fleet)) != 0)
+  {
+    printf("run_fleet failed, return code %d\r\n", rc);
+  }
+  else
+  {
+    report_fleet(&fleet);
+  }
+
+  close_fleet(&fleet);
+
+  return rc;
+}
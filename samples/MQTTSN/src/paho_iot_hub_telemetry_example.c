@@ -1,18 +1,25 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // SPDX-License-Identifier: MIT
 
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#ifdef _WIN32
-#include <Windows.h>
-#else
-#include <unistd.h>
-#endif
 
-#include "MQTTSNPacket.h"
 #include "azure/iot/az_iot_hub_client.h"
-#include "transport.h"
+#include "event_log.h"
+#include "gateway_discovery.h"
+#include "latency_histogram.h"
+#include "mqttsn_client.h"
+#include "offline_queue.h"
+#include "predefined_topics.h"
+#include "session_cache.h"
+#include "telemetry_aggregator.h"
+#include "telemetry_codec.h"
+#include "telemetry_filter.h"
+#include "telemetry_scheduler.h"
+#include "time_util.h"
+#include "transport_capture.h"
 
 // DO NOT MODIFY: Device ID Environment Variable Name
 #define ENV_DEVICE_ID "AZ_IOT_DEVICE_ID"
@@ -26,42 +33,169 @@
 // DO NOT MODIFY: MQTTSN Gateway gateway_port Environment Variable Name
 #define ENV_MQTTSN_GATEWAY_PORT "MQTTSN_GATEWAY_PORT"
 
+// DO NOT MODIFY: Number of unacknowledged QoS 1 PUBLISH packets allowed in flight
+#define ENV_MQTTSN_SEND_WINDOW "MQTTSN_SEND_WINDOW"
+
+// DO NOT MODIFY: Topic ID mapping file shared with the Gateway, empty to REGISTER the topic
+#define ENV_MQTTSN_PREDEFINED_TOPIC_FILE "MQTTSN_PREDEFINED_TOPIC_FILE"
+
+// DO NOT MODIFY: Maximum number of readings aggregated into one PUBLISH
+#define ENV_MQTTSN_AGGREGATE_READINGS "MQTTSN_AGGREGATE_READINGS"
+
+// DO NOT MODIFY: Maximum time in milliseconds a reading waits in the aggregate
+#define ENV_MQTTSN_AGGREGATE_DELAY_MS "MQTTSN_AGGREGATE_DELAY_MS"
+
+// DO NOT MODIFY: Path MTU bounding the size of an aggregated PUBLISH datagram
+#define ENV_MQTTSN_PATH_MTU "MQTTSN_PATH_MTU"
+
+// DO NOT MODIFY: Payload encoding, "json" or "delta" (binary, delta encoded)
+#define ENV_MQTTSN_PAYLOAD_ENCODING "MQTTSN_PAYLOAD_ENCODING"
+
+// DO NOT MODIFY: Seconds to sleep between messages (MQTT-SN sleeping client), 0 to stay active
+#define ENV_MQTTSN_SLEEP_DURATION "MQTTSN_SLEEP_DURATION"
+
+// DO NOT MODIFY: Memory-mapped file keeping the session across restarts, empty to always register
+#define ENV_MQTTSN_SESSION_CACHE_FILE "MQTTSN_SESSION_CACHE_FILE"
+
+// DO NOT MODIFY: Memory-mapped file of the offline queue, empty to keep the queue in memory
+#define ENV_MQTTSN_QUEUE_FILE "MQTTSN_QUEUE_FILE"
+
+// DO NOT MODIFY: Size in KiB of the offline queue, its footprint on disk
+#define ENV_MQTTSN_QUEUE_SIZE_KB "MQTTSN_QUEUE_SIZE_KB"
+
+// DO NOT MODIFY: Maximum number of messages in the offline queue, newer messages are dropped
+#define ENV_MQTTSN_QUEUE_DEPTH "MQTTSN_QUEUE_DEPTH"
+
+// DO NOT MODIFY: Maximum messages per second drained from the offline queue, 0 for the send window
+#define ENV_MQTTSN_QUEUE_DRAIN_RATE "MQTTSN_QUEUE_DRAIN_RATE"
+
+// DO NOT MODIFY: Periodic sensor streams and their rates in Hz, "name:rate[,name:rate...]"
+#define ENV_MQTTSN_TELEMETRY_STREAMS "MQTTSN_TELEMETRY_STREAMS"
+
+// DO NOT MODIFY: Multicast group to discover Gateways on, empty to use the configured one only
+#define ENV_MQTTSN_DISCOVERY_GROUP "MQTTSN_DISCOVERY_GROUP"
+
+// DO NOT MODIFY: UDP port of the discovery multicast group
+#define ENV_MQTTSN_DISCOVERY_PORT "MQTTSN_DISCOVERY_PORT"
+
+// DO NOT MODIFY: Seconds between SEARCHGW rounds ranking the discovered Gateways
+#define ENV_MQTTSN_DISCOVERY_INTERVAL "MQTTSN_DISCOVERY_INTERVAL"
+
+// DO NOT MODIFY: Consecutive timeouts after which the client fails over to another Gateway
+#define ENV_MQTTSN_FAILOVER_TIMEOUTS "MQTTSN_FAILOVER_TIMEOUTS"
+
+// DO NOT MODIFY: Telemetry topics to spread messages over with a "part" property, 0 for one topic
+#define ENV_MQTTSN_PROPERTY_TOPICS "MQTTSN_PROPERTY_TOPICS"
+
+// DO NOT MODIFY: Topics kept registered by the client when publishing to property topics
+#define ENV_MQTTSN_TOPIC_REGISTRY_SIZE "MQTTSN_TOPIC_REGISTRY_SIZE"
+
+// DO NOT MODIFY: Dead-band per field, "field:band[,field:band...]", empty to publish every reading
+#define ENV_MQTTSN_DEADBAND "MQTTSN_DEADBAND"
+
+// DO NOT MODIFY: Readings after which one is published even within its dead-bands, 0 = never
+#define ENV_MQTTSN_HEARTBEAT_INTERVALS "MQTTSN_HEARTBEAT_INTERVALS"
+
+// DO NOT MODIFY: Publish the min, max and mean of suppressed readings, 1 = yes (JSON only)
+#define ENV_MQTTSN_DEADBAND_SUMMARY "MQTTSN_DEADBAND_SUMMARY"
+
 #define DEFAULT_GATEWAY_ADDRESS "127.0.0.1"
 #define DEFAULT_GATEWAY_PORT "10000"
-#define TELEMETRY_SEND_INTERVAL_SECONDS 1 
+#define DEFAULT_SEND_WINDOW "1"
+#define DEFAULT_PREDEFINED_TOPIC_FILE ""
+#define DEFAULT_AGGREGATE_READINGS "1"
+#define DEFAULT_AGGREGATE_DELAY_MS "5000"
+#define DEFAULT_PATH_MTU "1500"
+#define DEFAULT_PAYLOAD_ENCODING "json"
+#define DEFAULT_SLEEP_DURATION "0"
+#define DEFAULT_SESSION_CACHE_FILE ""
+#define DEFAULT_QUEUE_FILE ""
+#define DEFAULT_QUEUE_SIZE_KB "64"
+#define DEFAULT_QUEUE_DEPTH "1000"
+#define DEFAULT_QUEUE_DRAIN_RATE "0"
+#define DEFAULT_TELEMETRY_STREAMS "telemetry:1"
+#define DEFAULT_DISCOVERY_GROUP ""
+#define DEFAULT_DISCOVERY_PORT "1883"
+#define DEFAULT_DISCOVERY_INTERVAL "30"
+#define DEFAULT_FAILOVER_TIMEOUTS "3"
+#define DEFAULT_PROPERTY_TOPICS "0"
+#define DEFAULT_TOPIC_REGISTRY_SIZE "32"
+#define DEFAULT_DEADBAND ""
+#define DEFAULT_HEARTBEAT_INTERVALS "10"
+#define DEFAULT_DEADBAND_SUMMARY "0"
 #define NUMBER_OF_MESSAGES 100
-#define TELEMETRY_PAYLOAD \
-  "{\"d\":{\"myName\":\"IoT mbed\",\"accelX\":12,\"accelY\":4,\"accelZ\":12,\"temp\":18}}"
+#define TELEMETRY_READING_SIZE 128
 
-#ifdef AZ_TELEMETRY_QOS_0
+#if defined(AZ_TELEMETRY_QOS_0) || defined(AZ_TELEMETRY_QOS_MINUS_1)
 #undef ENABLE_PUBACK // default to qos 1 and enable puback if QoS 1
 #else
 #define ENABLE_PUBACK
 #endif
 
 static char topic_name[128];
+
+// Simulated sensor readings, {"d":{"myName":"IoT mbed","accelX":12,"accelY":4,...}} in JSON
+static const TELEMETRY_SCHEMA telemetry_schema
+    = { "IoT mbed", 4, { { "accelX", 0 }, { "accelY", 0 }, { "accelZ", 0 }, { "temp", 0 } } };
 static unsigned char scratch_buffer[128];
 
 typedef struct iothub_client_context_tag
 {
   char iot_hub_hostname[128];
-  char gateway_address[16];
+  char gateway_address[64];
   int gateway_port;
   char device_id[64];
-  unsigned short telemetry_topic_id;
   az_iot_hub_client client;
-  short packet_id;
+  int send_window_size;
+  char predefined_topic_file[256];
+  int aggregate_readings;
+  int aggregate_delay_ms;
+  int path_mtu;
+  TELEMETRY_AGGREGATOR aggregator;
+  char payload_encoding[16];
+  TELEMETRY_ENCODER encoder;
+  char deadband[TELEMETRY_FILTER_SPEC_SIZE];
+  int heartbeat_intervals;
+  int deadband_summary;
+  TELEMETRY_FILTER filter;
+  char summary[TELEMETRY_FILTER_SUMMARY_SIZE];
+  int sleep_duration_s;
+  char telemetry_streams[128];
+  TELEMETRY_SCHEDULER scheduler;
+  char session_cache_file[256];
+  SESSION_CACHE session_cache;
+  char queue_file[256];
+  int queue_size_kb;
+  int queue_depth;
+  int drain_rate;
+  OFFLINE_QUEUE queue;
+  int dropped_readings;
+  uint64_t backlog_since_us; // first PUBLISH of the current backlog, 0 without a backlog
+  uint64_t backlog_us;
+  uint64_t backlog_messages;
+  char discovery_group[64];
+  int discovery_port;
+  int discovery_interval_s;
+  int failover_timeouts;
+  int property_topics;
+  int topic_registry_size;
+  GATEWAY_TABLE gateways;
+  GATEWAY_DISCOVERY discovery;
+  int warm_start;
+  uint64_t start_us;
+  uint64_t connect_us;
+  uint64_t first_publish_us;
+  TELEMETRY_SAMPLE sensor;
+  unsigned char reading[TELEMETRY_READING_SIZE];
+  MQTTSN_CLIENT mqttsn_client;
+  LATENCY_HISTOGRAM puback_latency;
+  LATENCY_HISTOGRAM recovery_time;
+  LATENCY_HISTOGRAM failover_time;
+  WIRE_STATS wire_stats;
+  TRANSPORT_IMPAIRMENT_CONFIG impairment;
+  int impaired;
 } IOTHUB_CLIENT_CONTEXT;
 
-static void sleep_seconds(uint32_t seconds)
-{
-#ifdef _WIN32
-  Sleep((DWORD)seconds * 1000);
-#else
-  sleep(seconds);
-#endif
-}
-
 /*
  * Read OS environment variables using stdlib function
  */
@@ -158,483 +292,1307 @@ static int read_configuration_and_init_client(
 }
 
 /*
- * Read the Environment Variables and initialize the az_iot_hub_client
+ * Read the number of QoS 1 PUBLISH packets allowed in flight
  */
-static int init_client_context(IOTHUB_CLIENT_CONTEXT* ctx)
+static int read_send_window_configuration(IOTHUB_CLIENT_CONTEXT* ctx)
 {
-  int rc;
+  az_span send_window_span = AZ_SPAN_FROM_BUFFER(scratch_buffer);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_SEND_WINDOW,
+      ENV_MQTTSN_SEND_WINDOW,
+      DEFAULT_SEND_WINDOW,
+      false,
+      send_window_span,
+      &send_window_span));
 
-  memset((void*)ctx, 0, sizeof(IOTHUB_CLIENT_CONTEXT));
+  AZ_RETURN_IF_FAILED(az_span_atou32(send_window_span, &ctx->send_window_size));
 
-  if (rc = read_configuration_and_init_client(
-          &ctx->client,
-          ctx->device_id,
-          sizeof(ctx->device_id),
-          ctx->gateway_address,
-          sizeof(ctx->gateway_address),
-          &ctx->gateway_port,
-          ctx->iot_hub_hostname,
-          sizeof(ctx->iot_hub_hostname)))
-  {
-    printf("Failed to read configuration from environment variables, return code %d\r\n", rc);
-  }
+  return 0;
+}
 
-  return rc;
+/*
+ * Read the path of the predefined topic ID mapping file
+ */
+static int read_topic_configuration(IOTHUB_CLIENT_CONTEXT* ctx)
+{
+  az_span topic_file_span
+      = az_span_init(ctx->predefined_topic_file, sizeof(ctx->predefined_topic_file) - 1);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_PREDEFINED_TOPIC_FILE,
+      ENV_MQTTSN_PREDEFINED_TOPIC_FILE,
+      DEFAULT_PREDEFINED_TOPIC_FILE,
+      false,
+      topic_file_span,
+      &topic_file_span));
+
+  ctx->predefined_topic_file[az_span_size(topic_file_span)] = '\0';
+
+  return 0;
 }
 
 /*
- * First 10 attempts: try within 3 seconds
- * Next 10 attempts: retry after every 1 minute
- * After 20 attempts: retry every 10 minutes
+ * Read the aggregation limits: readings per PUBLISH, latency deadline and path MTU
  */
-int get_connection_timeout_seconds(int attempt_number)
+static int read_aggregation_configuration(IOTHUB_CLIENT_CONTEXT* ctx)
 {
-  return (attempt_number < 10) ? 3 : (attempt_number < 20) ? 60 : 600;
+  az_span readings_span = AZ_SPAN_FROM_BUFFER(scratch_buffer);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_AGGREGATE_READINGS,
+      ENV_MQTTSN_AGGREGATE_READINGS,
+      DEFAULT_AGGREGATE_READINGS,
+      false,
+      readings_span,
+      &readings_span));
+
+  AZ_RETURN_IF_FAILED(az_span_atou32(readings_span, &ctx->aggregate_readings));
+
+  az_span delay_span = AZ_SPAN_FROM_BUFFER(scratch_buffer);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_AGGREGATE_DELAY_MS,
+      ENV_MQTTSN_AGGREGATE_DELAY_MS,
+      DEFAULT_AGGREGATE_DELAY_MS,
+      false,
+      delay_span,
+      &delay_span));
+
+  AZ_RETURN_IF_FAILED(az_span_atou32(delay_span, &ctx->aggregate_delay_ms));
+
+  az_span path_mtu_span = AZ_SPAN_FROM_BUFFER(scratch_buffer);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_PATH_MTU,
+      ENV_MQTTSN_PATH_MTU,
+      DEFAULT_PATH_MTU,
+      false,
+      path_mtu_span,
+      &path_mtu_span));
+
+  AZ_RETURN_IF_FAILED(az_span_atou32(path_mtu_span, &ctx->path_mtu));
+
+  return 0;
 }
 
 /*
- * 1. Create CONNECT packet
- * 2. Send CONNECT packet to the MQTTSN Gateway
+ * Read the payload encoding
  */
-static int send_connect(IOTHUB_CLIENT_CONTEXT* ctx, MQTTSNPacket_connectData* options)
+static int read_encoding_configuration(IOTHUB_CLIENT_CONTEXT* ctx)
 {
-  int rc;
-  int len;
+  az_span encoding_span = az_span_init(ctx->payload_encoding, sizeof(ctx->payload_encoding) - 1);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_PAYLOAD_ENCODING,
+      ENV_MQTTSN_PAYLOAD_ENCODING,
+      DEFAULT_PAYLOAD_ENCODING,
+      false,
+      encoding_span,
+      &encoding_span));
 
-  // 1. Create CONNECT packet
-  if ((len = MQTTSNSerialize_connect(scratch_buffer, sizeof(scratch_buffer), options)) <= 0)
-  {
-    printf("Failed to serialize CONNECT packet, return code %d\r\n", len);
-    return -1;
-  }
+  ctx->payload_encoding[az_span_size(encoding_span)] = '\0';
 
-  // 2. Send CONNECT packet to the MQTTSN Gateway
-  if ((rc
-       = transport_sendPacketBuffer(ctx->gateway_address, ctx->gateway_port, scratch_buffer, len))
-      != 0)
+  return 0;
+}
+
+/*
+ * Read the path of the session cache file
+ */
+static int read_session_cache_configuration(IOTHUB_CLIENT_CONTEXT* ctx)
+{
+  az_span session_cache_span
+      = az_span_init(ctx->session_cache_file, sizeof(ctx->session_cache_file) - 1);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_SESSION_CACHE_FILE,
+      ENV_MQTTSN_SESSION_CACHE_FILE,
+      DEFAULT_SESSION_CACHE_FILE,
+      false,
+      session_cache_span,
+      &session_cache_span));
+
+  ctx->session_cache_file[az_span_size(session_cache_span)] = '\0';
+
+  return 0;
+}
+
+/*
+ * Read the offline queue file, its size, its maximum depth and its drain rate
+ */
+static int read_queue_configuration(IOTHUB_CLIENT_CONTEXT* ctx)
+{
+  az_span queue_file_span = az_span_init(ctx->queue_file, sizeof(ctx->queue_file) - 1);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_QUEUE_FILE,
+      ENV_MQTTSN_QUEUE_FILE,
+      DEFAULT_QUEUE_FILE,
+      false,
+      queue_file_span,
+      &queue_file_span));
+
+  ctx->queue_file[az_span_size(queue_file_span)] = '\0';
+
+  az_span queue_size_span = AZ_SPAN_FROM_BUFFER(scratch_buffer);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_QUEUE_SIZE_KB,
+      ENV_MQTTSN_QUEUE_SIZE_KB,
+      DEFAULT_QUEUE_SIZE_KB,
+      false,
+      queue_size_span,
+      &queue_size_span));
+
+  AZ_RETURN_IF_FAILED(az_span_atou32(queue_size_span, &ctx->queue_size_kb));
+
+  az_span queue_depth_span = AZ_SPAN_FROM_BUFFER(scratch_buffer);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_QUEUE_DEPTH,
+      ENV_MQTTSN_QUEUE_DEPTH,
+      DEFAULT_QUEUE_DEPTH,
+      false,
+      queue_depth_span,
+      &queue_depth_span));
+
+  AZ_RETURN_IF_FAILED(az_span_atou32(queue_depth_span, &ctx->queue_depth));
+
+  az_span drain_rate_span = AZ_SPAN_FROM_BUFFER(scratch_buffer);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_QUEUE_DRAIN_RATE,
+      ENV_MQTTSN_QUEUE_DRAIN_RATE,
+      DEFAULT_QUEUE_DRAIN_RATE,
+      false,
+      drain_rate_span,
+      &drain_rate_span));
+
+  AZ_RETURN_IF_FAILED(az_span_atou32(drain_rate_span, &ctx->drain_rate));
+
+  return 0;
+}
+
+/*
+ * Read the sleep duration of the sleeping client
+ */
+static int read_sleep_configuration(IOTHUB_CLIENT_CONTEXT* ctx)
+{
+  az_span sleep_duration_span = AZ_SPAN_FROM_BUFFER(scratch_buffer);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_SLEEP_DURATION,
+      ENV_MQTTSN_SLEEP_DURATION,
+      DEFAULT_SLEEP_DURATION,
+      false,
+      sleep_duration_span,
+      &sleep_duration_span));
+
+  AZ_RETURN_IF_FAILED(az_span_atou32(sleep_duration_span, &ctx->sleep_duration_s));
+
+  return 0;
+}
+
+/*
+ * Read the dead-bands of the report by exception filter, its heartbeat and summaries
+ */
+static int read_filter_configuration(IOTHUB_CLIENT_CONTEXT* ctx)
+{
+  az_span deadband_span = az_span_init(ctx->deadband, sizeof(ctx->deadband) - 1);
+  az_span heartbeat_intervals_span = AZ_SPAN_FROM_BUFFER(scratch_buffer);
+  az_span deadband_summary_span;
+
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_DEADBAND,
+      ENV_MQTTSN_DEADBAND,
+      DEFAULT_DEADBAND,
+      false,
+      deadband_span,
+      &deadband_span));
+
+  ctx->deadband[az_span_size(deadband_span)] = '\0';
+
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_HEARTBEAT_INTERVALS,
+      ENV_MQTTSN_HEARTBEAT_INTERVALS,
+      DEFAULT_HEARTBEAT_INTERVALS,
+      false,
+      heartbeat_intervals_span,
+      &heartbeat_intervals_span));
+
+  AZ_RETURN_IF_FAILED(az_span_atou32(heartbeat_intervals_span, &ctx->heartbeat_intervals));
+
+  deadband_summary_span = AZ_SPAN_FROM_BUFFER(scratch_buffer);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_DEADBAND_SUMMARY,
+      ENV_MQTTSN_DEADBAND_SUMMARY,
+      DEFAULT_DEADBAND_SUMMARY,
+      false,
+      deadband_summary_span,
+      &deadband_summary_span));
+
+  AZ_RETURN_IF_FAILED(az_span_atou32(deadband_summary_span, &ctx->deadband_summary));
+
+  return 0;
+}
+
+/*
+ * Read the periodic sensor streams and their rates
+ */
+static int read_stream_configuration(IOTHUB_CLIENT_CONTEXT* ctx)
+{
+  az_span telemetry_streams_span
+      = az_span_init(ctx->telemetry_streams, sizeof(ctx->telemetry_streams) - 1);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_TELEMETRY_STREAMS,
+      ENV_MQTTSN_TELEMETRY_STREAMS,
+      DEFAULT_TELEMETRY_STREAMS,
+      false,
+      telemetry_streams_span,
+      &telemetry_streams_span));
+
+  ctx->telemetry_streams[az_span_size(telemetry_streams_span)] = '\0';
+
+  return 0;
+}
+
+/*
+ * Read the discovery multicast group, its port, the SEARCHGW interval and the failover threshold
+ */
+static int read_discovery_configuration(IOTHUB_CLIENT_CONTEXT* ctx)
+{
+  az_span discovery_group_span
+      = az_span_init(ctx->discovery_group, sizeof(ctx->discovery_group) - 1);
+  az_span discovery_port_span = AZ_SPAN_FROM_BUFFER(scratch_buffer);
+  az_span discovery_interval_span;
+  az_span failover_timeouts_span;
+
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_DISCOVERY_GROUP,
+      ENV_MQTTSN_DISCOVERY_GROUP,
+      DEFAULT_DISCOVERY_GROUP,
+      false,
+      discovery_group_span,
+      &discovery_group_span));
+
+  ctx->discovery_group[az_span_size(discovery_group_span)] = '\0';
+
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_DISCOVERY_PORT,
+      ENV_MQTTSN_DISCOVERY_PORT,
+      DEFAULT_DISCOVERY_PORT,
+      false,
+      discovery_port_span,
+      &discovery_port_span));
+
+  AZ_RETURN_IF_FAILED(az_span_atou32(discovery_port_span, &ctx->discovery_port));
+
+  discovery_interval_span = AZ_SPAN_FROM_BUFFER(scratch_buffer);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_DISCOVERY_INTERVAL,
+      ENV_MQTTSN_DISCOVERY_INTERVAL,
+      DEFAULT_DISCOVERY_INTERVAL,
+      false,
+      discovery_interval_span,
+      &discovery_interval_span));
+
+  AZ_RETURN_IF_FAILED(az_span_atou32(discovery_interval_span, &ctx->discovery_interval_s));
+
+  failover_timeouts_span = AZ_SPAN_FROM_BUFFER(scratch_buffer);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_FAILOVER_TIMEOUTS,
+      ENV_MQTTSN_FAILOVER_TIMEOUTS,
+      DEFAULT_FAILOVER_TIMEOUTS,
+      false,
+      failover_timeouts_span,
+      &failover_timeouts_span));
+
+  AZ_RETURN_IF_FAILED(az_span_atou32(failover_timeouts_span, &ctx->failover_timeouts));
+
+  return 0;
+}
+
+/*
+ * Read the number of property topics and the size of the topic registry
+ */
+static int read_property_topic_configuration(IOTHUB_CLIENT_CONTEXT* ctx)
+{
+  az_span property_topics_span = AZ_SPAN_FROM_BUFFER(scratch_buffer);
+  az_span topic_registry_size_span;
+
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_PROPERTY_TOPICS,
+      ENV_MQTTSN_PROPERTY_TOPICS,
+      DEFAULT_PROPERTY_TOPICS,
+      false,
+      property_topics_span,
+      &property_topics_span));
+
+  AZ_RETURN_IF_FAILED(az_span_atou32(property_topics_span, &ctx->property_topics));
+
+  topic_registry_size_span = AZ_SPAN_FROM_BUFFER(scratch_buffer);
+  AZ_RETURN_IF_FAILED(read_configuration_entry(
+      ENV_MQTTSN_TOPIC_REGISTRY_SIZE,
+      ENV_MQTTSN_TOPIC_REGISTRY_SIZE,
+      DEFAULT_TOPIC_REGISTRY_SIZE,
+      false,
+      topic_registry_size_span,
+      &topic_registry_size_span));
+
+  AZ_RETURN_IF_FAILED(az_span_atou32(topic_registry_size_span, &ctx->topic_registry_size));
+
+  return 0;
+}
+
+/*
+ * Read the optional simulated loss, delay, jitter, duplication and reordering
+ */
+static int read_impairment_configuration(IOTHUB_CLIENT_CONTEXT* ctx)
+{
+  int rc = transport_impairment_read_configuration(&ctx->impairment);
+
+  if (rc < 0)
   {
-    printf("Failed to send CONNECT packet to the Gateway, return code %d\r\n", rc);
     return rc;
   }
 
+  ctx->impaired = rc;
   return 0;
 }
 
 /*
- * Wait for CONNACK packet from the MQTTSN Gateway
+ * Read the event log mode, level and file, and open the log
  */
-static int receive_connack()
+static int read_event_log_configuration(void)
 {
-  int rc;
+  EVENT_LOG_CONFIG config;
 
-  if (MQTTSNPacket_read(scratch_buffer, sizeof(scratch_buffer), transport_getdata)
-      == MQTTSN_CONNACK)
+  if (event_log_read_configuration(&config) != 0)
   {
-    if (MQTTSNDeserialize_connack(&rc, scratch_buffer, sizeof(scratch_buffer)) != 1 || rc != 0)
-    {
-      printf("Failed to deserialize CONNACK packet, return code %d\r\n", rc);
-      rc = -1;
-    }
-    else
-    {
-      printf("Successfully received CONNACK\r\n");
-    }
+    return -1;
   }
-  else
+
+  return event_log_open(&config);
+}
+
+/*
+ * Read the optional capture file, and start capturing the traffic of the transport to it
+ */
+static int read_capture_configuration(void)
+{
+  TRANSPORT_CAPTURE_CONFIG config;
+
+  if (transport_capture_read_configuration(&config) != 0)
   {
-    printf("Failed to receive CONNACK packet\r\n");
-    rc = -1;
+    return -1;
   }
 
-  return rc;
+  return transport_capture_open(&config);
 }
 
 /*
- * 1. Open transport
- * 2. Attempt connecting to Gateway with some backoff
+ * Read the Environment Variables and initialize the az_iot_hub_client
  */
-static int connect_device(IOTHUB_CLIENT_CONTEXT* ctx)
+static int init_client_context(IOTHUB_CLIENT_CONTEXT* ctx)
 {
   int rc;
-  int len;
-  int retry_attempt = 0;
-  MQTTSNPacket_connectData options = MQTTSNPacket_connectData_initializer;
-  options.clientID.cstring = ctx->device_id;
 
-  // 1. Open unicast UDP transport
-  if ((rc = transport_open()) < 0)
+  memset((void*)ctx, 0, sizeof(IOTHUB_CLIENT_CONTEXT));
+  ctx->start_us = time_util_now_us();
+  ctx->session_cache.fd = -1;
+  ctx->queue.fd = -1;
+  ctx->discovery.sock = -1;
+  ctx->scheduler.timer_fd = -1;
+
+  if (rc = read_configuration_and_init_client(
+          &ctx->client,
+          ctx->device_id,
+          sizeof(ctx->device_id),
+          ctx->gateway_address,
+          sizeof(ctx->gateway_address),
+          &ctx->gateway_port,
+          ctx->iot_hub_hostname,
+          sizeof(ctx->iot_hub_hostname)))
   {
-    printf("Failed to open transport, return code %d\r\n", rc);
-    return rc;
+    printf("Failed to read configuration from environment variables, return code %d\r\n", rc);
   }
-
-  // 2. Attempt connecting to Gateway with some backoff
-  do
+  else if ((rc = read_send_window_configuration(ctx)) != 0)
   {
-    if ((rc = send_connect(ctx, &options)) != 0)
-    {
-      printf(
-          "Failed to send CONNECT packet to Gateway for device ID = %s, return code = %d\r\n",
-          ctx->device_id,
-          rc);
-    }
-    else if ((rc = receive_connack()) != 0)
+    printf("Failed to read send window configuration, return code %d\r\n", rc);
+  }
+  else if ((rc = read_topic_configuration(ctx)) != 0)
+  {
+    printf("Failed to read topic configuration, return code %d\r\n", rc);
+  }
+  else if ((rc = read_session_cache_configuration(ctx)) != 0)
+  {
+    printf("Failed to read session cache configuration, return code %d\r\n", rc);
+  }
+  else if ((rc = read_aggregation_configuration(ctx)) != 0)
+  {
+    printf("Failed to read aggregation configuration, return code %d\r\n", rc);
+  }
+  else if ((rc = read_encoding_configuration(ctx)) != 0)
+  {
+    printf("Failed to read payload encoding configuration, return code %d\r\n", rc);
+  }
+  else if ((rc = read_queue_configuration(ctx)) != 0)
+  {
+    printf("Failed to read offline queue configuration, return code %d\r\n", rc);
+  }
+  else if ((rc = read_sleep_configuration(ctx)) != 0)
+  {
+    printf("Failed to read sleep configuration, return code %d\r\n", rc);
+  }
+  else if ((rc = read_stream_configuration(ctx)) != 0)
+  {
+    printf("Failed to read telemetry stream configuration, return code %d\r\n", rc);
+  }
+  else if ((rc = read_filter_configuration(ctx)) != 0)
+  {
+    printf("Failed to read dead-band filter configuration, return code %d\r\n", rc);
+  }
+  else if ((rc = read_discovery_configuration(ctx)) != 0)
+  {
+    printf("Failed to read discovery configuration, return code %d\r\n", rc);
+  }
+  else if ((rc = read_property_topic_configuration(ctx)) != 0)
+  {
+    printf("Failed to read property topic configuration, return code %d\r\n", rc);
+  }
+  else if ((rc = read_impairment_configuration(ctx)) != 0)
+  {
+    printf("Failed to read impairment configuration, return code %d\r\n", rc);
+  }
+  else if ((rc = read_event_log_configuration()) != 0)
+  {
+    printf("Failed to read event log configuration, return code %d\r\n", rc);
+  }
+  else if ((rc = read_capture_configuration()) != 0)
+  {
+    printf("Failed to read capture configuration, return code %d\r\n", rc);
+  }
+  else if (
+      (rc = telemetry_encoder_init(&ctx->encoder, ctx->payload_encoding, &telemetry_schema))
+      != 0)
+  {
+    printf("Unknown payload encoding %s, use json or delta\r\n", ctx->payload_encoding);
+  }
+  else if (
+      (rc = telemetry_filter_init(
+           &ctx->filter,
+           &telemetry_schema,
+           ctx->deadband,
+           ctx->heartbeat_intervals,
+           ctx->deadband_summary))
+      != 0)
+  {
+    printf(
+        "Invalid dead-bands %s, use field:band[,field:band...] with a band in the units of the "
+        "field or in %% of its value, and * for every other field\r\n",
+        ctx->deadband);
+  }
+  else if (ctx->deadband_summary && !ctx->encoder.json)
+  {
+    printf("Dead-band summaries are JSON, they need the json payload encoding\r\n");
+    rc = -1;
+  }
+  else if (
+      (rc = telemetry_aggregator_init(
+           &ctx->aggregator,
+           telemetry_aggregator_max_payload(ctx->path_mtu),
+           ctx->aggregate_readings,
+           (uint64_t)ctx->aggregate_delay_ms * 1000,
+           ctx->encoder.json))
+      != 0)
+  {
+    printf("Invalid aggregation configuration, path MTU = %d\r\n", ctx->path_mtu);
+  }
+  else if (
+      (rc = telemetry_scheduler_init(&ctx->scheduler)) != 0
+      || (rc = telemetry_scheduler_add_streams(&ctx->scheduler, ctx->telemetry_streams)) != 0)
+  {
+    printf(
+        "Invalid telemetry streams %s, use name:rate[,name:rate...] with at most %d streams\r\n",
+        ctx->telemetry_streams,
+        TELEMETRY_SCHEDULER_MAX_STREAMS);
+  }
+  else if (
+      (rc = offline_queue_open(
+           &ctx->queue, ctx->queue_file, (size_t)ctx->queue_size_kb * 1024, ctx->queue_depth))
+      != 0)
+  {
+    printf("Failed to open the offline queue, return code %d\r\n", rc);
+  }
+  else
+  {
+    if (ctx->queue.recovered > 0)
     {
       printf(
-          "Failed to receive CONNACK packet from Gateway for device ID = %s, return code = %d\r\n",
-          ctx->device_id,
-          rc);
-    }
-
-    if (rc != 0)
-    {
-      int timeout_seconds = get_connection_timeout_seconds(++retry_attempt);
-      printf("Retry attempt number %d waiting %d\n", retry_attempt, timeout_seconds);
-
-      sleep_seconds(timeout_seconds);
+          "Recovered %llu queued messages from %s\r\n",
+          (unsigned long long)ctx->queue.recovered,
+          ctx->queue_file);
     }
 
-  } while (rc != 0);
+    ctx->sensor.values[0] = 12;
+    ctx->sensor.values[1] = 4;
+    ctx->sensor.values[2] = 12;
+    ctx->sensor.values[3] = 18;
+  }
 
   return rc;
 }
 
 /*
- * 1. Create REGISTER packet
- * 2. Send REGISTER packet to the MQTTSN Gateway
+ * Look the telemetry topic up in the mapping file shared with the Gateway.
+ * Return the predefined topic ID, or 0 to REGISTER the topic name
  */
-static int send_topic_registration(IOTHUB_CLIENT_CONTEXT* ctx, MQTTSNString* topic_str)
+static unsigned short get_predefined_topic_id(IOTHUB_CLIENT_CONTEXT* ctx)
 {
-  int rc;
-  int len;
-
-  // 1. Create REGISTER packet (by registering the topic name with the MQTTSN Gateway)
-  printf("Registering topic %s\r\n", topic_name);
+  PREDEFINED_TOPICS topics;
+  unsigned short topic_id;
 
-  topic_str->cstring = topic_name;
-  topic_str->lenstring.len = strlen(topic_name);
-
-  if ((len = MQTTSNSerialize_register(
-           scratch_buffer, sizeof(scratch_buffer), 0, ctx->packet_id, topic_str))
-      <= 0)
+  if (ctx->predefined_topic_file[0] == '\0'
+      || predefined_topics_load(&topics, ctx->predefined_topic_file) != 0)
   {
-    printf("Failed to serialize REGISTER packet, return code %d\r\n", len);
-    return len;
+    return 0;
   }
 
-  // 2. Send REGISTER packet to the MQTTSN Gateway
-  if ((rc
-       = transport_sendPacketBuffer(ctx->gateway_address, ctx->gateway_port, scratch_buffer, len))
-      != 0)
+  if ((topic_id = predefined_topics_lookup(&topics, ctx->device_id, topic_name)) != 0)
   {
-    printf("Failed to send REGISTER packet to the Gateway, return code %d\r\n", rc);
-    return rc;
+    printf("Using predefined topic ID = %hu for %s\r\n", topic_id, topic_name);
+  }
+  else
+  {
+    printf("Topic %s is not predefined, it will be registered\r\n", topic_name);
   }
 
-  return 0;
+  predefined_topics_deinit(&topics);
+  return topic_id;
 }
 
 /*
- * 1. Wait for REGACK packet from the MQTTSN Gateway
- * 2. Save received topic ID
+ * Find the Gateways on the discovery group and pick the one with the lowest score, the configured
+ * Gateway if none answers. The search keeps running in the background to rank them for failover.
+ * 1. Add the configured Gateway to the table
+ * 2. Multicast SEARCHGW and collect GWINFO replies until the round closes
+ * 3. Use the best Gateway
  */
-static int receive_topic_registration_ack(IOTHUB_CLIENT_CONTEXT* ctx, unsigned short* topic_id)
+static int discover_gateways(IOTHUB_CLIENT_CONTEXT* ctx)
 {
-  int len;
+  int rc;
+  uint64_t now_us = time_util_now_us();
+  GATEWAY_DISCOVERY* discovery = &ctx->discovery;
+  GATEWAY_TABLE_ENTRY* best;
+  struct pollfd pfd;
+
+  // 1. Add the configured Gateway to the table
+  gateway_table_init(&ctx->gateways);
+  gateway_table_add(&ctx->gateways, ctx->gateway_address, ctx->gateway_port);
+
+  // 2. Multicast SEARCHGW and collect GWINFO replies until the round closes
+  if ((rc = gateway_discovery_open(
+           discovery,
+           ctx->discovery_group,
+           ctx->discovery_port,
+           (uint64_t)ctx->discovery_interval_s * 1000000,
+           &ctx->gateways))
+          != 0
+      || (rc = gateway_discovery_search(discovery, now_us)) != 0)
+  {
+    return rc;
+  }
 
-  // 1. Wait for REGACK packet from the MQTTSN Gateway
-  if (MQTTSNPacket_read(scratch_buffer, sizeof(scratch_buffer), transport_getdata) == MQTTSN_REGACK)
+  printf("Searching for Gateways on %s:%d\r\n", ctx->discovery_group, ctx->discovery_port);
+  pfd.fd = discovery->sock;
+  pfd.events = POLLIN;
+  while (discovery->search_sent_us != 0)
   {
-    unsigned short sub_msg_id;
-    unsigned char return_code;
+    uint64_t deadline_us = gateway_discovery_next_deadline_us(discovery);
 
-    // 2. Save received topic ID
-    if (MQTTSNDeserialize_regack(
-            topic_id, &sub_msg_id, &return_code, scratch_buffer, sizeof(scratch_buffer))
-            != 1
-        || return_code != 0)
+    if (poll(&pfd, 1, deadline_us > now_us ? (int)((deadline_us - now_us + 999) / 1000) : 0) < 0
+        || (rc = gateway_discovery_step(discovery, now_us = time_util_now_us())) != 0)
     {
-      printf("Failed to deserialize REGACK packet, return code %d\r\n", return_code);
-      return -1;
-    }
-    else
-    {
-      printf("Successfully received REGACK for topic id = %d \r\n", *topic_id);
+      printf("Failed to discover Gateways\r\n");
+      return rc != 0 ? rc : -1;
     }
   }
-  else
+
+  // 3. Use the best Gateway
+  gateway_table_print(&ctx->gateways, now_us);
+  if ((best = gateway_table_best(&ctx->gateways, NULL, now_us)) != NULL)
   {
-    printf("Failed to receive REGACK\r\n");
-    return -1;
+    snprintf(ctx->gateway_address, sizeof(ctx->gateway_address), "%s", best->address);
+    ctx->gateway_port = best->port;
   }
 
+  printf("Selected Gateway %s:%d\r\n", ctx->gateway_address, ctx->gateway_port);
   return 0;
 }
 
 /*
- * 1. Send registration for long topic name to Gateway
- * 2. Receive registration ack
- * 3. Retry with backoff if fail to register
+ * Open the session cache file, if there is one, and return the session saved by the previous run
+ * for this device and Gateway, or NULL for a cold start
  */
-static int register_topic(
-    IOTHUB_CLIENT_CONTEXT* ctx,
-    char* topic_name,
-    int topic_len,
-    unsigned short* topic_id)
+static const SESSION_CACHE_RECORD* open_session_cache(IOTHUB_CLIENT_CONTEXT* ctx)
 {
-  int rc;
-  int len;
-  int retry_attempt = 0;
-  MQTTSNString topic_str;
-  topic_str.cstring = topic_name;
-  topic_str.lenstring.len = topic_len;
+  const SESSION_CACHE_RECORD* session;
 
-  do
+  if (ctx->session_cache_file[0] == '\0'
+      || session_cache_open(&ctx->session_cache, ctx->session_cache_file) != 0)
   {
-    if ((rc = send_topic_registration(ctx, &topic_str)) != 0)
-    {
-      printf(
-          "Failed to send REGISTER packet with Gateway the topic name = %s, return code = %d\r\n",
-          topic_name,
-          rc);
-    }
-    else if ((rc = receive_topic_registration_ack(ctx, topic_id)) != 0)
-    {
-      printf(
-          "Failed to receive REGACK packet from Gateway for topic name = %s, return code = %d\r\n",
-          topic_name,
-          rc);
-    }
+    return NULL;
+  }
 
-    if (rc != 0)
-    {
-      int timeout_seconds = get_connection_timeout_seconds(++retry_attempt);
-      printf("Retry attempt number %d waiting %d\n", retry_attempt, timeout_seconds);
+  session = session_cache_find(
+      &ctx->session_cache, ctx->device_id, ctx->gateway_address, ctx->gateway_port);
+  return session != NULL && !session->clean_session ? session : NULL;
+}
 
-      sleep_seconds(timeout_seconds);
-    }
+/*
+ * Save the topic and the last packet ID, so that the next start can resume the session
+ */
+static void save_session(IOTHUB_CLIENT_CONTEXT* ctx)
+{
+  SESSION_CACHE_RECORD record;
+  MQTTSN_CLIENT* client = &ctx->mqttsn_client;
 
-  } while (rc != 0);
+  if (ctx->session_cache.file == NULL)
+  {
+    return;
+  }
 
-  return 0;
+  memset((void*)&record, 0, sizeof(record));
+  snprintf(record.client_id, sizeof(record.client_id), "%s", ctx->device_id);
+  snprintf(
+      record.gateway_address,
+      sizeof(record.gateway_address),
+      "%s",
+      client->options.gateway_address);
+  record.gateway_port = client->options.gateway_port;
+  snprintf(record.topic_name, sizeof(record.topic_name), "%s", topic_name);
+  record.topic_type = client->topic_type;
+  record.topic_id = client->topic_id;
+  record.packet_id = client->packet_id;
+  record.clean_session = 0; // DISCONNECT without a duration leaves the session to the Gateway
+
+  if (session_cache_save(&ctx->session_cache, &record) != 0)
+  {
+    printf("Failed to save the session to %s\r\n", ctx->session_cache_file);
+  }
 }
 
 /*
- * 1. Create PUBLISH packet
- * 2. Send PUBLISH packet to the MQTTSN Gateway
+ * 1. Discover the Gateways on the discovery group, if there is one, and select the best
+ * 2. Get telemetry topic name and topic ID from the session cache, or the topic name from the
+ *    Azure IoT Hub
+ * 3. Open the non-blocking MQTTSN client, with the cached or predefined topic ID if there is one
+ * 4. Start connecting to the Gateway and registering the topic, or resuming the cached session;
+ *    the handshake, with its retries and backoff, then progresses while the application runs
  */
-static int send_publish(IOTHUB_CLIENT_CONTEXT* ctx, unsigned char* payload, int payload_size)
+static int connect_device(IOTHUB_CLIENT_CONTEXT* ctx)
 {
   int rc;
-  int len;
-  int retained = 0;
-  MQTTSN_topicid topic;
-  int qos;
+  size_t len;
+  MQTTSN_CLIENT_OPTIONS options = mqttsn_client_options_default();
+  const SESSION_CACHE_RECORD* session;
 
-#ifdef ENABLE_PUBACK
-  qos = 1;
+  // 1. Discover the Gateways on the discovery group, if there is one, and select the best
+  if (ctx->discovery_group[0] != '\0' && (rc = discover_gateways(ctx)) != 0)
+  {
+    return rc;
+  }
+
+  // 2. Get telemetry topic name and topic ID from the session cache, or the topic name from the
+  //    Azure IoT Hub
+  session = open_session_cache(ctx);
+  ctx->warm_start = session != NULL;
+  if (session != NULL)
+  {
+    memcpy(topic_name, session->topic_name, sizeof(topic_name));
+    printf("Resuming the session with topic ID = %hu\r\n", session->topic_id);
+  }
+  else if (az_failed(
+          rc = az_iot_hub_client_telemetry_get_publish_topic(
+              &ctx->client, NULL, topic_name, sizeof(topic_name), &len)))
+  {
+    printf("Failed to get publish topic, return code %d\r\n", rc);
+    return rc;
+  }
+
+  // 3. Open the non-blocking MQTTSN client, with the cached or predefined topic ID if there is one
+  latency_histogram_init(&ctx->puback_latency);
+  latency_histogram_init(&ctx->recovery_time);
+  latency_histogram_init(&ctx->failover_time);
+  wire_stats_init(&ctx->wire_stats);
+  options.client_id = ctx->device_id;
+  options.topic_name = topic_name;
+  options.predefined_topic_id = session == NULL ? get_predefined_topic_id(ctx) : 0;
+  options.gateway_address = ctx->gateway_address;
+  options.gateway_port = ctx->gateway_port;
+#ifdef SRC_PORT
+  options.src_port = SRC_PORT;
+#endif
+#if defined(AZ_TELEMETRY_QOS_MINUS_1)
+  options.qos = -1; // no connection, needs a predefined topic ID
+#elif defined(ENABLE_PUBACK)
+  options.qos = 1;
 #else
-  qos = 0;
+  options.qos = 0;
 #endif
+  options.send_window_size = ctx->send_window_size;
+  options.zero_copy = 1; // a queued message stays in the offline queue until it leaves the window
+  options.use_timerfd = 1;
+  options.verbose = 1;
+  options.puback_latency = &ctx->puback_latency;
+  options.recovery_time = &ctx->recovery_time;
+  options.wire_stats = &ctx->wire_stats;
+  options.impairment = ctx->impaired ? &ctx->impairment : NULL;
+  options.gateways = ctx->discovery_group[0] != '\0' ? &ctx->gateways : NULL;
+  options.failover_timeouts = ctx->failover_timeouts;
+  options.failover_time = &ctx->failover_time;
+  options.topic_registry_size = ctx->property_topics > 0 ? ctx->topic_registry_size : 0;
+
+  if ((rc = mqttsn_client_init(&ctx->mqttsn_client, &options)) != 0)
+  {
+    printf("Failed to initialize MQTTSN client, return code %d\r\n", rc);
+    return rc;
+  }
 
-  topic.type = MQTTSN_TOPIC_TYPE_NORMAL;
-  topic.data.id = ctx->telemetry_topic_id;
-
-  // 1. Create PUBLISH packet
-  if ((len = MQTTSNSerialize_publish(
-           scratch_buffer,
-           sizeof(scratch_buffer),
-           0,
-           qos,
-           retained,
-           ctx->packet_id,
-           topic,
-           payload,
-           payload_size))
-      <= 0)
-  {
-    printf("Failed to serialize PUBLISH packet, return code %d\r\n", len);
-    return len;
-  }
-
-  // 2. Send PUBLISH packet to the MQTTSN Gateway
-  if ((rc
-       = transport_sendPacketBuffer(ctx->gateway_address, ctx->gateway_port, scratch_buffer, len))
-      != 0)
+  // 4. Start connecting to the Gateway and registering the topic, or resuming the cached session
+  if (session != NULL)
+  {
+    mqttsn_client_resume(
+        &ctx->mqttsn_client, session->topic_type, session->topic_id, session->packet_id);
+  }
+  ctx->connect_us = time_util_now_us();
+  if ((rc = mqttsn_client_connect(&ctx->mqttsn_client)) != 0)
   {
     printf(
-        "Failed to send PUBLISH packet with packet id = %d, return code %d\r\n",
-        ctx->packet_id,
+        "Failed to send CONNECT packet to Gateway for device ID = %s, return code = %d\r\n",
+        ctx->device_id,
         rc);
-
     return rc;
   }
 
-  printf("Successfully published telemetry payload of length = %d\r\n", len);
-
   return 0;
 }
 
-#ifdef ENABLE_PUBACK
 /*
- * 1. Wait for PUBACK packet from the MQTTSN Gateway
- * 2. Validate packet ID
+ * Get the telemetry topic of the message carrying the application property part=<part>, one of
+ * property_topics topics the messages are spread over
  */
-static int receive_puback(IOTHUB_CLIENT_CONTEXT* ctx, unsigned short* packet_id)
+static int get_property_topic(IOTHUB_CLIENT_CONTEXT* ctx, int part, char* topic, size_t topic_size)
 {
-  unsigned short packet_id_received;
+  char properties_buffer[32];
+  char part_value[12];
+  az_iot_hub_client_properties properties;
+  az_result rc;
 
-  // 1. Wait for PUBACK packet from the MQTTSN Gateway
-  if (MQTTSNPacket_read(scratch_buffer, sizeof(scratch_buffer), transport_getdata) == MQTTSN_PUBACK)
+  snprintf(part_value, sizeof(part_value), "%d", part);
+  if (az_failed(
+          rc = az_iot_hub_client_properties_init(
+              &properties, AZ_SPAN_FROM_BUFFER(properties_buffer), 0))
+      || az_failed(
+          rc = az_iot_hub_client_properties_append(
+              &properties, AZ_SPAN_FROM_STR("part"), az_span_from_str(part_value)))
+      || az_failed(
+          rc = az_iot_hub_client_telemetry_get_publish_topic(
+              &ctx->client, &properties, topic, topic_size, NULL)))
   {
-    unsigned short topic_id;
-    unsigned char return_code;
+    printf("Failed to get the publish topic of part %d, return code %d\r\n", part, rc);
+    return -1;
+  }
 
-    if (MQTTSNDeserialize_puback(
-            &topic_id, &packet_id_received, &return_code, scratch_buffer, sizeof(scratch_buffer))
-            != 1
-        || return_code != MQTTSN_RC_ACCEPTED)
-    {
-      printf(
-          "Failed to deserialize PUBACK packet ID = %hu, return code %d\r\n",
-          packet_id_received,
-          return_code);
-      return -1;
-    }
-    else
-    {
-      printf("Successfully received PUBACK for packet ID = %hu\r\n", packet_id_received);
-    }
+  return 0;
+}
+
+/*
+ * Simulated sensor read: the values drift by at most one unit per reading. The reading is encoded
+ * with encoder, a copy of the configured payload encoder that is kept only if the reading is
+ * published.
+ */
+static int sample_sensor(
+    IOTHUB_CLIENT_CONTEXT* ctx,
+    TELEMETRY_ENCODER* encoder,
+    unsigned char** payload)
+{
+  for (int i = 0; i < telemetry_schema.field_count; i++)
+  {
+    ctx->sensor.values[i] += rand() % 3 - 1;
   }
-  else
+
+  *payload = ctx->reading;
+  return telemetry_encoder_encode(encoder, &ctx->sensor, ctx->reading, sizeof(ctx->reading));
+}
+
+/*
+ * Print the throughput achieved with the configured send window, the estimated radio-on time per
+ * message, how the offline queue filled and drained and the bytes on the wire per reading with the
+ * configured aggregation, followed by the bytes per reading for other aggregate sizes
+ */
+static void report_telemetry_throughput(
+    IOTHUB_CLIENT_CONTEXT* ctx,
+    int readings,
+    int messages,
+    int reading_size,
+    uint64_t elapsed_us)
+{
+  double elapsed_seconds = (double)elapsed_us / 1e6;
+  double backlog_seconds = (double)ctx->backlog_us / 1e6;
+  uint64_t now_us = time_util_now_us();
+  double radio_on_ms = (double)mqttsn_client_radio_on_us(&ctx->mqttsn_client, now_us) / 1000.0;
+  double session_ms = (double)(now_us - ctx->connect_us) / 1000.0;
+  MQTTSN_CLIENT_STATS* stats = &ctx->mqttsn_client.stats;
+  uint64_t wire_bytes = stats->publish_bytes_sent
+      + stats->publish_packets_sent * TELEMETRY_AGGREGATOR_IP_UDP_HEADER_SIZE;
+
+  printf(
+      "Send window = %d, messages = %d, elapsed = %.3f s, throughput = %.2f msg/s\r\n",
+      ctx->send_window_size,
+      messages,
+      elapsed_seconds,
+      elapsed_seconds > 0 ? (double)messages / elapsed_seconds : 0.0);
+  printf(
+      "Retransmissions = %llu, recoveries = %llu, messages lost = %llu\r\n",
+      (unsigned long long)stats->retransmissions,
+      (unsigned long long)stats->recoveries,
+      (unsigned long long)stats->messages_lost);
+  printf(
+      "SRTT = %.1f ms, RTTVAR = %.1f ms, RTO = %.1f ms, RTT samples = %llu, backoffs = %llu\r\n",
+      (double)ctx->mqttsn_client.rtt.srtt_us / 1000.0,
+      (double)ctx->mqttsn_client.rtt.rttvar_us / 1000.0,
+      (double)ctx->mqttsn_client.rtt.rto_us / 1000.0,
+      (unsigned long long)ctx->mqttsn_client.rtt.samples,
+      (unsigned long long)ctx->mqttsn_client.rtt.backoffs);
+  printf(
+      "%s start, time to first PUBLISH = %.1f ms\r\n",
+      ctx->warm_start ? "Warm" : "Cold",
+      (double)(ctx->first_publish_us - ctx->start_us) / 1000.0);
+  printf(
+      "Sleep duration = %d s, sleeps = %llu, wake-ups = %llu\r\n",
+      ctx->sleep_duration_s,
+      (unsigned long long)stats->sleeps,
+      (unsigned long long)stats->wakeups);
+  printf(
+      "Radio on = %.1f ms of %.1f ms (%.1f%%), %.1f ms per message, always on = %.1f ms per "
+      "message\r\n",
+      radio_on_ms,
+      session_ms,
+      session_ms > 0 ? radio_on_ms * 100.0 / session_ms : 0.0,
+      messages > 0 ? radio_on_ms / messages : 0.0,
+      messages > 0 ? session_ms / messages : 0.0);
+  printf(
+      "Offline queue: footprint = %zu bytes, depth limit = %d, peak depth = %d, recovered = %llu, "
+      "dropped = %llu (%d readings)\r\n",
+      ctx->queue.map_size,
+      ctx->queue.max_depth,
+      ctx->queue.peak_depth,
+      (unsigned long long)ctx->queue.recovered,
+      (unsigned long long)ctx->queue.dropped,
+      ctx->dropped_readings);
+  printf(
+      "Backlog drained = %llu messages in %.3f s, drain throughput = %.2f msg/s, drain rate = %d "
+      "msg/s\r\n",
+      (unsigned long long)ctx->backlog_messages,
+      backlog_seconds,
+      backlog_seconds > 0 ? (double)ctx->backlog_messages / backlog_seconds : 0.0,
+      ctx->drain_rate);
+  printf(
+      "REGISTER round trips saved = %llu, bytes saved = %llu\r\n",
+      (unsigned long long)stats->register_round_trips_saved,
+      (unsigned long long)stats->register_bytes_saved);
+  printf(
+      "Readings = %d, readings per message = %.2f, PUBLISH bytes on wire per reading = %.1f\r\n",
+      readings,
+      messages > 0 ? (double)readings / messages : 0.0,
+      readings > 0 ? (double)wire_bytes / readings : 0.0);
+  telemetry_scheduler_print(&ctx->scheduler);
+  if (ctx->filter.enabled)
   {
-    printf("Failed to receive PUBACK packet\r\n");
-    return -1;
+    telemetry_filter_print(&ctx->filter);
   }
+  printf("Payload encoding = %s, reading size = %d bytes\r\n", ctx->encoder.name, reading_size);
+  telemetry_aggregator_print_wire_table(reading_size, ctx->aggregator.max_size, ctx->encoder.json);
+  latency_histogram_print(&ctx->puback_latency, "PUBACK latency");
+  latency_histogram_print(&ctx->recovery_time, "Recovery time");
 
-  // 2. Validate packet ID
-  if (*packet_id != packet_id_received)
+  if (ctx->property_topics > 0)
   {
-    printf("Failed to receive PUBACK packet for the requested packet ID = %hu\r\n", *packet_id);
-    return -1;
+    TOPIC_REGISTRY_STATS* registry_stats = &ctx->mqttsn_client.registry.stats;
+
+    printf(
+        "Property topics = %d, topic registry size = %d, hits = %llu, misses = %llu, evictions = "
+        "%llu, registrations = %llu, most REGISTER packets in flight = %d\r\n",
+        ctx->property_topics,
+        ctx->topic_registry_size,
+        (unsigned long long)registry_stats->hits,
+        (unsigned long long)registry_stats->misses,
+        (unsigned long long)registry_stats->evictions,
+        (unsigned long long)registry_stats->registrations,
+        registry_stats->max_pending);
   }
 
-  return 0;
+  if (ctx->mqttsn_client.options.gateways != NULL)
+  {
+    printf(
+        "Gateway = %s:%d, failovers = %llu, switches to a faster Gateway = %llu\r\n",
+        ctx->mqttsn_client.options.gateway_address,
+        ctx->mqttsn_client.options.gateway_port,
+        (unsigned long long)stats->failovers,
+        (unsigned long long)stats->gateway_switches);
+    latency_histogram_print(&ctx->failover_time, "Time to recover after failover");
+    gateway_table_print(&ctx->gateways, now_us);
+  }
 }
-#endif
 
 /*
- * 1. Get new message ID
- * 2. Publish message
- * 3. Wait for puback if enabled (QoS 1)
+ * Close the aggregate and append it to the offline queue; a full queue drops it
  */
-static int send_telemetry(IOTHUB_CLIENT_CONTEXT* ctx, unsigned char* payload, int payload_size)
+static int queue_aggregate(IOTHUB_CLIENT_CONTEXT* ctx)
 {
-  int rc;
-  int len;
+  unsigned char* payload;
+  int readings = ctx->aggregator.count;
+  int payload_size = telemetry_aggregator_close(&ctx->aggregator, &payload);
+  int rc = offline_queue_append(&ctx->queue, payload, payload_size);
 
-  // 1. Get new message ID
-  ctx->packet_id++;
+  telemetry_aggregator_reset(&ctx->aggregator);
 
-  // 2. Publish message
-  if ((rc = send_publish(ctx, payload, payload_size)) != 0)
+  if (rc < 0)
   {
-    printf(
-        "Failed to send PUBLISH packet for payload = %s, payload size = %d\r\n",
-        payload,
-        payload_size);
+    printf("Message of %d bytes does not fit in the offline queue\r\n", payload_size);
     return rc;
   }
-  // 3. Wait for puback if enabled (QoS 1)
-#ifdef ENABLE_PUBACK
-  else if ((rc = receive_puback(ctx, &ctx->packet_id)) != 0)
+
+  if (rc == OFFLINE_QUEUE_FULL)
   {
-    printf(
-        "Failed to receive PUBACK packet for payload = %s, payload size = %d\r\n",
-        payload,
-        payload_size);
-    return rc;
+    printf("Offline queue full, dropped a message of %d readings\r\n", readings);
+    ctx->dropped_readings += readings;
   }
-#endif
 
   return 0;
 }
 
 /*
- * 1. Get telemetry topic name from the Azure IoT Hub
- * 2. Register the topic with the Gateway to get topic ID
- * 3. Send sample telemetry messages
+ * Add a reading to the aggregate, queueing the aggregate first when the reading does not fit
  */
-static int send_sample_telemetry_messages(IOTHUB_CLIENT_CONTEXT* ctx)
+static int aggregate_reading(
+    IOTHUB_CLIENT_CONTEXT* ctx,
+    const unsigned char* reading,
+    int reading_size,
+    uint64_t now_us)
 {
   int rc;
-  int len;
-  int retry_attempt = 0;
-  int index = 0;
 
-  // 1. Get telemetry topic name from the Azure IoT Hub
-  if (az_failed(
-          rc = az_iot_hub_client_telemetry_get_publish_topic(
-              &ctx->client, NULL, topic_name, sizeof(topic_name), (size_t*)&len)))
+  if ((rc = telemetry_aggregator_add(&ctx->aggregator, reading, reading_size, now_us))
+      == TELEMETRY_AGGREGATOR_FULL)
   {
-    printf("Failed to get publish topic, return code %d\r\n", rc);
-    return rc;
+    if ((rc = queue_aggregate(ctx)) != 0)
+    {
+      return rc;
+    }
+
+    rc = telemetry_aggregator_add(&ctx->aggregator, reading, reading_size, now_us);
   }
 
-  // 2. Register the topic with the Gateway to get topic ID
-  if ((rc = register_topic(ctx, topic_name, len, &ctx->telemetry_topic_id)) != 0)
+  if (rc != 0)
   {
-    printf("Failed to register telemetry topic, return code %d\r\n", rc);
-    return rc;
+    printf(
+        "Reading of %d bytes does not fit in a PUBLISH payload of %d bytes\r\n",
+        reading_size,
+        ctx->aggregator.max_size);
+  }
+
+  return rc;
+}
+
+/*
+ * Account a PUBLISH to the drain throughput: a backlog lasts from the first PUBLISH that leaves
+ * queued messages behind to the PUBLISH that empties the queue
+ */
+static void account_backlog(IOTHUB_CLIENT_CONTEXT* ctx, uint64_t now_us)
+{
+  int has_unsent = offline_queue_has_unsent(&ctx->queue);
+
+  if (ctx->backlog_since_us == 0 && has_unsent)
+  {
+    ctx->backlog_since_us = now_us;
   }
 
-  // 3. Send sample telemetry messages
-  while(index < NUMBER_OF_MESSAGES)
+  if (ctx->backlog_since_us != 0)
   {
-    printf("Sending Message %d\r\n", index + 1);
+    ctx->backlog_messages++;
+    if (!has_unsent)
+    {
+      ctx->backlog_us += now_us - ctx->backlog_since_us;
+      ctx->backlog_since_us = 0;
+    }
+  }
+}
+
+/*
+ * Sample the sensor at the rate of each telemetry stream, aggregate the readings into the offline
+ * queue and publish the queue while the MQTTSN client works on the network in between. Readings
+ * are paced by absolute deadlines on a timerfd, so neither the time spent publishing nor the poll
+ * timeout granularity shifts the schedule. Sampling never waits for the network: while the Gateway
+ * cannot be reached messages pile up in the queue, and once it answers they are drained as fast as
+ * the send window and the drain rate allow.
+ * 1. Wait until a reading, the aggregate deadline or the next drain slot is due or the client or
+ *    the Gateway discovery has a datagram or an expired deadline
+ * 2. Let the client process datagrams and retransmissions, and release the acknowledged messages
+ *    from the queue. Let the discovery rank the Gateways the client fails over to.
+ * 3. Sample the sensor for every stream that is due and add the readings that leave their
+ *    dead-bands to the aggregate, queueing the aggregate first when a reading does not fit
+ * 4. Queue the aggregate when it reached its deadline or holds the last reading
+ * 5. Publish queued messages as long as the send window has room, waking the client up from sleep
+ *    first, to the telemetry topic or spread over the property topics
+ * 6. With a sleep duration, put the client to sleep once every queued message was acknowledged
+ * 7. Write out what the event log ring holds
+ */
+static int send_sample_telemetry_messages(IOTHUB_CLIENT_CONTEXT* ctx)
+{
+  int rc;
+  int index = 0;
+  int messages = 0;
+  int published;
+  int busy = 0; // the client refused the last message, retry once it made progress
+  int reading_size = 0;
+  int summary_size;
+  int payload_size;
+  unsigned char* reading;
+  unsigned char* payload;
+  uint64_t position;
+  char property_topic[TOPIC_REGISTRY_NAME_SIZE];
+  uint64_t start_us = 0;
+  uint64_t next_drain_us = 0;
+  MQTTSN_CLIENT* client = &ctx->mqttsn_client;
+  TELEMETRY_AGGREGATOR* aggregator = &ctx->aggregator;
+  OFFLINE_QUEUE* queue = &ctx->queue;
+  TELEMETRY_SCHEDULER* scheduler = &ctx->scheduler;
+  TELEMETRY_STREAM* stream;
+  TELEMETRY_ENCODER encoder;
+  struct pollfd pfds[3];
+
+  pfds[0].events = POLLIN;
+  pfds[1].fd = ctx->discovery.sock; // -1 without discovery, ignored by poll
+  pfds[1].events = POLLIN;
+  pfds[2].fd = telemetry_scheduler_poll_fd(scheduler);
+  pfds[2].events = POLLIN;
+  telemetry_scheduler_start(scheduler, time_util_now_ns());
+
+  while (index < NUMBER_OF_MESSAGES || aggregator->count > 0 || offline_queue_depth(queue) > 0)
+  {
+    uint64_t now_us = time_util_now_us();
+    uint64_t wake_us = aggregator->deadline_us;
+    int timeout_ms = -1;
+
+    // 1. Wait until a reading, the aggregate deadline or the next drain slot is due or the client
+    //    or the discovery needs attention. Readings wake us up through the scheduler timerfd;
+    //    while the send window is full only they, the client and the discovery can.
+    if (ctx->discovery.sock >= 0 && gateway_discovery_next_deadline_us(&ctx->discovery) < wake_us)
+    {
+      wake_us = gateway_discovery_next_deadline_us(&ctx->discovery);
+    }
+
+    if (offline_queue_has_unsent(queue) && mqttsn_client_can_publish(client) && !busy
+        && next_drain_us < wake_us)
+    {
+      wake_us = next_drain_us;
+    }
+
+    if (wake_us != UINT64_MAX)
+    {
+      timeout_ms = wake_us > now_us ? (int)((wake_us - now_us + 999) / 1000) : 0;
+    }
+
+    pfds[0].fd = mqttsn_client_poll_fd(client);
+    if (poll(pfds, 3, timeout_ms) < 0)
+    {
+      printf("Failed to poll the MQTTSN client\r\n");
+      return -1;
+    }
+
+    // 2. Let the client process datagrams and retransmissions, and release the acknowledged
+    //    messages from the queue. A message the client gave up on is released as well. A failover
+    //    resends the messages in flight to the new Gateway.
+    if ((rc = mqttsn_client_step(client)) != 0)
+    {
+      printf("MQTTSN client step failed, return code %d\r\n", rc);
+      return rc;
+    }
 
-    // Attempt sending messages with some backoff
-    if ((rc = send_telemetry(ctx, TELEMETRY_PAYLOAD, sizeof(TELEMETRY_PAYLOAD)) != 0))
+    busy = 0;
+
+    if (ctx->discovery.sock >= 0
+        && (rc = gateway_discovery_step(&ctx->discovery, time_util_now_us())) != 0)
     {
-      int timeout_seconds = get_connection_timeout_seconds(++retry_attempt);
-      printf("Retry attempt number %d waiting %d\n", retry_attempt, timeout_seconds);
+      printf("Gateway discovery failed, return code %d\r\n", rc);
+      return rc;
+    }
 
-      sleep_seconds(timeout_seconds);
+    offline_queue_commit(queue, mqttsn_client_lowest_tag_in_flight(client));
 
-      continue;
+    // 3. Sample the sensor for every stream that is due and add the readings that leave their
+    //    dead-bands to the aggregate, queueing the aggregate first when a reading does not fit.
+    //    The scheduler stops with the last reading, which is always published.
+    while (index < NUMBER_OF_MESSAGES
+           && (stream = telemetry_scheduler_next_due(scheduler, time_util_now_ns())) != NULL)
+    {
+      now_us = time_util_now_us();
+      encoder = ctx->encoder;
+      if ((reading_size = sample_sensor(ctx, &encoder, &reading)) < 0)
+      {
+        printf("Failed to encode the reading of stream %s\r\n", stream->name);
+        return reading_size;
+      }
+
+      if (++index == NUMBER_OF_MESSAGES)
+      {
+        telemetry_scheduler_disarm(scheduler);
+      }
+
+      // A suppressed reading leaves the delta encoder where it was, the next record is relative
+      // to the last published one
+      if (!telemetry_filter_check(
+              &ctx->filter, &ctx->sensor, reading_size, index == NUMBER_OF_MESSAGES))
+      {
+        continue;
+      }
+
+      ctx->encoder = encoder;
+      if ((summary_size = telemetry_filter_summary_to_json(
+               &ctx->filter, ctx->summary, sizeof(ctx->summary)))
+              < 0
+          || (summary_size > 0
+              && (rc = aggregate_reading(
+                      ctx, (unsigned char*)ctx->summary, summary_size, now_us))
+                  != 0))
+      {
+        return summary_size < 0 ? summary_size : rc;
+      }
+
+      if ((rc = aggregate_reading(ctx, reading, reading_size, now_us)) != 0)
+      {
+        return rc;
+      }
     }
 
-    retry_attempt = 0;
+    if (index < NUMBER_OF_MESSAGES)
+    {
+      telemetry_scheduler_arm(scheduler, time_util_now_ns());
+    }
 
-    // Publish messages at an interval
-    sleep_seconds(TELEMETRY_SEND_INTERVAL_SECONDS);
-    index++;
+    // 4. Queue the aggregate when it reached its deadline or holds the last reading
+    now_us = time_util_now_us();
+    if (aggregator->count > 0
+        && (index == NUMBER_OF_MESSAGES || telemetry_aggregator_ready(aggregator, now_us))
+        && (rc = queue_aggregate(ctx)) != 0)
+    {
+      return rc;
+    }
+
+    // 5. Publish queued messages as long as the send window has room, waking the client up from
+    //    sleep first, to the telemetry topic or spread over the property topics. The position of a
+    //    message in the queue tags it until its PUBACK.
+    if (offline_queue_has_unsent(queue)
+        && (client->state == MQTTSN_CLIENT_ASLEEP || client->state == MQTTSN_CLIENT_AWAKE)
+        && (rc = mqttsn_client_connect(client)) != 0)
+    {
+      printf("Failed to wake the MQTTSN client up, return code %d\r\n", rc);
+      return rc;
+    }
+
+    published = 0;
+    while (now_us >= next_drain_us
+           && (payload_size = offline_queue_peek(queue, &payload, &position)) > 0)
+    {
+      if (ctx->property_topics == 0)
+      {
+        rc = mqttsn_client_publish_tagged(client, payload, payload_size, position);
+      }
+      else if (
+          (rc = get_property_topic(
+               ctx, messages % ctx->property_topics, property_topic, sizeof(property_topic)))
+          == 0)
+      {
+        rc = mqttsn_client_publish_topic(client, property_topic, payload, payload_size, position);
+      }
+
+      // Not connected, the send window is full or the topic is not registered yet: wait for the
+      // client to make progress
+      if (rc == MQTTSN_CLIENT_BUSY)
+      {
+        busy = 1;
+        break;
+      }
+
+      if (rc != 0)
+      {
+        printf(
+            "Failed to send PUBLISH packet for %s payload, payload size = %d\r\n",
+            ctx->encoder.name,
+            payload_size);
+        return rc;
+      }
+
+      offline_queue_advance(queue);
+      if (messages == 0)
+      {
+        start_us = ctx->first_publish_us = now_us;
+        save_session(ctx);
+      }
+
+      EVENT_LOG(
+          EVENT_LOG_LEVEL_INFO,
+          EVENT_LOG_MESSAGE_SENT,
+          messages + 1,
+          offline_queue_depth(queue),
+          0,
+          0);
+      account_backlog(ctx, now_us);
+      published++;
+      messages++;
+
+      if (ctx->drain_rate > 0)
+      {
+        next_drain_us = now_us + 1000000ULL / (uint64_t)ctx->drain_rate;
+      }
+    }
+
+    if (published > 0)
+    {
+      if ((rc = mqttsn_client_flush(client)) != 0)
+      {
+        printf("Failed to send PUBLISH packet, return code %d\r\n", rc);
+        return rc;
+      }
+
+      // Without PUBACK nothing stays in flight, the messages are released as soon as they are sent
+      offline_queue_commit(queue, mqttsn_client_lowest_tag_in_flight(client));
+    }
+
+    // 6. With a sleep duration, put the client to sleep once every queued message was acknowledged.
+    //    Readings keep being aggregated and queued while it sleeps.
+    if (ctx->sleep_duration_s > 0 && index < NUMBER_OF_MESSAGES && offline_queue_depth(queue) == 0
+        && (rc = mqttsn_client_sleep(client, ctx->sleep_duration_s)) < 0)
+    {
+      printf("Failed to put the MQTTSN client to sleep, return code %d\r\n", rc);
+      return rc;
+    }
+
+    // 7. Write out what the event log ring holds, off the path of the packets
+    event_log_flush();
   }
 
+  // Throughput is measured from the first PUBLISH, there is none if nothing was published
+  report_telemetry_throughput(
+      ctx, index, messages, reading_size, messages > 0 ? time_util_now_us() - start_us : 0);
+
   return 0;
 }
 
 /*
  * 1. Send Disconnect packet to the Gateway
- * 2. Close the transport
+ * 2. Save the session for the next start, close the offline queue, the discovery, the
+ *    transport, the event log and the capture
+ * 3. Print what the impairment did and the bytes and packets per message type as JSON
  */
 static int disconnect_device(IOTHUB_CLIENT_CONTEXT* ctx)
 {
   int rc;
-  int len;
 
   // 1. Send Disconnect packet to the Gateway
   printf("Disconnecting\r\n");
 
-  if ((len = MQTTSNSerialize_disconnect(scratch_buffer, sizeof(scratch_buffer), 0)) <= 0)
-  {
-    printf("Failed to serialize Disconnect packet, return code %d\r\n", len);
-    return -1;
-  }
-
-  if ((rc
-       = transport_sendPacketBuffer(ctx->gateway_address, ctx->gateway_port, scratch_buffer, len))
-      != 0)
+  if ((rc = mqttsn_client_disconnect(&ctx->mqttsn_client)) != 0)
   {
     printf("Failed to send Disconnect packet to the Gateway, return code %d\r\n", rc);
     return rc;
@@ -642,12 +1600,24 @@ static int disconnect_device(IOTHUB_CLIENT_CONTEXT* ctx)
 
   printf("Disconnected.\r\n");
 
-  // 2. Close the transport
-  if ((rc = transport_close()) != 0)
+  // 2. Save the session for the next start, close the offline queue, the discovery, the
+  //    transport, the event log and the capture
+  save_session(ctx);
+  session_cache_close(&ctx->session_cache);
+  offline_queue_close(&ctx->queue);
+  gateway_discovery_close(&ctx->discovery);
+  telemetry_scheduler_deinit(&ctx->scheduler);
+  mqttsn_client_deinit(&ctx->mqttsn_client);
+  event_log_close();
+  transport_capture_close();
+
+  // 3. Print what the impairment did and the bytes and packets per message type as JSON
+  if (ctx->impaired)
   {
-    printf("Failed to close transport socket, return code %d\r\n", rc);
-    return rc;
+    transport_impairment_print_totals();
   }
+  printf("Wire statistics:\r\n");
+  wire_stats_print_json(&ctx->wire_stats, stdout);
 
   return 0;
 }
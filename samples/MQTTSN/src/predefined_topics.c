@@ -0,0 +1,308 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "predefined_topics.h"
+
+#define PREDEFINED_TOPICS_LINE_SIZE 512
+
+static char* trim(char* str)
+{
+  char* end;
+
+  while (isspace((unsigned char)*str))
+  {
+    str++;
+  }
+
+  end = str + strlen(str);
+  while (end > str && isspace((unsigned char)end[-1]))
+  {
+    *--end = '\0';
+  }
+
+  return str;
+}
+
+// FNV-1a of the client ID followed by the topic ID
+static uint32_t hash_key(const char* client_id, unsigned short topic_id)
+{
+  uint32_t hash = 2166136261u;
+
+  while (*client_id != '\0')
+  {
+    hash = (hash ^ (unsigned char)*client_id++) * 16777619u;
+  }
+
+  hash = (hash ^ (topic_id >> 8)) * 16777619u;
+  return (hash ^ (topic_id & 0xFF)) * 16777619u;
+}
+
+/*
+ * Return the slot of the entry for client_id and topic_id, or the empty slot that ends its probe
+ * sequence
+ */
+static int find_slot(
+    const PREDEFINED_TOPICS* topics,
+    const char* client_id,
+    unsigned short topic_id,
+    uint32_t hash)
+{
+  int slot;
+
+  for (slot = (int)(hash & (uint32_t)topics->slot_mask); topics->slots[slot] >= 0;
+       slot = (slot + 1) & topics->slot_mask)
+  {
+    const PREDEFINED_TOPIC* entry = &topics->entries[topics->slots[slot]];
+
+    if (entry->hash == hash && entry->topic_id == topic_id
+        && strcmp(entry->client_id, client_id) == 0)
+    {
+      break;
+    }
+  }
+
+  return slot;
+}
+
+/*
+ * Index every entry by client ID and topic ID. When a client maps a topic ID twice, the first entry
+ * wins, as it did for a scan of the file.
+ * Return 0 on success, -1 if the table cannot be allocated
+ */
+static int build_index(PREDEFINED_TOPICS* topics)
+{
+  int slot_count = 16;
+
+  // At most half the slots in use, so that probe sequences stay short
+  while (slot_count < 2 * topics->count)
+  {
+    slot_count *= 2;
+  }
+
+  if ((topics->slots = (int*)malloc((size_t)slot_count * sizeof(int))) == NULL)
+  {
+    return -1;
+  }
+
+  memset(topics->slots, 0xFF, (size_t)slot_count * sizeof(int));
+  topics->slot_mask = slot_count - 1;
+
+  for (int i = 0; i < topics->count; i++)
+  {
+    PREDEFINED_TOPIC* entry = &topics->entries[i];
+    int slot = find_slot(topics, entry->client_id, entry->topic_id, entry->hash);
+
+    if (topics->slots[slot] < 0)
+    {
+      topics->slots[slot] = i;
+    }
+  }
+
+  return 0;
+}
+
+static char* duplicate(const char* str)
+{
+  size_t len = strlen(str) + 1;
+  char* copy = (char*)malloc(len);
+
+  if (copy != NULL)
+  {
+    memcpy(copy, str, len);
+  }
+
+  return copy;
+}
+
+/*
+ * Parse "ClientId, TopicName, TopicId" into the entry. The topic name may not contain a comma.
+ * Return 0 on success, 1 for a blank or comment line, -1 for a malformed line
+ */
+static int parse_line(char* line, PREDEFINED_TOPIC* entry)
+{
+  char* fields[3];
+  char* end;
+  long topic_id;
+  char* rest = trim(line);
+
+  if (*rest == '\0' || *rest == '#')
+  {
+    return 1;
+  }
+
+  for (int i = 0; i < 3; i++)
+  {
+    char* comma = strchr(rest, ',');
+
+    if ((comma == NULL) != (i == 2))
+    {
+      return -1;
+    }
+
+    if (comma != NULL)
+    {
+      *comma = '\0';
+    }
+
+    fields[i] = trim(rest);
+    rest = comma + 1;
+  }
+
+  topic_id = strtol(fields[2], &end, 10);
+  if (*fields[0] == '\0' || *fields[1] == '\0' || *end != '\0' || topic_id <= 0
+      || topic_id >= 0xFFFF)
+  {
+    return -1;
+  }
+
+  entry->topic_id = (unsigned short)topic_id;
+  entry->hash = hash_key(fields[0], entry->topic_id);
+  entry->client_id = duplicate(fields[0]);
+  entry->topic_name = duplicate(fields[1]);
+  return entry->client_id != NULL && entry->topic_name != NULL ? 0 : -1;
+}
+
+/*
+ * Read every entry of the mapping file and index them. Malformed lines are reported and skipped.
+ * Return 0 on success, -1 if the file cannot be read
+ */
+int predefined_topics_load(PREDEFINED_TOPICS* topics, const char* path)
+{
+  FILE* file;
+  char line[PREDEFINED_TOPICS_LINE_SIZE];
+  int capacity = 0;
+  int line_number = 0;
+
+  memset((void*)topics, 0, sizeof(PREDEFINED_TOPICS));
+
+  if ((file = fopen(path, "r")) == NULL)
+  {
+    printf("Failed to open predefined topic file %s\r\n", path);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    PREDEFINED_TOPIC entry;
+    int rc;
+
+    line_number++;
+    if ((rc = parse_line(line, &entry)) > 0)
+    {
+      continue;
+    }
+    else if (rc < 0)
+    {
+      printf("Ignoring malformed line %d in %s\r\n", line_number, path);
+      continue;
+    }
+
+    if (topics->count == capacity)
+    {
+      PREDEFINED_TOPIC* entries;
+
+      capacity = capacity ? capacity * 2 : 16;
+      if ((entries = (PREDEFINED_TOPIC*)realloc(
+               topics->entries, (size_t)capacity * sizeof(PREDEFINED_TOPIC)))
+          == NULL)
+      {
+        fclose(file);
+        predefined_topics_deinit(topics);
+        return -1;
+      }
+
+      topics->entries = entries;
+    }
+
+    topics->entries[topics->count++] = entry;
+  }
+
+  fclose(file);
+  if (build_index(topics) != 0)
+  {
+    predefined_topics_deinit(topics);
+    return -1;
+  }
+
+  return 0;
+}
+
+void predefined_topics_deinit(PREDEFINED_TOPICS* topics)
+{
+  for (int i = 0; i < topics->count; i++)
+  {
+    free(topics->entries[i].client_id);
+    free(topics->entries[i].topic_name);
+  }
+
+  free(topics->entries);
+  free(topics->slots);
+  topics->entries = NULL;
+  topics->slots = NULL;
+  topics->count = 0;
+}
+
+/*
+ * Return the topic ID for the client's topic, preferring an entry for the client over a "*"
+ * entry, or 0 if the topic is not predefined
+ */
+unsigned short predefined_topics_lookup(
+    const PREDEFINED_TOPICS* topics,
+    const char* client_id,
+    const char* topic_name)
+{
+  unsigned short wildcard_id = 0;
+
+  for (int i = 0; i < topics->count; i++)
+  {
+    const PREDEFINED_TOPIC* entry = &topics->entries[i];
+
+    if (strcmp(entry->topic_name, topic_name) != 0)
+    {
+      continue;
+    }
+
+    if (strcmp(entry->client_id, client_id) == 0)
+    {
+      return entry->topic_id;
+    }
+
+    if (wildcard_id == 0 && strcmp(entry->client_id, "*") == 0)
+    {
+      wildcard_id = entry->topic_id;
+    }
+  }
+
+  return wildcard_id;
+}
+
+/*
+ * Reverse lookup used on the Gateway side for every PUBLISH with a predefined topic ID: the topic
+ * name mapped to topic_id for client_id, or NULL when the client may not use that ID. As in
+ * predefined_topics_lookup, an entry for the client itself wins over a "*" entry.
+ */
+const char* predefined_topics_find_name(
+    const PREDEFINED_TOPICS* topics,
+    const char* client_id,
+    unsigned short topic_id)
+{
+  int slot;
+
+  if (topics->slots == NULL)
+  {
+    return NULL;
+  }
+
+  slot = find_slot(topics, client_id, topic_id, hash_key(client_id, topic_id));
+  if (topics->slots[slot] < 0)
+  {
+    slot = find_slot(topics, "*", topic_id, hash_key("*", topic_id));
+  }
+
+  return topics->slots[slot] >= 0 ? topics->entries[topics->slots[slot]].topic_name : NULL;
+}
@@ -0,0 +1,44 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef PREDEFINED_TOPICS_H
+#define PREDEFINED_TOPICS_H
+
+#include <stdint.h>
+
+typedef struct predefined_topic_tag
+{
+  char* client_id; // "*" matches every client
+  char* topic_name;
+  unsigned short topic_id;
+  uint32_t hash; // of the client ID and the topic ID
+} PREDEFINED_TOPIC;
+
+/*
+ * Topic ID mapping shared with the Gateway. The file uses the format of the Paho MQTTSNGateway
+ * predefined topic list, one "ClientId, TopicName, TopicId" entry per line and '#' comments, so
+ * the same file can be given to the Gateway (PredefinedTopicList in gateway.conf).
+ * The telemetry topic differs per device, so a fleet's file has an entry per device. Entries are
+ * hashed by client ID and topic ID (FNV-1a) into an open-addressed table with linear probing, of
+ * at least twice count slots, so that a Gateway checks the topic ID of a PUBLISH in constant time.
+ */
+typedef struct predefined_topics_tag
+{
+  PREDEFINED_TOPIC* entries;
+  int count;
+  int* slots; // entry index per slot, -1 when empty
+  int slot_mask;
+} PREDEFINED_TOPICS;
+
+int predefined_topics_load(PREDEFINED_TOPICS* topics, const char* path);
+void predefined_topics_deinit(PREDEFINED_TOPICS* topics);
+unsigned short predefined_topics_lookup(
+    const PREDEFINED_TOPICS* topics,
+    const char* client_id,
+    const char* topic_name);
+const char* predefined_topics_find_name(
+    const PREDEFINED_TOPICS* topics,
+    const char* client_id,
+    unsigned short topic_id);
+
+#endif // PREDEFINED_TOPICS_H
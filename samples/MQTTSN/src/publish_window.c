@@ -0,0 +1,297 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "MQTTSNPacket.h"
+#include "publish_window.h"
+
+#define MQTTSN_FLAG_DUP 0x80
+
+int publish_window_init(PUBLISH_WINDOW* window, int size)
+{
+  memset((void*)window, 0, sizeof(PUBLISH_WINDOW));
+
+  if (size < 1 || size > PUBLISH_WINDOW_MAX_SIZE)
+  {
+    return -1;
+  }
+
+  if ((window->entries = calloc((size_t)size, sizeof(PUBLISH_WINDOW_ENTRY))) == NULL)
+  {
+    return -1;
+  }
+
+  window->size = size;
+  return 0;
+}
+
+void publish_window_deinit(PUBLISH_WINDOW* window)
+{
+  free(window->entries);
+  window->entries = NULL;
+  window->size = 0;
+  window->in_flight = 0;
+}
+
+int publish_window_is_full(const PUBLISH_WINDOW* window)
+{
+  return window->in_flight >= window->size;
+}
+
+/*
+ * Track a PUBLISH that was just sent, to be retransmitted at deadline_us, or with now_us 0 and
+ * deadline_us UINT64_MAX one that waits for its topic to be registered. The packet is copied; a
+ * payload sent separately is only referenced and must stay unchanged until the entry is removed.
+ * Return -1 if the window is full or the packet is too large.
+ */
+int publish_window_add(
+    PUBLISH_WINDOW* window,
+    unsigned short packet_id,
+    const unsigned char* packet,
+    int packet_len,
+    const unsigned char* payload,
+    int payload_len,
+    int topic,
+    uint64_t now_us,
+    uint64_t deadline_us,
+    uint64_t tag)
+{
+  if (publish_window_is_full(window) || packet_len > PUBLISH_WINDOW_PACKET_SIZE)
+  {
+    return -1;
+  }
+
+  for (int i = 0; i < window->size; i++)
+  {
+    PUBLISH_WINDOW_ENTRY* entry = &window->entries[i];
+
+    if (!entry->in_use)
+    {
+      entry->in_use = 1;
+      entry->packet_id = packet_id;
+      entry->topic = topic;
+      entry->packet_len = packet_len;
+      entry->payload = payload;
+      entry->payload_len = payload_len;
+      entry->retransmissions = 0;
+      entry->first_sent_us = now_us;
+      entry->last_sent_us = now_us;
+      entry->deadline_us = deadline_us;
+      entry->tag = tag;
+      memcpy(entry->packet, packet, (size_t)packet_len);
+      window->in_flight++;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/*
+ * Return the entry matching packet_id, NULL if none
+ */
+PUBLISH_WINDOW_ENTRY* publish_window_find(PUBLISH_WINDOW* window, unsigned short packet_id)
+{
+  for (int i = 0; i < window->size; i++)
+  {
+    if (window->entries[i].in_use && window->entries[i].packet_id == packet_id)
+    {
+      return &window->entries[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Release the entry matching packet_id. The latency is measured from the first transmission.
+ * Return how many times the entry was retransmitted, so that the caller can tell whether the
+ * latency is a valid round trip time sample, or -1 for an unknown packet ID (for example a late
+ * PUBACK for an entry already released). The topic of the entry is returned in out_topic.
+ */
+int publish_window_ack(
+    PUBLISH_WINDOW* window,
+    unsigned short packet_id,
+    uint64_t now_us,
+    uint64_t* out_latency_us,
+    int* out_topic)
+{
+  PUBLISH_WINDOW_ENTRY* entry = publish_window_find(window, packet_id);
+  int retransmissions;
+
+  if (entry == NULL)
+  {
+    return -1;
+  }
+
+  retransmissions = entry->retransmissions;
+  if (out_latency_us != NULL)
+  {
+    *out_latency_us = now_us - entry->first_sent_us;
+  }
+
+  if (out_topic != NULL)
+  {
+    *out_topic = entry->topic;
+  }
+
+  publish_window_remove(window, entry);
+  return retransmissions;
+}
+
+/*
+ * Return the first entry whose retransmission timeout has expired, or NULL
+ */
+PUBLISH_WINDOW_ENTRY* publish_window_next_expired(PUBLISH_WINDOW* window, uint64_t now_us)
+{
+  for (int i = 0; i < window->size; i++)
+  {
+    PUBLISH_WINDOW_ENTRY* entry = &window->entries[i];
+
+    if (entry->in_use && entry->deadline_us <= now_us)
+    {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Rewrite the topic ID of every packet of topic in the window, e.g. after falling back from a
+ * predefined topic ID to a registered one, and make them due for (re)transmission right away
+ */
+void publish_window_set_topic(
+    PUBLISH_WINDOW* window,
+    int topic,
+    int topic_type,
+    unsigned short topic_id)
+{
+  for (int i = 0; i < window->size; i++)
+  {
+    PUBLISH_WINDOW_ENTRY* entry = &window->entries[i];
+    int datalen;
+    int lenlen;
+
+    if (!entry->in_use || entry->topic != topic)
+    {
+      continue;
+    }
+
+    // Layout: length, MsgType, Flags, TopicId, MsgId, Data
+    lenlen = MQTTSNPacket_decode(entry->packet, entry->packet_len, &datalen);
+    entry->packet[lenlen + 1] = (unsigned char)((entry->packet[lenlen + 1] & ~0x03) | topic_type);
+    entry->packet[lenlen + 2] = (unsigned char)(topic_id >> 8);
+    entry->packet[lenlen + 3] = (unsigned char)(topic_id & 0xFF);
+    entry->deadline_us = 0;
+  }
+}
+
+/*
+ * Keep the packets of topic from being retransmitted until publish_window_set_topic() gives them
+ * a new topic ID
+ */
+void publish_window_hold_topic(PUBLISH_WINDOW* window, int topic)
+{
+  for (int i = 0; i < window->size; i++)
+  {
+    if (window->entries[i].in_use && window->entries[i].topic == topic)
+    {
+      window->entries[i].deadline_us = UINT64_MAX;
+    }
+  }
+}
+
+/*
+ * Return an entry of topic, NULL if none
+ */
+PUBLISH_WINDOW_ENTRY* publish_window_find_topic(PUBLISH_WINDOW* window, int topic)
+{
+  for (int i = 0; i < window->size; i++)
+  {
+    if (window->entries[i].in_use && window->entries[i].topic == topic)
+    {
+      return &window->entries[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * The entry waited for its topic and is sent for the first time, to be retransmitted at
+ * deadline_us
+ */
+void publish_window_mark_sent(PUBLISH_WINDOW_ENTRY* entry, uint64_t now_us, uint64_t deadline_us)
+{
+  entry->first_sent_us = now_us;
+  entry->last_sent_us = now_us;
+  entry->deadline_us = deadline_us;
+}
+
+/*
+ * Set the DUP flag in the stored packet ahead of sending it again, to be retransmitted once more
+ * at deadline_us
+ */
+void publish_window_mark_retransmitted(
+    PUBLISH_WINDOW_ENTRY* entry,
+    uint64_t now_us,
+    uint64_t deadline_us)
+{
+  int datalen;
+  int lenlen = MQTTSNPacket_decode(entry->packet, entry->packet_len, &datalen);
+
+  // Layout: length, MsgType, Flags, TopicId, MsgId, Data
+  entry->packet[lenlen + 1] |= MQTTSN_FLAG_DUP;
+  entry->retransmissions++;
+  entry->last_sent_us = now_us;
+  entry->deadline_us = deadline_us;
+}
+
+void publish_window_remove(PUBLISH_WINDOW* window, PUBLISH_WINDOW_ENTRY* entry)
+{
+  entry->in_use = 0;
+  window->in_flight--;
+}
+
+/*
+ * Return the time at which the oldest outstanding entry times out, UINT64_MAX if none
+ */
+uint64_t publish_window_next_deadline(const PUBLISH_WINDOW* window)
+{
+  uint64_t deadline = UINT64_MAX;
+
+  for (int i = 0; i < window->size; i++)
+  {
+    const PUBLISH_WINDOW_ENTRY* entry = &window->entries[i];
+
+    if (entry->in_use && entry->deadline_us < deadline)
+    {
+      deadline = entry->deadline_us;
+    }
+  }
+
+  return deadline;
+}
+
+/*
+ * Return the lowest tag of the outstanding entries, UINT64_MAX if none
+ */
+uint64_t publish_window_lowest_tag(const PUBLISH_WINDOW* window)
+{
+  uint64_t tag = UINT64_MAX;
+
+  for (int i = 0; i < window->size; i++)
+  {
+    const PUBLISH_WINDOW_ENTRY* entry = &window->entries[i];
+
+    if (entry->in_use && entry->tag < tag)
+    {
+      tag = entry->tag;
+    }
+  }
+
+  return tag;
+}
@@ -0,0 +1,87 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef PUBLISH_WINDOW_H
+#define PUBLISH_WINDOW_H
+
+#include <stdint.h>
+
+#define PUBLISH_WINDOW_MAX_SIZE 64
+// Largest UDP payload on a 1500 byte MTU IPv4 path, so an aggregated PUBLISH fits
+#define PUBLISH_WINDOW_PACKET_SIZE 1472
+
+// Topic of an entry published to the client's own topic rather than a topic registry entry
+#define PUBLISH_WINDOW_DEFAULT_TOPIC -1
+
+/*
+ * A serialized QoS 1 PUBLISH waiting for its PUBACK. The packet is kept as sent so that it can be
+ * retransmitted by only setting the DUP flag. A zero-copy PUBLISH keeps only its header here and
+ * references the payload of the application. An entry whose topic is still being registered
+ * waits, unsent, until its topic ID is written into it.
+ */
+typedef struct publish_window_entry_tag
+{
+  unsigned short packet_id;
+  int in_use;
+  int topic; // topic registry index, PUBLISH_WINDOW_DEFAULT_TOPIC for the client's own topic
+  int packet_len;
+  const unsigned char* payload; // NULL when the payload is part of the packet
+  int payload_len;
+  int retransmissions;
+  uint64_t first_sent_us; // 0 while not sent yet
+  uint64_t last_sent_us;
+  uint64_t deadline_us; // (re)transmission due, 0 = right away, UINT64_MAX = waiting for its topic
+  uint64_t tag; // chosen by the application, e.g. the position of the message in its queue
+  unsigned char packet[PUBLISH_WINDOW_PACKET_SIZE];
+} PUBLISH_WINDOW_ENTRY;
+
+/*
+ * Send window of up to size unacknowledged PUBLISH packets. PUBACKs are matched by packet ID in
+ * any order. Every entry has its own retransmission deadline, chosen by the caller.
+ */
+typedef struct publish_window_tag
+{
+  PUBLISH_WINDOW_ENTRY* entries;
+  int size;
+  int in_flight;
+} PUBLISH_WINDOW;
+
+int publish_window_init(PUBLISH_WINDOW* window, int size);
+void publish_window_deinit(PUBLISH_WINDOW* window);
+int publish_window_is_full(const PUBLISH_WINDOW* window);
+int publish_window_add(
+    PUBLISH_WINDOW* window,
+    unsigned short packet_id,
+    const unsigned char* packet,
+    int packet_len,
+    const unsigned char* payload,
+    int payload_len,
+    int topic,
+    uint64_t now_us,
+    uint64_t deadline_us,
+    uint64_t tag);
+PUBLISH_WINDOW_ENTRY* publish_window_find(PUBLISH_WINDOW* window, unsigned short packet_id);
+int publish_window_ack(
+    PUBLISH_WINDOW* window,
+    unsigned short packet_id,
+    uint64_t now_us,
+    uint64_t* out_latency_us,
+    int* out_topic);
+PUBLISH_WINDOW_ENTRY* publish_window_next_expired(PUBLISH_WINDOW* window, uint64_t now_us);
+void publish_window_mark_sent(PUBLISH_WINDOW_ENTRY* entry, uint64_t now_us, uint64_t deadline_us);
+void publish_window_mark_retransmitted(
+    PUBLISH_WINDOW_ENTRY* entry,
+    uint64_t now_us,
+    uint64_t deadline_us);
+void publish_window_set_topic(
+    PUBLISH_WINDOW* window,
+    int topic,
+    int topic_type,
+    unsigned short topic_id);
+void publish_window_hold_topic(PUBLISH_WINDOW* window, int topic);
+PUBLISH_WINDOW_ENTRY* publish_window_find_topic(PUBLISH_WINDOW* window, int topic);
+void publish_window_remove(PUBLISH_WINDOW* window, PUBLISH_WINDOW_ENTRY* entry);
+uint64_t publish_window_next_deadline(const PUBLISH_WINDOW* window);
+uint64_t publish_window_lowest_tag(const PUBLISH_WINDOW* window);
+
+#endif // PUBLISH_WINDOW_H
@@ -0,0 +1,92 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <string.h>
+
+#include "rtt_estimator.h"
+
+static void clamp_rto(RTT_ESTIMATOR* rtt)
+{
+  if (rtt->rto_us < rtt->min_rto_us)
+  {
+    rtt->rto_us = rtt->min_rto_us;
+  }
+  if (rtt->rto_us > rtt->max_rto_us)
+  {
+    rtt->rto_us = rtt->max_rto_us;
+  }
+}
+
+/*
+ * Start with initial_rto_us until the first sample. The seed drives the timeout jitter; seeding
+ * every connection differently spreads the retries of a fleet.
+ */
+void rtt_estimator_init(
+    RTT_ESTIMATOR* rtt,
+    uint64_t initial_rto_us,
+    uint64_t min_rto_us,
+    uint64_t max_rto_us,
+    uint64_t seed)
+{
+  memset((void*)rtt, 0, sizeof(RTT_ESTIMATOR));
+  rtt->rto_us = initial_rto_us;
+  rtt->min_rto_us = min_rto_us;
+  rtt->max_rto_us = max_rto_us;
+  // xorshift must not start from 0
+  rtt->random_state = seed != 0 ? seed : 0x9E3779B97F4A7C15ULL;
+  clamp_rto(rtt);
+}
+
+/*
+ * Update SRTT, RTTVAR and the RTO with the round trip time of an exchange that was not
+ * retransmitted
+ */
+void rtt_estimator_sample(RTT_ESTIMATOR* rtt, uint64_t rtt_us)
+{
+  uint64_t variance_us;
+
+  if (rtt->samples++ == 0)
+  {
+    rtt->srtt_us = rtt_us;
+    rtt->rttvar_us = rtt_us / 2;
+  }
+  else
+  {
+    uint64_t error_us = rtt->srtt_us > rtt_us ? rtt->srtt_us - rtt_us : rtt_us - rtt->srtt_us;
+
+    rtt->rttvar_us = (3 * rtt->rttvar_us + error_us) / 4;
+    rtt->srtt_us = (7 * rtt->srtt_us + rtt_us) / 8;
+  }
+
+  variance_us = 4 * rtt->rttvar_us;
+  rtt->rto_us = rtt->srtt_us
+      + (variance_us > RTT_ESTIMATOR_GRANULARITY_US ? variance_us : RTT_ESTIMATOR_GRANULARITY_US);
+  clamp_rto(rtt);
+}
+
+/*
+ * A retransmission timer expired: double the RTO
+ */
+void rtt_estimator_backoff(RTT_ESTIMATOR* rtt)
+{
+  rtt->backoffs++;
+  rtt->rto_us = rtt->rto_us > rtt->max_rto_us / 2 ? rtt->max_rto_us : rtt->rto_us * 2;
+}
+
+/*
+ * Return the timeout for a transmission sent now: the RTO stretched by a random amount of up to
+ * RTT_ESTIMATOR_JITTER_PERCENT. The RTO stays a lower bound, so the jitter never causes a
+ * spurious retransmission.
+ */
+uint64_t rtt_estimator_timeout_us(RTT_ESTIMATOR* rtt)
+{
+  uint64_t x = rtt->random_state;
+
+  // xorshift64
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  rtt->random_state = x;
+
+  return rtt->rto_us + (x % (rtt->rto_us * RTT_ESTIMATOR_JITTER_PERCENT / 100 + 1));
+}
@@ -0,0 +1,44 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef RTT_ESTIMATOR_H
+#define RTT_ESTIMATOR_H
+
+#include <stdint.h>
+
+// Clock granularity G of RFC 6298, the smallest variance term of the RTO
+#define RTT_ESTIMATOR_GRANULARITY_US 1000
+
+// Each timeout is stretched by up to this percentage so that a fleet does not retry in lockstep
+#define RTT_ESTIMATOR_JITTER_PERCENT 25
+
+/*
+ * Retransmission timeout (RTO) computed from measured round trip times, as RFC 6298 specifies for
+ * TCP. SRTT and RTTVAR are smoothed with gains of 1/8 and 1/4, and RTO = SRTT + 4 * RTTVAR,
+ * clamped to [min_rto_us, max_rto_us]. Following Karn's rule, samples must only be taken from
+ * exchanges that were never retransmitted. Every timeout doubles the RTO, up to max_rto_us, until
+ * the next sample.
+ */
+typedef struct rtt_estimator_tag
+{
+  uint64_t srtt_us; // 0 until the first sample
+  uint64_t rttvar_us;
+  uint64_t rto_us;
+  uint64_t min_rto_us;
+  uint64_t max_rto_us;
+  uint64_t samples;
+  uint64_t backoffs;
+  uint64_t random_state;
+} RTT_ESTIMATOR;
+
+void rtt_estimator_init(
+    RTT_ESTIMATOR* rtt,
+    uint64_t initial_rto_us,
+    uint64_t min_rto_us,
+    uint64_t max_rto_us,
+    uint64_t seed);
+void rtt_estimator_sample(RTT_ESTIMATOR* rtt, uint64_t rtt_us);
+void rtt_estimator_backoff(RTT_ESTIMATOR* rtt);
+uint64_t rtt_estimator_timeout_us(RTT_ESTIMATOR* rtt);
+
+#endif // RTT_ESTIMATOR_H
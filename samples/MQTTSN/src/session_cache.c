@@ -0,0 +1,160 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "session_cache.h"
+
+static uint32_t get_checksum(const SESSION_CACHE_RECORD* record)
+{
+  const unsigned char* bytes = (const unsigned char*)record;
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < offsetof(SESSION_CACHE_RECORD, checksum); i++)
+  {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+
+  return hash;
+}
+
+static int is_valid(const SESSION_CACHE_RECORD* record)
+{
+  return record->generation != 0 && record->checksum == get_checksum(record)
+      && record->client_id[sizeof(record->client_id) - 1] == '\0'
+      && record->gateway_address[sizeof(record->gateway_address) - 1] == '\0'
+      && record->topic_name[sizeof(record->topic_name) - 1] == '\0';
+}
+
+/*
+ * Return the valid slot with the highest generation, NULL if there is none
+ */
+static SESSION_CACHE_RECORD* get_current(const SESSION_CACHE* cache)
+{
+  SESSION_CACHE_RECORD* current = NULL;
+
+  for (int i = 0; i < 2; i++)
+  {
+    SESSION_CACHE_RECORD* slot = &cache->file->slots[i];
+
+    if (is_valid(slot) && (current == NULL || slot->generation > current->generation))
+    {
+      current = slot;
+    }
+  }
+
+  return current;
+}
+
+/*
+ * 1. Open or create the state file with the size of SESSION_CACHE_FILE
+ * 2. Map it shared, so that every store reaches the page cache and survives a crash of the
+ *    process
+ * 3. Start over when the file was written by another version
+ */
+int session_cache_open(SESSION_CACHE* cache, const char* path)
+{
+  struct stat st;
+  void* map;
+
+  cache->file = NULL;
+
+  // 1. Open or create the state file with the size of SESSION_CACHE_FILE
+  if ((cache->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0)
+  {
+    printf("Failed to open session cache %s, errno %d\r\n", path, errno);
+    return -1;
+  }
+
+  if (fstat(cache->fd, &st) != 0
+      || (st.st_size != (off_t)sizeof(SESSION_CACHE_FILE)
+          && ftruncate(cache->fd, (off_t)sizeof(SESSION_CACHE_FILE)) != 0))
+  {
+    printf("Failed to size session cache %s, errno %d\r\n", path, errno);
+    session_cache_close(cache);
+    return -1;
+  }
+
+  // 2. Map it shared, so that every store reaches the page cache and survives a crash of the
+  //    process
+  map = mmap(NULL, sizeof(SESSION_CACHE_FILE), PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+  if (map == MAP_FAILED)
+  {
+    printf("Failed to map session cache %s, errno %d\r\n", path, errno);
+    session_cache_close(cache);
+    return -1;
+  }
+  cache->file = (SESSION_CACHE_FILE*)map;
+
+  // 3. Start over when the file was written by another version
+  if (cache->file->magic != SESSION_CACHE_MAGIC || cache->file->version != SESSION_CACHE_VERSION)
+  {
+    memset((void*)cache->file, 0, sizeof(SESSION_CACHE_FILE));
+    cache->file->magic = SESSION_CACHE_MAGIC;
+    cache->file->version = SESSION_CACHE_VERSION;
+  }
+
+  return 0;
+}
+
+void session_cache_close(SESSION_CACHE* cache)
+{
+  if (cache->file != NULL)
+  {
+    munmap((void*)cache->file, sizeof(SESSION_CACHE_FILE));
+    cache->file = NULL;
+  }
+
+  if (cache->fd >= 0)
+  {
+    close(cache->fd);
+    cache->fd = -1;
+  }
+}
+
+/*
+ * Return the saved session of the client with the Gateway, NULL if there is none (cold start)
+ */
+const SESSION_CACHE_RECORD* session_cache_find(
+    const SESSION_CACHE* cache,
+    const char* client_id,
+    const char* gateway_address,
+    int gateway_port)
+{
+  const SESSION_CACHE_RECORD* record = get_current(cache);
+
+  if (record == NULL || strcmp(record->client_id, client_id) != 0
+      || strcmp(record->gateway_address, gateway_address) != 0
+      || record->gateway_port != gateway_port)
+  {
+    return NULL;
+  }
+
+  return record;
+}
+
+/*
+ * 1. Write the record to the slot that is not current, with the next generation and its checksum
+ * 2. Ask the kernel to write the page back without waiting for it
+ */
+int session_cache_save(SESSION_CACHE* cache, const SESSION_CACHE_RECORD* record)
+{
+  SESSION_CACHE_RECORD* current = get_current(cache);
+  SESSION_CACHE_RECORD* slot
+      = current == &cache->file->slots[0] ? &cache->file->slots[1] : &cache->file->slots[0];
+
+  // 1. Write the record to the slot that is not current, with the next generation and its checksum
+  *slot = *record;
+  slot->generation = current != NULL ? current->generation + 1 : 1;
+  slot->checksum = get_checksum(slot);
+
+  // 2. Ask the kernel to write the page back without waiting for it
+  return msync((void*)cache->file, sizeof(SESSION_CACHE_FILE), MS_ASYNC);
+}
@@ -0,0 +1,59 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef SESSION_CACHE_H
+#define SESSION_CACHE_H
+
+#include <stdint.h>
+
+#define SESSION_CACHE_MAGIC 0x4D534E53 // "MSNS"
+#define SESSION_CACHE_VERSION 2
+
+/*
+ * MQTT-SN session negotiated with a Gateway, enough to resume it without REGISTER
+ */
+typedef struct session_cache_record_tag
+{
+  uint64_t generation; // the valid slot with the highest generation is current
+  char client_id[64];
+  char gateway_address[64];
+  int gateway_port;
+  char topic_name[128];
+  int topic_type; // MQTTSN_TOPIC_TYPE_*
+  unsigned short topic_id;
+  unsigned short packet_id; // last packet ID used, new messages must not look like duplicates
+  int clean_session; // value of the flag for the next CONNECT
+  uint32_t checksum; // FNV-1a of the fields above
+} SESSION_CACHE_RECORD;
+
+/*
+ * Layout of the state file. Records are written alternately to both slots, so a write torn by a
+ * crash leaves the previous record intact and fails its checksum.
+ */
+typedef struct session_cache_file_tag
+{
+  uint32_t magic;
+  uint32_t version;
+  SESSION_CACHE_RECORD slots[2];
+} SESSION_CACHE_FILE;
+
+/*
+ * Small memory-mapped state file that outlives the process, so that a device which wakes up,
+ * sends one reading and powers off can skip the topic lookup and the REGISTER on its next start
+ */
+typedef struct session_cache_tag
+{
+  int fd;
+  SESSION_CACHE_FILE* file;
+} SESSION_CACHE;
+
+int session_cache_open(SESSION_CACHE* cache, const char* path);
+void session_cache_close(SESSION_CACHE* cache);
+const SESSION_CACHE_RECORD* session_cache_find(
+    const SESSION_CACHE* cache,
+    const char* client_id,
+    const char* gateway_address,
+    int gateway_port);
+int session_cache_save(SESSION_CACHE* cache, const SESSION_CACHE_RECORD* record);
+
+#endif // SESSION_CACHE_H
@@ -0,0 +1,219 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <string.h>
+
+#include "MQTTSNPacket.h"
+#include "telemetry_aggregator.h"
+
+// PUBLISH header: 3 byte length, MsgType, Flags, TopicId, MsgId
+#define PUBLISH_HEADER_MAX_SIZE 9
+
+/*
+ * Largest PUBLISH payload that fits in one datagram on a path with the given MTU
+ */
+int telemetry_aggregator_max_payload(int path_mtu)
+{
+  int max_payload = path_mtu - TELEMETRY_AGGREGATOR_IP_UDP_HEADER_SIZE - PUBLISH_HEADER_MAX_SIZE;
+
+  if (max_payload > PUBLISH_WINDOW_PACKET_SIZE - PUBLISH_HEADER_MAX_SIZE)
+  {
+    max_payload = PUBLISH_WINDOW_PACKET_SIZE - PUBLISH_HEADER_MAX_SIZE;
+  }
+
+  return max_payload;
+}
+
+/*
+ * Bytes on the wire (IPv4, UDP and MQTT-SN headers) of a PUBLISH carrying the payload
+ */
+int telemetry_aggregator_wire_bytes(int payload_len)
+{
+  // MsgType, Flags, TopicId, MsgId, Data after the length field
+  return TELEMETRY_AGGREGATOR_IP_UDP_HEADER_SIZE + MQTTSNPacket_len(6 + payload_len);
+}
+
+/*
+ * Payload size of an aggregate of readings of the same size: "[" r1 "," r2 ... "]" for a JSON
+ * array, r1 r2 ... otherwise
+ */
+int telemetry_aggregator_payload_len(int reading_len, int readings, int json_array)
+{
+  if (!json_array)
+  {
+    return readings * reading_len;
+  }
+
+  return readings == 1 ? reading_len : readings * (reading_len + 1) + 1;
+}
+
+/*
+ * Payload size once closed, of count readings occupying len bytes of the buffer
+ */
+static int get_closed_len(const TELEMETRY_AGGREGATOR* aggregator, int count, int len)
+{
+  if (!aggregator->json_array)
+  {
+    return len;
+  }
+
+  // Closing adds "]" unless there is a single reading, which is sent without the "["
+  return count == 1 ? len - 1 : len + 1;
+}
+
+int telemetry_aggregator_init(
+    TELEMETRY_AGGREGATOR* aggregator,
+    int max_size,
+    int max_readings,
+    uint64_t max_delay_us,
+    int json_array)
+{
+  memset((void*)aggregator, 0, sizeof(TELEMETRY_AGGREGATOR));
+
+  if (max_size <= 0 || max_size > PUBLISH_WINDOW_PACKET_SIZE - PUBLISH_HEADER_MAX_SIZE
+      || max_readings <= 0)
+  {
+    return -1;
+  }
+
+  aggregator->max_size = max_size;
+  aggregator->max_readings = max_readings;
+  aggregator->max_delay_us = max_delay_us;
+  aggregator->json_array = json_array;
+  telemetry_aggregator_reset(aggregator);
+  return 0;
+}
+
+/*
+ * Append the reading to the aggregate, the first reading starts the latency deadline.
+ * Return 0 on success, TELEMETRY_AGGREGATOR_FULL if the aggregate must be published first, -1 if
+ * the reading alone is larger than the size limit
+ */
+int telemetry_aggregator_add(
+    TELEMETRY_AGGREGATOR* aggregator,
+    const unsigned char* reading,
+    int reading_len,
+    uint64_t now_us)
+{
+  int separator = aggregator->json_array && aggregator->count > 0 ? 1 : 0;
+
+  if (reading_len > aggregator->max_size)
+  {
+    return -1;
+  }
+
+  if (aggregator->count >= aggregator->max_readings
+      || get_closed_len(
+             aggregator, aggregator->count + 1, aggregator->len + separator + reading_len)
+          > aggregator->max_size)
+  {
+    return TELEMETRY_AGGREGATOR_FULL;
+  }
+
+  if (aggregator->count == 0)
+  {
+    aggregator->deadline_us = now_us + aggregator->max_delay_us;
+  }
+
+  if (separator)
+  {
+    aggregator->buffer[aggregator->len++] = ',';
+  }
+
+  memcpy(aggregator->buffer + aggregator->len, reading, (size_t)reading_len);
+  aggregator->len += reading_len;
+  aggregator->count++;
+
+  if (reading_len > aggregator->largest_reading)
+  {
+    aggregator->largest_reading = reading_len;
+  }
+
+  return 0;
+}
+
+/*
+ * Return non-zero when the aggregate must be published: it holds max_readings, the next reading
+ * (assumed no larger than the largest so far) would not fit, or its first reading reached the
+ * latency deadline
+ */
+int telemetry_aggregator_ready(const TELEMETRY_AGGREGATOR* aggregator, uint64_t now_us)
+{
+  int next_len;
+
+  if (aggregator->count == 0)
+  {
+    return 0;
+  }
+
+  next_len = aggregator->len + aggregator->json_array + aggregator->largest_reading;
+
+  return aggregator->count >= aggregator->max_readings || now_us >= aggregator->deadline_us
+      || get_closed_len(aggregator, aggregator->count + 1, next_len) > aggregator->max_size;
+}
+
+/*
+ * Frame the aggregate and return the payload length. The payload stays valid until
+ * telemetry_aggregator_reset().
+ */
+int telemetry_aggregator_close(TELEMETRY_AGGREGATOR* aggregator, unsigned char** out_payload)
+{
+  if (!aggregator->json_array)
+  {
+    *out_payload = aggregator->buffer;
+    return aggregator->len;
+  }
+
+  if (aggregator->count == 1)
+  {
+    *out_payload = aggregator->buffer + 1;
+    return aggregator->len - 1;
+  }
+
+  aggregator->buffer[aggregator->len] = ']';
+  *out_payload = aggregator->buffer;
+  return aggregator->len + 1;
+}
+
+void telemetry_aggregator_reset(TELEMETRY_AGGREGATOR* aggregator)
+{
+  aggregator->buffer[0] = '[';
+  aggregator->len = aggregator->json_array ? 1 : 0;
+  aggregator->count = 0;
+  aggregator->deadline_us = UINT64_MAX;
+}
+
+/*
+ * Print the bytes on the wire per reading for aggregates of 1, 2, 4, ... readings up to the most
+ * that fit in max_size bytes
+ */
+void telemetry_aggregator_print_wire_table(int reading_len, int max_size, int json_array)
+{
+  int max_readings = json_array ? (max_size - 1) / (reading_len + 1) : max_size / reading_len;
+
+  if (max_readings < 1)
+  {
+    max_readings = 1;
+  }
+
+  printf("Readings per PUBLISH, bytes on wire, bytes on wire per reading:\r\n");
+  for (int readings = 1;; readings *= 2)
+  {
+    int wire_bytes;
+
+    if (readings > max_readings)
+    {
+      readings = max_readings;
+    }
+
+    wire_bytes = telemetry_aggregator_wire_bytes(
+        telemetry_aggregator_payload_len(reading_len, readings, json_array));
+    printf("  %4d %6d %8.1f\r\n", readings, wire_bytes, (double)wire_bytes / readings);
+
+    if (readings == max_readings)
+    {
+      break;
+    }
+  }
+}
@@ -0,0 +1,55 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef TELEMETRY_AGGREGATOR_H
+#define TELEMETRY_AGGREGATOR_H
+
+#include <stdint.h>
+
+#include "publish_window.h"
+
+// telemetry_aggregator_add could not fit the reading, close and publish the aggregate first
+#define TELEMETRY_AGGREGATOR_FULL 1
+
+// IPv4 and UDP headers carried by every datagram
+#define TELEMETRY_AGGREGATOR_IP_UDP_HEADER_SIZE 28
+
+/*
+ * Collects readings into one PUBLISH payload. JSON readings are framed as a JSON array,
+ * "[r1,r2,...]", and a single reading is sent as is. Self-delimiting binary records are
+ * concatenated. The aggregate is closed when it holds max_readings, when no further reading would
+ * fit in max_size bytes, or max_delay_us after its first reading.
+ */
+typedef struct telemetry_aggregator_tag
+{
+  int max_size;
+  int max_readings;
+  uint64_t max_delay_us;
+  int json_array;
+  int count;
+  int len;
+  int largest_reading;
+  uint64_t deadline_us;
+  unsigned char buffer[PUBLISH_WINDOW_PACKET_SIZE];
+} TELEMETRY_AGGREGATOR;
+
+int telemetry_aggregator_max_payload(int path_mtu);
+int telemetry_aggregator_wire_bytes(int payload_len);
+int telemetry_aggregator_payload_len(int reading_len, int readings, int json_array);
+int telemetry_aggregator_init(
+    TELEMETRY_AGGREGATOR* aggregator,
+    int max_size,
+    int max_readings,
+    uint64_t max_delay_us,
+    int json_array);
+int telemetry_aggregator_add(
+    TELEMETRY_AGGREGATOR* aggregator,
+    const unsigned char* reading,
+    int reading_len,
+    uint64_t now_us);
+int telemetry_aggregator_ready(const TELEMETRY_AGGREGATOR* aggregator, uint64_t now_us);
+int telemetry_aggregator_close(TELEMETRY_AGGREGATOR* aggregator, unsigned char** out_payload);
+void telemetry_aggregator_reset(TELEMETRY_AGGREGATOR* aggregator);
+void telemetry_aggregator_print_wire_table(int reading_len, int max_size, int json_array);
+
+#endif // TELEMETRY_AGGREGATOR_H
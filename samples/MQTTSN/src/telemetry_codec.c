@@ -0,0 +1,307 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <string.h>
+
+#include "telemetry_codec.h"
+
+static uint32_t zigzag_encode(int32_t value)
+{
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t zigzag_decode(uint32_t value)
+{
+  return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+/*
+ * Write value as a little endian base 128 varint. Return the bytes written, 0 if it does not fit
+ */
+static int varint_write(uint32_t value, unsigned char* buf, int buflen)
+{
+  int len = 0;
+
+  do
+  {
+    if (len == buflen)
+    {
+      return 0;
+    }
+
+    buf[len++] = (unsigned char)((value & 0x7F) | (value > 0x7F ? 0x80 : 0));
+    value >>= 7;
+  } while (value != 0);
+
+  return len;
+}
+
+/*
+ * Return the bytes read, 0 for a truncated or overlong varint
+ */
+static int varint_read(const unsigned char* buf, int len, uint32_t* out_value)
+{
+  uint32_t value = 0;
+
+  for (int i = 0; i < len && i < 5; i++)
+  {
+    value |= (uint32_t)(buf[i] & 0x7F) << (7 * i);
+    if ((buf[i] & 0x80) == 0)
+    {
+      *out_value = value;
+      return i + 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Print value / 10^decimals without going through floating point
+ */
+static int format_fixed_point(int32_t value, int decimals, char* buf, int buflen)
+{
+  int64_t magnitude = value < 0 ? -(int64_t)value : value;
+  int64_t scale = 1;
+
+  for (int i = 0; i < decimals; i++)
+  {
+    scale *= 10;
+  }
+
+  if (decimals == 0)
+  {
+    return snprintf(buf, (size_t)buflen, "%d", value);
+  }
+
+  return snprintf(
+      buf,
+      (size_t)buflen,
+      "%s%lld.%0*lld",
+      value < 0 ? "-" : "",
+      (long long)(magnitude / scale),
+      decimals,
+      (long long)(magnitude % scale));
+}
+
+/*
+ * Print the fields of the sample as JSON members, "<field>":<value>,... Return the length, which
+ * is buflen or more if they do not fit.
+ */
+int telemetry_codec_fields_to_json(
+    const TELEMETRY_SCHEMA* schema,
+    const TELEMETRY_SAMPLE* sample,
+    char* buf,
+    int buflen)
+{
+  int len = 0;
+
+  for (int i = 0; i < schema->field_count && len < buflen; i++)
+  {
+    len += snprintf(
+        buf + len, (size_t)(buflen - len), "%s\"%s\":", i > 0 ? "," : "", schema->fields[i].name);
+    if (len < buflen)
+    {
+      len += format_fixed_point(
+          sample->values[i], schema->fields[i].decimals, buf + len, buflen - len);
+    }
+  }
+
+  return len;
+}
+
+/*
+ * Return the length of the JSON form, -1 if it does not fit
+ */
+int telemetry_codec_to_json(
+    const TELEMETRY_SCHEMA* schema,
+    const TELEMETRY_SAMPLE* sample,
+    char* buf,
+    int buflen)
+{
+  int len = snprintf(
+      buf,
+      (size_t)buflen,
+      "{\"d\":{\"myName\":\"%s\"%s",
+      schema->device_name,
+      schema->field_count > 0 ? "," : "");
+
+  if (len < buflen)
+  {
+    len += telemetry_codec_fields_to_json(schema, sample, buf + len, buflen - len);
+  }
+
+  if (len < buflen)
+  {
+    len += snprintf(buf + len, (size_t)(buflen - len), "}}");
+  }
+
+  // The terminating NUL must fit as well, but it is not part of the payload
+  return len < buflen ? len : -1;
+}
+
+static int encode_json(
+    TELEMETRY_ENCODER* encoder,
+    const TELEMETRY_SAMPLE* sample,
+    unsigned char* buf,
+    int buflen)
+{
+  return telemetry_codec_to_json(encoder->schema, sample, (char*)buf, buflen);
+}
+
+/*
+ * Every key_frame_interval records, and for the first one, the values are sent in full so that a
+ * Gateway that lost a record resynchronizes
+ */
+static int encode_delta(
+    TELEMETRY_ENCODER* encoder,
+    const TELEMETRY_SAMPLE* sample,
+    unsigned char* buf,
+    int buflen)
+{
+  int len = 1;
+  int key_frame = encoder->since_key_frame == 0;
+
+  if (buflen < 1)
+  {
+    return -1;
+  }
+
+  buf[0] = (unsigned char)(key_frame ? TELEMETRY_CODEC_KEY_FRAME : 0) | encoder->sequence;
+
+  for (int i = 0; i < encoder->schema->field_count; i++)
+  {
+    int32_t value = key_frame ? sample->values[i]
+                              : (int32_t)((uint32_t)sample->values[i]
+                                          - (uint32_t)encoder->previous.values[i]);
+    int written = varint_write(zigzag_encode(value), buf + len, buflen - len);
+
+    if (written == 0)
+    {
+      return -1;
+    }
+
+    len += written;
+  }
+
+  encoder->previous = *sample;
+  encoder->sequence = (unsigned char)((encoder->sequence + 1) & 0x7F);
+  if (++encoder->since_key_frame >= encoder->key_frame_interval)
+  {
+    encoder->since_key_frame = 0;
+  }
+
+  return len;
+}
+
+/*
+ * Return 0 on success, -1 for an unknown encoder name
+ */
+int telemetry_encoder_init(
+    TELEMETRY_ENCODER* encoder,
+    const char* name,
+    const TELEMETRY_SCHEMA* schema)
+{
+  memset((void*)encoder, 0, sizeof(TELEMETRY_ENCODER));
+  encoder->schema = schema;
+  encoder->key_frame_interval = TELEMETRY_CODEC_DEFAULT_KEY_FRAME_INTERVAL;
+
+  if (strcmp(name, "json") == 0)
+  {
+    encoder->name = "json";
+    encoder->encode = encode_json;
+    encoder->json = 1;
+  }
+  else if (strcmp(name, "delta") == 0)
+  {
+    encoder->name = "delta";
+    encoder->encode = encode_delta;
+  }
+  else
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Return the encoded length, -1 if it does not fit in buflen bytes
+ */
+int telemetry_encoder_encode(
+    TELEMETRY_ENCODER* encoder,
+    const TELEMETRY_SAMPLE* sample,
+    unsigned char* buf,
+    int buflen)
+{
+  return encoder->encode(encoder, sample, buf, buflen);
+}
+
+void telemetry_decoder_init(TELEMETRY_DECODER* decoder, const TELEMETRY_SCHEMA* schema)
+{
+  memset((void*)decoder, 0, sizeof(TELEMETRY_DECODER));
+  decoder->schema = schema;
+}
+
+/*
+ * Decode the delta record at the start of buf. Aggregated records are decoded by calling again
+ * out_record_len bytes further, which is also set when a gap is detected.
+ * Return 0 on success, TELEMETRY_CODEC_ERROR_GAP if a record before this delta record was lost, or
+ * TELEMETRY_CODEC_ERROR_TRUNCATED
+ */
+int telemetry_decoder_decode(
+    TELEMETRY_DECODER* decoder,
+    const unsigned char* buf,
+    int len,
+    TELEMETRY_SAMPLE* out_sample,
+    int* out_record_len)
+{
+  int pos = 1;
+  int key_frame;
+  unsigned char sequence;
+
+  if (len < 1)
+  {
+    return TELEMETRY_CODEC_ERROR_TRUNCATED;
+  }
+
+  key_frame = (buf[0] & TELEMETRY_CODEC_KEY_FRAME) != 0;
+  sequence = buf[0] & 0x7F;
+
+  for (int i = 0; i < decoder->schema->field_count; i++)
+  {
+    uint32_t value;
+    int read = varint_read(buf + pos, len - pos, &value);
+
+    if (read == 0)
+    {
+      return TELEMETRY_CODEC_ERROR_TRUNCATED;
+    }
+
+    out_sample->values[i] = zigzag_decode(value);
+    pos += read;
+  }
+
+  *out_record_len = pos;
+
+  if (!key_frame)
+  {
+    if (!decoder->has_previous || sequence != ((decoder->sequence + 1) & 0x7F))
+    {
+      decoder->has_previous = 0;
+      return TELEMETRY_CODEC_ERROR_GAP;
+    }
+
+    for (int i = 0; i < decoder->schema->field_count; i++)
+    {
+      out_sample->values[i]
+          = (int32_t)((uint32_t)decoder->previous.values[i] + (uint32_t)out_sample->values[i]);
+    }
+  }
+
+  decoder->previous = *out_sample;
+  decoder->sequence = sequence;
+  decoder->has_previous = 1;
+  return 0;
+}
@@ -0,0 +1,105 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef TELEMETRY_CODEC_H
+#define TELEMETRY_CODEC_H
+
+#include <stdint.h>
+
+#define TELEMETRY_CODEC_MAX_FIELDS 16
+
+// A delta record arrived without the record it is relative to, skip to the next key frame
+#define TELEMETRY_CODEC_ERROR_GAP -2
+#define TELEMETRY_CODEC_ERROR_TRUNCATED -3
+
+// Key frame flag in the binary record header, the low 7 bits hold the sequence number
+#define TELEMETRY_CODEC_KEY_FRAME 0x80
+#define TELEMETRY_CODEC_DEFAULT_KEY_FRAME_INTERVAL 32
+
+/*
+ * Describes the readings of a device. Numeric fields are fixed point: a value v with d decimals
+ * is carried as the integer v * 10^d. The JSON form is
+ * {"d":{"myName":"<device_name>","<field>":<value>,...}}.
+ */
+typedef struct telemetry_field_tag
+{
+  const char* name;
+  int decimals;
+} TELEMETRY_FIELD;
+
+typedef struct telemetry_schema_tag
+{
+  const char* device_name;
+  int field_count;
+  TELEMETRY_FIELD fields[TELEMETRY_CODEC_MAX_FIELDS];
+} TELEMETRY_SCHEMA;
+
+typedef struct telemetry_sample_tag
+{
+  int32_t values[TELEMETRY_CODEC_MAX_FIELDS];
+} TELEMETRY_SAMPLE;
+
+/*
+ * Pluggable payload encoder, selected by name:
+ * - "json":  the JSON form of the sample, aggregated as a JSON array
+ * - "delta": binary records, one header byte (key frame flag and 7 bit sequence number) followed
+ *            by a zigzag varint per field, holding the value in key frames and the difference to
+ *            the previous sample otherwise. Records are self-delimiting and are aggregated back
+ *            to back.
+ */
+typedef struct telemetry_encoder_tag
+{
+  const char* name;
+  int (*encode)(
+      struct telemetry_encoder_tag* encoder,
+      const TELEMETRY_SAMPLE* sample,
+      unsigned char* buf,
+      int buflen);
+  int json; // output is JSON text
+  const TELEMETRY_SCHEMA* schema;
+  int key_frame_interval;
+  int since_key_frame;
+  unsigned char sequence;
+  TELEMETRY_SAMPLE previous;
+} TELEMETRY_ENCODER;
+
+/*
+ * Expands delta records back to samples, e.g. on the Gateway side before forwarding JSON to the
+ * IoT Hub. Records must be decoded in the order they were encoded.
+ */
+typedef struct telemetry_decoder_tag
+{
+  const TELEMETRY_SCHEMA* schema;
+  int has_previous;
+  unsigned char sequence;
+  TELEMETRY_SAMPLE previous;
+} TELEMETRY_DECODER;
+
+int telemetry_encoder_init(
+    TELEMETRY_ENCODER* encoder,
+    const char* name,
+    const TELEMETRY_SCHEMA* schema);
+int telemetry_encoder_encode(
+    TELEMETRY_ENCODER* encoder,
+    const TELEMETRY_SAMPLE* sample,
+    unsigned char* buf,
+    int buflen);
+void telemetry_decoder_init(TELEMETRY_DECODER* decoder, const TELEMETRY_SCHEMA* schema);
+int telemetry_decoder_decode(
+    TELEMETRY_DECODER* decoder,
+    const unsigned char* buf,
+    int len,
+    TELEMETRY_SAMPLE* out_sample,
+    int* out_record_len);
+int telemetry_codec_fields_to_json(
+    const TELEMETRY_SCHEMA* schema,
+    const TELEMETRY_SAMPLE* sample,
+    char* buf,
+    int buflen);
+int telemetry_codec_to_json(
+    const TELEMETRY_SCHEMA* schema,
+    const TELEMETRY_SAMPLE* sample,
+    char* buf,
+    int buflen);
+
+#endif // TELEMETRY_CODEC_H
@@ -0,0 +1,302 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "telemetry_filter.h"
+
+static void reset_window(TELEMETRY_FILTER_WINDOW* window)
+{
+  memset((void*)window, 0, sizeof(TELEMETRY_FILTER_WINDOW));
+}
+
+static void add_to_window(
+    TELEMETRY_FILTER_WINDOW* window,
+    const TELEMETRY_SAMPLE* sample,
+    int field_count)
+{
+  for (int i = 0; i < field_count; i++)
+  {
+    int32_t value = sample->values[i];
+
+    if (window->count == 0 || value < window->min.values[i])
+    {
+      window->min.values[i] = value;
+    }
+    if (window->count == 0 || value > window->max.values[i])
+    {
+      window->max.values[i] = value;
+    }
+    window->sum[i] += value;
+  }
+
+  window->count++;
+}
+
+/*
+ * Parse a band, "<value>" in the units of the field or "<percent>%" of the last published value
+ */
+static int parse_band(const char* text, int decimals, TELEMETRY_FILTER_BAND* band)
+{
+  char* end;
+  double value = strtod(text, &end);
+  double scale = 1.0;
+
+  if (end == text || !(value >= 0.0))
+  {
+    return -1;
+  }
+
+  band->absolute = 0;
+  band->relative = 0.0;
+  if (*end == '%' && end[1] == '\0')
+  {
+    band->relative = value / 100.0;
+    return 0;
+  }
+
+  for (int i = 0; i < decimals; i++)
+  {
+    scale *= 10.0;
+  }
+
+  if (*end != '\0' || value * scale > (double)INT32_MAX)
+  {
+    return -1;
+  }
+
+  band->absolute = (int32_t)(value * scale + 0.5);
+  return 0;
+}
+
+/*
+ * 1. Check the heartbeat interval
+ * 2. Parse the "field:band[,field:band...]" dead-bands, e.g. "temp:0.5,accelX:5%". The field "*"
+ *    sets the band of every field not listed by name, which otherwise publishes on any change.
+ *    Fields named twice keep the last band. An empty list disables the filter.
+ */
+int telemetry_filter_init(
+    TELEMETRY_FILTER* filter,
+    const TELEMETRY_SCHEMA* schema,
+    const char* deadbands,
+    int heartbeat_intervals,
+    int summaries)
+{
+  char list[TELEMETRY_FILTER_SPEC_SIZE];
+  int named[TELEMETRY_CODEC_MAX_FIELDS];
+  char* saveptr;
+
+  memset((void*)filter, 0, sizeof(TELEMETRY_FILTER));
+  memset(named, 0, sizeof(named));
+  filter->schema = schema;
+  filter->heartbeat_intervals = heartbeat_intervals;
+  filter->summaries = summaries;
+
+  // 1. Check the heartbeat interval
+  if (heartbeat_intervals < 0
+      || snprintf(list, sizeof(list), "%s", deadbands) >= (int)sizeof(list))
+  {
+    return -1;
+  }
+
+  // 2. Parse the "field:band[,field:band...]" dead-bands
+  for (char* entry = strtok_r(list, ",", &saveptr); entry != NULL;
+       entry = strtok_r(NULL, ",", &saveptr))
+  {
+    char* colon = strchr(entry, ':');
+    int found = 0;
+
+    if (colon == NULL || colon == entry)
+    {
+      return -1;
+    }
+
+    *colon = '\0';
+    for (int i = 0; i < schema->field_count; i++)
+    {
+      int wildcard = strcmp(entry, "*") == 0;
+
+      if ((wildcard && !named[i]) || strcmp(entry, schema->fields[i].name) == 0)
+      {
+        if (parse_band(colon + 1, schema->fields[i].decimals, &filter->bands[i]) != 0)
+        {
+          return -1;
+        }
+
+        named[i] = named[i] || !wildcard;
+        found = 1;
+      }
+    }
+
+    if (!found)
+    {
+      return -1;
+    }
+
+    filter->enabled = 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Decide whether the reading, encoded_len bytes once encoded, is published:
+ * 1. Publish the first reading, a forced one, and any reading without dead-bands
+ * 2. Publish when a field moved out of its dead-band around the last published reading
+ * 3. Publish a heartbeat after heartbeat_intervals - 1 suppressed readings in a row
+ * 4. Otherwise add the reading to the window of suppressed readings
+ * Return 1 to publish the reading, 0 to drop it
+ */
+int telemetry_filter_check(
+    TELEMETRY_FILTER* filter,
+    const TELEMETRY_SAMPLE* sample,
+    int encoded_len,
+    int force)
+{
+  int field_count = filter->schema->field_count;
+  int publish;
+
+  filter->stats.readings++;
+
+  // 1. Publish the first reading, a forced one, and any reading without dead-bands
+  publish = force || !filter->enabled || !filter->has_published;
+
+  // 2. Publish when a field moved out of its dead-band around the last published reading
+  for (int i = 0; i < field_count && !publish; i++)
+  {
+    int64_t last = filter->published.values[i];
+    int64_t change = (int64_t)sample->values[i] - last;
+    double magnitude = (double)(change < 0 ? -change : change);
+
+    publish = magnitude > (double)filter->bands[i].absolute
+        && magnitude > filter->bands[i].relative * (double)(last < 0 ? -last : last);
+  }
+
+  // 3. Publish a heartbeat after heartbeat_intervals - 1 suppressed readings in a row
+  if (!publish && filter->heartbeat_intervals > 0
+      && filter->since_published + 1 >= filter->heartbeat_intervals)
+  {
+    publish = 1;
+    filter->stats.heartbeats++;
+  }
+
+  // 4. Otherwise add the reading to the window of suppressed readings
+  if (!publish)
+  {
+    add_to_window(&filter->window, sample, field_count);
+    filter->since_published++;
+    filter->stats.suppressed_bytes += (uint64_t)encoded_len;
+    return 0;
+  }
+
+  filter->summary = filter->window;
+  reset_window(&filter->window);
+  filter->published = *sample;
+  filter->has_published = 1;
+  filter->since_published = 0;
+  filter->stats.published++;
+  filter->stats.published_bytes += (uint64_t)encoded_len;
+  return 1;
+}
+
+/*
+ * Print the summary of the readings suppressed before the last published one, to be published
+ * ahead of it:
+ * {"s":{"myName":"<device_name>","n":<count>,"min":{...},"max":{...},"mean":{...}}}
+ * Means are rounded to the precision of the field. Return the length, 0 without summaries or
+ * suppressed readings, -1 if it does not fit.
+ */
+int telemetry_filter_summary_to_json(TELEMETRY_FILTER* filter, char* buf, int buflen)
+{
+  const TELEMETRY_SCHEMA* schema = filter->schema;
+  TELEMETRY_FILTER_WINDOW* summary = &filter->summary;
+  TELEMETRY_SAMPLE mean;
+  int len;
+
+  if (!filter->summaries || summary->count == 0)
+  {
+    return 0;
+  }
+
+  for (int i = 0; i < schema->field_count; i++)
+  {
+    int64_t sum = summary->sum[i];
+    int64_t half = summary->count / 2;
+
+    mean.values[i] = (int32_t)(sum >= 0 ? (sum + half) / summary->count
+                                        : -((-sum + half) / summary->count));
+  }
+
+  len = snprintf(
+      buf,
+      (size_t)buflen,
+      "{\"s\":{\"myName\":\"%s\",\"n\":%d,\"min\":{",
+      schema->device_name,
+      summary->count);
+  if (len < buflen)
+  {
+    len += telemetry_codec_fields_to_json(schema, &summary->min, buf + len, buflen - len);
+  }
+  if (len < buflen)
+  {
+    len += snprintf(buf + len, (size_t)(buflen - len), "},\"max\":{");
+  }
+  if (len < buflen)
+  {
+    len += telemetry_codec_fields_to_json(schema, &summary->max, buf + len, buflen - len);
+  }
+  if (len < buflen)
+  {
+    len += snprintf(buf + len, (size_t)(buflen - len), "},\"mean\":{");
+  }
+  if (len < buflen)
+  {
+    len += telemetry_codec_fields_to_json(schema, &mean, buf + len, buflen - len);
+  }
+  if (len < buflen)
+  {
+    len += snprintf(buf + len, (size_t)(buflen - len), "}}}");
+  }
+
+  // The terminating NUL must fit as well, but it is not part of the payload
+  if (len >= buflen)
+  {
+    return -1;
+  }
+
+  reset_window(summary);
+  filter->stats.summaries++;
+  filter->stats.summary_bytes += (uint64_t)len;
+  return len;
+}
+
+/*
+ * Print the readings and bytes the filter saved. Bytes are those of the encoded readings and
+ * summaries, before aggregation.
+ */
+void telemetry_filter_print(const TELEMETRY_FILTER* filter)
+{
+  const TELEMETRY_FILTER_STATS* stats = &filter->stats;
+  uint64_t suppressed = stats->readings - stats->published;
+  uint64_t sent_bytes = stats->published_bytes + stats->summary_bytes;
+  uint64_t unfiltered_bytes = stats->published_bytes + stats->suppressed_bytes;
+
+  printf(
+      "Dead-band filter: readings = %llu, published = %llu (heartbeats = %llu), suppressed = %llu "
+      "(%.1f%%), summaries = %llu\r\n",
+      (unsigned long long)stats->readings,
+      (unsigned long long)stats->published,
+      (unsigned long long)stats->heartbeats,
+      (unsigned long long)suppressed,
+      stats->readings > 0 ? (double)suppressed * 100.0 / (double)stats->readings : 0.0,
+      (unsigned long long)stats->summaries);
+  printf(
+      "Dead-band filter: reading bytes = %llu instead of %llu, %.1f%% saved\r\n",
+      (unsigned long long)sent_bytes,
+      (unsigned long long)unfiltered_bytes,
+      unfiltered_bytes > 0
+          ? ((double)unfiltered_bytes - (double)sent_bytes) * 100.0 / (double)unfiltered_bytes
+          : 0.0);
+}
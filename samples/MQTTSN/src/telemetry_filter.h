@@ -0,0 +1,81 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef TELEMETRY_FILTER_H
+#define TELEMETRY_FILTER_H
+
+#include <stdint.h>
+
+#include "telemetry_codec.h"
+
+#define TELEMETRY_FILTER_SPEC_SIZE 256
+
+// Largest summary of suppressed readings, see telemetry_filter_summary_to_json()
+#define TELEMETRY_FILTER_SUMMARY_SIZE 512
+
+/*
+ * Dead-band of a field: a change larger than absolute (fixed point, like the field) or than
+ * relative times the last published value makes a reading worth publishing
+ */
+typedef struct telemetry_filter_band_tag
+{
+  int32_t absolute;
+  double relative;
+} TELEMETRY_FILTER_BAND;
+
+typedef struct telemetry_filter_window_tag
+{
+  int count;
+  TELEMETRY_SAMPLE min;
+  TELEMETRY_SAMPLE max;
+  int64_t sum[TELEMETRY_CODEC_MAX_FIELDS];
+} TELEMETRY_FILTER_WINDOW;
+
+typedef struct telemetry_filter_stats_tag
+{
+  uint64_t readings;
+  uint64_t published; // including heartbeats
+  uint64_t heartbeats; // published although within every dead-band
+  uint64_t summaries;
+  uint64_t published_bytes;
+  uint64_t suppressed_bytes; // encoded size the suppressed readings would have had
+  uint64_t summary_bytes;
+} TELEMETRY_FILTER_STATS;
+
+/*
+ * Report by exception: a reading is published only when a field left its dead-band around the
+ * last published reading, or as a heartbeat once heartbeat_intervals readings went by without one
+ * being published, so that the backend can tell a quiet sensor from a dead one. The readings
+ * suppressed in between can be summed up by their count and the min, max and mean of every field.
+ * Without any dead-band every reading is published.
+ */
+typedef struct telemetry_filter_tag
+{
+  const TELEMETRY_SCHEMA* schema;
+  int enabled; // at least one dead-band was configured
+  TELEMETRY_FILTER_BAND bands[TELEMETRY_CODEC_MAX_FIELDS];
+  int heartbeat_intervals; // 0 = no heartbeat
+  int summaries;
+  int has_published;
+  TELEMETRY_SAMPLE published; // last published reading, the center of the dead-bands
+  int since_published; // readings suppressed since
+  TELEMETRY_FILTER_WINDOW window; // readings suppressed since the last published one
+  TELEMETRY_FILTER_WINDOW summary; // window closed by the last published reading
+  TELEMETRY_FILTER_STATS stats;
+} TELEMETRY_FILTER;
+
+int telemetry_filter_init(
+    TELEMETRY_FILTER* filter,
+    const TELEMETRY_SCHEMA* schema,
+    const char* deadbands,
+    int heartbeat_intervals,
+    int summaries);
+int telemetry_filter_check(
+    TELEMETRY_FILTER* filter,
+    const TELEMETRY_SAMPLE* sample,
+    int encoded_len,
+    int force);
+int telemetry_filter_summary_to_json(TELEMETRY_FILTER* filter, char* buf, int buflen);
+void telemetry_filter_print(const TELEMETRY_FILTER* filter);
+
+#endif // TELEMETRY_FILTER_H
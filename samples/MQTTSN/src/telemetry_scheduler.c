@@ -0,0 +1,229 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "telemetry_scheduler.h"
+
+int telemetry_scheduler_init(TELEMETRY_SCHEDULER* scheduler)
+{
+  memset((void*)scheduler, 0, sizeof(TELEMETRY_SCHEDULER));
+  scheduler->armed_ns = UINT64_MAX;
+
+  if ((scheduler->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+  {
+    printf("Failed to create scheduler timer, errno %d\r\n", errno);
+    return -1;
+  }
+
+  return 0;
+}
+
+void telemetry_scheduler_deinit(TELEMETRY_SCHEDULER* scheduler)
+{
+  if (scheduler->timer_fd >= 0)
+  {
+    close(scheduler->timer_fd);
+    scheduler->timer_fd = -1;
+  }
+}
+
+/*
+ * Add a stream of rate_hz readings per second
+ */
+int telemetry_scheduler_add(TELEMETRY_SCHEDULER* scheduler, const char* name, double rate_hz)
+{
+  TELEMETRY_STREAM* stream;
+
+  if (scheduler->count == TELEMETRY_SCHEDULER_MAX_STREAMS || !(rate_hz > 0.0)
+      || rate_hz > TELEMETRY_SCHEDULER_MAX_RATE_HZ
+      || strlen(name) >= TELEMETRY_SCHEDULER_NAME_SIZE)
+  {
+    return -1;
+  }
+
+  stream = &scheduler->streams[scheduler->count++];
+  memset((void*)stream, 0, sizeof(TELEMETRY_STREAM));
+  snprintf(stream->name, sizeof(stream->name), "%s", name);
+  stream->rate_hz = rate_hz;
+  stream->period_ns = (uint64_t)(1e9 / rate_hz + 0.5);
+  latency_histogram_init(&stream->lateness);
+  return 0;
+}
+
+/*
+ * Add the streams of a "name:rate,name:rate" list, rates in Hz, e.g. "accel:100,temp:0.2"
+ */
+int telemetry_scheduler_add_streams(TELEMETRY_SCHEDULER* scheduler, const char* streams)
+{
+  char list[TELEMETRY_SCHEDULER_MAX_STREAMS * (TELEMETRY_SCHEDULER_NAME_SIZE + 16)];
+  char* saveptr;
+
+  if (snprintf(list, sizeof(list), "%s", streams) >= (int)sizeof(list))
+  {
+    return -1;
+  }
+
+  for (char* entry = strtok_r(list, ",", &saveptr); entry != NULL;
+       entry = strtok_r(NULL, ",", &saveptr))
+  {
+    char* end;
+    char* colon = strchr(entry, ':');
+    double rate_hz;
+
+    if (colon == NULL || colon == entry)
+    {
+      return -1;
+    }
+
+    *colon = '\0';
+    rate_hz = strtod(colon + 1, &end);
+    if (end == colon + 1 || *end != '\0'
+        || telemetry_scheduler_add(scheduler, entry, rate_hz) != 0)
+    {
+      return -1;
+    }
+  }
+
+  return scheduler->count > 0 ? 0 : -1;
+}
+
+/*
+ * Give every stream its first deadline at start_ns and arm the timerfd
+ */
+void telemetry_scheduler_start(TELEMETRY_SCHEDULER* scheduler, uint64_t start_ns)
+{
+  for (int i = 0; i < scheduler->count; i++)
+  {
+    scheduler->streams[i].next_deadline_ns = start_ns;
+  }
+
+  telemetry_scheduler_arm(scheduler, start_ns);
+}
+
+int telemetry_scheduler_poll_fd(const TELEMETRY_SCHEDULER* scheduler)
+{
+  return scheduler->timer_fd;
+}
+
+/*
+ * Return the earliest deadline of all streams, UINT64_MAX without streams
+ */
+uint64_t telemetry_scheduler_next_deadline_ns(const TELEMETRY_SCHEDULER* scheduler)
+{
+  uint64_t deadline_ns = UINT64_MAX;
+
+  for (int i = 0; i < scheduler->count; i++)
+  {
+    if (scheduler->streams[i].next_deadline_ns < deadline_ns)
+    {
+      deadline_ns = scheduler->streams[i].next_deadline_ns;
+    }
+  }
+
+  return deadline_ns;
+}
+
+/*
+ * Return the stream with the earliest deadline if it is due, NULL otherwise. The stream records
+ * how late it is dispatched and moves on to its next deadline, skipping the ones it overran.
+ */
+TELEMETRY_STREAM* telemetry_scheduler_next_due(TELEMETRY_SCHEDULER* scheduler, uint64_t now_ns)
+{
+  TELEMETRY_STREAM* due = NULL;
+  uint64_t late_ns;
+  uint64_t overrun;
+
+  for (int i = 0; i < scheduler->count; i++)
+  {
+    TELEMETRY_STREAM* stream = &scheduler->streams[i];
+
+    if (stream->next_deadline_ns <= now_ns
+        && (due == NULL || stream->next_deadline_ns < due->next_deadline_ns))
+    {
+      due = stream;
+    }
+  }
+
+  if (due == NULL)
+  {
+    return NULL;
+  }
+
+  late_ns = now_ns - due->next_deadline_ns;
+  overrun = late_ns / due->period_ns;
+  latency_histogram_record(&due->lateness, late_ns / 1000);
+  due->missed += overrun;
+  due->dispatched++;
+  due->next_deadline_ns += (overrun + 1) * due->period_ns;
+  return due;
+}
+
+/*
+ * Arm the timerfd for the earliest deadline, clearing an expiration that was already handled
+ */
+void telemetry_scheduler_arm(TELEMETRY_SCHEDULER* scheduler, uint64_t now_ns)
+{
+  struct itimerspec spec;
+  uint64_t expirations;
+  uint64_t deadline_ns = telemetry_scheduler_next_deadline_ns(scheduler);
+
+  // An expired timer stays readable until read; rearm it in case the deadline is still due
+  if (scheduler->armed_ns <= now_ns)
+  {
+    (void)read(scheduler->timer_fd, &expirations, sizeof(expirations));
+    scheduler->armed_ns = 0;
+  }
+
+  if (deadline_ns == scheduler->armed_ns)
+  {
+    return;
+  }
+
+  // A deadline in the past fires at once, no deadline leaves it_value zero and disarms the timer
+  memset(&spec, 0, sizeof(spec));
+  if (deadline_ns != UINT64_MAX)
+  {
+    spec.it_value.tv_sec = (time_t)(deadline_ns / 1000000000);
+    spec.it_value.tv_nsec = (long)(deadline_ns % 1000000000);
+  }
+
+  timerfd_settime(scheduler->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+  scheduler->armed_ns = deadline_ns;
+}
+
+/*
+ * Stop the timerfd, e.g. once enough readings were taken
+ */
+void telemetry_scheduler_disarm(TELEMETRY_SCHEDULER* scheduler)
+{
+  struct itimerspec spec;
+
+  memset(&spec, 0, sizeof(spec));
+  timerfd_settime(scheduler->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+  scheduler->armed_ns = UINT64_MAX;
+}
+
+void telemetry_scheduler_print(const TELEMETRY_SCHEDULER* scheduler)
+{
+  char name[64];
+
+  for (int i = 0; i < scheduler->count; i++)
+  {
+    const TELEMETRY_STREAM* stream = &scheduler->streams[i];
+
+    printf(
+        "Stream %s: rate = %.3f Hz, readings = %llu, missed deadlines = %llu\r\n",
+        stream->name,
+        stream->rate_hz,
+        (unsigned long long)stream->dispatched,
+        (unsigned long long)stream->missed);
+    snprintf(name, sizeof(name), "Scheduling jitter %s", stream->name);
+    latency_histogram_print(&stream->lateness, name);
+  }
+}
@@ -0,0 +1,58 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef TELEMETRY_SCHEDULER_H
+#define TELEMETRY_SCHEDULER_H
+
+#include <stdint.h>
+
+#include "latency_histogram.h"
+
+#define TELEMETRY_SCHEDULER_MAX_STREAMS 8
+#define TELEMETRY_SCHEDULER_NAME_SIZE 16
+
+// Highest rate of a stream, a period of 10 us
+#define TELEMETRY_SCHEDULER_MAX_RATE_HZ 100000.0
+
+/*
+ * One periodic stream. Its deadlines are start + k * period on the monotonic clock, whenever the
+ * previous reading was taken, so the schedule never drifts. A reading dispatched a period or more
+ * late skips the deadlines it overran instead of catching up with a burst of stale readings.
+ */
+typedef struct telemetry_stream_tag
+{
+  char name[TELEMETRY_SCHEDULER_NAME_SIZE];
+  double rate_hz;
+  uint64_t period_ns;
+  uint64_t next_deadline_ns;
+  uint64_t dispatched;
+  uint64_t missed; // deadlines skipped
+  LATENCY_HISTOGRAM lateness; // microseconds from the deadline to the dispatch
+} TELEMETRY_STREAM;
+
+/*
+ * Periodic streams of different rates behind one timerfd armed, with an absolute nanosecond
+ * deadline, for the earliest of them. The timerfd goes into the application's poll set, so
+ * sub-millisecond periods do not depend on the millisecond timeout of poll.
+ */
+typedef struct telemetry_scheduler_tag
+{
+  TELEMETRY_STREAM streams[TELEMETRY_SCHEDULER_MAX_STREAMS];
+  int count;
+  int timer_fd;
+  uint64_t armed_ns; // UINT64_MAX while disarmed
+} TELEMETRY_SCHEDULER;
+
+int telemetry_scheduler_init(TELEMETRY_SCHEDULER* scheduler);
+void telemetry_scheduler_deinit(TELEMETRY_SCHEDULER* scheduler);
+int telemetry_scheduler_add(TELEMETRY_SCHEDULER* scheduler, const char* name, double rate_hz);
+int telemetry_scheduler_add_streams(TELEMETRY_SCHEDULER* scheduler, const char* streams);
+void telemetry_scheduler_start(TELEMETRY_SCHEDULER* scheduler, uint64_t start_ns);
+int telemetry_scheduler_poll_fd(const TELEMETRY_SCHEDULER* scheduler);
+uint64_t telemetry_scheduler_next_deadline_ns(const TELEMETRY_SCHEDULER* scheduler);
+TELEMETRY_STREAM* telemetry_scheduler_next_due(TELEMETRY_SCHEDULER* scheduler, uint64_t now_ns);
+void telemetry_scheduler_arm(TELEMETRY_SCHEDULER* scheduler, uint64_t now_ns);
+void telemetry_scheduler_disarm(TELEMETRY_SCHEDULER* scheduler);
+void telemetry_scheduler_print(const TELEMETRY_SCHEDULER* scheduler);
+
+#endif // TELEMETRY_SCHEDULER_H
@@ -0,0 +1,32 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef TIME_UTIL_H
+#define TIME_UTIL_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Monotonic clock in microseconds, used for deadlines and latency measurements
+ */
+static inline uint64_t time_util_now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * Monotonic clock in nanoseconds, used by the benchmarks and the telemetry scheduler
+ */
+static inline uint64_t time_util_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+#endif // TIME_UTIL_H
@@ -0,0 +1,431 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "topic_registry.h"
+
+// FNV-1a
+static uint32_t hash_name(const char* name)
+{
+  uint32_t hash = 2166136261u;
+
+  while (*name != '\0')
+  {
+    hash = (hash ^ (unsigned char)*name++) * 16777619u;
+  }
+
+  return hash;
+}
+
+/*
+ * Return the slot holding the entry of name, -1 if there is none
+ */
+static int find_slot(const TOPIC_REGISTRY* registry, const char* name, uint32_t hash)
+{
+  if (registry->size == 0)
+  {
+    return -1;
+  }
+
+  for (int slot = (int)(hash & (uint32_t)registry->slot_mask); registry->slots[slot] >= 0;
+       slot = (slot + 1) & registry->slot_mask)
+  {
+    const TOPIC_REGISTRY_ENTRY* entry = &registry->entries[registry->slots[slot]];
+
+    if (entry->hash == hash && strcmp(entry->name, name) == 0)
+    {
+      return slot;
+    }
+  }
+
+  return -1;
+}
+
+static void unlink_entry(TOPIC_REGISTRY* registry, TOPIC_REGISTRY_ENTRY* entry)
+{
+  if (entry->newer >= 0)
+  {
+    registry->entries[entry->newer].older = entry->older;
+  }
+  else
+  {
+    registry->newest = entry->older;
+  }
+
+  if (entry->older >= 0)
+  {
+    registry->entries[entry->older].newer = entry->newer;
+  }
+  else
+  {
+    registry->oldest = entry->newer;
+  }
+}
+
+static void link_newest(TOPIC_REGISTRY* registry, TOPIC_REGISTRY_ENTRY* entry)
+{
+  int index = topic_registry_index(registry, entry);
+
+  entry->newer = -1;
+  entry->older = registry->newest;
+  if (registry->newest >= 0)
+  {
+    registry->entries[registry->newest].newer = index;
+  }
+  else
+  {
+    registry->oldest = index;
+  }
+  registry->newest = index;
+}
+
+/*
+ * Make the entry due for a REGISTER right away
+ */
+static void set_registering(TOPIC_REGISTRY* registry, TOPIC_REGISTRY_ENTRY* entry)
+{
+  if (entry->state != TOPIC_REGISTRY_REGISTERING)
+  {
+    entry->state = TOPIC_REGISTRY_REGISTERING;
+    entry->next_pending = registry->pending_list;
+    registry->pending_list = topic_registry_index(registry, entry);
+    if (++registry->pending > registry->stats.max_pending)
+    {
+      registry->stats.max_pending = registry->pending;
+    }
+  }
+
+  entry->retransmissions = 0;
+  entry->first_sent_us = 0;
+  entry->deadline_us = 0;
+}
+
+static void clear_registering(TOPIC_REGISTRY* registry, TOPIC_REGISTRY_ENTRY* entry)
+{
+  int index = topic_registry_index(registry, entry);
+
+  if (entry->state != TOPIC_REGISTRY_REGISTERING)
+  {
+    return;
+  }
+
+  if (registry->pending_list == index)
+  {
+    registry->pending_list = entry->next_pending;
+  }
+  else
+  {
+    for (int i = registry->pending_list; i >= 0; i = registry->entries[i].next_pending)
+    {
+      if (registry->entries[i].next_pending == index)
+      {
+        registry->entries[i].next_pending = entry->next_pending;
+        break;
+      }
+    }
+  }
+
+  registry->pending--;
+}
+
+/*
+ * A registry of size 0 stays empty: nothing can be added to it
+ */
+int topic_registry_init(TOPIC_REGISTRY* registry, int size)
+{
+  int slot_count = 1;
+
+  memset((void*)registry, 0, sizeof(TOPIC_REGISTRY));
+  registry->newest = registry->oldest = registry->free_list = registry->pending_list = -1;
+
+  if (size < 0 || size > TOPIC_REGISTRY_MAX_SIZE)
+  {
+    return -1;
+  }
+
+  if (size == 0)
+  {
+    return 0;
+  }
+
+  // At most half the slots in use, so that probe sequences stay short
+  while (slot_count < 2 * size)
+  {
+    slot_count *= 2;
+  }
+
+  registry->entries = calloc((size_t)size, sizeof(TOPIC_REGISTRY_ENTRY));
+  registry->slots = malloc((size_t)slot_count * sizeof(int));
+  if (registry->entries == NULL || registry->slots == NULL)
+  {
+    topic_registry_deinit(registry);
+    return -1;
+  }
+
+  memset(registry->slots, 0xFF, (size_t)slot_count * sizeof(int));
+  registry->size = size;
+  registry->slot_mask = slot_count - 1;
+  registry->free_list = 0;
+  for (int i = 0; i < size; i++)
+  {
+    registry->entries[i].older = i + 1 < size ? i + 1 : -1;
+  }
+
+  return 0;
+}
+
+void topic_registry_deinit(TOPIC_REGISTRY* registry)
+{
+  free(registry->entries);
+  free(registry->slots);
+  registry->entries = NULL;
+  registry->slots = NULL;
+  registry->size = 0;
+}
+
+/*
+ * Return the entry of name, registered or not, and make it the most recently used. NULL when the
+ * name is unknown.
+ */
+TOPIC_REGISTRY_ENTRY* topic_registry_lookup(TOPIC_REGISTRY* registry, const char* name)
+{
+  int slot = find_slot(registry, name, hash_name(name));
+  TOPIC_REGISTRY_ENTRY* entry;
+
+  if (slot < 0)
+  {
+    registry->stats.misses++;
+    return NULL;
+  }
+
+  registry->stats.hits++;
+  entry = &registry->entries[registry->slots[slot]];
+  if (registry->newest != registry->slots[slot])
+  {
+    unlink_entry(registry, entry);
+    link_newest(registry, entry);
+  }
+
+  return entry;
+}
+
+/*
+ * Add name as the most recently used entry, due for a REGISTER, evicting the least recently used
+ * registered entry that no message pins when the registry is full. Return NULL when every entry is
+ * pinned or registering, or the name is too long.
+ */
+TOPIC_REGISTRY_ENTRY* topic_registry_add(TOPIC_REGISTRY* registry, const char* name)
+{
+  TOPIC_REGISTRY_ENTRY* entry;
+  size_t len = strlen(name);
+  int slot;
+
+  if (len >= TOPIC_REGISTRY_NAME_SIZE || registry->size == 0)
+  {
+    return NULL;
+  }
+
+  if (registry->free_list < 0)
+  {
+    int victim = registry->oldest;
+
+    while (victim >= 0
+           && (registry->entries[victim].state != TOPIC_REGISTRY_REGISTERED
+               || registry->entries[victim].messages > 0))
+    {
+      victim = registry->entries[victim].newer;
+    }
+
+    if (victim < 0)
+    {
+      return NULL;
+    }
+
+    topic_registry_remove(registry, &registry->entries[victim]);
+    registry->stats.evictions++;
+  }
+
+  entry = &registry->entries[registry->free_list];
+  registry->free_list = entry->older;
+  memset((void*)entry, 0, sizeof(TOPIC_REGISTRY_ENTRY));
+  memcpy(entry->name, name, len + 1);
+  entry->hash = hash_name(name);
+
+  for (slot = (int)(entry->hash & (uint32_t)registry->slot_mask); registry->slots[slot] >= 0;
+       slot = (slot + 1) & registry->slot_mask)
+  {
+  }
+
+  registry->slots[slot] = topic_registry_index(registry, entry);
+  registry->count++;
+  registry->stats.registrations++;
+  link_newest(registry, entry);
+  set_registering(registry, entry);
+  return entry;
+}
+
+/*
+ * Forget the entry. Later entries of its probe sequence move back into the freed slot, so that
+ * lookups need no tombstones.
+ */
+void topic_registry_remove(TOPIC_REGISTRY* registry, TOPIC_REGISTRY_ENTRY* entry)
+{
+  int slot = find_slot(registry, entry->name, entry->hash);
+  int next = slot;
+
+  for (;;)
+  {
+    int home;
+
+    next = (next + 1) & registry->slot_mask;
+    if (registry->slots[next] < 0)
+    {
+      break;
+    }
+
+    // The entry at next may fill the hole unless its home slot lies cyclically in (slot, next]
+    home = (int)(registry->entries[registry->slots[next]].hash & (uint32_t)registry->slot_mask);
+    if (next > slot ? (home <= slot || home > next) : (home <= slot && home > next))
+    {
+      registry->slots[slot] = registry->slots[next];
+      slot = next;
+    }
+  }
+
+  registry->slots[slot] = -1;
+  clear_registering(registry, entry);
+  unlink_entry(registry, entry);
+  entry->state = TOPIC_REGISTRY_FREE;
+  entry->older = registry->free_list;
+  registry->free_list = topic_registry_index(registry, entry);
+  registry->count--;
+}
+
+int topic_registry_index(const TOPIC_REGISTRY* registry, const TOPIC_REGISTRY_ENTRY* entry)
+{
+  return (int)(entry - registry->entries);
+}
+
+TOPIC_REGISTRY_ENTRY* topic_registry_get(TOPIC_REGISTRY* registry, int index)
+{
+  return &registry->entries[index];
+}
+
+/*
+ * The Gateway acknowledged the REGISTER of the entry with topic_id
+ */
+void topic_registry_set_registered(
+    TOPIC_REGISTRY* registry,
+    TOPIC_REGISTRY_ENTRY* entry,
+    unsigned short topic_id)
+{
+  clear_registering(registry, entry);
+  entry->state = TOPIC_REGISTRY_REGISTERED;
+  entry->topic_id = topic_id;
+}
+
+/*
+ * Return the entry whose REGISTER in flight has packet_id, NULL if none
+ */
+TOPIC_REGISTRY_ENTRY* topic_registry_find_packet(
+    TOPIC_REGISTRY* registry,
+    unsigned short packet_id)
+{
+  for (int i = registry->pending_list; i >= 0; i = registry->entries[i].next_pending)
+  {
+    TOPIC_REGISTRY_ENTRY* entry = &registry->entries[i];
+
+    if (entry->first_sent_us != 0 && entry->packet_id == packet_id)
+    {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Return the registered entry of topic_id, NULL if none
+ */
+TOPIC_REGISTRY_ENTRY* topic_registry_find_topic_id(
+    TOPIC_REGISTRY* registry,
+    unsigned short topic_id)
+{
+  for (int i = registry->newest; i >= 0; i = registry->entries[i].older)
+  {
+    TOPIC_REGISTRY_ENTRY* entry = &registry->entries[i];
+
+    if (entry->state == TOPIC_REGISTRY_REGISTERED && entry->topic_id == topic_id)
+    {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Return an entry whose REGISTER is due, NULL if none
+ */
+TOPIC_REGISTRY_ENTRY* topic_registry_next_expired(TOPIC_REGISTRY* registry, uint64_t now_us)
+{
+  for (int i = registry->pending_list; i >= 0; i = registry->entries[i].next_pending)
+  {
+    if (registry->entries[i].deadline_us <= now_us)
+    {
+      return &registry->entries[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Return the time at which the next REGISTER is due, UINT64_MAX if none
+ */
+uint64_t topic_registry_next_deadline(const TOPIC_REGISTRY* registry)
+{
+  uint64_t deadline = UINT64_MAX;
+
+  for (int i = registry->pending_list; i >= 0; i = registry->entries[i].next_pending)
+  {
+    if (registry->entries[i].deadline_us < deadline)
+    {
+      deadline = registry->entries[i].deadline_us;
+    }
+  }
+
+  return deadline;
+}
+
+/*
+ * Make the entry due for a REGISTER again, e.g. when the Gateway no longer knows its topic ID
+ */
+void topic_registry_reregister(TOPIC_REGISTRY* registry, TOPIC_REGISTRY_ENTRY* entry)
+{
+  set_registering(registry, entry);
+}
+
+/*
+ * A new session forgot every registration: the topics of messages in the send window are due for
+ * a REGISTER, the others are dropped and registered again on their next use
+ */
+void topic_registry_reset(TOPIC_REGISTRY* registry)
+{
+  for (int i = registry->newest; i >= 0;)
+  {
+    TOPIC_REGISTRY_ENTRY* entry = &registry->entries[i];
+
+    i = entry->older;
+    if (entry->messages > 0)
+    {
+      set_registering(registry, entry);
+    }
+    else
+    {
+      topic_registry_remove(registry, entry);
+    }
+  }
+}
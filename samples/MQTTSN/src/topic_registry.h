@@ -0,0 +1,91 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef TOPIC_REGISTRY_H
+#define TOPIC_REGISTRY_H
+
+#include <stdint.h>
+
+#define TOPIC_REGISTRY_MAX_SIZE 4096
+// Telemetry topic with a few message properties
+#define TOPIC_REGISTRY_NAME_SIZE 256
+
+typedef enum
+{
+  TOPIC_REGISTRY_FREE,
+  TOPIC_REGISTRY_REGISTERING, // REGISTER due or in flight
+  TOPIC_REGISTRY_REGISTERED
+} TOPIC_REGISTRY_STATE;
+
+typedef struct topic_registry_entry_tag
+{
+  char name[TOPIC_REGISTRY_NAME_SIZE];
+  uint32_t hash;
+  TOPIC_REGISTRY_STATE state;
+  unsigned short topic_id; // valid once registered
+  unsigned short packet_id; // of the REGISTER in flight
+  int retransmissions;
+  uint64_t first_sent_us; // 0 while the REGISTER was not sent
+  uint64_t sent_us;
+  uint64_t deadline_us; // REGISTER (re)transmission due, 0 = right away
+  int messages; // PUBLISH packets in the send window with this topic, which pin the entry
+  int newer; // LRU neighbours, -1 at either end
+  int older;
+  int next_pending; // next entry in TOPIC_REGISTRY_REGISTERING, -1 at the end
+} TOPIC_REGISTRY_ENTRY;
+
+typedef struct topic_registry_stats_tag
+{
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t registrations;
+  int max_pending; // most REGISTER packets in flight at once
+} TOPIC_REGISTRY_STATS;
+
+/*
+ * Topic name to registered topic ID map of up to size topics, for a client publishing to many
+ * topics, e.g. telemetry topics carrying message properties. Names are hashed (FNV-1a) into an
+ * open-addressed table, with linear probing, of at least twice size slots, so that lookups stay
+ * short. Past size topics, the least recently used one that no PUBLISH in the send window refers
+ * to is evicted and registered again on its next use. The registry only keeps state: the client
+ * sends the REGISTER packets, several in flight at once, and matches their REGACK by packet ID.
+ */
+typedef struct topic_registry_tag
+{
+  TOPIC_REGISTRY_ENTRY* entries;
+  int* slots; // entry index per slot, -1 when empty
+  int size;
+  int slot_mask;
+  int count;
+  int newest;
+  int oldest;
+  int free_list; // chained through older
+  int pending_list;
+  int pending; // entries in TOPIC_REGISTRY_REGISTERING
+  TOPIC_REGISTRY_STATS stats;
+} TOPIC_REGISTRY;
+
+int topic_registry_init(TOPIC_REGISTRY* registry, int size);
+void topic_registry_deinit(TOPIC_REGISTRY* registry);
+TOPIC_REGISTRY_ENTRY* topic_registry_lookup(TOPIC_REGISTRY* registry, const char* name);
+TOPIC_REGISTRY_ENTRY* topic_registry_add(TOPIC_REGISTRY* registry, const char* name);
+void topic_registry_remove(TOPIC_REGISTRY* registry, TOPIC_REGISTRY_ENTRY* entry);
+int topic_registry_index(const TOPIC_REGISTRY* registry, const TOPIC_REGISTRY_ENTRY* entry);
+TOPIC_REGISTRY_ENTRY* topic_registry_get(TOPIC_REGISTRY* registry, int index);
+void topic_registry_set_registered(
+    TOPIC_REGISTRY* registry,
+    TOPIC_REGISTRY_ENTRY* entry,
+    unsigned short topic_id);
+TOPIC_REGISTRY_ENTRY* topic_registry_find_packet(
+    TOPIC_REGISTRY* registry,
+    unsigned short packet_id);
+TOPIC_REGISTRY_ENTRY* topic_registry_find_topic_id(
+    TOPIC_REGISTRY* registry,
+    unsigned short topic_id);
+TOPIC_REGISTRY_ENTRY* topic_registry_next_expired(TOPIC_REGISTRY* registry, uint64_t now_us);
+uint64_t topic_registry_next_deadline(const TOPIC_REGISTRY* registry);
+void topic_registry_reregister(TOPIC_REGISTRY* registry, TOPIC_REGISTRY_ENTRY* entry);
+void topic_registry_reset(TOPIC_REGISTRY* registry);
+
+#endif // TOPIC_REGISTRY_H
@@ -15,6 +15,11 @@
  *    Sergio R. Caprile - "commonalization" from prior samples and/or documentation extension
  *******************************************************************************/
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* sendmmsg and recvmmsg */
+#define _GNU_SOURCE
+#endif
+
 #include <sys/types.h>
 
 #if !defined(SOCKET_ERROR)
@@ -35,7 +40,9 @@
 #define EWOULDBLOCK WSAEWOULDBLOCK
 #define ENOTCONN WSAENOTCONN
 #define ECONNRESET WSAECONNRESET
+#define ECONNREFUSED WSAECONNREFUSED
 #define ioctl ioctlsocket
+#define poll WSAPoll
 #define socklen_t int
 #else
 #define INVALID_SOCKET SOCKET_ERROR
@@ -45,6 +52,7 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -61,19 +69,28 @@
 #include <sys/ioctl.h>
 #endif
 
+#include "time_util.h"
+#include "transport.h"
+#include "transport_capture.h"
+#include "transport_impairment.h"
+
 /**
 This simple low-level implementation assumes a single connection for a single thread. Thus, a static
 variable is used for that connection.
-On other scenarios, the user must solve this by taking into account that the current implementation
-of MQTTSNPacket_read() has a function pointer for a function call to get the data to a buffer, but
-no provisions to know the caller or other indicator (the socket id): int (*getfn)(unsigned char*,
-int)
+On other scenarios, the current implementation of MQTTSNPacket_read() has a function pointer for a
+function call to get the data to a buffer, but no provisions to know the caller or other indicator
+(the socket id): int (*getfn)(unsigned char*, int). Use a TRANSPORT_HANDLE instead, and receive on
+its socket with transport_batch_receive(), as the MQTTSN client does.
 */
 static int mysock = INVALID_SOCKET;
+static TRANSPORT_SEND_BATCH send_batch;
+static TRANSPORT_RECEIVE_BATCH receive_batch;
 
-#ifdef SRC_PORT
-struct sockaddr_in addr, srcaddr;
-#endif
+/**
+The transport_socket_* functions take the socket explicitly so that one process can drive many
+connections (for example the fleet simulator, one socket per simulated device). The single
+connection functions below are implemented on top of them.
+*/
 
 int Socket_error(char* aString, int sock)
 {
@@ -97,8 +114,462 @@ int Socket_error(char* aString, int sock)
   return errno;
 }
 
+/**
+A connected socket reports the ICMP port unreachable caused by an earlier datagram as ECONNREFUSED
+on the next call: the peer is not listening (yet), which retransmissions already deal with.
+return 1 when the last socket call failed without anything to report
+*/
+static int is_transient_error(void)
+{
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED;
+}
+
+/**
+return the address to pass to sendto, NULL for the peer of a connected socket (addr_len 0)
+*/
+static const struct sockaddr* get_destination(
+    const struct sockaddr_storage* addr,
+    socklen_t addr_len)
+{
+  return addr_len > 0 ? (const struct sockaddr*)addr : NULL;
+}
+
+static int poll_socket(int sock, int timeout_ms)
+{
+  struct pollfd pfd;
+  int rc;
+
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  if ((rc = poll(&pfd, 1, timeout_ms)) < 0)
+  {
+    if (errno == EINTR)
+      return 0;
+    return -Socket_error("poll", sock);
+  }
+
+  return rc > 0 ? 1 : 0;
+}
+
+/**
+Send the impaired datagrams whose delay has passed by now_us. A datagram that fails to send is lost,
+as it would be on a congested link.
+return 0 on success, <0 for the last error
+*/
+static int impairment_send_due(TRANSPORT_IMPAIRMENT* impairment, int sock, uint64_t now_us)
+{
+  TRANSPORT_IMPAIRED_DATAGRAM* datagram;
+  int rc = 0;
+
+  while ((datagram = transport_impairment_next(impairment, TRANSPORT_IMPAIR_SEND, now_us)) != NULL)
+  {
+    const struct sockaddr* addr = get_destination(&datagram->addr, datagram->addr_len);
+
+    if (sendto(sock, datagram->data, datagram->len, 0, addr, datagram->addr_len) == SOCKET_ERROR
+        && !is_transient_error())
+      rc = -Socket_error("sendto", sock);
+    transport_impairment_release(impairment, TRANSPORT_IMPAIR_SEND);
+  }
+
+  return rc;
+}
+
+/**
+Move up to TRANSPORT_BATCH_SIZE datagrams from the socket into the receive queue of the impairment.
+return 0 on success, <0 for an error
+*/
+static int impairment_drain_socket(TRANSPORT_IMPAIRMENT* impairment, int sock)
+{
+  unsigned char buf[TRANSPORT_DATAGRAM_SIZE];
+  struct sockaddr_storage from;
+  socklen_t addrlen;
+  int rc;
+
+  for (int i = 0; i < TRANSPORT_BATCH_SIZE; i++)
+  {
+    addrlen = sizeof(from);
+    rc = recvfrom(sock, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*)&from, &addrlen);
+    if (rc == SOCKET_ERROR)
+    {
+      if (is_transient_error())
+        break;
+      return -Socket_error("recvfrom", sock);
+    }
+
+    transport_impairment_submit(
+        impairment,
+        TRANSPORT_IMPAIR_RECEIVE,
+        (const struct sockaddr*)&from,
+        addrlen,
+        buf,
+        rc,
+        time_util_now_us());
+  }
+
+  return 0;
+}
+
+/**
+Fill the batch with received datagrams whose delay has passed. With wait set, block until at least
+one is due, sending held datagrams as their delay passes meanwhile.
+return the number of datagrams received, <0 for an error
+*/
+static int impairment_receive(
+    TRANSPORT_IMPAIRMENT* impairment,
+    TRANSPORT_RECEIVE_BATCH* batch,
+    int sock,
+    int wait)
+{
+  TRANSPORT_IMPAIRED_DATAGRAM* datagram;
+  int rc;
+
+  for (;;)
+  {
+    uint64_t now_us;
+    uint64_t deadline_us;
+
+    if ((rc = impairment_drain_socket(impairment, sock)) < 0)
+      return rc;
+
+    now_us = time_util_now_us();
+    while (batch->count < TRANSPORT_BATCH_SIZE
+           && (datagram = transport_impairment_next(impairment, TRANSPORT_IMPAIR_RECEIVE, now_us))
+               != NULL)
+    {
+      if (transport_capture_enabled)
+        transport_capture_record(
+            sock,
+            TRANSPORT_CAPTURE_RECEIVED,
+            (const struct sockaddr*)&datagram->addr,
+            datagram->data,
+            datagram->len,
+            NULL,
+            0);
+      memcpy(batch->buffers[batch->count], datagram->data, datagram->len);
+      batch->lengths[batch->count] = datagram->len;
+      batch->addrs[batch->count] = datagram->addr;
+      batch->addr_lengths[batch->count] = datagram->addr_len;
+      batch->count++;
+      transport_impairment_release(impairment, TRANSPORT_IMPAIR_RECEIVE);
+    }
+
+    if (batch->count > 0 || !wait)
+      return batch->count;
+
+    impairment_send_due(impairment, sock, now_us);
+    deadline_us = transport_impairment_next_deadline_us(impairment);
+    if ((rc = poll_socket(
+             sock,
+             deadline_us == UINT64_MAX ? -1 : (int)((deadline_us - now_us + 999) / 1000)))
+        < 0)
+      return rc;
+  }
+}
+
 int transport_sendPacketBuffer(char* host, int port, unsigned char* buf, int buflen)
 {
+  int rc;
+
+  // keep datagrams in order with anything still queued
+  if ((rc = transport_flush()) != 0)
+    return rc;
+
+  return transport_socket_send(mysock, host, port, buf, buflen);
+}
+
+/**
+Queue a datagram to be sent by the next transport_flush (or transport_sendPacketBuffer)
+*/
+int transport_queuePacketBuffer(char* host, int port, unsigned char* buf, int buflen)
+{
+  return transport_batch_queue(&send_batch, host, port, buf, buflen);
+}
+
+int transport_flush()
+{
+  int rc = transport_batch_flush(&send_batch);
+  return rc < 0 ? rc : 0;
+}
+
+/**
+Hand out the datagrams drained by the last recvmmsg before blocking for more
+*/
+int transport_getdata(unsigned char* buf, int count)
+{
+  unsigned char* datagram;
+  int rc;
+
+  if (receive_batch.next >= receive_batch.count
+      && (rc = transport_batch_receive(&receive_batch, mysock, 1, NULL)) <= 0)
+    return rc < 0 ? rc : SOCKET_ERROR;
+
+  if ((rc = transport_batch_next(&receive_batch, &datagram)) <= 0)
+    return rc;
+  if (rc > count)
+    rc = count;
+  memcpy(buf, datagram, rc);
+  // printf("received %d bytes count %d\n", rc, (int)count);
+  return rc;
+}
+
+/**
+return the number of datagrams already received and not yet read by transport_getdata
+*/
+int transport_pending()
+{
+  return receive_batch.count - receive_batch.next;
+}
+
+/**
+return >=0 for a socket descriptor, <0 for an error code
+*/
+int transport_open()
+{
+#ifdef SRC_PORT
+  mysock = transport_socket_open(SRC_PORT, 0);
+#else
+  mysock = transport_socket_open(0, 0);
+#endif
+
+  transport_batch_init(&send_batch, mysock, NULL);
+  receive_batch.count = receive_batch.next = 0;
+
+  return mysock;
+}
+
+int transport_close()
+{
+  return transport_socket_close(mysock);
+}
+
+int transport_wait(int timeout_ms)
+{
+  if (transport_pending() > 0)
+    return 1;
+
+  return transport_socket_wait(mysock, timeout_ms);
+}
+
+static int open_socket(int family, int src_port, int nonblocking, int reuse_port)
+{
+  struct sockaddr_storage srcaddr;
+  socklen_t srcaddr_len;
+  int sock = socket(family, SOCK_DGRAM, 0);
+
+  if (sock == INVALID_SOCKET)
+  {
+    return -Socket_error("socket", sock);
+  }
+
+  // set custom source port, optionally shared with other sockets that set SO_REUSEPORT as well
+  if (src_port > 0)
+  {
+#ifdef SO_REUSEPORT
+    int reuse = 1;
+
+    if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+    {
+      int rc = Socket_error("setsockopt", sock);
+      close(sock);
+      return -rc;
+    }
+#endif
+
+    memset(&srcaddr, 0, sizeof(srcaddr));
+    if (family == AF_INET6)
+    {
+      struct sockaddr_in6* addr = (struct sockaddr_in6*)&srcaddr;
+
+      addr->sin6_family = AF_INET6;
+      addr->sin6_addr = in6addr_any;
+      addr->sin6_port = htons(src_port);
+      srcaddr_len = sizeof(struct sockaddr_in6);
+    }
+    else
+    {
+      struct sockaddr_in* addr = (struct sockaddr_in*)&srcaddr;
+
+      addr->sin_family = AF_INET;
+      addr->sin_addr.s_addr = htonl(INADDR_ANY);
+      addr->sin_port = htons(src_port);
+      srcaddr_len = sizeof(struct sockaddr_in);
+    }
+
+    if (bind(sock, (struct sockaddr*)&srcaddr, srcaddr_len) < 0)
+    {
+      int rc = Socket_error("bind", sock);
+      close(sock);
+      return -rc;
+    }
+  }
+
+  if (nonblocking)
+  {
+    int flags = fcntl(sock, F_GETFL, 0);
+
+    if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+      int rc = Socket_error("fcntl", sock);
+      close(sock);
+      return -rc;
+    }
+  }
+
+  return sock;
+}
+
+/**
+Open a UDP socket bound to src_port (0 lets the kernel pick an ephemeral port). Sockets opened
+with nonblocking set are meant to be driven from an event loop such as epoll.
+return >=0 for a socket descriptor, <0 for an error code
+*/
+int transport_socket_open(int src_port, int nonblocking)
+{
+  return open_socket(AF_INET, src_port, nonblocking, 0);
+}
+
+/**
+Open a UDP socket bound to port with SO_REUSEPORT, so that several processes or threads can each
+open one on the same port. The kernel spreads the datagrams over the sockets by a hash of the
+source address and port, so the datagrams of one client always reach the same socket.
+return >=0 for a socket descriptor, <0 for an error code
+*/
+int transport_socket_open_shared(int port, int nonblocking)
+{
+#ifdef SO_REUSEPORT
+  return open_socket(AF_INET, port, nonblocking, 1);
+#else
+  return -1;
+#endif
+}
+
+/**
+Open a non-blocking UDP socket bound to port, shared with the other sockets of the host bound to
+it, and join the IPv4 multicast group. Datagrams sent to group_addr stay on the local network
+(TTL 1) and are looped back to the host.
+return >=0 for a socket descriptor, <0 for an error code
+*/
+int transport_multicast_open(const char* group, int port, struct sockaddr_in* group_addr)
+{
+  struct sockaddr_in addr;
+  struct ip_mreq membership;
+  int reuse = 1;
+  unsigned char ttl = 1;
+  unsigned char loop = 1;
+  int flags;
+  int sock;
+
+  memset(group_addr, 0, sizeof(struct sockaddr_in));
+  group_addr->sin_family = AF_INET;
+  group_addr->sin_port = htons(port);
+  if (inet_pton(AF_INET, group, &group_addr->sin_addr) != 1
+      || !IN_MULTICAST(ntohl(group_addr->sin_addr.s_addr)))
+  {
+    printf("Invalid IPv4 multicast group %s\n", group);
+    return SOCKET_ERROR;
+  }
+
+  if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET)
+    return -Socket_error("socket", sock);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  membership.imr_multiaddr = group_addr->sin_addr;
+  membership.imr_interface.s_addr = htonl(INADDR_ANY);
+
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) != 0
+      || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0
+      || setsockopt(
+             sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&membership, sizeof(membership))
+          != 0
+      || setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl)) != 0
+      || setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loop, sizeof(loop)) != 0
+      || (flags = fcntl(sock, F_GETFL, 0)) < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+  {
+    int rc = Socket_error("multicast", sock);
+    close(sock);
+    return -rc;
+  }
+
+  return sock;
+}
+
+/**
+Resolve host, a name or an IPv4 or IPv6 address, once and open a UDP socket connected to it and
+bound to src_port (0 lets the kernel pick an ephemeral port). The addresses of host are tried in
+the order of the resolver.
+return 0 on success, <0 for an error code
+*/
+int transport_handle_open(
+    TRANSPORT_HANDLE* handle,
+    const char* host,
+    int port,
+    int src_port,
+    int nonblocking)
+{
+  struct addrinfo hints;
+  struct addrinfo* results;
+  char service[8];
+  int rc;
+
+  memset(handle, 0, sizeof(TRANSPORT_HANDLE));
+  handle->sock = INVALID_SOCKET;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_NUMERICSERV;
+  snprintf(service, sizeof(service), "%d", port);
+
+  if ((rc = getaddrinfo(host, service, &hints, &results)) != 0)
+  {
+    printf("Failed to resolve %s, %s\n", host, gai_strerror(rc));
+    return SOCKET_ERROR;
+  }
+
+  for (struct addrinfo* ai = results; ai != NULL && handle->sock < 0; ai = ai->ai_next)
+  {
+    if ((handle->sock = open_socket(ai->ai_family, src_port, nonblocking, 0)) < 0)
+    {
+      continue;
+    }
+
+    if (connect(handle->sock, ai->ai_addr, ai->ai_addrlen) != 0)
+    {
+      Socket_error("connect", handle->sock);
+      close(handle->sock);
+      handle->sock = INVALID_SOCKET;
+      continue;
+    }
+
+    memcpy(&handle->peer, ai->ai_addr, ai->ai_addrlen);
+    handle->peer_len = ai->ai_addrlen;
+  }
+
+  freeaddrinfo(results);
+  return handle->sock >= 0 ? 0 : SOCKET_ERROR;
+}
+
+int transport_handle_close(TRANSPORT_HANDLE* handle)
+{
+  int rc = 0;
+
+  if (handle->sock >= 0)
+  {
+    rc = transport_socket_close(handle->sock);
+    handle->sock = INVALID_SOCKET;
+  }
+
+  return rc;
+}
+
+int transport_socket_send(int sock, char* host, int port, unsigned char* buf, int buflen)
+{
+  TRANSPORT_IMPAIRMENT* impairment;
   struct sockaddr_in cliaddr;
   int rc = 0;
 
@@ -107,55 +578,552 @@ int transport_sendPacketBuffer(char* host, int port, unsigned char* buf, int buf
   cliaddr.sin_addr.s_addr = inet_addr(host);
   cliaddr.sin_port = htons(port);
 
-  if ((rc = sendto(mysock, buf, buflen, 0, (const struct sockaddr*)&cliaddr, sizeof(cliaddr)))
+  if ((impairment = transport_impairment_get(sock)) != NULL)
+  {
+    if (transport_capture_enabled)
+      transport_capture_record(
+          sock, TRANSPORT_CAPTURE_SENT, (const struct sockaddr*)&cliaddr, buf, buflen, NULL, 0);
+    transport_impairment_submit(
+        impairment,
+        TRANSPORT_IMPAIR_SEND,
+        (const struct sockaddr*)&cliaddr,
+        sizeof(cliaddr),
+        buf,
+        buflen,
+        time_util_now_us());
+    return impairment_send_due(impairment, sock, time_util_now_us());
+  }
+
+  if ((rc = sendto(sock, buf, buflen, 0, (const struct sockaddr*)&cliaddr, sizeof(cliaddr)))
       == SOCKET_ERROR)
-    Socket_error("sendto", mysock);
+    Socket_error("sendto", sock);
   else
+  {
+    if (transport_capture_enabled)
+      transport_capture_record(
+          sock, TRANSPORT_CAPTURE_SENT, (const struct sockaddr*)&cliaddr, buf, buflen, NULL, 0);
     rc = 0;
+  }
   return rc;
 }
 
-int transport_getdata(unsigned char* buf, int count)
+/**
+return the datagram length, 0 if a non-blocking socket has nothing queued, <0 for an error
+*/
+int transport_socket_recv(int sock, unsigned char* buf, int count)
 {
-  int rc = recvfrom(mysock, buf, count, 0, NULL, NULL);
-  // printf("received %d bytes count %d\n", rc, (int)count);
+  TRANSPORT_IMPAIRMENT* impairment = transport_impairment_get(sock);
+  TRANSPORT_IMPAIRED_DATAGRAM* datagram;
+  struct sockaddr_storage from;
+  socklen_t addrlen = sizeof(from);
+  int rc;
+
+  if (impairment != NULL)
+  {
+    if ((rc = impairment_drain_socket(impairment, sock)) < 0)
+      return rc;
+
+    if ((datagram
+         = transport_impairment_next(impairment, TRANSPORT_IMPAIR_RECEIVE, time_util_now_us()))
+        == NULL)
+      return 0;
+
+    if (transport_capture_enabled)
+      transport_capture_record(
+          sock,
+          TRANSPORT_CAPTURE_RECEIVED,
+          (const struct sockaddr*)&datagram->addr,
+          datagram->data,
+          datagram->len,
+          NULL,
+          0);
+    rc = datagram->len < count ? datagram->len : count;
+    memcpy(buf, datagram->data, rc);
+    transport_impairment_release(impairment, TRANSPORT_IMPAIR_RECEIVE);
+    return rc;
+  }
+
+  rc = recvfrom(sock, buf, count, 0, (struct sockaddr*)&from, &addrlen);
+
+  if (rc == SOCKET_ERROR && is_transient_error())
+  {
+    rc = 0;
+  }
+  else if (rc > 0 && transport_capture_enabled)
+  {
+    transport_capture_record(
+        sock, TRANSPORT_CAPTURE_RECEIVED, (const struct sockaddr*)&from, buf, rc, NULL, 0);
+  }
+
   return rc;
 }
 
 /**
-return >=0 for a socket descriptor, <0 for an error code
+Wait up to timeout_ms (-1 waits forever) for a datagram to arrive on the socket.
+return 1 when a datagram can be read, 0 on timeout, <0 for an error
 */
-int transport_open()
+int transport_socket_wait(int sock, int timeout_ms)
 {
-  mysock = socket(AF_INET, SOCK_DGRAM, 0);
+  TRANSPORT_IMPAIRMENT* impairment = transport_impairment_get(sock);
+  uint64_t now_us;
+  uint64_t deadline_us;
+  int rc;
 
-  if (mysock == INVALID_SOCKET)
+  if (impairment == NULL)
+    return poll_socket(sock, timeout_ms);
+
+  // Wake up when the next held datagram is due, so that it can be delivered or sent
+  now_us = time_util_now_us();
+  deadline_us = transport_impairment_next_deadline_us(impairment);
+  if (deadline_us != UINT64_MAX
+      && (timeout_ms < 0 || deadline_us < now_us + (uint64_t)timeout_ms * 1000))
+    timeout_ms = deadline_us > now_us ? (int)((deadline_us - now_us + 999) / 1000) : 0;
+
+  if ((rc = poll_socket(sock, timeout_ms)) != 0)
+    return rc;
+
+  transport_socket_service(sock);
+  return transport_impairment_next(impairment, TRANSPORT_IMPAIR_RECEIVE, time_util_now_us())
+      != NULL;
+}
+
+/**
+Send the datagrams held back by an impairment (see transport_impairment_attach) whose delay has
+passed. Call it at transport_socket_next_deadline_us. Does nothing on a socket that is not
+impaired.
+return 0 on success, <0 for an error
+*/
+int transport_socket_service(int sock)
+{
+  TRANSPORT_IMPAIRMENT* impairment = transport_impairment_get(sock);
+
+  if (impairment == NULL)
+    return 0;
+
+  impairment_drain_socket(impairment, sock);
+  return impairment_send_due(impairment, sock, time_util_now_us());
+}
+
+/**
+return the monotonic time (time_util_now_us) at which a datagram held back by an impairment is due
+to be sent or received, UINT64_MAX if none is held or the socket is not impaired
+*/
+uint64_t transport_socket_next_deadline_us(int sock)
+{
+  TRANSPORT_IMPAIRMENT* impairment = transport_impairment_get(sock);
+
+  return impairment != NULL ? transport_impairment_next_deadline_us(impairment) : UINT64_MAX;
+}
+
+int transport_socket_close(int sock)
+{
+  TRANSPORT_IMPAIRMENT* impairment = transport_impairment_get(sock);
+  int rc;
+
+  // Anything still held back leaves now, so that e.g. a final DISCONNECT is not lost
+  if (impairment != NULL)
   {
-    return Socket_error("socket", mysock);
+    impairment_send_due(impairment, sock, UINT64_MAX);
+    transport_impairment_detach(sock);
   }
 
-  // set custom source port
-#ifdef SRC_PORT
-  memset(&srcaddr, 0, sizeof(srcaddr));
-  srcaddr.sin_family = AF_INET;
-  srcaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-  srcaddr.sin_port = htons(SRC_PORT);
+  if (transport_capture_enabled)
+    transport_capture_forget(sock);
+
+  rc = shutdown(sock, SHUT_WR);
+  rc = close(sock);
+
+  return rc;
+}
+
+void transport_batch_init(TRANSPORT_SEND_BATCH* batch, int sock, WIRE_STATS* stats)
+{
+  batch->sock = sock;
+  batch->count = 0;
+  batch->stats = stats;
+}
+
+/**
+Copy a datagram into the batch, flushing first if the batch is full.
+return 0 on success, <0 for an error
+*/
+int transport_batch_queue(
+    TRANSPORT_SEND_BATCH* batch,
+    char* host,
+    int port,
+    unsigned char* buf,
+    int buflen)
+{
+  struct sockaddr_in addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr(host);
+  addr.sin_port = htons(port);
+
+  return transport_batch_queue_to(batch, (const struct sockaddr*)&addr, sizeof(addr), buf, buflen);
+}
+
+/**
+Copy a datagram for an already resolved address, such as the source of a received datagram, into
+the batch, flushing first if the batch is full.
+return 0 on success, <0 for an error
+*/
+int transport_batch_queue_to(
+    TRANSPORT_SEND_BATCH* batch,
+    const struct sockaddr* addr,
+    socklen_t addr_len,
+    unsigned char* buf,
+    int buflen)
+{
+  return transport_batch_queue_gather_to(batch, addr, addr_len, buf, buflen, NULL, 0);
+}
+
+/**
+Queue a datagram made of a header, copied into the batch, and a payload that is only referenced, so
+it must stay unchanged until the batch is flushed. The payload is copied as well where the datagram
+cannot be sent from two pieces: without sendmmsg, or on an impaired socket that may hold it back.
+return 0 on success, <0 for an error
+*/
+int transport_batch_queue_gather(
+    TRANSPORT_SEND_BATCH* batch,
+    char* host,
+    int port,
+    const unsigned char* header,
+    int header_len,
+    const unsigned char* payload,
+    int payload_len)
+{
+  struct sockaddr_in addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr(host);
+  addr.sin_port = htons(port);
+
+  return transport_batch_queue_gather_to(
+      batch, (const struct sockaddr*)&addr, sizeof(addr), header, header_len, payload, payload_len);
+}
+
+/**
+transport_batch_queue_gather for an already resolved address, or for the peer of a connected
+socket when addr is NULL.
+return 0 on success, <0 for an error
+*/
+int transport_batch_queue_gather_to(
+    TRANSPORT_SEND_BATCH* batch,
+    const struct sockaddr* addr,
+    socklen_t addr_len,
+    const unsigned char* header,
+    int header_len,
+    const unsigned char* payload,
+    int payload_len)
+{
+  int rc;
+  int i;
 
-  if (bind(mysock, (struct sockaddr*)&srcaddr, sizeof(srcaddr)) < 0)
+  if (header_len + payload_len > TRANSPORT_DATAGRAM_SIZE
+      || (addr != NULL && (size_t)addr_len > sizeof(struct sockaddr_storage)))
+    return SOCKET_ERROR;
+
+  if (batch->count == TRANSPORT_BATCH_SIZE && (rc = transport_batch_flush(batch)) < 0)
+    return rc;
+
+  i = batch->count++;
+  if (addr != NULL)
+  {
+    memcpy(&batch->addrs[i], addr, addr_len);
+    batch->addr_lengths[i] = addr_len;
+  }
+  else
   {
-    return Socket_error("socket", mysock);
+    batch->addrs[i].ss_family = AF_UNSPEC;
+    batch->addr_lengths[i] = 0;
   }
+  memcpy(batch->buffers[i], header, header_len);
+  batch->lengths[i] = header_len;
+  batch->payloads[i] = NULL;
+  batch->payload_lengths[i] = 0;
+
+  if (payload_len > 0)
+  {
+#if defined(__linux__)
+    if (transport_impairment_get(batch->sock) == NULL)
+    {
+      batch->payloads[i] = payload;
+      batch->payload_lengths[i] = payload_len;
+      return 0;
+    }
 #endif
+    memcpy(batch->buffers[i] + header_len, payload, payload_len);
+    batch->lengths[i] += payload_len;
+  }
 
-  return mysock;
+  return 0;
 }
 
-int transport_close()
+/**
+Send the queued datagrams as they are, counting in sent those the socket accepted.
+return 0 on success, <0 for an error
+*/
+static int send_datagrams(TRANSPORT_SEND_BATCH* batch, int* out_sent)
+{
+  int sent = 0;
+  int rc = 0;
+
+#if defined(__linux__)
+  struct mmsghdr msgs[TRANSPORT_BATCH_SIZE];
+  struct iovec iovecs[TRANSPORT_BATCH_SIZE][2];
+  int refused = 0;
+
+  memset(msgs, 0, sizeof(struct mmsghdr) * batch->count);
+  for (int i = 0; i < batch->count; i++)
+  {
+    // The header from the batch, then the referenced payload if there is one
+    iovecs[i][0].iov_base = batch->buffers[i];
+    iovecs[i][0].iov_len = batch->lengths[i];
+    iovecs[i][1].iov_base = (void*)batch->payloads[i];
+    iovecs[i][1].iov_len = batch->payload_lengths[i];
+    msgs[i].msg_hdr.msg_name = (void*)get_destination(&batch->addrs[i], batch->addr_lengths[i]);
+    msgs[i].msg_hdr.msg_namelen = batch->addr_lengths[i];
+    msgs[i].msg_hdr.msg_iov = iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = batch->payloads[i] != NULL ? 2 : 1;
+  }
+
+  // sendmmsg may stop early, for example when the socket buffer is full. A refused earlier
+  // datagram fails the call without sending anything, so the datagram is sent again.
+  while (sent < batch->count)
+  {
+    if ((rc = sendmmsg(batch->sock, &msgs[sent], batch->count - sent, 0)) <= 0)
+    {
+      if (rc < 0 && errno == ECONNREFUSED && refused++ < batch->count)
+        continue;
+      rc = -Socket_error("sendmmsg", batch->sock);
+      break;
+    }
+    sent += rc;
+  }
+#else
+  for (; sent < batch->count; sent++)
+  {
+    socklen_t addrlen = batch->addr_lengths[sent];
+    const struct sockaddr* addr = get_destination(&batch->addrs[sent], addrlen);
+
+    // Without sendmmsg a datagram is sent from one piece, so a referenced payload is copied after
+    // its header. It fits: the queue functions check the length of the whole datagram.
+    if (batch->payloads[sent] != NULL)
+    {
+      memcpy(
+          batch->buffers[sent] + batch->lengths[sent],
+          batch->payloads[sent],
+          batch->payload_lengths[sent]);
+      batch->lengths[sent] += batch->payload_lengths[sent];
+      batch->payloads[sent] = NULL;
+      batch->payload_lengths[sent] = 0;
+    }
+
+    if (sendto(batch->sock, batch->buffers[sent], batch->lengths[sent], 0, addr, addrlen)
+            == SOCKET_ERROR
+        && (errno != ECONNREFUSED
+            || sendto(batch->sock, batch->buffers[sent], batch->lengths[sent], 0, addr, addrlen)
+                == SOCKET_ERROR))
+    {
+      rc = -Socket_error("sendto", batch->sock);
+      break;
+    }
+  }
+#endif
+
+  for (int i = 0; transport_capture_enabled && i < sent; i++)
+    transport_capture_record(
+        batch->sock,
+        TRANSPORT_CAPTURE_SENT,
+        get_destination(&batch->addrs[i], batch->addr_lengths[i]),
+        batch->buffers[i],
+        batch->lengths[i],
+        batch->payloads[i],
+        batch->payload_lengths[i]);
+
+  *out_sent = sent;
+  return rc < 0 ? rc : 0;
+}
+
+/**
+Send every queued datagram. The batch is empty afterwards, even if some datagrams failed to send.
+On an impaired socket the datagrams go through the impairment and count as sent even if they are
+dropped or held back.
+return the number of datagrams sent, <0 for an error
+*/
+int transport_batch_flush(TRANSPORT_SEND_BATCH* batch)
+{
+  TRANSPORT_IMPAIRMENT* impairment = transport_impairment_get(batch->sock);
+  int sent = 0;
+  int rc = 0;
+
+  if (impairment != NULL)
+  {
+    uint64_t now_us = time_util_now_us();
+
+    for (; sent < batch->count; sent++)
+    {
+      if (transport_capture_enabled)
+        transport_capture_record(
+            batch->sock,
+            TRANSPORT_CAPTURE_SENT,
+            get_destination(&batch->addrs[sent], batch->addr_lengths[sent]),
+            batch->buffers[sent],
+            batch->lengths[sent],
+            NULL,
+            0);
+      transport_impairment_submit(
+          impairment,
+          TRANSPORT_IMPAIR_SEND,
+          (const struct sockaddr*)&batch->addrs[sent],
+          batch->addr_lengths[sent],
+          batch->buffers[sent],
+          batch->lengths[sent],
+          now_us);
+    }
+
+    rc = impairment_send_due(impairment, batch->sock, now_us);
+  }
+  else
+  {
+    rc = send_datagrams(batch, &sent);
+  }
+
+  // Only the header is read to classify a datagram
+  for (int i = 0; batch->stats != NULL && i < sent; i++)
+    wire_stats_record_sent(
+        batch->stats, batch->buffers[i], batch->lengths[i] + batch->payload_lengths[i]);
+
+  batch->count = 0;
+  return rc < 0 ? rc : sent;
+}
+
+/**
+Drain up to TRANSPORT_BATCH_SIZE datagrams, and their source addresses, from the socket. With wait
+set, block until at least one datagram arrives; otherwise return 0 when nothing is queued. Received
+datagrams are counted in stats, if not NULL.
+return the number of datagrams received, <0 for an error
+*/
+int transport_batch_receive(
+    TRANSPORT_RECEIVE_BATCH* batch,
+    int sock,
+    int wait,
+    WIRE_STATS* stats)
 {
+  TRANSPORT_IMPAIRMENT* impairment = transport_impairment_get(sock);
   int rc;
 
-  rc = shutdown(mysock, SHUT_WR);
-  rc = close(mysock);
+  batch->count = 0;
+  batch->next = 0;
+
+  if (impairment != NULL)
+  {
+    if ((rc = impairment_receive(impairment, batch, sock, wait)) <= 0)
+      return rc;
+
+    for (int i = 0; stats != NULL && i < rc; i++)
+      wire_stats_record_received(stats, batch->buffers[i], batch->lengths[i]);
+
+    return rc;
+  }
+
+#if defined(__linux__)
+  struct mmsghdr msgs[TRANSPORT_BATCH_SIZE];
+  struct iovec iovecs[TRANSPORT_BATCH_SIZE];
+
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < TRANSPORT_BATCH_SIZE; i++)
+  {
+    iovecs[i].iov_base = batch->buffers[i];
+    iovecs[i].iov_len = TRANSPORT_DATAGRAM_SIZE;
+    msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  rc = recvmmsg(sock, msgs, TRANSPORT_BATCH_SIZE, wait ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
+  if (rc == SOCKET_ERROR)
+  {
+    if (is_transient_error())
+      return 0;
+    return -Socket_error("recvmmsg", sock);
+  }
 
+  for (int i = 0; i < rc; i++)
+  {
+    batch->lengths[i] = msgs[i].msg_len;
+    batch->addr_lengths[i] = msgs[i].msg_hdr.msg_namelen;
+  }
+#else
+  socklen_t addrlen = sizeof(struct sockaddr_storage);
+
+  (void)wait;
+  rc = recvfrom(
+      sock,
+      batch->buffers[0],
+      TRANSPORT_DATAGRAM_SIZE,
+      0,
+      (struct sockaddr*)&batch->addrs[0],
+      &addrlen);
+  if (rc == SOCKET_ERROR && is_transient_error())
+    return 0;
+  if (rc <= 0)
+    return rc;
+
+  batch->lengths[0] = rc;
+  batch->addr_lengths[0] = addrlen;
+  rc = 1;
+#endif
+
+  for (int i = 0; transport_capture_enabled && i < rc; i++)
+    transport_capture_record(
+        sock,
+        TRANSPORT_CAPTURE_RECEIVED,
+        (const struct sockaddr*)&batch->addrs[i],
+        batch->buffers[i],
+        batch->lengths[i],
+        NULL,
+        0);
+
+  for (int i = 0; stats != NULL && i < rc; i++)
+    wire_stats_record_received(stats, batch->buffers[i], batch->lengths[i]);
+
+  batch->count = rc;
   return rc;
 }
+
+/**
+return the length of the next received datagram and point buf at it, 0 when the batch is drained
+*/
+int transport_batch_next(TRANSPORT_RECEIVE_BATCH* batch, unsigned char** buf)
+{
+  if (batch->next >= batch->count)
+    return 0;
+
+  *buf = batch->buffers[batch->next];
+  return batch->lengths[batch->next++];
+}
+
+/**
+Like transport_batch_next, and also copy the source address of the datagram to from, and its length
+to from_len.
+return the length of the next received datagram, 0 when the batch is drained
+*/
+int transport_batch_next_from(
+    TRANSPORT_RECEIVE_BATCH* batch,
+    unsigned char** buf,
+    struct sockaddr_storage* from,
+    socklen_t* from_len)
+{
+  if (batch->next < batch->count)
+  {
+    *from = batch->addrs[batch->next];
+    *from_len = batch->addr_lengths[batch->next];
+  }
+
+  return transport_batch_next(batch, buf);
+}
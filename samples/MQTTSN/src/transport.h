@@ -15,7 +15,136 @@
  *    Sergio R. Caprile - "commonalization" from prior samples and/or documentation extension
  *******************************************************************************/
 
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#if defined(WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+#include "wire_stats.h"
+
+#define TRANSPORT_BATCH_SIZE 32
+#define TRANSPORT_DATAGRAM_SIZE 1500
+
+/**
+A UDP socket connected to one peer, resolved once from a host name or an IPv4 or IPv6 address.
+Sends skip the address conversion and the route lookup of every datagram, and the kernel drops
+datagrams from any other source. Its socket is handed explicitly to the transport_batch_*
+functions, so that one thread can serve any number of connections.
+*/
+typedef struct transport_handle_tag
+{
+  int sock;
+  struct sockaddr_storage peer;
+  socklen_t peer_len;
+} TRANSPORT_HANDLE;
+
+/**
+Outgoing datagrams queued by transport_batch_queue and sent together, with a single sendmmsg call
+on Linux, by transport_batch_flush. Datagrams actually sent are counted in stats, if not NULL.
+A datagram queued by transport_batch_queue_gather is sent from two pieces: the header, copied into
+the batch, and the payload, only referenced until the flush. A datagram queued without an address
+(addr_lengths 0) goes to the peer of a connected socket.
+*/
+typedef struct transport_send_batch_tag
+{
+  int sock;
+  int count;
+  WIRE_STATS* stats;
+  struct sockaddr_storage addrs[TRANSPORT_BATCH_SIZE];
+  socklen_t addr_lengths[TRANSPORT_BATCH_SIZE];
+  int lengths[TRANSPORT_BATCH_SIZE];
+  const unsigned char* payloads[TRANSPORT_BATCH_SIZE]; // NULL when the datagram was copied whole
+  int payload_lengths[TRANSPORT_BATCH_SIZE];
+  unsigned char buffers[TRANSPORT_BATCH_SIZE][TRANSPORT_DATAGRAM_SIZE];
+} TRANSPORT_SEND_BATCH;
+
+/**
+Incoming datagrams drained from a socket by one recvmmsg call, handed out one at a time by
+transport_batch_next.
+*/
+typedef struct transport_receive_batch_tag
+{
+  int count;
+  int next;
+  struct sockaddr_storage addrs[TRANSPORT_BATCH_SIZE];
+  socklen_t addr_lengths[TRANSPORT_BATCH_SIZE];
+  int lengths[TRANSPORT_BATCH_SIZE];
+  unsigned char buffers[TRANSPORT_BATCH_SIZE][TRANSPORT_DATAGRAM_SIZE];
+} TRANSPORT_RECEIVE_BATCH;
+
 int transport_sendPacketBuffer(char* host, int port, unsigned char* buf, int buflen);
 int transport_getdata(unsigned char* buf, int count);
 int transport_open(void);
 int transport_close(void);
+int transport_wait(int timeout_ms);
+int transport_queuePacketBuffer(char* host, int port, unsigned char* buf, int buflen);
+int transport_flush(void);
+int transport_pending(void);
+
+int transport_handle_open(
+    TRANSPORT_HANDLE* handle,
+    const char* host,
+    int port,
+    int src_port,
+    int nonblocking);
+int transport_handle_close(TRANSPORT_HANDLE* handle);
+
+int transport_socket_open(int src_port, int nonblocking);
+int transport_socket_open_shared(int port, int nonblocking);
+int transport_multicast_open(const char* group, int port, struct sockaddr_in* group_addr);
+int transport_socket_send(int sock, char* host, int port, unsigned char* buf, int buflen);
+int transport_socket_recv(int sock, unsigned char* buf, int count);
+int transport_socket_wait(int sock, int timeout_ms);
+int transport_socket_close(int sock);
+int transport_socket_service(int sock);
+uint64_t transport_socket_next_deadline_us(int sock);
+
+void transport_batch_init(TRANSPORT_SEND_BATCH* batch, int sock, WIRE_STATS* stats);
+int transport_batch_queue(
+    TRANSPORT_SEND_BATCH* batch,
+    char* host,
+    int port,
+    unsigned char* buf,
+    int buflen);
+int transport_batch_queue_to(
+    TRANSPORT_SEND_BATCH* batch,
+    const struct sockaddr* addr,
+    socklen_t addr_len,
+    unsigned char* buf,
+    int buflen);
+int transport_batch_queue_gather(
+    TRANSPORT_SEND_BATCH* batch,
+    char* host,
+    int port,
+    const unsigned char* header,
+    int header_len,
+    const unsigned char* payload,
+    int payload_len);
+int transport_batch_queue_gather_to(
+    TRANSPORT_SEND_BATCH* batch,
+    const struct sockaddr* addr,
+    socklen_t addr_len,
+    const unsigned char* header,
+    int header_len,
+    const unsigned char* payload,
+    int payload_len);
+int transport_batch_flush(TRANSPORT_SEND_BATCH* batch);
+int transport_batch_receive(
+    TRANSPORT_RECEIVE_BATCH* batch,
+    int sock,
+    int wait,
+    WIRE_STATS* stats);
+int transport_batch_next(TRANSPORT_RECEIVE_BATCH* batch, unsigned char** buf);
+int transport_batch_next_from(
+    TRANSPORT_RECEIVE_BATCH* batch,
+    unsigned char** buf,
+    struct sockaddr_storage* from,
+    socklen_t* from_len);
+
+#endif // TRANSPORT_H
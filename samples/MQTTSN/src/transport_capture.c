@@ -0,0 +1,542 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "transport_capture.h"
+
+// DO NOT MODIFY: Capture Environment Variable Names
+#define ENV_MQTTSN_CAPTURE_FILE "MQTTSN_CAPTURE_FILE"
+#define ENV_MQTTSN_CAPTURE_BUFFER_KB "MQTTSN_CAPTURE_BUFFER_KB"
+
+// A buffer must hold the largest block: a datagram, its IP and UDP headers and the block framing
+#define MIN_BUFFER_KB 4
+
+// The writer wakes up at least this often, so that the file trails the traffic by little
+#define WRITER_PERIOD_MS 100
+
+// Sockets are looked up by descriptor in a two level table, as the impairments are
+#define SOCKETS_CHUNK_BITS 10
+#define SOCKETS_CHUNK_SIZE (1 << SOCKETS_CHUNK_BITS)
+#define SOCKETS_CHUNKS 1024
+
+#define IPV4_HEADER_SIZE 20
+#define IPV6_HEADER_SIZE 40
+#define UDP_HEADER_SIZE 8
+
+// Block type, length, interface, timestamp (2), captured and original length, then the packet
+#define PACKET_BLOCK_HEADER_SIZE 28
+// The flags option, the end of options and the trailing block length
+#define PACKET_BLOCK_TRAILER_SIZE 16
+
+typedef struct capture_endpoint_tag
+{
+  int family; // AF_INET, AF_INET6 or 0 when unknown
+  uint16_t port; // network byte order
+  unsigned char addr[16];
+} CAPTURE_ENDPOINT;
+
+// Addresses of a socket, looked up once when it first sends or receives
+typedef struct capture_socket_tag
+{
+  int known;
+  int connected;
+  CAPTURE_ENDPOINT local;
+  CAPTURE_ENDPOINT peer;
+} CAPTURE_SOCKET;
+
+typedef struct capture_buffer_tag
+{
+  unsigned char* data;
+  size_t len;
+} CAPTURE_BUFFER;
+
+int transport_capture_enabled;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+static int stopping;
+static FILE* output;
+static const char* output_path;
+static CAPTURE_BUFFER buffers[2];
+static int active; // the buffer datagrams are recorded to, the writer owns the other one
+static size_t capacity;
+static uint16_t ip_id;
+static CAPTURE_SOCKET* sockets[SOCKETS_CHUNKS];
+static TRANSPORT_CAPTURE_STATS stats;
+
+static void endpoint_from_address(const struct sockaddr* addr, CAPTURE_ENDPOINT* endpoint)
+{
+  memset(endpoint, 0, sizeof(CAPTURE_ENDPOINT));
+  if (addr->sa_family == AF_INET)
+  {
+    const struct sockaddr_in* in = (const struct sockaddr_in*)addr;
+
+    endpoint->family = AF_INET;
+    endpoint->port = in->sin_port;
+    memcpy(endpoint->addr, &in->sin_addr, 4);
+  }
+  else if (addr->sa_family == AF_INET6)
+  {
+    const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)addr;
+
+    endpoint->family = AF_INET6;
+    endpoint->port = in6->sin6_port;
+    memcpy(endpoint->addr, &in6->sin6_addr, 16);
+  }
+}
+
+/*
+ * Return the addresses of the socket, looking them up on first use. Called with the lock held.
+ */
+static CAPTURE_SOCKET* get_socket(int sock)
+{
+  CAPTURE_SOCKET** chunk;
+  CAPTURE_SOCKET* entry;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+
+  if (sock < 0 || (sock >> SOCKETS_CHUNK_BITS) >= SOCKETS_CHUNKS)
+  {
+    return NULL;
+  }
+
+  chunk = &sockets[sock >> SOCKETS_CHUNK_BITS];
+  if (*chunk == NULL && (*chunk = calloc(SOCKETS_CHUNK_SIZE, sizeof(CAPTURE_SOCKET))) == NULL)
+  {
+    return NULL;
+  }
+
+  entry = &(*chunk)[sock & (SOCKETS_CHUNK_SIZE - 1)];
+  if (!entry->known)
+  {
+    memset(entry, 0, sizeof(CAPTURE_SOCKET));
+    addrlen = sizeof(addr);
+    if (getsockname(sock, (struct sockaddr*)&addr, &addrlen) == 0)
+    {
+      endpoint_from_address((const struct sockaddr*)&addr, &entry->local);
+    }
+
+    addrlen = sizeof(addr);
+    if (getpeername(sock, (struct sockaddr*)&addr, &addrlen) == 0)
+    {
+      endpoint_from_address((const struct sockaddr*)&addr, &entry->peer);
+      entry->connected = 1;
+    }
+
+    entry->known = 1;
+  }
+
+  return entry;
+}
+
+/*
+ * An IPv4 endpoint in an IPv6 packet becomes an IPv4-mapped address
+ */
+static void map_to_ipv6(CAPTURE_ENDPOINT* endpoint)
+{
+  if (endpoint->family != AF_INET6)
+  {
+    memmove(endpoint->addr + 12, endpoint->addr, 4);
+    memset(endpoint->addr, 0, 10);
+    endpoint->addr[10] = endpoint->addr[11] = 0xFF;
+    endpoint->family = AF_INET6;
+  }
+}
+
+static void put_16(unsigned char* buf, uint16_t value)
+{
+  buf[0] = (unsigned char)(value >> 8);
+  buf[1] = (unsigned char)value;
+}
+
+static uint16_t ipv4_checksum(const unsigned char* header)
+{
+  uint32_t sum = 0;
+
+  for (int i = 0; i < IPV4_HEADER_SIZE; i += 2)
+  {
+    sum += (uint32_t)(header[i] << 8 | header[i + 1]);
+  }
+
+  while (sum >> 16)
+  {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+
+  return (uint16_t)~sum;
+}
+
+/*
+ * Write the IP and UDP headers of a datagram of len bytes from source to destination. Return the
+ * size of the headers. The UDP checksum is left out, which IPv4 allows.
+ */
+static int write_headers(
+    unsigned char* buf,
+    const CAPTURE_ENDPOINT* source,
+    const CAPTURE_ENDPOINT* destination,
+    int len)
+{
+  unsigned char* udp;
+  int size;
+
+  if (source->family == AF_INET6)
+  {
+    memset(buf, 0, IPV6_HEADER_SIZE);
+    buf[0] = 0x60;
+    put_16(buf + 4, (uint16_t)(UDP_HEADER_SIZE + len));
+    buf[6] = IPPROTO_UDP;
+    buf[7] = 64;
+    memcpy(buf + 8, source->addr, 16);
+    memcpy(buf + 24, destination->addr, 16);
+    size = IPV6_HEADER_SIZE;
+  }
+  else
+  {
+    memset(buf, 0, IPV4_HEADER_SIZE);
+    buf[0] = 0x45;
+    put_16(buf + 2, (uint16_t)(IPV4_HEADER_SIZE + UDP_HEADER_SIZE + len));
+    put_16(buf + 4, ip_id++);
+    put_16(buf + 6, 0x4000); // don't fragment
+    buf[8] = 64;
+    buf[9] = IPPROTO_UDP;
+    memcpy(buf + 12, source->addr, 4);
+    memcpy(buf + 16, destination->addr, 4);
+    put_16(buf + 10, ipv4_checksum(buf));
+    size = IPV4_HEADER_SIZE;
+  }
+
+  udp = buf + size;
+  memcpy(udp, &source->port, 2);
+  memcpy(udp + 2, &destination->port, 2);
+  put_16(udp + 4, (uint16_t)(UDP_HEADER_SIZE + len));
+  put_16(udp + 6, 0);
+  return size + UDP_HEADER_SIZE;
+}
+
+// pcapng fields are in host byte order
+static void put_16_host(unsigned char* buf, uint16_t value)
+{
+  memcpy(buf, &value, sizeof(value));
+}
+
+static void put_32(unsigned char* buf, uint32_t value)
+{
+  memcpy(buf, &value, sizeof(value));
+}
+
+static void* run_writer(void* arg)
+{
+  (void)arg;
+
+  for (;;)
+  {
+    CAPTURE_BUFFER* full;
+    int stop;
+
+    // Wait for the active buffer to fill up to half, at most WRITER_PERIOD_MS, then take it
+    pthread_mutex_lock(&lock);
+    if (!stopping && buffers[active].len < capacity / 2)
+    {
+      struct timespec deadline;
+
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += WRITER_PERIOD_MS * 1000000L;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      pthread_cond_timedwait(&wake, &lock, &deadline);
+    }
+
+    full = &buffers[active];
+    active ^= 1;
+    stop = stopping;
+    pthread_mutex_unlock(&lock);
+
+    if (full->len > 0)
+    {
+      fwrite(full->data, 1, full->len, output);
+      fflush(output);
+      full->len = 0;
+    }
+
+    if (stop)
+    {
+      return NULL;
+    }
+  }
+}
+
+/*
+ * Read the capture file and buffer size from the environment. Return -1 for an invalid value.
+ */
+int transport_capture_read_configuration(TRANSPORT_CAPTURE_CONFIG* config)
+{
+  const char* value;
+
+  memset(config, 0, sizeof(TRANSPORT_CAPTURE_CONFIG));
+  config->buffer_kb = TRANSPORT_CAPTURE_DEFAULT_BUFFER_KB;
+
+  if ((value = getenv(ENV_MQTTSN_CAPTURE_FILE)) != NULL && value[0] != '\0')
+  {
+    config->path = value;
+  }
+
+  if ((value = getenv(ENV_MQTTSN_CAPTURE_BUFFER_KB)) != NULL
+      && (config->buffer_kb = atoi(value)) < MIN_BUFFER_KB)
+  {
+    printf(
+        "Invalid value for %s, must be at least %d\r\n",
+        ENV_MQTTSN_CAPTURE_BUFFER_KB,
+        MIN_BUFFER_KB);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * 1. Allocate the two buffers and create the capture file
+ * 2. Write the section header block and the description of the single, raw IP, interface
+ * 3. Start the writer thread
+ * Does nothing without a path. Must not race with transport_capture_record().
+ */
+int transport_capture_open(const TRANSPORT_CAPTURE_CONFIG* config)
+{
+  unsigned char header[48];
+
+  transport_capture_close();
+  if (config->path == NULL)
+  {
+    return 0;
+  }
+
+  // 1. Allocate the two buffers and create the capture file
+  capacity = (size_t)config->buffer_kb * 1024;
+  buffers[0].data = malloc(capacity);
+  buffers[1].data = malloc(capacity);
+  if (buffers[0].data == NULL || buffers[1].data == NULL
+      || (output = fopen(config->path, "wb")) == NULL)
+  {
+    printf("Failed to open the capture file %s\r\n", config->path);
+    transport_capture_close();
+    return -1;
+  }
+
+  // 2. Write the section header block and the description of the single, raw IP, interface. Blocks
+  //    are in host byte order, which the byte order magic tells readers.
+  put_32(header, TRANSPORT_CAPTURE_SECTION_HEADER);
+  put_32(header + 4, 28);
+  put_32(header + 8, TRANSPORT_CAPTURE_BYTE_ORDER_MAGIC);
+  put_32(header + 12, 1); // version 1.0
+  put_32(header + 16, 0xFFFFFFFF); // section length unknown, 64 bits
+  put_32(header + 20, 0xFFFFFFFF);
+  put_32(header + 24, 28);
+  put_32(header + 28, TRANSPORT_CAPTURE_INTERFACE_DESCRIPTION);
+  put_32(header + 32, 20);
+  put_16_host(header + 36, TRANSPORT_CAPTURE_LINKTYPE_RAW);
+  put_16_host(header + 38, 0);
+  put_32(header + 40, 0); // no snapshot length, timestamps in microseconds by default
+  put_32(header + 44, 20);
+  fwrite(header, 1, sizeof(header), output);
+  fflush(output);
+
+  // 3. Start the writer thread
+  stopping = 0;
+  active = 0;
+  buffers[0].len = buffers[1].len = 0;
+  if (pthread_create(&writer, NULL, run_writer, NULL) != 0)
+  {
+    printf("Failed to start the capture writer\r\n");
+    fclose(output);
+    output = NULL;
+    transport_capture_close();
+    return -1;
+  }
+
+  output_path = config->path;
+  transport_capture_enabled = 1;
+  return 0;
+}
+
+/*
+ * Record a datagram made of header and payload (payload may be NULL), sent to or received from
+ * addr. Connected sockets use their peer and addr may be NULL.
+ */
+void transport_capture_record(
+    int sock,
+    int direction,
+    const struct sockaddr* addr,
+    const unsigned char* header,
+    int header_len,
+    const unsigned char* payload,
+    int payload_len)
+{
+  struct timespec now;
+  CAPTURE_SOCKET* entry;
+  CAPTURE_ENDPOINT local;
+  CAPTURE_ENDPOINT remote;
+  CAPTURE_BUFFER* buffer;
+  unsigned char* block;
+  uint64_t timestamp_us;
+  int datagram_len = header_len + payload_len;
+  int packet_len;
+  int padded_len;
+  size_t block_len;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  timestamp_us = (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+
+  pthread_mutex_lock(&lock);
+  if (!transport_capture_enabled)
+  {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  // The addresses of both ends, IPv6 if either one is
+  memset(&local, 0, sizeof(local));
+  memset(&remote, 0, sizeof(remote));
+  if ((entry = get_socket(sock)) != NULL)
+  {
+    local = entry->local;
+    remote = entry->peer;
+  }
+  if ((entry == NULL || !entry->connected) && addr != NULL)
+  {
+    endpoint_from_address(addr, &remote);
+  }
+  if (local.family == AF_INET6 || remote.family == AF_INET6)
+  {
+    map_to_ipv6(&local);
+    map_to_ipv6(&remote);
+  }
+
+  packet_len = (local.family == AF_INET6 ? IPV6_HEADER_SIZE : IPV4_HEADER_SIZE) + UDP_HEADER_SIZE
+      + datagram_len;
+  padded_len = (packet_len + 3) & ~3;
+  block_len = PACKET_BLOCK_HEADER_SIZE + (size_t)padded_len + PACKET_BLOCK_TRAILER_SIZE;
+
+  buffer = &buffers[active];
+  if (buffer->len + block_len > capacity)
+  {
+    stats.dropped++;
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  block = buffer->data + buffer->len;
+  put_32(block, TRANSPORT_CAPTURE_ENHANCED_PACKET);
+  put_32(block + 4, (uint32_t)block_len);
+  put_32(block + 8, 0); // interface
+  put_32(block + 12, (uint32_t)(timestamp_us >> 32));
+  put_32(block + 16, (uint32_t)timestamp_us);
+  put_32(block + 20, (uint32_t)packet_len);
+  put_32(block + 24, (uint32_t)packet_len);
+  block += PACKET_BLOCK_HEADER_SIZE;
+
+  if (direction == TRANSPORT_CAPTURE_SENT)
+  {
+    block += write_headers(block, &local, &remote, datagram_len);
+  }
+  else
+  {
+    block += write_headers(block, &remote, &local, datagram_len);
+  }
+  memcpy(block, header, (size_t)header_len);
+  if (payload_len > 0)
+  {
+    memcpy(block + header_len, payload, (size_t)payload_len);
+  }
+  block += datagram_len;
+  memset(block, 0, (size_t)(padded_len - packet_len));
+  block += padded_len - packet_len;
+
+  // Options: the direction flags, then the end of options
+  put_16_host(block, TRANSPORT_CAPTURE_OPTION_FLAGS);
+  put_16_host(block + 2, 4);
+  put_32(block + 4, direction == TRANSPORT_CAPTURE_SENT ? 2 : 1);
+  put_32(block + 8, 0);
+  put_32(block + 12, (uint32_t)block_len);
+
+  buffer->len += block_len;
+  stats.datagrams++;
+  stats.bytes += block_len;
+  if (buffer->len >= capacity / 2)
+  {
+    pthread_cond_signal(&wake);
+  }
+
+  pthread_mutex_unlock(&lock);
+}
+
+/*
+ * The socket was closed: its descriptor may come back with other addresses
+ */
+void transport_capture_forget(int sock)
+{
+  pthread_mutex_lock(&lock);
+  if (sock >= 0 && (sock >> SOCKETS_CHUNK_BITS) < SOCKETS_CHUNKS
+      && sockets[sock >> SOCKETS_CHUNK_BITS] != NULL)
+  {
+    sockets[sock >> SOCKETS_CHUNK_BITS][sock & (SOCKETS_CHUNK_SIZE - 1)].known = 0;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void transport_capture_get_stats(TRANSPORT_CAPTURE_STATS* out_stats)
+{
+  pthread_mutex_lock(&lock);
+  *out_stats = stats;
+  pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Stop recording, let the writer write out what was recorded and close the file
+ */
+void transport_capture_close(void)
+{
+  int enabled;
+
+  pthread_mutex_lock(&lock);
+  enabled = transport_capture_enabled;
+  transport_capture_enabled = 0;
+  stopping = 1;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+
+  if (enabled)
+  {
+    pthread_join(writer, NULL);
+
+    printf(
+        "Capture: %llu datagrams, %llu bytes written to %s, %llu dropped\r\n",
+        (unsigned long long)stats.datagrams,
+        (unsigned long long)stats.bytes,
+        output_path,
+        (unsigned long long)stats.dropped);
+  }
+
+  if (output != NULL)
+  {
+    fclose(output);
+    output = NULL;
+  }
+
+  for (int i = 0; i < SOCKETS_CHUNKS; i++)
+  {
+    free(sockets[i]);
+    sockets[i] = NULL;
+  }
+
+  free(buffers[0].data);
+  free(buffers[1].data);
+  memset(buffers, 0, sizeof(buffers));
+  memset(&stats, 0, sizeof(stats));
+}
@@ -0,0 +1,67 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef TRANSPORT_CAPTURE_H
+#define TRANSPORT_CAPTURE_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#define TRANSPORT_CAPTURE_SENT 1
+#define TRANSPORT_CAPTURE_RECEIVED 2
+
+// Each of the two buffers, handed to the writer thread when half full
+#define TRANSPORT_CAPTURE_DEFAULT_BUFFER_KB 1024
+
+// pcapng block types and the link type of the interface, raw IPv4 or IPv6 packets
+#define TRANSPORT_CAPTURE_SECTION_HEADER 0x0A0D0D0A
+#define TRANSPORT_CAPTURE_INTERFACE_DESCRIPTION 0x00000001
+#define TRANSPORT_CAPTURE_ENHANCED_PACKET 0x00000006
+#define TRANSPORT_CAPTURE_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define TRANSPORT_CAPTURE_LINKTYPE_RAW 101
+
+// Enhanced packet block option holding the direction, inbound = 1, outbound = 2, in bits 0-1
+#define TRANSPORT_CAPTURE_OPTION_FLAGS 2
+
+typedef struct transport_capture_config_tag
+{
+  const char* path; // NULL = no capture
+  int buffer_kb;
+} TRANSPORT_CAPTURE_CONFIG;
+
+typedef struct transport_capture_stats_tag
+{
+  uint64_t datagrams;
+  uint64_t bytes; // of the pcapng blocks
+  uint64_t dropped; // the writer fell behind and both buffers were full
+} TRANSPORT_CAPTURE_STATS;
+
+/*
+ * pcapng capture of every datagram the transport sends or receives, what tcpdump would see on the
+ * interface but without root. Each datagram is stored as an IPv4 or IPv6 packet with a UDP header
+ * rebuilt from the addresses of the socket, with a microsecond wall clock timestamp and its
+ * direction. On a socket with an impairment, datagrams are recorded on the side of the device:
+ * when sent to the impairment, which may then drop or delay them, and when it delivers them, so
+ * that latencies include the emulated link. Recording copies the datagram into a buffer under a
+ * lock and never touches the file: a writer thread swaps the full buffer for the empty one and
+ * writes it out, so that capture does not delay sends. When the writer falls behind, datagrams
+ * are dropped and counted instead. Callers check transport_capture_enabled
+ * first, so that capture costs one load when it is off.
+ */
+extern int transport_capture_enabled;
+
+int transport_capture_read_configuration(TRANSPORT_CAPTURE_CONFIG* config);
+int transport_capture_open(const TRANSPORT_CAPTURE_CONFIG* config);
+void transport_capture_record(
+    int sock,
+    int direction,
+    const struct sockaddr* addr,
+    const unsigned char* header,
+    int header_len,
+    const unsigned char* payload,
+    int payload_len);
+void transport_capture_forget(int sock);
+void transport_capture_get_stats(TRANSPORT_CAPTURE_STATS* stats);
+void transport_capture_close(void);
+
+#endif // TRANSPORT_CAPTURE_H
@@ -0,0 +1,481 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "transport_impairment.h"
+
+// DO NOT MODIFY: Impairment Environment Variable Names. Rates are percentages.
+#define ENV_MQTTSN_IMPAIR_LOSS "MQTTSN_IMPAIR_LOSS"
+#define ENV_MQTTSN_IMPAIR_DELAY_MS "MQTTSN_IMPAIR_DELAY_MS"
+#define ENV_MQTTSN_IMPAIR_JITTER_MS "MQTTSN_IMPAIR_JITTER_MS"
+#define ENV_MQTTSN_IMPAIR_DUPLICATE "MQTTSN_IMPAIR_DUPLICATE"
+#define ENV_MQTTSN_IMPAIR_REORDER "MQTTSN_IMPAIR_REORDER"
+#define ENV_MQTTSN_IMPAIR_SEED "MQTTSN_IMPAIR_SEED"
+#define ENV_MQTTSN_IMPAIR_DIRECTION "MQTTSN_IMPAIR_DIRECTION"
+
+#define DEFAULT_IMPAIR_SEED 1
+
+// Sockets are looked up by descriptor in a two level table, so that lookups need no lock
+#define REGISTRY_CHUNK_BITS 10
+#define REGISTRY_CHUNK_SIZE (1 << REGISTRY_CHUNK_BITS)
+#define REGISTRY_CHUNKS 1024
+
+static TRANSPORT_IMPAIRMENT** registry[REGISTRY_CHUNKS];
+static char registry_lock;
+static int attached_sockets;
+
+// Process wide counters, indexed by direction - 1
+static TRANSPORT_IMPAIRMENT_STATS totals[2];
+
+static void count(uint64_t* counter)
+{
+  __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * splitmix64, to turn small consecutive seeds into unrelated PRNG states
+ */
+static uint64_t mix_seed(uint64_t seed)
+{
+  seed += 0x9E3779B97F4A7C15ULL;
+  seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+  return seed ^ (seed >> 31);
+}
+
+/*
+ * xorshift64*, return a uniformly distributed number in [0, 1)
+ */
+static double random_uniform(TRANSPORT_IMPAIRMENT* impairment)
+{
+  uint64_t x = impairment->random_state;
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  impairment->random_state = x;
+  return (double)((x * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t get_delay_us(TRANSPORT_IMPAIRMENT* impairment)
+{
+  double delay_ms = impairment->config.delay_ms;
+
+  if (impairment->config.jitter_ms > 0)
+  {
+    delay_ms += (random_uniform(impairment) * 2.0 - 1.0) * impairment->config.jitter_ms;
+  }
+
+  return delay_ms > 0 ? (uint64_t)(delay_ms * 1000.0) : 0;
+}
+
+static int is_before(const TRANSPORT_IMPAIRED_DATAGRAM* a, const TRANSPORT_IMPAIRED_DATAGRAM* b)
+{
+  return a->release_us < b->release_us
+      || (a->release_us == b->release_us && a->sequence < b->sequence);
+}
+
+/*
+ * Restore the release order after the entry at position moved earlier
+ */
+static void sift_down(TRANSPORT_IMPAIRMENT_QUEUE* queue, int position)
+{
+  TRANSPORT_IMPAIRED_DATAGRAM entry = queue->entries[position];
+
+  while (position > 0 && is_before(&entry, &queue->entries[position - 1]))
+  {
+    queue->entries[position] = queue->entries[position - 1];
+    position--;
+  }
+
+  queue->entries[position] = entry;
+}
+
+static int queue_insert(
+    TRANSPORT_IMPAIRMENT* impairment,
+    TRANSPORT_IMPAIRMENT_QUEUE* queue,
+    const struct sockaddr* addr,
+    socklen_t addr_len,
+    const unsigned char* buf,
+    int len,
+    uint64_t release_us,
+    int held)
+{
+  TRANSPORT_IMPAIRED_DATAGRAM* entry;
+
+  if (queue->count >= TRANSPORT_IMPAIRMENT_QUEUE_LIMIT)
+  {
+    return -1;
+  }
+
+  if (queue->count == queue->capacity)
+  {
+    int capacity = queue->capacity > 0 ? queue->capacity * 2 : 16;
+    TRANSPORT_IMPAIRED_DATAGRAM* entries
+        = realloc(queue->entries, (size_t)capacity * sizeof(TRANSPORT_IMPAIRED_DATAGRAM));
+
+    if (entries == NULL)
+    {
+      return -1;
+    }
+
+    queue->entries = entries;
+    queue->capacity = capacity;
+  }
+
+  entry = &queue->entries[queue->count];
+  if ((entry->data = malloc((size_t)len)) == NULL)
+  {
+    return -1;
+  }
+
+  memcpy(entry->data, buf, (size_t)len);
+  entry->len = len;
+  memcpy(&entry->addr, addr, (size_t)addr_len);
+  entry->addr_len = addr_len;
+  entry->release_us = release_us;
+  entry->sequence = ++impairment->sequence;
+  entry->held = held;
+  sift_down(queue, queue->count++);
+  return 0;
+}
+
+/*
+ * A datagram due at release_us overtakes every held datagram due later, which then follow it
+ */
+static void release_held(
+    TRANSPORT_IMPAIRMENT* impairment,
+    TRANSPORT_IMPAIRMENT_QUEUE* queue,
+    uint64_t release_us)
+{
+  for (int i = 0; i < queue->count; i++)
+  {
+    TRANSPORT_IMPAIRED_DATAGRAM* entry = &queue->entries[i];
+
+    if (entry->held && entry->release_us > release_us)
+    {
+      entry->held = 0;
+      entry->release_us = release_us;
+      entry->sequence = ++impairment->sequence;
+      sift_down(queue, i);
+    }
+  }
+}
+
+/*
+ * Read the impairment from the environment. Return 1 when some impairment is configured, 0 when
+ * none is, -1 for an invalid value.
+ */
+int transport_impairment_read_configuration(TRANSPORT_IMPAIRMENT_CONFIG* config)
+{
+  const char* names[] = { ENV_MQTTSN_IMPAIR_LOSS, ENV_MQTTSN_IMPAIR_DUPLICATE,
+                          ENV_MQTTSN_IMPAIR_REORDER };
+  double* rates[] = { &config->loss, &config->duplicate, &config->reorder };
+  const char* value;
+
+  memset(config, 0, sizeof(TRANSPORT_IMPAIRMENT_CONFIG));
+  config->seed = DEFAULT_IMPAIR_SEED;
+  config->directions = TRANSPORT_IMPAIR_SEND | TRANSPORT_IMPAIR_RECEIVE;
+
+  for (int i = 0; i < 3; i++)
+  {
+    value = getenv(names[i]);
+    *rates[i] = value != NULL ? atof(value) / 100.0 : 0.0;
+    if (*rates[i] < 0.0 || *rates[i] > 1.0)
+    {
+      printf("Invalid value for %s, must be a percentage between 0 and 100\r\n", names[i]);
+      return -1;
+    }
+  }
+
+  value = getenv(ENV_MQTTSN_IMPAIR_DELAY_MS);
+  config->delay_ms = value != NULL ? atoi(value) : 0;
+  value = getenv(ENV_MQTTSN_IMPAIR_JITTER_MS);
+  config->jitter_ms = value != NULL ? atoi(value) : 0;
+  value = getenv(ENV_MQTTSN_IMPAIR_SEED);
+  config->seed = value != NULL ? (uint32_t)strtoul(value, NULL, 10) : DEFAULT_IMPAIR_SEED;
+
+  if (config->delay_ms < 0 || config->jitter_ms < 0)
+  {
+    printf("Impairment delay and jitter must not be negative\r\n");
+    return -1;
+  }
+
+  if ((value = getenv(ENV_MQTTSN_IMPAIR_DIRECTION)) != NULL && strcmp(value, "both") != 0)
+  {
+    if (strcmp(value, "send") == 0)
+    {
+      config->directions = TRANSPORT_IMPAIR_SEND;
+    }
+    else if (strcmp(value, "receive") == 0)
+    {
+      config->directions = TRANSPORT_IMPAIR_RECEIVE;
+    }
+    else
+    {
+      printf(
+          "Invalid value for %s, must be both, send or receive\r\n", ENV_MQTTSN_IMPAIR_DIRECTION);
+      return -1;
+    }
+  }
+
+  if (config->loss == 0.0 && config->duplicate == 0.0 && config->reorder == 0.0
+      && config->delay_ms == 0 && config->jitter_ms == 0)
+  {
+    return 0;
+  }
+
+  printf(
+      "Impairment: loss %.1f%%, delay %d ms +-%d ms, duplicate %.1f%%, reorder %.1f%%, seed %u, "
+      "direction %s\r\n",
+      config->loss * 100.0,
+      config->delay_ms,
+      config->jitter_ms,
+      config->duplicate * 100.0,
+      config->reorder * 100.0,
+      config->seed,
+      config->directions == TRANSPORT_IMPAIR_SEND
+          ? "send"
+          : config->directions == TRANSPORT_IMPAIR_RECEIVE ? "receive" : "both");
+  return 1;
+}
+
+/*
+ * Impair every datagram sent or received on the socket from now on, until
+ * transport_impairment_detach (called by transport_socket_close).
+ * Return 0 on success, -1 if the socket cannot be impaired
+ */
+int transport_impairment_attach(int sock, const TRANSPORT_IMPAIRMENT_CONFIG* config)
+{
+  TRANSPORT_IMPAIRMENT* impairment;
+  TRANSPORT_IMPAIRMENT** chunk;
+  int rc = 0;
+
+  if (sock < 0 || sock >= REGISTRY_CHUNKS * REGISTRY_CHUNK_SIZE
+      || (impairment = calloc(1, sizeof(TRANSPORT_IMPAIRMENT))) == NULL)
+  {
+    return -1;
+  }
+
+  impairment->config = *config;
+  impairment->random_state = mix_seed(config->seed);
+
+  while (__atomic_test_and_set(&registry_lock, __ATOMIC_ACQUIRE))
+  {
+  }
+
+  if ((chunk = registry[sock >> REGISTRY_CHUNK_BITS]) == NULL)
+  {
+    chunk = calloc(REGISTRY_CHUNK_SIZE, sizeof(TRANSPORT_IMPAIRMENT*));
+    __atomic_store_n(&registry[sock >> REGISTRY_CHUNK_BITS], chunk, __ATOMIC_RELEASE);
+  }
+
+  if (chunk == NULL || chunk[sock & (REGISTRY_CHUNK_SIZE - 1)] != NULL)
+  {
+    free(impairment);
+    rc = -1;
+  }
+  else
+  {
+    __atomic_store_n(&chunk[sock & (REGISTRY_CHUNK_SIZE - 1)], impairment, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&attached_sockets, 1, __ATOMIC_RELEASE);
+  }
+
+  __atomic_clear(&registry_lock, __ATOMIC_RELEASE);
+  return rc;
+}
+
+/*
+ * Forget the socket's impairment. Datagrams still held are discarded.
+ */
+void transport_impairment_detach(int sock)
+{
+  TRANSPORT_IMPAIRMENT* impairment = transport_impairment_get(sock);
+
+  if (impairment == NULL)
+  {
+    return;
+  }
+
+  registry[sock >> REGISTRY_CHUNK_BITS][sock & (REGISTRY_CHUNK_SIZE - 1)] = NULL;
+  __atomic_fetch_sub(&attached_sockets, 1, __ATOMIC_RELEASE);
+
+  for (int direction = TRANSPORT_IMPAIR_SEND; direction <= TRANSPORT_IMPAIR_RECEIVE; direction++)
+  {
+    while (impairment->queues[direction - 1].count > 0)
+    {
+      transport_impairment_release(impairment, direction);
+    }
+
+    free(impairment->queues[direction - 1].entries);
+  }
+
+  free(impairment);
+}
+
+/*
+ * Return the socket's impairment, NULL if the socket is not impaired
+ */
+TRANSPORT_IMPAIRMENT* transport_impairment_get(int sock)
+{
+  TRANSPORT_IMPAIRMENT** chunk;
+
+  if (__atomic_load_n(&attached_sockets, __ATOMIC_ACQUIRE) == 0 || sock < 0
+      || sock >= REGISTRY_CHUNKS * REGISTRY_CHUNK_SIZE
+      || (chunk = __atomic_load_n(&registry[sock >> REGISTRY_CHUNK_BITS], __ATOMIC_ACQUIRE))
+          == NULL)
+  {
+    return NULL;
+  }
+
+  return __atomic_load_n(&chunk[sock & (REGISTRY_CHUNK_SIZE - 1)], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Decide the fate of a datagram sent to, or received from, addr: drop it, or hold one or two
+ * copies until their delay has passed. A direction that is not impaired only keeps the order.
+ * Return 0, or -1 if the datagram was dropped because the queue is full
+ */
+int transport_impairment_submit(
+    TRANSPORT_IMPAIRMENT* impairment,
+    int direction,
+    const struct sockaddr* addr,
+    socklen_t addr_len,
+    const unsigned char* buf,
+    int len,
+    uint64_t now_us)
+{
+  TRANSPORT_IMPAIRMENT_QUEUE* queue = &impairment->queues[direction - 1];
+  TRANSPORT_IMPAIRMENT_STATS* stats = &totals[direction - 1];
+  int copies = 1;
+
+  count(&stats->datagrams);
+
+  if (!(impairment->config.directions & direction))
+  {
+    release_held(impairment, queue, now_us);
+    return queue_insert(impairment, queue, addr, addr_len, buf, len, now_us, 0);
+  }
+
+  if (random_uniform(impairment) < impairment->config.loss)
+  {
+    count(&stats->dropped);
+    return 0;
+  }
+
+  if (random_uniform(impairment) < impairment->config.duplicate)
+  {
+    count(&stats->duplicated);
+    copies = 2;
+  }
+
+  for (int i = 0; i < copies; i++)
+  {
+    uint64_t delay_us = get_delay_us(impairment);
+    int held = random_uniform(impairment) < impairment->config.reorder;
+
+    if (delay_us > 0)
+    {
+      count(&stats->delayed);
+    }
+
+    if (held)
+    {
+      count(&stats->reordered);
+      delay_us += TRANSPORT_IMPAIRMENT_REORDER_HOLD_MS * 1000ULL;
+    }
+    else
+    {
+      release_held(impairment, queue, now_us + delay_us);
+    }
+
+    if (queue_insert(impairment, queue, addr, addr_len, buf, len, now_us + delay_us, held) != 0)
+    {
+      count(&stats->dropped);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Return the next datagram whose delay has passed, NULL if there is none. It stays queued until
+ * transport_impairment_release.
+ */
+TRANSPORT_IMPAIRED_DATAGRAM* transport_impairment_next(
+    TRANSPORT_IMPAIRMENT* impairment,
+    int direction,
+    uint64_t now_us)
+{
+  TRANSPORT_IMPAIRMENT_QUEUE* queue = &impairment->queues[direction - 1];
+
+  if (queue->count == 0 || queue->entries[0].release_us > now_us)
+  {
+    return NULL;
+  }
+
+  return &queue->entries[0];
+}
+
+void transport_impairment_release(TRANSPORT_IMPAIRMENT* impairment, int direction)
+{
+  TRANSPORT_IMPAIRMENT_QUEUE* queue = &impairment->queues[direction - 1];
+
+  free(queue->entries[0].data);
+  memmove(
+      &queue->entries[0],
+      &queue->entries[1],
+      (size_t)(queue->count - 1) * sizeof(TRANSPORT_IMPAIRED_DATAGRAM));
+  queue->count--;
+}
+
+/*
+ * Return the monotonic time (time_util_now_us) at which the next held datagram is due in either
+ * direction, UINT64_MAX if none is held
+ */
+uint64_t transport_impairment_next_deadline_us(const TRANSPORT_IMPAIRMENT* impairment)
+{
+  uint64_t deadline_us = UINT64_MAX;
+
+  for (int i = 0; i < 2; i++)
+  {
+    const TRANSPORT_IMPAIRMENT_QUEUE* queue = &impairment->queues[i];
+
+    if (queue->count > 0 && queue->entries[0].release_us < deadline_us)
+    {
+      deadline_us = queue->entries[0].release_us;
+    }
+  }
+
+  return deadline_us;
+}
+
+void transport_impairment_get_totals(
+    TRANSPORT_IMPAIRMENT_STATS* sent,
+    TRANSPORT_IMPAIRMENT_STATS* received)
+{
+  *sent = totals[TRANSPORT_IMPAIR_SEND - 1];
+  *received = totals[TRANSPORT_IMPAIR_RECEIVE - 1];
+}
+
+void transport_impairment_print_totals(void)
+{
+  const char* names[] = { "sent", "received" };
+
+  for (int i = 0; i < 2; i++)
+  {
+    printf(
+        "Impairment %s: datagrams = %llu, dropped = %llu, duplicated = %llu, reordered = %llu, "
+        "delayed = %llu\r\n",
+        names[i],
+        (unsigned long long)totals[i].datagrams,
+        (unsigned long long)totals[i].dropped,
+        (unsigned long long)totals[i].duplicated,
+        (unsigned long long)totals[i].reordered,
+        (unsigned long long)totals[i].delayed);
+  }
+}
@@ -0,0 +1,95 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef TRANSPORT_IMPAIRMENT_H
+#define TRANSPORT_IMPAIRMENT_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define TRANSPORT_IMPAIR_SEND 1
+#define TRANSPORT_IMPAIR_RECEIVE 2
+
+// Longest time a reordered datagram waits for the next datagram to overtake it
+#define TRANSPORT_IMPAIRMENT_REORDER_HOLD_MS 100
+
+// Datagrams held per direction before new ones are dropped, like the netem queue limit
+#define TRANSPORT_IMPAIRMENT_QUEUE_LIMIT 1000
+
+typedef struct transport_impairment_config_tag
+{
+  double loss; // probability that a datagram is dropped
+  double duplicate; // probability that a datagram is delivered twice
+  double reorder; // probability that a datagram is held back until the next one overtakes it
+  int delay_ms; // added one-way delay
+  int jitter_ms; // the delay of each datagram varies uniformly by +-jitter_ms
+  uint32_t seed; // same seed and traffic, same impairments
+  int directions; // TRANSPORT_IMPAIR_SEND and/or TRANSPORT_IMPAIR_RECEIVE
+} TRANSPORT_IMPAIRMENT_CONFIG;
+
+typedef struct transport_impairment_stats_tag
+{
+  uint64_t datagrams;
+  uint64_t dropped;
+  uint64_t duplicated;
+  uint64_t reordered;
+  uint64_t delayed;
+} TRANSPORT_IMPAIRMENT_STATS;
+
+typedef struct transport_impaired_datagram_tag
+{
+  uint64_t release_us;
+  uint64_t sequence;
+  int held; // reordered, waiting for the next datagram to overtake it
+  struct sockaddr_storage addr; // destination when sending, source when receiving
+  socklen_t addr_len; // 0 for the peer of a connected socket
+  int len;
+  unsigned char* data;
+} TRANSPORT_IMPAIRED_DATAGRAM;
+
+typedef struct transport_impairment_queue_tag
+{
+  TRANSPORT_IMPAIRED_DATAGRAM* entries; // ordered by release time, then sequence
+  int count;
+  int capacity;
+} TRANSPORT_IMPAIRMENT_QUEUE;
+
+/*
+ * Loss, delay, jitter, duplication and reordering applied in user space to the datagrams of one
+ * socket, in either direction. Every decision comes from a per-socket PRNG seeded from the
+ * configuration, so a run can be repeated exactly without traffic shaping privileges. Datagrams
+ * are held in release time order until their delay has passed.
+ */
+typedef struct transport_impairment_tag
+{
+  TRANSPORT_IMPAIRMENT_CONFIG config;
+  uint64_t random_state;
+  uint64_t sequence;
+  TRANSPORT_IMPAIRMENT_QUEUE queues[2]; // send, receive
+} TRANSPORT_IMPAIRMENT;
+
+int transport_impairment_read_configuration(TRANSPORT_IMPAIRMENT_CONFIG* config);
+int transport_impairment_attach(int sock, const TRANSPORT_IMPAIRMENT_CONFIG* config);
+void transport_impairment_detach(int sock);
+TRANSPORT_IMPAIRMENT* transport_impairment_get(int sock);
+int transport_impairment_submit(
+    TRANSPORT_IMPAIRMENT* impairment,
+    int direction,
+    const struct sockaddr* addr,
+    socklen_t addr_len,
+    const unsigned char* buf,
+    int len,
+    uint64_t now_us);
+TRANSPORT_IMPAIRED_DATAGRAM* transport_impairment_next(
+    TRANSPORT_IMPAIRMENT* impairment,
+    int direction,
+    uint64_t now_us);
+void transport_impairment_release(TRANSPORT_IMPAIRMENT* impairment, int direction);
+uint64_t transport_impairment_next_deadline_us(const TRANSPORT_IMPAIRMENT* impairment);
+void transport_impairment_get_totals(
+    TRANSPORT_IMPAIRMENT_STATS* sent,
+    TRANSPORT_IMPAIRMENT_STATS* received);
+void transport_impairment_print_totals(void);
+
+#endif // TRANSPORT_IMPAIRMENT_H
@@ -0,0 +1,134 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <string.h>
+
+#include "wire_stats.h"
+
+static const char* const message_type_names[WIRE_STATS_MESSAGE_TYPES]
+    = { "ADVERTISE",    "SEARCHGW",      "GWINFO",      "RESERVED_03", "CONNECT",
+        "CONNACK",      "WILLTOPICREQ",  "WILLTOPIC",   "WILLMSGREQ",  "WILLMSG",
+        "REGISTER",     "REGACK",        "PUBLISH",     "PUBACK",      "PUBCOMP",
+        "PUBREC",       "PUBREL",        "RESERVED_11", "SUBSCRIBE",   "SUBACK",
+        "UNSUBSCRIBE",  "UNSUBACK",      "PINGREQ",     "PINGRESP",    "DISCONNECT",
+        "RESERVED_19",  "WILLTOPICUPD",  "WILLTOPICRESP", "WILLMSGUPD", "WILLMSGRESP",
+        "RESERVED_1E",  "OTHER" };
+
+void wire_stats_init(WIRE_STATS* stats)
+{
+  memset((void*)stats, 0, sizeof(WIRE_STATS));
+  stats->header_size = WIRE_STATS_IPV4_UDP_HEADER_SIZE;
+}
+
+/*
+ * Return the message type of an MQTT-SN packet, the length field being 1 or 3 bytes (0x01 followed
+ * by a 2 byte length), or WIRE_STATS_OTHER
+ */
+int wire_stats_message_type(const unsigned char* buf, int len)
+{
+  int type_offset = len > 0 && buf[0] == 0x01 ? 3 : 1;
+
+  if (len <= type_offset || buf[type_offset] >= WIRE_STATS_OTHER)
+  {
+    return WIRE_STATS_OTHER;
+  }
+
+  return buf[type_offset];
+}
+
+const char* wire_stats_message_type_name(int type)
+{
+  return type >= 0 && type < WIRE_STATS_MESSAGE_TYPES ? message_type_names[type] : "OTHER";
+}
+
+static void count(WIRE_STATS_COUNTER* counters, const unsigned char* buf, int len)
+{
+  WIRE_STATS_COUNTER* counter = &counters[wire_stats_message_type(buf, len)];
+
+  counter->packets++;
+  counter->bytes += (uint64_t)len;
+}
+
+void wire_stats_record_sent(WIRE_STATS* stats, const unsigned char* buf, int len)
+{
+  count(stats->sent, buf, len);
+}
+
+void wire_stats_record_received(WIRE_STATS* stats, const unsigned char* buf, int len)
+{
+  count(stats->received, buf, len);
+}
+
+void wire_stats_record_retransmitted(WIRE_STATS* stats, const unsigned char* buf, int len)
+{
+  count(stats->retransmitted, buf, len);
+}
+
+/*
+ * Add the counts of source to destination, e.g. to combine the statistics of worker threads
+ */
+void wire_stats_merge(WIRE_STATS* destination, const WIRE_STATS* source)
+{
+  for (int i = 0; i < WIRE_STATS_MESSAGE_TYPES; i++)
+  {
+    destination->sent[i].packets += source->sent[i].packets;
+    destination->sent[i].bytes += source->sent[i].bytes;
+    destination->received[i].packets += source->received[i].packets;
+    destination->received[i].bytes += source->received[i].bytes;
+    destination->retransmitted[i].packets += source->retransmitted[i].packets;
+    destination->retransmitted[i].bytes += source->retransmitted[i].bytes;
+  }
+}
+
+static void print_counter(
+    const WIRE_STATS* stats,
+    const char* name,
+    const WIRE_STATS_COUNTER* counter,
+    FILE* file)
+{
+  fprintf(
+      file,
+      "\"%s\":{\"packets\":%llu,\"bytes\":%llu,\"wire_bytes\":%llu}",
+      name,
+      (unsigned long long)counter->packets,
+      (unsigned long long)counter->bytes,
+      (unsigned long long)(counter->bytes + counter->packets * (uint64_t)stats->header_size));
+}
+
+/*
+ * Print one direction as {"<TYPE>":{"packets":n,"bytes":n,"wire_bytes":n},...,"TOTAL":{...}},
+ * skipping message types that were never seen
+ */
+static void print_counters(const WIRE_STATS* stats, const WIRE_STATS_COUNTER* counters, FILE* file)
+{
+  WIRE_STATS_COUNTER total = { 0, 0 };
+
+  fprintf(file, "{");
+  for (int i = 0; i < WIRE_STATS_MESSAGE_TYPES; i++)
+  {
+    if (counters[i].packets > 0)
+    {
+      print_counter(stats, message_type_names[i], &counters[i], file);
+      fprintf(file, ",");
+      total.packets += counters[i].packets;
+      total.bytes += counters[i].bytes;
+    }
+  }
+  print_counter(stats, "TOTAL", &total, file);
+  fprintf(file, "}");
+}
+
+/*
+ * Print the statistics as a single line JSON object so that runs can be compared by scripts.
+ * bytes are UDP payload bytes, wire_bytes include the IP and UDP headers.
+ */
+void wire_stats_print_json(const WIRE_STATS* stats, FILE* file)
+{
+  fprintf(file, "{\"ip_udp_header_bytes\":%d,\"sent\":", stats->header_size);
+  print_counters(stats, stats->sent, file);
+  fprintf(file, ",\"received\":");
+  print_counters(stats, stats->received, file);
+  fprintf(file, ",\"retransmitted\":");
+  print_counters(stats, stats->retransmitted, file);
+  fprintf(file, "}\r\n");
+}
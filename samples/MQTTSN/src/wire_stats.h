@@ -0,0 +1,44 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef WIRE_STATS_H
+#define WIRE_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// IPv4 and UDP headers carried by every datagram
+#define WIRE_STATS_IPV4_UDP_HEADER_SIZE 28
+
+// MQTT-SN message types 0x00 to 0x1D; the last slot counts anything else, e.g. ENCAPSULATED
+#define WIRE_STATS_MESSAGE_TYPES 32
+#define WIRE_STATS_OTHER (WIRE_STATS_MESSAGE_TYPES - 1)
+
+typedef struct wire_stats_counter_tag
+{
+  uint64_t packets;
+  uint64_t bytes; // UDP payload bytes
+} WIRE_STATS_COUNTER;
+
+/*
+ * Datagrams and bytes sent and received per MQTT-SN message type. Retransmissions are counted as
+ * sent and, separately, as retransmitted.
+ */
+typedef struct wire_stats_tag
+{
+  int header_size; // IP and UDP header bytes added to every datagram
+  WIRE_STATS_COUNTER sent[WIRE_STATS_MESSAGE_TYPES];
+  WIRE_STATS_COUNTER received[WIRE_STATS_MESSAGE_TYPES];
+  WIRE_STATS_COUNTER retransmitted[WIRE_STATS_MESSAGE_TYPES];
+} WIRE_STATS;
+
+void wire_stats_init(WIRE_STATS* stats);
+int wire_stats_message_type(const unsigned char* buf, int len);
+const char* wire_stats_message_type_name(int type);
+void wire_stats_record_sent(WIRE_STATS* stats, const unsigned char* buf, int len);
+void wire_stats_record_received(WIRE_STATS* stats, const unsigned char* buf, int len);
+void wire_stats_record_retransmitted(WIRE_STATS* stats, const unsigned char* buf, int len);
+void wire_stats_merge(WIRE_STATS* destination, const WIRE_STATS* source);
+void wire_stats_print_json(const WIRE_STATS* stats, FILE* file);
+
+#endif // WIRE_STATS_H